@@ -0,0 +1,116 @@
+// channel.h - Interface for bounded, lock-free channels that stream
+// messages (typically marshalled blocks) between threads.
+//
+
+#ifndef __CHANNEL_H__
+#define __CHANNEL_H__
+
+#include "threading_core.h"
+
+/**
+ * @brief Opaque structure that holds the state of a channel.
+ */
+typedef struct _CHANNEL CHANNEL, *LPCHANNEL;
+
+/**
+ * @brief Handle to a channel.
+ */
+typedef LPCHANNEL HCHANNEL;
+
+/**
+ * @brief Creates a bounded channel that any number of threads can send to
+ * and receive from.
+ * @param nCapacity Maximum number of messages the channel holds at once.
+ * It is rounded up to the next power of two.
+ * @return Handle to the new channel, or INVALID_HANDLE_VALUE if an error
+ * occurred.
+ * @remarks Messages are void* values, such as the addresses returned by
+ * MarshalBlockToThread or TransferBlockToThread.  Sending and receiving
+ * never take a lock; a thread only enters the kernel when it has to block
+ * because the channel is full (senders) or empty (receivers).
+ */
+HCHANNEL CreateChannel(int nCapacity);
+
+/**
+ * @brief Destroys a channel.
+ * @param hChannel Handle to the channel to destroy.
+ * @return Zero if successful; EINVAL if the handle is invalid.
+ * @remarks No thread may be using the channel.  Messages still in the
+ * channel are not released; drain it first if they own memory.
+ */
+int DestroyChannel(HCHANNEL hChannel);
+
+/**
+ * @brief Closes a channel, so that no more messages can be sent to it.
+ * @param hChannel Handle to the channel to close.
+ * @return Zero if successful; EINVAL if the handle is invalid.
+ * @remarks Blocked senders fail with EPIPE.  Receivers keep getting the
+ * messages that are still in the channel, and fail with EPIPE once it is
+ * empty.
+ */
+int CloseChannel(HCHANNEL hChannel);
+
+/**
+ * @brief Sends a message to a channel.
+ * @param hChannel Handle to the channel.
+ * @param pvMessage Message to send.
+ * @param nTimeoutMs Maximum number of milliseconds to wait for room in the
+ * channel; INFINITE to wait as long as it takes, or zero not to wait at
+ * all.
+ * @return Zero if the message was sent; EAGAIN if nTimeoutMs is zero and the
+ * channel is full; ETIMEDOUT if the timeout elapsed; EPIPE if the channel
+ * has been closed; EINVAL if the handle is invalid.
+ */
+int SendToChannel(HCHANNEL hChannel, void* pvMessage, int nTimeoutMs);
+
+/**
+ * @brief Receives a message from a channel.
+ * @param hChannel Handle to the channel.
+ * @param ppvMessage Address of storage that receives the message.
+ * @param nTimeoutMs Maximum number of milliseconds to wait for a message;
+ * INFINITE to wait as long as it takes, or zero not to wait at all.
+ * @return Zero if a message was received; EAGAIN if nTimeoutMs is zero and
+ * the channel is empty; ETIMEDOUT if the timeout elapsed; EPIPE if the
+ * channel has been closed and is empty; EINVAL if the arguments are
+ * invalid.
+ */
+int ReceiveFromChannel(HCHANNEL hChannel, void** ppvMessage, int nTimeoutMs);
+
+/**
+ * @brief Sends several messages to a channel.
+ * @param hChannel Handle to the channel.
+ * @param ppvMessages Address of an array of messages to send, in order.
+ * @param nCount Number of elements in ppvMessages.
+ * @param pnSent Address of storage that receives the number of messages
+ * that were sent.  May be NULL.
+ * @param nTimeoutMs Maximum number of milliseconds to wait for room in the
+ * channel; INFINITE to wait as long as it takes, or zero not to wait at
+ * all.
+ * @return Zero if every message was sent; otherwise, the error code that
+ * SendToChannel would have returned for the first message that was not.
+ * @remarks Runs of consecutive messages are claimed with a single atomic
+ * operation, so this is much cheaper than calling SendToChannel in a loop.
+ * Messages from other senders may be interleaved between runs.
+ */
+int SendBatchToChannel(HCHANNEL hChannel, void** ppvMessages, int nCount,
+    int* pnSent, int nTimeoutMs);
+
+/**
+ * @brief Receives up to the specified number of messages from a channel.
+ * @param hChannel Handle to the channel.
+ * @param ppvMessages Address of an array that receives the messages.
+ * @param nMaxCount Number of elements in ppvMessages.
+ * @param pnReceived Address of storage that receives the number of messages
+ * that were received.
+ * @param nTimeoutMs Maximum number of milliseconds to wait for the first
+ * message; INFINITE to wait as long as it takes, or zero not to wait at
+ * all.
+ * @return Zero if at least one message was received; otherwise, the error
+ * code that ReceiveFromChannel would have returned.
+ * @remarks Only waits until there is something to receive; it then takes
+ * whatever is in the channel, up to nMaxCount messages.
+ */
+int ReceiveBatchFromChannel(HCHANNEL hChannel, void** ppvMessages,
+    int nMaxCount, int* pnReceived, int nTimeoutMs);
+
+#endif //__CHANNEL_H__
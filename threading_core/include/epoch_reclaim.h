@@ -0,0 +1,81 @@
+// epoch_reclaim.h - Interface for epoch-based reclamation: deferring the
+// release of memory that other threads may still be reading, without
+// making those readers take locks or write to shared memory.
+//
+
+#ifndef __EPOCH_RECLAIM_H__
+#define __EPOCH_RECLAIM_H__
+
+#include "threading_core.h"
+
+/**
+ * @brief Number of blocks a thread retires before it tries to move the
+ * global epoch on and release what it retired earlier.
+ */
+#ifndef EPOCH_RETIRE_BATCH_SIZE
+#define EPOCH_RETIRE_BATCH_SIZE 64
+#endif //EPOCH_RETIRE_BATCH_SIZE
+
+/**
+ * @brief Enters a read-side critical section.  Blocks that are retired
+ * while the caller is inside one are not released until it has left.
+ * @return Zero if successful; ENOMEM if the calling thread could not be
+ * registered, in which case it is not inside a critical section.
+ * @remarks Calls nest; only the outermost pair counts.  Neither this
+ * function nor ExitEpoch writes to memory that other threads write to, or
+ * uses atomic read-modify-write instructions: the caller publishes the
+ * epoch it is in to a slot of its own, and the thread that moves the epoch
+ * on makes that visible with a process-wide memory barrier (membarrier).
+ * On kernels without it, the caller issues a fence instead.
+ * A thread is registered the first time it calls this function or
+ * RetireBlock, and unregistered when it exits.  Do not block for long
+ * inside a critical section: no memory retired by any thread can be
+ * released until it ends.
+ */
+int EnterEpoch(void);
+
+/**
+ * @brief Leaves a read-side critical section.
+ */
+void ExitEpoch(void);
+
+/**
+ * @brief Releases a block once no thread can still be reading it, i.e.,
+ * once every thread that was inside a critical section when it was retired
+ * has left it.
+ * @param pvBlock Address of the block, which must already be unreachable
+ * for threads that enter a critical section from now on.  May be NULL.
+ * @param lpfnRelease Address of the function that releases the block, or
+ * NULL for free().
+ * @return Zero if successful; ENOMEM if the calling thread could not be
+ * registered, or if a batch could not be allocated while the caller is
+ * inside a critical section.  Either way, the block still belongs to the
+ * caller.
+ * @remarks Blocks are kept in per-thread batches, so retiring one takes no
+ * lock.  Every EPOCH_RETIRE_BATCH_SIZE blocks, the calling thread tries to
+ * move the global epoch on and releases its blocks that are two epochs
+ * old.  May be called inside a critical section.
+ */
+int RetireBlock(void* pvBlock, LPRELEASE_BLOCK_ROUTINE lpfnRelease);
+
+/**
+ * @brief Releases a block returned by MarshalBlockToThread (or one of the
+ * other marshalling functions) once no thread can still be reading it.
+ * @param pvData Address of the marshalled block.  May be NULL.
+ * @return Same as RetireBlock.
+ * @remarks Same as RetireBlock with FreeMarshalledBlock.
+ */
+int RetireMarshalledBlock(void* pvData);
+
+/**
+ * @brief Waits until every block the calling thread has retired can be
+ * released, and releases it.
+ * @return Zero if successful; EDEADLK if the caller is inside a critical
+ * section, which it would wait for forever; ENOMEM if the calling thread
+ * could not be registered.
+ * @remarks Useful before tearing down the structure the blocks
+ * came from, or in tests.
+ */
+int SynchronizeEpoch(void);
+
+#endif //__EPOCH_RECLAIM_H__
@@ -0,0 +1,92 @@
+// event_dispatcher.h - Interface for the event dispatcher, which takes
+// signals off a signalfd on a thread of its own and runs their handlers in
+// ordinary thread context instead of inside signal handlers.
+//
+
+#ifndef __EVENT_DISPATCHER_H__
+#define __EVENT_DISPATCHER_H__
+
+#include <signal.h>
+
+#include "threading_core.h"
+
+/**
+ * @brief Signature of a function that handles a signal routed through the
+ * event dispatcher.
+ * @param nSignal Code of the signal.
+ * @param hThread Handle of the thread the signal was raised to with
+ * KillThreadEx and friends, or INVALID_HANDLE_VALUE if the signal was sent
+ * to the process as a whole.
+ * @param pUserState Value passed to RegisterThreadEvent.
+ * @remarks Runs on the dispatcher thread, not in a signal handler, so it may
+ * allocate memory, take locks and write logs.  One event is handled at a
+ * time; a handler that blocks holds up the ones behind it.
+ */
+typedef void (*LPEVENT_ROUTINE)(int nSignal, HTHREAD hThread,
+    void* pUserState);
+
+/**
+ * @brief Starts the event dispatcher for a set of signals.
+ * @param pSignals Address of the set of signals to dispatch.  Signals that
+ * report faults, such as SIGSEGV, and SIGKILL and SIGSTOP cannot be
+ * dispatched.
+ * @return TRUE if the dispatcher is running; FALSE if it was already
+ * running, if the set holds a signal that cannot be dispatched, or if an
+ * error occurred.
+ * @remarks Blocks the signals in the calling thread, in the threads it
+ * creates from then on, and in every thread that this library starts, and
+ * reads them from a signalfd on a dedicated thread.  Call it from main,
+ * before any other thread exists, so that no thread is left with the
+ * signals unblocked for the kernel to pick.
+ * Handlers registered with RegisterEventEx for a dispatched signal, and
+ * handlers registered with RegisterThreadEvent, are then called on the
+ * dispatcher thread.  KillThreadEx and friends stop sending a dispatched
+ * signal to the thread at all: they queue the event to the dispatcher,
+ * which runs the handler routed to that thread and acknowledges the stop
+ * request on its behalf, and the thread learns of the request through
+ * IsThreadStopRequested.  A dispatched signal sent to a thread with
+ * pthread_kill stays pending on that thread and is never handled.
+ */
+BOOL StartEventDispatcher(const sigset_t* pSignals);
+
+/**
+ * @brief Stops the event dispatcher and waits for its thread to exit.
+ * @return Zero if successful, or the system error code that made the
+ * dispatcher thread stop handling events before it was asked to.
+ * @remarks Events still queued are acknowledged without being handled.
+ * The signals stay blocked in every thread that had blocked them, so this
+ * is meant for shutdown rather than for going back to signal handlers.
+ */
+int StopEventDispatcher(void);
+
+/**
+ * @brief Gets whether a signal is currently routed through the event
+ * dispatcher.
+ * @param nSignal Code of the signal.
+ * @return TRUE if the dispatcher is running and handles nSignal; FALSE
+ * otherwise.
+ */
+BOOL IsEventDispatched(int nSignal);
+
+/**
+ * @brief Routes a dispatched signal to a handler, either for one thread or
+ * for the process as a whole.
+ * @param hThread Handle of the thread whose events lpfnEventRoutine
+ * handles, or INVALID_HANDLE_VALUE for the events of every thread that has
+ * no route of its own, and of the process.
+ * @param nSignal Code of the signal.
+ * @param lpfnEventRoutine Address of the handler, or NULL to remove the
+ * route.
+ * @param pUserState Value to pass to the handler.
+ * @return TRUE if the route was added, replaced or removed; FALSE if the
+ * arguments are invalid or there is not enough memory.
+ * @remarks An event goes to the route of its thread, then to the route for
+ * INVALID_HANDLE_VALUE, then to the handler registered with
+ * RegisterEventEx.  Routes may be set up before the dispatcher is started.
+ * The route of a thread is discarded once the thread's handle has been
+ * released.
+ */
+BOOL RegisterThreadEvent(HTHREAD hThread, int nSignal,
+    LPEVENT_ROUTINE lpfnEventRoutine, void* pUserState);
+
+#endif //__EVENT_DISPATCHER_H__
@@ -0,0 +1,83 @@
+// fiber.h - Interface for fibers: threads of control that the threading_core
+// library schedules in user space, many to one, onto a few carrier threads,
+// and that are otherwise used through the same HTHREAD API as threads.
+//
+
+#ifndef __FIBER_H__
+#define __FIBER_H__
+
+#include "threading_core.h"
+
+/**
+ * @brief Size, in bytes, of the stack of a fiber whose attributes ask for
+ * the default.
+ */
+#ifndef FIBER_STACK_SIZE
+#define FIBER_STACK_SIZE (64 * 1024)
+#endif //FIBER_STACK_SIZE
+
+/**
+ * @brief Maximum number of default-size fiber stacks that are kept for
+ * reuse once their fibers have finished.
+ */
+#ifndef FIBER_STACK_CACHE_MAX
+#define FIBER_STACK_CACHE_MAX 1024
+#endif //FIBER_STACK_CACHE_MAX
+
+/**
+ * @brief Creates a fiber, which runs a thread procedure on one of the
+ * carrier threads.
+ * @param lpfnThreadProc Address of the thread procedure.
+ * @param pUserState Address of user state that is passed to lpfnThreadProc.
+ * May be NULL.
+ * @return Handle to the fiber, or INVALID_HANDLE_VALUE if an error occurred.
+ * @remarks Same as CreateThreadEx2 with THREAD_ATTRIBUTES::bFiber set and
+ * the other attributes left at their defaults.
+ * A fiber handle works with WaitThread, WaitThreadEx, WaitThreadExTimeout,
+ * WaitForMultipleThreads, KillThreadEx, IsThreadStopRequested, the thread
+ * name functions and the statistics, just like a thread handle.  The
+ * differences are:
+ * - A fiber runs until it returns or calls YieldThread; it is never
+ *   preempted by another fiber.  A fiber that blocks in the kernel blocks
+ *   its carrier thread, and every fiber queued behind it.
+ * - KillThreadEx only sets the stop token of a fiber; no signal is raised,
+ *   and CancelThread does the same.  Fibers must poll
+ *   IsThreadStopRequested.
+ * - A fiber may resume on a different carrier thread after YieldThread, so
+ *   it must not keep the address of a thread-local variable, errno
+ *   included, across the call.
+ * - GetThreadId returns the carrier thread the fiber last ran on.
+ * - A fiber that calls WaitThreadEx or WaitThreadExTimeout lets the other
+ *   fibers run while it waits; other blocking calls, WaitForMultipleThreads
+ *   included, hold up the carrier thread.
+ * The carrier threads are started the first time a fiber is created.
+ */
+HTHREAD CreateFiber(LPTHREAD_START_ROUTINE lpfnThreadProc, void* pUserState);
+
+/**
+ * @brief Sets the number of carrier threads that run fibers.
+ * @param nCarrierThreads Number of carrier threads, or zero for one per
+ * online CPU, which is the default.
+ * @return TRUE if the setting took effect; FALSE if the carrier threads
+ * are already running, or nCarrierThreads is negative.
+ * @remarks Must be called before the first fiber is created.
+ */
+BOOL SetFiberCarrierCount(int nCarrierThreads);
+
+/**
+ * @brief Lets other fibers, or other threads, run.
+ * @remarks On a fiber, puts the calling fiber at the back of the run queue
+ * and switches to its carrier thread, which picks the next ready fiber,
+ * without entering the kernel; returns when the calling fiber's turn comes
+ * around again, or at once if no other fiber is ready.  On an ordinary
+ * thread, calls sched_yield.
+ */
+void YieldThread(void);
+
+/**
+ * @brief Gets whether the caller is running on a fiber.
+ * @return TRUE on a fiber; FALSE on an ordinary thread.
+ */
+BOOL IsRunningOnFiber(void);
+
+#endif //__FIBER_H__
@@ -0,0 +1,145 @@
+// future.h - Interface for future/promise handles that deliver the result of
+// a unit of work to the threads that are interested in it.
+//
+
+#ifndef __FUTURE_H__
+#define __FUTURE_H__
+
+#include "threading_core.h"
+
+/**
+ * @brief Opaque structure that holds the state of a future.
+ */
+typedef struct _FUTURE FUTURE, *LPFUTURE;
+
+/**
+ * @brief Handle to a future, i.e., a void* result that may not have been
+ * produced yet.
+ */
+typedef LPFUTURE HFUTURE;
+
+/**
+ * @brief Creates a future that is completed by calling SetFutureResult.
+ * @return Handle to the new future, or INVALID_HANDLE_VALUE if an error
+ * occurred.
+ * @remarks This is the "promise" half of a future: the producer keeps the
+ * handle to complete it, and consumers wait on the same handle.  The handle
+ * starts out with a single reference.  If the producer and a consumer may
+ * release the handle independently of each other, call AddRefFuture before
+ * handing it over, so that each of them owns a reference of its own and
+ * calls DestroyFuture once when it is done with it.
+ */
+HFUTURE CreatePromise(void);
+
+/**
+ * @brief Adds a reference to a future, for handing it to one more thread
+ * that will release it with DestroyFuture.
+ * @param hFuture Handle to the future.
+ */
+void AddRefFuture(HFUTURE hFuture);
+
+/**
+ * @brief Releases a reference to a future.
+ * @param hFuture Handle to the future to release.
+ * @remarks The memory used by the future is freed once its last reference
+ * has been released.  A future does not need to be completed to be
+ * released; however, once its last reference is gone it can never be
+ * completed, so the futures returned by ContinueFutureWith and
+ * ContinueFutureWithEx for continuations that have not run yet are
+ * abandoned: their continuations never run, and waiting on them fails with
+ * ECANCELED.
+ */
+void DestroyFuture(HFUTURE hFuture);
+
+/**
+ * @brief Completes a future and wakes every thread waiting on it.
+ * @param hFuture Handle to the future to complete.
+ * @param pvResult Result to deliver.  May be NULL.
+ * @return TRUE if the future was completed; FALSE if the handle is invalid
+ * or the future had already been completed.
+ * @remarks Continuations registered with ContinueFutureWith run on the
+ * calling thread before this function returns.
+ */
+BOOL SetFutureResult(HFUTURE hFuture, void* pvResult);
+
+/**
+ * @brief Gets whether a future has been completed, without blocking.
+ * @param hFuture Handle to the future to poll.
+ * @return TRUE if the future has been completed or abandoned; FALSE
+ * otherwise.
+ */
+BOOL IsFutureReady(HFUTURE hFuture);
+
+/**
+ * @brief Waits for a future to be completed and retrieves its result.
+ * @param hFuture Handle to the future to wait for.
+ * @param ppvResult Address of storage that receives the result.  May be
+ * NULL.
+ * @param nTimeoutMs Maximum number of milliseconds to wait, or INFINITE.
+ * @return Zero if the future was completed; ETIMEDOUT if the timeout elapsed
+ * first; ECANCELED if the future was abandoned (see DestroyFuture); EINVAL
+ * if the handle is invalid.
+ * @remarks The handle remains valid after this function returns, so a
+ * future can be waited on any number of times by any number of threads.
+ */
+int WaitFuture(HFUTURE hFuture, void** ppvResult, int nTimeoutMs);
+
+/**
+ * @brief Waits for any one of several futures to be completed.
+ * @param phFutures Address of an array of handles to futures.
+ * @param nCount Number of elements in phFutures.
+ * @param nTimeoutMs Maximum number of milliseconds to wait, or INFINITE.
+ * @param pnIndex Address of storage that receives the index, in phFutures,
+ * of a future that has been completed.
+ * @return Zero if a future was completed; ETIMEDOUT if the timeout elapsed
+ * first; EINVAL if the arguments are invalid.
+ * @remarks To react to each of N futures as it completes, call this in a
+ * loop and swap each completed future out of the array.  An abandoned
+ * future counts as completed; WaitFuture reports it as ECANCELED.
+ */
+int WaitAnyFuture(HFUTURE* phFutures, int nCount, int nTimeoutMs,
+    int* pnIndex);
+
+/**
+ * @brief Registers a continuation that runs when a future is completed.
+ * @param hFuture Handle to the antecedent future.
+ * @param lpfnContinuation Address of a function that receives the result of
+ * the antecedent future as its argument.
+ * @return Handle to a new future that is completed with the value returned
+ * by lpfnContinuation, or INVALID_HANDLE_VALUE if an error occurred.
+ * @remarks The continuation runs on the thread that completes hFuture, or
+ * immediately on the calling thread if hFuture is already complete.  If
+ * hFuture is abandoned instead, the continuation never runs and the future
+ * returned is abandoned as well.
+ */
+HFUTURE ContinueFutureWith(HFUTURE hFuture,
+    LPTHREAD_START_ROUTINE lpfnContinuation);
+
+/**
+ * @brief Registers a continuation that is queued on a thread pool when a
+ * future is completed.
+ * @param hFuture Handle to the antecedent future.
+ * @param hThreadPool Handle to the thread pool that should run the
+ * continuation.
+ * @param lpfnContinuation Address of a function that receives the result of
+ * the antecedent future as its argument.
+ * @return Handle to a new future that is completed with the value returned
+ * by lpfnContinuation, or INVALID_HANDLE_VALUE if an error occurred.
+ */
+HFUTURE ContinueFutureWithEx(HFUTURE hFuture, HTHREADPOOL hThreadPool,
+    LPTHREAD_START_ROUTINE lpfnContinuation);
+
+/**
+ * @brief Queues a work item on a thread pool and returns a future for its
+ * result.
+ * @param hThreadPool Handle to the thread pool that should run the item.
+ * @param lpfnWorkItem Address of the function to run.
+ * @param pUserState Address of user state that is passed to lpfnWorkItem.
+ * May be NULL.
+ * @return Handle to a future that is completed with the value returned by
+ * lpfnWorkItem, or INVALID_HANDLE_VALUE if an error occurred.
+ */
+HFUTURE SubmitWorkItem(HTHREADPOOL hThreadPool,
+    LPTHREAD_START_ROUTINE lpfnWorkItem, void* pUserState);
+
+#endif //__FUTURE_H__
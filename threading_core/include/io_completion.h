@@ -0,0 +1,143 @@
+// io_completion.h - Interface for I/O completion ports: queues of readiness
+// events on file descriptors, which a few poll threads fill from epoll and
+// a bounded number of worker threads drain.
+//
+
+#ifndef __IO_COMPLETION_H__
+#define __IO_COMPLETION_H__
+
+#include "threading_core.h"
+
+/**
+ * @brief Maximum number of events a poll thread takes from epoll at once.
+ */
+#ifndef IOCP_EVENTS_PER_POLL
+#define IOCP_EVENTS_PER_POLL 64
+#endif //IOCP_EVENTS_PER_POLL
+
+/**
+ * @brief Opaque structure that holds the state of a completion port.
+ */
+typedef struct _IOCOMPLETIONPORT IOCOMPLETIONPORT, *LPIOCOMPLETIONPORT;
+
+/**
+ * @brief Handle to an I/O completion port.
+ */
+typedef LPIOCOMPLETIONPORT HIOCP;
+
+/**
+ * @brief Completion packet, as returned by GetQueuedCompletion.
+ */
+typedef struct _IOCOMPLETION {
+  int nFd;                    // file descriptor; -1 for a posted packet
+  uint32_t nEvents;           // EPOLLIN, EPOLLOUT, EPOLLHUP, ... or posted
+  uintptr_t nCompletionKey;   // as passed to AssociateFd or posted
+} IOCOMPLETION, *LPIOCOMPLETION;
+
+/**
+ * @brief Creates an I/O completion port.
+ * @param nConcurrency Maximum number of worker threads that may be running
+ * completions at the same time, or zero for one per online CPU.
+ * @param nPollThreads Number of threads that wait on epoll for the port, or
+ * zero for one.
+ * @return Handle to the new port, or INVALID_HANDLE_VALUE if an error
+ * occurred.
+ * @remarks A port reports readiness, as epoll does, rather than finished
+ * reads and writes: a worker that gets an EPOLLIN completion reads from the
+ * (non-blocking) descriptor itself.  The poll threads do nothing but move
+ * events from epoll to the port's queue, so a single one keeps up with a
+ * great many descriptors.
+ */
+HIOCP CreateIoCompletionPort(int nConcurrency, int nPollThreads);
+
+/**
+ * @brief Stops the poll threads of a completion port and releases its
+ * resources.
+ * @param hPort Handle to the port.
+ * @return System error code.  Zero if successful.  The port is torn down
+ * even if an error is reported.
+ * @remarks Threads that are blocked in GetQueuedCompletion return
+ * ESHUTDOWN; this function waits until they have.  Packets still in the
+ * queue are discarded.  The descriptors associated with the port are not
+ * closed.  A thread that is still running a packet from the port may call
+ * GetQueuedCompletion once more, which returns ESHUTDOWN; nobody else may
+ * use the handle once this function has returned.
+ */
+int DestroyIoCompletionPort(HIOCP hPort);
+
+/**
+ * @brief Starts watching a file descriptor for readiness.
+ * @param hPort Handle to the port.
+ * @param nFd Descriptor to watch, e.g., a socket or pipe in non-blocking
+ * mode.
+ * @param nEvents Events to watch for: EPOLLIN, EPOLLOUT, EPOLLRDHUP, or a
+ * combination.  EPOLLERR and EPOLLHUP are always reported.
+ * @param nCompletionKey Value that is passed back in the completions of the
+ * descriptor, e.g., the address of the connection it belongs to.
+ * @return Zero if successful, or a system error code; EEXIST if the
+ * descriptor is already associated with the port.
+ * @remarks The descriptor is armed once: after it has produced a
+ * completion, it produces no more until RearmFd is called, so that no two
+ * workers ever handle the same descriptor at the same time.
+ */
+int AssociateFd(HIOCP hPort, int nFd, uint32_t nEvents,
+    uintptr_t nCompletionKey);
+
+/**
+ * @brief Watches a descriptor for the next event, once the worker that got
+ * its last completion is done with it.
+ * @param hPort Handle to the port.
+ * @param nFd Descriptor, as passed to AssociateFd.
+ * @return Zero if successful, or a system error code; ENOENT if the
+ * descriptor is not associated with the port; ESHUTDOWN if the port is
+ * being destroyed.
+ * @remarks Readiness that is still there, e.g., unread data, produces a new
+ * completion right away.
+ */
+int RearmFd(HIOCP hPort, int nFd);
+
+/**
+ * @brief Stops watching a descriptor.
+ * @param hPort Handle to the port.
+ * @param nFd Descriptor, as passed to AssociateFd.
+ * @return Zero if successful, or a system error code; ENOENT if the
+ * descriptor is not associated with the port.
+ * @remarks Call this before closing the descriptor.  A completion that is
+ * already queued for the descriptor is still delivered.
+ */
+int DissociateFd(HIOCP hPort, int nFd);
+
+/**
+ * @brief Queues a packet that has nothing to do with a descriptor, e.g., to
+ * tell the workers to quit.
+ * @param hPort Handle to the port.
+ * @param nCompletionKey Value for IOCOMPLETION::nCompletionKey.
+ * @param nEvents Value for IOCOMPLETION::nEvents.
+ * @return TRUE if the packet was queued; FALSE if the port is shutting down
+ * or there is not enough memory.
+ */
+BOOL PostQueuedCompletion(HIOCP hPort, uintptr_t nCompletionKey,
+    uint32_t nEvents);
+
+/**
+ * @brief Waits for a completion packet.
+ * @param hPort Handle to the port.
+ * @param pCompletion Address of storage that receives the packet.
+ * @param nTimeoutMs Number of milliseconds to wait; zero to poll, or
+ * INFINITE to wait until a packet comes.
+ * @return Zero if a packet was received; ETIMEDOUT if none came in time;
+ * ESHUTDOWN if the port is being destroyed; EINVAL if an argument is
+ * invalid, e.g., a negative timeout other than INFINITE.
+ * @remarks The calling thread counts as running from the time this
+ * function returns a packet until it calls it again, calls it for another
+ * port, or exits, and packets are only handed out while fewer threads than
+ * the concurrency of the port are running.  So a worker that is posted a
+ * packet telling it to quit may simply return.  Idle threads are woken
+ * last in, first out, so the work goes to the thread whose caches are
+ * warmest, and the others stay asleep.  A thread should take packets from
+ * one port only.
+ */
+int GetQueuedCompletion(HIOCP hPort, LPIOCOMPLETION pCompletion,
+    int nTimeoutMs);
+
+#endif //__IO_COMPLETION_H__
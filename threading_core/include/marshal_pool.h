@@ -0,0 +1,50 @@
+// marshal_pool.h - Interface for the size-classed pools that supply the
+// memory for blocks marshalled across thread boundaries.
+//
+
+#ifndef __MARSHAL_POOL_H__
+#define __MARSHAL_POOL_H__
+
+/**
+ * @brief Size, in bytes, from which a marshalled block gets a mapping of its
+ * own, backed by transparent huge pages where possible, and is copied with
+ * non-temporal stores that do not push the rest of the data out of the
+ * cache.
+ */
+#ifndef MARSHAL_LARGE_BLOCK_SIZE
+#define MARSHAL_LARGE_BLOCK_SIZE (1024 * 1024)
+#endif //MARSHAL_LARGE_BLOCK_SIZE
+
+/**
+ * @brief Opaque structure that holds the state of a marshalling pool.
+ */
+typedef struct _MARSHALPOOL MARSHALPOOL, *LPMARSHALPOOL;
+
+/**
+ * @brief Handle to a pool of memory for marshalled blocks.
+ */
+typedef LPMARSHALPOOL HMARSHALPOOL;
+
+/**
+ * @brief Creates a pool from which MarshalBlockToThreadEx can allocate.
+ * @return Handle to the new pool, or NULL if an error occurred.
+ * @remarks Blocks are carved out of slabs in power-of-two size classes.
+ * Every thread keeps a small cache of free blocks per class, so most
+ * allocations and releases never touch a lock; blocks released by a thread
+ * other than the one that allocated them are handed back to the pool in
+ * batches.  Blocks that are too big for the largest size class come
+ * straight from the heap, and blocks of MARSHAL_LARGE_BLOCK_SIZE bytes or
+ * more straight from the system, whatever pool they are allocated from.
+ */
+HMARSHALPOOL CreateMarshalPool(void);
+
+/**
+ * @brief Destroys a marshalling pool and releases all of its memory.
+ * @param hPool Handle to the pool to destroy.
+ * @remarks Every block that was allocated from the pool becomes invalid,
+ * so only call this once the threads that use the pool are done with it.
+ * The default pool used by MarshalBlockToThread cannot be destroyed.
+ */
+void DestroyMarshalPool(HMARSHALPOOL hPool);
+
+#endif //__MARSHAL_POOL_H__
@@ -5,6 +5,17 @@
 #ifndef __MARSHALLING_FUNCTIONS_H__
 #define __MARSHALLING_FUNCTIONS_H__
 
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "marshal_pool.h"
+
+/**
+ * @brief Pointer to a function that releases a buffer whose ownership has
+ * been handed over by TransferBlockToThread or ShareBlockWithThreads.
+ */
+typedef void (*LPRELEASE_BLOCK_ROUTINE)(void* pvBuffer);
+
 /**
  * @name MarshalBlockToThread
  * @brief Called to marshal a value from the stack to the shared heap and
@@ -21,10 +32,157 @@
  * An exception is thrown (and the calling application is killed) if the
  * operation failed.  Typcially, this is the case when there is insufficient
  * storage space on the global heap for the data block. To 'demarshal' the
- * data block, all you need to do is call free() on the pointer that this
- * function returns.
+ * data block, call DeMarshalBlockFromThread, or, if you have used the data
+ * in place, FreeMarshalledBlock.  Do NOT call free() on the pointer that this
+ * function returns: the block comes from the default marshalling pool.
+ * Blocks of MARSHAL_LARGE_BLOCK_SIZE bytes or more get pages of their own
+ * and are copied without going through the cache of the calling thread.
+ */
+void* MarshalBlockToThread(void* pvData, size_t nBlockSize);
+
+/**
+ * @name MarshalBlockToThreadEx
+ * @brief Called to marshal a value from the stack into a block allocated
+ * from a specific marshalling pool.
+ * @param hPool Handle to the pool to allocate from, as returned by
+ * CreateMarshalPool.  Pass NULL to use the default pool, which is what
+ * MarshalBlockToThread does.
+ * @param pvData Address of the data to be marshalled.
+ * @param nBlockSize Size of the data to be marshalled.
+ * @return If successful, address of the copy of the data.
+ * @remarks Small blocks are served from a per-thread free list and only
+ * touch the pool in batches, so marshalling at a high rate does not
+ * contend on the global heap.  Release the block with
+ * DeMarshalBlockFromThread or FreeMarshalledBlock.  An exception is thrown
+ * if the operation failed.
+ */
+void* MarshalBlockToThreadEx(HMARSHALPOOL hPool, void* pvData,
+    size_t nBlockSize);
+
+/**
+ * @name MarshalBlocksToThread
+ * @brief Gathers several fragments of data into a single marshalled block.
+ * @param pBlocks Address of an array of fragments, e.g., a header and a
+ * payload that live apart.  Fragments of zero length are skipped.
+ * @param nBlockCount Number of elements in pBlocks.
+ * @return If successful, address of a block that holds the fragments one
+ * after the other, in order.
+ * @remarks Saves marshalling a block that the caller had to assemble first.
+ * The block is released like one returned by MarshalBlockToThread, and
+ * DeMarshalBlockFromThread takes it apart again if given the total size.
+ * An exception is thrown if the operation failed, or if the fragments add
+ * up to nothing.
+ */
+void* MarshalBlocksToThread(const struct iovec* pBlocks, int nBlockCount);
+
+/**
+ * @name MarshalBlocksToThreadEx
+ * @brief Gathers several fragments of data into a single block allocated
+ * from a specific marshalling pool.
+ * @param hPool Handle to the pool to allocate from, or NULL for the default
+ * pool.
+ * @param pBlocks Address of an array of fragments.
+ * @param nBlockCount Number of elements in pBlocks.
+ * @return If successful, address of the block.
+ */
+void* MarshalBlocksToThreadEx(HMARSHALPOOL hPool,
+    const struct iovec* pBlocks, int nBlockCount);
+
+/**
+ * @name FreeMarshalledBlock
+ * @brief Releases a marshalled block without copying its data anywhere.
+ * @param pvData Address returned by MarshalBlockToThread or
+ * MarshalBlockToThreadEx.  May be NULL.
+ * @remarks Use this instead of free() when the receiving thread has used
+ * the data in place.  The block is returned to the pool it came from.  For
+ * an envelope from TransferBlockToThread, the buffer is released as well;
+ * for a shared block, one reference is dropped.
+ */
+void FreeMarshalledBlock(void* pvData);
+
+/**
+ * @name TransferBlockToThread
+ * @brief Hands ownership of an existing buffer to another thread without
+ * copying it.
+ * @param pvBuffer Address of the buffer to hand over.  It must not live on
+ * the stack.
+ * @param nBlockSize Size of the buffer, in bytes.
+ * @param lpfnRelease Address of the function that releases the buffer, or
+ * NULL if it was allocated with malloc().
+ * @return Address of an envelope to pass to the receiving thread.
+ * @remarks The calling thread must not touch pvBuffer after this call.  The
+ * receiver takes the buffer out of the envelope with AcceptTransferredBlock,
+ * or calls DeMarshalBlockFromThread as usual (which copies the data out and
+ * releases the buffer), or drops it with FreeMarshalledBlock.  Use
+ * MarshalBlockToThread instead for data that really lives on the stack.  An
+ * exception is thrown if the operation failed.
+ */
+void* TransferBlockToThread(void* pvBuffer, size_t nBlockSize,
+    LPRELEASE_BLOCK_ROUTINE lpfnRelease);
+
+/**
+ * @name AcceptTransferredBlock
+ * @brief Takes ownership of the buffer in an envelope returned by
+ * TransferBlockToThread.
+ * @param pvEnvelope Address of the envelope.  It is released by this call.
+ * @param pnBlockSize Address of storage that receives the size of the
+ * buffer.  May be NULL.
+ * @param plpfnRelease Address of storage that receives the function that
+ * releases the buffer.  May be NULL if the caller knows how to release it.
+ * @return Address of the buffer, which now belongs to the caller.
+ * @remarks An exception is thrown if pvEnvelope is not a live envelope
+ * returned by TransferBlockToThread.
+ */
+void* AcceptTransferredBlock(void* pvEnvelope, size_t* pnBlockSize,
+    LPRELEASE_BLOCK_ROUTINE* plpfnRelease);
+
+/**
+ * @name ShareBlockWithThreads
+ * @brief Hands a read-only buffer to any number of threads without copying
+ * it.
+ * @param pvBuffer Address of the buffer to share.  It must not live on the
+ * stack.
+ * @param nBlockSize Size of the buffer, in bytes.
+ * @param lpfnRelease Address of the function that releases the buffer, or
+ * NULL if it was allocated with malloc().
+ * @param nRefCount Number of references the shared block starts out with;
+ * typically, one per consumer.  Must be positive.
+ * @return Address of a shared block to pass to each consumer.
+ * @remarks Consumers read the buffer through GetSharedBlockData and drop
+ * their reference with ReleaseSharedBlock (or FreeMarshalledBlock); the
+ * buffer is released along with the last reference.  Nobody may write to the
+ * buffer once it has been shared.  An exception is thrown if the operation
+ * failed.
+ */
+void* ShareBlockWithThreads(void* pvBuffer, size_t nBlockSize,
+    LPRELEASE_BLOCK_ROUTINE lpfnRelease, int nRefCount);
+
+/**
+ * @name GetSharedBlockData
+ * @brief Gets the buffer of a block returned by ShareBlockWithThreads.
+ * @param pvShared Address of the shared block.
+ * @param pnBlockSize Address of storage that receives the size of the
+ * buffer.  May be NULL.
+ * @return Address of the buffer, which is valid until the caller releases
+ * its reference.
+ */
+const void* GetSharedBlockData(void* pvShared, size_t* pnBlockSize);
+
+/**
+ * @name AddRefSharedBlock
+ * @brief Adds a reference to a block returned by ShareBlockWithThreads, for
+ * handing it to one more consumer.
+ * @param pvShared Address of the shared block.
+ */
+void AddRefSharedBlock(void* pvShared);
+
+/**
+ * @name ReleaseSharedBlock
+ * @brief Drops a reference to a block returned by ShareBlockWithThreads.
+ * @param pvShared Address of the shared block.
+ * @remarks The buffer is released when the last reference is dropped.
  */
-void* MarshalBlockToThread(void* pvData, int nBlockSize);
+void ReleaseSharedBlock(void* pvShared);
 
 /**
  * @name DeMarshalBlockFromThread
@@ -34,10 +192,15 @@ void* MarshalBlockToThread(void* pvData, int nBlockSize);
  * demarshalled data should be copied.
  * @param pvData Address of heap storage containing the data which is
  * to be recovered from across the thread boundary.
+ * @param nDataSize Number of bytes to copy to pvDest.
  * @remarks This function should be utilized by calling threads to bring data
- * back over from a child thread.
+ * back over from a child thread.  The block is released as soon as it has
+ * been copied; if other threads may still be reading it, copy it out
+ * yourself and hand it to RetireMarshalledBlock instead.  Like
+ * MarshalBlockToThread, copies MARSHAL_LARGE_BLOCK_SIZE bytes or more
+ * without going through the cache.
  */
 void DeMarshalBlockFromThread(void* pvDest, void* pvData,
-    int nDataSize);
+    size_t nDataSize);
 
 #endif //__MARSHALLING_FUNCTIONS_H__
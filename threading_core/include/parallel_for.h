@@ -0,0 +1,148 @@
+// parallel_for.h - Interface for data-parallel loops over index ranges,
+// which the threading_core library runs as tasks on a task scheduler.
+//
+
+#ifndef __PARALLEL_FOR_H__
+#define __PARALLEL_FOR_H__
+
+#include "threading_core.h"
+#include "task_scheduler.h"
+
+/**
+ * @brief Number of chunks per worker thread that a range is cut into when
+ * the caller leaves the grain size up to the library.  More chunks balance
+ * the load better; fewer cost less to schedule.
+ */
+#ifndef PARALLEL_CHUNKS_PER_WORKER
+#define PARALLEL_CHUNKS_PER_WORKER 8
+#endif //PARALLEL_CHUNKS_PER_WORKER
+
+/**
+ * @brief Body of a parallel loop.  Called with consecutive, non-overlapping
+ * chunks [nBegin, nEnd) of the range, possibly at the same time on
+ * different threads.
+ * @param nBegin First index of the chunk.
+ * @param nEnd One past the last index of the chunk.
+ * @param pContext Address of the context passed to ParallelFor.
+ */
+typedef void (*LPPARALLEL_FOR_ROUTINE)(long nBegin, long nEnd,
+    void* pContext);
+
+/**
+ * @brief Body of a parallel reduction.  Folds the elements of a chunk
+ * [nBegin, nEnd) of the range into a partial result.
+ * @param nBegin First index of the chunk.
+ * @param nEnd One past the last index of the chunk.
+ * @param pvPartial Address of the partial result to fold the chunk into.
+ * No other thread touches it at the same time.
+ * @param pContext Address of the context passed to ParallelReduce.
+ */
+typedef void (*LPPARALLEL_REDUCE_ROUTINE)(long nBegin, long nEnd,
+    void* pvPartial, void* pContext);
+
+/**
+ * @brief Combines one partial result of a parallel reduction into another.
+ * @param pvResult Address of the result to combine into.
+ * @param pvPartial Address of the partial result to combine.
+ * @param pContext Address of the context passed to ParallelReduce.
+ */
+typedef void (*LPPARALLEL_COMBINE_ROUTINE)(void* pvResult,
+    const void* pvPartial, void* pContext);
+
+/**
+ * @brief Runs a loop body over a range of indices, in parallel, on the
+ * library's shared task scheduler.
+ * @param nBegin First index of the range.
+ * @param nEnd One past the last index of the range.
+ * @param nGrain Number of indices below which a chunk is not split any
+ * further, or zero to let the library choose.
+ * @param lpfnBody Address of the loop body.
+ * @param pContext Address of context that is passed to lpfnBody.  May be
+ * NULL.
+ * @return Zero if successful; EINVAL if lpfnBody is NULL or nGrain is
+ * negative; ENOMEM if the shared task scheduler could not be started.
+ * @remarks Same as ParallelForEx with the shared scheduler, which has one
+ * worker per online CPU and is started on first use.
+ */
+int ParallelFor(long nBegin, long nEnd, long nGrain,
+    LPPARALLEL_FOR_ROUTINE lpfnBody, void* pContext);
+
+/**
+ * @brief Runs a loop body over a range of indices, in parallel, on the
+ * specified task scheduler.
+ * @param hScheduler Handle to the scheduler to run on.
+ * @param nBegin First index of the range.
+ * @param nEnd One past the last index of the range.
+ * @param nGrain Number of indices below which a chunk is not split any
+ * further, or zero to let the library choose.
+ * @param lpfnBody Address of the loop body.
+ * @param pContext Address of context that is passed to lpfnBody.  May be
+ * NULL.
+ * @return Zero if successful; EINVAL if an argument is invalid.
+ * @remarks Returns once the whole range has been processed.  The range is
+ * split in halves, recursively, down to the grain size; each half that is
+ * split off becomes a task that an idle worker can steal, so the load
+ * balances itself even if some chunks take much longer than others.  The
+ * calling thread processes chunks too, if it is a worker of hScheduler.
+ * Nothing is allocated per chunk.  Calls may be nested; a call made from a
+ * task of a different scheduler runs the whole range on the calling
+ * thread.  Also waits for any other tasks that the caller has spawned on
+ * hScheduler and not yet synced.
+ */
+int ParallelForEx(HTASKSCHEDULER hScheduler, long nBegin, long nEnd,
+    long nGrain, LPPARALLEL_FOR_ROUTINE lpfnBody, void* pContext);
+
+/**
+ * @brief Reduces a range of indices to a single result, in parallel, on
+ * the library's shared task scheduler.
+ * @param nBegin First index of the range.
+ * @param nEnd One past the last index of the range.
+ * @param nGrain See ParallelFor.
+ * @param pvIdentity Address of the identity of the reduction, e.g., a zero
+ * for a sum.
+ * @param pvResult Address of storage that receives the result.
+ * @param nResultSize Size, in bytes, of the identity and of the result.
+ * @param lpfnBody Address of the function that folds a chunk into a partial
+ * result.
+ * @param lpfnCombine Address of the function that combines two partial
+ * results.
+ * @param pContext Address of context that is passed to lpfnBody and
+ * lpfnCombine.  May be NULL.
+ * @return Zero if successful; EINVAL if an argument is invalid; ENOMEM if
+ * there is not enough memory.
+ * @remarks Same as ParallelReduceEx with the shared scheduler.
+ */
+int ParallelReduce(long nBegin, long nEnd, long nGrain,
+    const void* pvIdentity, void* pvResult, size_t nResultSize,
+    LPPARALLEL_REDUCE_ROUTINE lpfnBody, LPPARALLEL_COMBINE_ROUTINE lpfnCombine,
+    void* pContext);
+
+/**
+ * @brief Reduces a range of indices to a single result, in parallel, on
+ * the specified task scheduler.
+ * @param hScheduler Handle to the scheduler to run on.
+ * @param nBegin See ParallelReduce.
+ * @param nEnd See ParallelReduce.
+ * @param nGrain See ParallelReduce.
+ * @param pvIdentity See ParallelReduce.
+ * @param pvResult See ParallelReduce.
+ * @param nResultSize See ParallelReduce.
+ * @param lpfnBody See ParallelReduce.
+ * @param lpfnCombine See ParallelReduce.
+ * @param pContext See ParallelReduce.
+ * @return Zero if successful; EINVAL if an argument is invalid; ENOMEM if
+ * there is not enough memory.
+ * @remarks The range is split as by ParallelForEx.  Each thread folds its
+ * chunks into a partial result of its own, which starts out as a copy of
+ * the identity and sits on cache lines of its own, so that the threads do
+ * not contend for the same memory.  The partial results are combined on
+ * the calling thread at the end.  The reduction must be associative and
+ * commutative, since the order in which chunks are folded and combined is
+ * not fixed.
+ */
+int ParallelReduceEx(HTASKSCHEDULER hScheduler, long nBegin, long nEnd,
+    long nGrain, const void* pvIdentity, void* pvResult, size_t nResultSize,
+    LPPARALLEL_REDUCE_ROUTINE lpfnBody, LPPARALLEL_COMBINE_ROUTINE lpfnCombine,
+    void* pContext);
+
+#endif //__PARALLEL_FOR_H__
@@ -0,0 +1,91 @@
+// ring_buffer.h - Interface for single-producer/single-consumer ring buffers
+// that carry marshalled blocks from one thread to another.
+//
+
+#ifndef __RING_BUFFER_H__
+#define __RING_BUFFER_H__
+
+#include "threading_core.h"
+
+/**
+ * @brief Opaque structure that holds the state of a ring buffer.
+ */
+typedef struct _RINGBUFFER RINGBUFFER, *LPRINGBUFFER;
+
+/**
+ * @brief Handle to a ring buffer.
+ */
+typedef LPRINGBUFFER HRINGBUFFER;
+
+/**
+ * @brief Creates a ring buffer for passing blocks from exactly one producer
+ * thread to exactly one consumer thread.
+ * @param nCapacity Maximum number of blocks the ring buffer holds at once.
+ * It is rounded up to the next power of two.
+ * @param nMaxInlineSize Size, in bytes, of the largest block that is copied
+ * straight into the ring buffer.  Larger blocks are marshalled with
+ * MarshalBlockToThread, and the ring buffer only carries their address.
+ * @return Handle to the new ring buffer, or INVALID_HANDLE_VALUE if an
+ * error occurred.
+ * @remarks Neither side performs an atomic read-modify-write on the fast
+ * path, and small blocks never touch the heap.  The consumer only sleeps
+ * (on a futex) when the ring buffer is empty, and the producer only when it
+ * is full.  Using a ring buffer from more than one producer or more than
+ * one consumer at a time is not supported; use a channel (see channel.h)
+ * for that.
+ */
+HRINGBUFFER CreateRingBuffer(int nCapacity, int nMaxInlineSize);
+
+/**
+ * @brief Destroys a ring buffer.
+ * @param hRingBuffer Handle to the ring buffer to destroy.
+ * @return Zero if successful; EINVAL if the handle is invalid.
+ * @remarks Neither side may be using the ring buffer.  Blocks that are
+ * still in it are discarded.
+ */
+int DestroyRingBuffer(HRINGBUFFER hRingBuffer);
+
+/**
+ * @brief Tells the consumer of a ring buffer that no more blocks are coming.
+ * @param hRingBuffer Handle to the ring buffer.
+ * @return Zero if successful; EINVAL if the handle is invalid.
+ * @remarks Must be called by the producer.  The consumer keeps getting the
+ * blocks that are still in the ring buffer, and then gets EPIPE.
+ */
+int CloseRingBuffer(HRINGBUFFER hRingBuffer);
+
+/**
+ * @brief Copies a block into a ring buffer.  Called by the producer.
+ * @param hRingBuffer Handle to the ring buffer.
+ * @param pvData Address of the data to send.
+ * @param nBlockSize Size of the data, in bytes.
+ * @param nTimeoutMs Maximum number of milliseconds to wait for room in the
+ * ring buffer; INFINITE to wait as long as it takes, or zero not to wait at
+ * all.
+ * @return Zero if the block was sent; EAGAIN if nTimeoutMs is zero and the
+ * ring buffer is full; ETIMEDOUT if the timeout elapsed; EPIPE if the ring
+ * buffer has been closed; EINVAL if the arguments are invalid.
+ */
+int WriteToRingBuffer(HRINGBUFFER hRingBuffer, void* pvData, int nBlockSize,
+    int nTimeoutMs);
+
+/**
+ * @brief Copies the next block out of a ring buffer.  Called by the
+ * consumer.
+ * @param hRingBuffer Handle to the ring buffer.
+ * @param pvDest Address of storage that receives the data.
+ * @param nDestSize Size, in bytes, of the storage at pvDest.
+ * @param pnBlockSize Address of storage that receives the size of the
+ * block.  May be NULL.
+ * @param nTimeoutMs Maximum number of milliseconds to wait for a block;
+ * INFINITE to wait as long as it takes, or zero not to wait at all.
+ * @return Zero if a block was received; EAGAIN if nTimeoutMs is zero and the
+ * ring buffer is empty; ETIMEDOUT if the timeout elapsed; EPIPE if the ring
+ * buffer has been closed and is empty; EMSGSIZE if the block does not fit
+ * in nDestSize bytes, in which case it stays in the ring buffer and
+ * *pnBlockSize says how big it is; EINVAL if the arguments are invalid.
+ */
+int ReadFromRingBuffer(HRINGBUFFER hRingBuffer, void* pvDest, int nDestSize,
+    int* pnBlockSize, int nTimeoutMs);
+
+#endif //__RING_BUFFER_H__
@@ -1,13 +1,40 @@
 #ifndef __STDAFX_H__
 #define __STDAFX_H__
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE   // pthread_setname_np and friends
+#endif //_GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>  //Header file for sleep(). man 3 sleep for details.
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>  // non-temporal stores for large marshalled blocks
+#endif //__SSE2__
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>  // __rdtsc, for trace timestamps
+#endif
 
 #ifndef OK
 #define OK		0		// Code to return to the operating system to indicate successful program termination
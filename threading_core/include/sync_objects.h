@@ -0,0 +1,195 @@
+// sync_objects.h - Interface for the synchronization objects of the
+// threading_core library: mutexes, condition variables and reader-writer
+// locks that are built directly on futexes.
+//
+
+#ifndef __SYNC_OBJECTS_H__
+#define __SYNC_OBJECTS_H__
+
+#include "threading_core.h"
+
+/**
+ * @brief Upper bound on the number of times a thread polls a lock that is
+ * held by somebody else before it goes to sleep in the kernel.
+ * @remarks Each object learns how long it is typically held and spins for
+ * about that long, up to this limit.  Nobody spins on a machine with a
+ * single CPU, since the holder cannot make progress while we do.
+ */
+#ifndef SYNC_SPIN_LIMIT
+#define SYNC_SPIN_LIMIT 200
+#endif //SYNC_SPIN_LIMIT
+
+/**
+ * @brief Opaque structure that holds the state of a mutex.
+ */
+typedef struct _MUTEX MUTEX, *LPMUTEX;
+
+/**
+ * @brief Handle to a mutex.
+ */
+typedef LPMUTEX HMUTEX;
+
+/**
+ * @brief Opaque structure that holds the state of a condition variable.
+ */
+typedef struct _CONDITION CONDITION, *LPCONDITION;
+
+/**
+ * @brief Handle to a condition variable.
+ */
+typedef LPCONDITION HCONDITION;
+
+/**
+ * @brief Opaque structure that holds the state of a reader-writer lock.
+ */
+typedef struct _RWLOCK RWLOCK, *LPRWLOCK;
+
+/**
+ * @brief Handle to a reader-writer lock.
+ */
+typedef LPRWLOCK HRWLOCK;
+
+/**
+ * @brief Creates a mutex.
+ * @return Handle to the new mutex, or INVALID_HANDLE_VALUE if there is not
+ * enough memory.
+ * @remarks Locking a mutex that nobody holds takes a single atomic
+ * operation and never enters the kernel.  The mutex is not recursive.
+ */
+HMUTEX CreateMutex(void);
+
+/**
+ * @brief Destroys a mutex.
+ * @param hMutex Handle to the mutex to destroy.
+ * @return Zero if successful; EINVAL if the handle is invalid.
+ * @remarks Nobody may hold or be waiting for the mutex.
+ */
+int DestroyMutex(HMUTEX hMutex);
+
+/**
+ * @brief Locks a mutex, waiting as long as it takes.
+ * @param hMutex Handle to the mutex.
+ * @return Zero if successful; EINVAL if the handle is invalid.
+ */
+int LockMutex(HMUTEX hMutex);
+
+/**
+ * @brief Locks a mutex, waiting for at most the specified number of
+ * milliseconds.
+ * @param hMutex Handle to the mutex.
+ * @param nTimeoutMs Maximum number of milliseconds to wait; INFINITE to
+ * wait as long as it takes, or zero not to wait at all.
+ * @return Zero if the mutex was locked; EAGAIN if nTimeoutMs is zero and
+ * somebody else holds it; ETIMEDOUT if the timeout elapsed; EINVAL if the
+ * handle is invalid or nTimeoutMs is negative but not INFINITE.
+ */
+int LockMutexTimeout(HMUTEX hMutex, int nTimeoutMs);
+
+/**
+ * @brief Unlocks a mutex that the calling thread holds.
+ * @param hMutex Handle to the mutex.
+ * @return Zero if successful; EINVAL if the handle is invalid.
+ * @remarks Only enters the kernel if some thread is asleep waiting for the
+ * mutex.
+ */
+int UnlockMutex(HMUTEX hMutex);
+
+/**
+ * @brief Creates a condition variable.
+ * @return Handle to the new condition variable, or INVALID_HANDLE_VALUE if
+ * there is not enough memory.
+ */
+HCONDITION CreateCondition(void);
+
+/**
+ * @brief Destroys a condition variable.
+ * @param hCondition Handle to the condition variable to destroy.
+ * @return Zero if successful; EINVAL if the handle is invalid.
+ * @remarks Nobody may be waiting on the condition variable.
+ */
+int DestroyCondition(HCONDITION hCondition);
+
+/**
+ * @brief Unlocks a mutex and waits for a condition variable to be
+ * signalled, then locks the mutex again.
+ * @param hCondition Handle to the condition variable.
+ * @param hMutex Handle to a mutex that the calling thread holds.
+ * @param nTimeoutMs Maximum number of milliseconds to wait, or INFINITE.
+ * @return Zero if the condition variable was signalled; ETIMEDOUT if the
+ * timeout elapsed; EINVAL if the handles are invalid or nTimeoutMs is
+ * negative but not INFINITE.  The mutex is locked again in every case but
+ * the last.
+ * @remarks As with pthread_cond_wait, the thread may wake up without having
+ * been signalled, so check the predicate again in a loop.
+ */
+int WaitCondition(HCONDITION hCondition, HMUTEX hMutex, int nTimeoutMs);
+
+/**
+ * @brief Wakes one thread that is waiting on a condition variable.
+ * @param hCondition Handle to the condition variable.
+ * @return Zero if successful; EINVAL if the handle is invalid.
+ * @remarks Does not enter the kernel if nobody is waiting.
+ */
+int SignalCondition(HCONDITION hCondition);
+
+/**
+ * @brief Wakes every thread that is waiting on a condition variable.
+ * @param hCondition Handle to the condition variable.
+ * @return Zero if successful; EINVAL if the handle is invalid.
+ * @remarks Does not enter the kernel if nobody is waiting.
+ */
+int BroadcastCondition(HCONDITION hCondition);
+
+/**
+ * @brief Creates a reader-writer lock that is tuned for data that is read
+ * much more often than it is written.
+ * @return Handle to the new lock, or INVALID_HANDLE_VALUE if there is not
+ * enough memory.
+ * @remarks Readers count themselves in a counter of the CPU they run on,
+ * each on a cache line of its own, so that readers on different CPUs never
+ * write to the same memory.  A writer has to look at every counter, which
+ * makes writing more expensive than with pthread_rwlock.  Writers take
+ * precedence: once one is waiting, new readers wait for it, so read locks
+ * must not be taken recursively.
+ */
+HRWLOCK CreateRWLock(void);
+
+/**
+ * @brief Destroys a reader-writer lock.
+ * @param hRWLock Handle to the lock to destroy.
+ * @return Zero if successful; EINVAL if the handle is invalid.
+ * @remarks Nobody may hold or be waiting for the lock.
+ */
+int DestroyRWLock(HRWLOCK hRWLock);
+
+/**
+ * @brief Locks a reader-writer lock for reading, waiting as long as it
+ * takes for any writer to finish.
+ * @param hRWLock Handle to the lock.
+ * @return Zero if successful; EINVAL if the handle is invalid.
+ */
+int LockRWLockShared(HRWLOCK hRWLock);
+
+/**
+ * @brief Releases a read lock that the calling thread holds.
+ * @param hRWLock Handle to the lock.
+ * @return Zero if successful; EINVAL if the handle is invalid.
+ */
+int UnlockRWLockShared(HRWLOCK hRWLock);
+
+/**
+ * @brief Locks a reader-writer lock for writing, waiting as long as it
+ * takes for the other writers and all readers to finish.
+ * @param hRWLock Handle to the lock.
+ * @return Zero if successful; EINVAL if the handle is invalid.
+ */
+int LockRWLockExclusive(HRWLOCK hRWLock);
+
+/**
+ * @brief Releases a write lock that the calling thread holds.
+ * @param hRWLock Handle to the lock.
+ * @return Zero if successful; EINVAL if the handle is invalid.
+ */
+int UnlockRWLockExclusive(HRWLOCK hRWLock);
+
+#endif //__SYNC_OBJECTS_H__
@@ -0,0 +1,103 @@
+// task_scheduler.h - Interface for a work-stealing scheduler that runs
+// fork/join style tasks on a fixed set of worker threads.
+//
+
+#ifndef __TASK_SCHEDULER_H__
+#define __TASK_SCHEDULER_H__
+
+#include "threading_core.h"
+
+/**
+ * @brief Opaque structure that holds the state of a task scheduler.
+ */
+typedef struct _TASKSCHEDULER TASKSCHEDULER, *LPTASKSCHEDULER;
+
+/**
+ * @brief Handle to a work-stealing task scheduler.
+ */
+typedef LPTASKSCHEDULER HTASKSCHEDULER;
+
+/**
+ * @brief Creates a work-stealing task scheduler.
+ * @param nWorkerThreads Number of worker threads to start.  Pass zero (or a
+ * negative value) to start one worker per online CPU.
+ * @return Handle to the new scheduler, or INVALID_HANDLE_VALUE if an error
+ * occurred.
+ * @remarks Each worker owns a lock-free Chase-Lev deque.  Tasks spawned from
+ * inside a task are pushed onto the deque of the worker that runs it; idle
+ * workers steal the oldest tasks from the deques of the other workers.
+ * Tasks spawned from threads that are not workers of the scheduler go
+ * through a shared injection queue.
+ */
+HTASKSCHEDULER CreateTaskScheduler(int nWorkerThreads);
+
+/**
+ * @brief Creates a work-stealing task scheduler whose workers are pinned to
+ * physical cores according to the specified placement policy.
+ * @param nWorkerThreads Number of worker threads to start.  Pass zero (or a
+ * negative value) to start one worker per physical core, or, with
+ * THREAD_PLACEMENT_NONE, one per online CPU.
+ * @param nPlacement One of the THREAD_PLACEMENT_* values.
+ * @return Handle to the new scheduler, or INVALID_HANDLE_VALUE if an error
+ * occurred.
+ * @remarks Pinning keeps each worker's deque and the data its tasks touch in
+ * the caches of one core.  THREAD_PLACEMENT_COMPACT suits tasks that share a
+ * lot of data; THREAD_PLACEMENT_SCATTER suits tasks that need memory
+ * bandwidth.
+ */
+HTASKSCHEDULER CreateTaskSchedulerEx(int nWorkerThreads, int nPlacement);
+
+/**
+ * @brief Stops the workers of a task scheduler and releases its resources.
+ * @param hScheduler Handle to the scheduler to destroy.
+ * @return System error code.  Zero if successful.
+ * @remarks Call SyncTasks first; tasks that have not yet started when this
+ * function is called are discarded.
+ */
+int DestroyTaskScheduler(HTASKSCHEDULER hScheduler);
+
+/**
+ * @brief Gets the number of worker threads of a task scheduler.
+ * @param hScheduler Handle to the scheduler.
+ * @return Number of workers, or ERROR if the handle is invalid.
+ */
+int GetTaskSchedulerWorkerCount(HTASKSCHEDULER hScheduler);
+
+/**
+ * @brief Gets the zero-based index of the calling worker thread within its
+ * task scheduler.
+ * @return Index of the worker, or ERROR if the calling thread is not a
+ * worker of any task scheduler.
+ */
+int GetCurrentWorkerIndex(void);
+
+/**
+ * @brief Forks a child task.
+ * @param hScheduler Handle to the scheduler that should run the task.
+ * @param lpfnTask Address of the function to run.  It has the same
+ * signature as a thread procedure passed to CreateThreadEx, so existing
+ * thread procedures can be spawned as tasks unchanged.
+ * @param pUserState Address of user state that is passed to lpfnTask.  May
+ * be NULL.
+ * @return TRUE if the task was spawned; FALSE otherwise.
+ * @remarks The child belongs to the task (or thread) that spawned it; use
+ * SyncTasks to join it.  A task that returns without calling SyncTasks is
+ * implicitly joined with its children before it is considered finished.
+ * The value returned by lpfnTask is discarded.
+ */
+BOOL SpawnTask(HTASKSCHEDULER hScheduler, LPTHREAD_START_ROUTINE lpfnTask,
+    void* pUserState);
+
+/**
+ * @brief Waits for every task spawned by the calling task (or thread) to
+ * finish.
+ * @param hScheduler Handle to the scheduler the tasks were spawned on.
+ * @return System error code.  Zero if successful.
+ * @remarks When called from inside a task, the calling worker keeps running
+ * its own tasks and stealing others while it waits, so nested fork/join
+ * never blocks a worker.  Threads that are not workers of the scheduler
+ * sleep until their children have finished.
+ */
+int SyncTasks(HTASKSCHEDULER hScheduler);
+
+#endif //__TASK_SCHEDULER_H__
@@ -0,0 +1,116 @@
+// thread_arena.h - Interface for per-thread arenas: bump allocators for the
+// short-lived allocations of thread procedures, work items and tasks, whose
+// memory is given back all at once instead of block by block.
+//
+
+#ifndef __THREAD_ARENA_H__
+#define __THREAD_ARENA_H__
+
+#include "threading_core.h"
+
+/**
+ * @brief Size, in bytes, of the chunks an arena gets from the heap.  Bigger
+ * allocations get a chunk of their own.
+ */
+#ifndef THREAD_ARENA_CHUNK_SIZE
+#define THREAD_ARENA_CHUNK_SIZE (64 * 1024)
+#endif //THREAD_ARENA_CHUNK_SIZE
+
+/**
+ * @brief Maximum number of chunks an arena keeps, once it is reset, for the
+ * next allocations to reuse.  The rest go back to the heap.
+ */
+#ifndef THREAD_ARENA_SPARE_CHUNKS
+#define THREAD_ARENA_SPARE_CHUNKS 4
+#endif //THREAD_ARENA_SPARE_CHUNKS
+
+/**
+ * @brief Alignment, in bytes, of every block allocated from an arena.
+ */
+#ifndef THREAD_ARENA_ALIGNMENT
+#define THREAD_ARENA_ALIGNMENT 16
+#endif //THREAD_ARENA_ALIGNMENT
+
+/**
+ * @brief Opaque structure that holds the state of an arena.
+ */
+typedef struct _THREADARENA THREADARENA, *LPTHREADARENA;
+
+/**
+ * @brief Handle to an arena.
+ */
+typedef LPTHREADARENA HARENA;
+
+/**
+ * @brief Position in an arena, which ResetArenaToMark goes back to.  The
+ * fields are for the use of the library only.
+ */
+typedef struct _ARENAMARK {
+  void* pvChunk;
+  size_t nUsed;
+} ARENAMARK, *LPARENAMARK;
+
+/**
+ * @brief Gets the arena of the calling thread.
+ * @return Handle to the arena, or INVALID_HANDLE_VALUE if there is not
+ * enough memory to set it up.
+ * @remarks Every thread has an arena of its own, set up the first time it
+ * asks for it, so threads that never use it pay nothing.  Nothing but the
+ * thread itself may allocate from it, so no locks are taken.  Every fiber
+ * has its own arena as well.
+ * The arena is reset, and its memory released, in bulk:
+ * - When a thread or fiber created by this library terminates.  Its thread
+ *   procedure must not return a block of its arena to WaitThreadEx; see
+ *   PromoteArenaBlock.
+ * - When a work item of a thread pool, a task of a task scheduler, or a
+ *   timer callback returns.  Blocks it allocated are gone at that point.
+ * - When any other thread exits.
+ */
+HARENA GetThreadArena(void);
+
+/**
+ * @brief Allocates a block from an arena.
+ * @param hArena Handle to the arena, as returned by GetThreadArena.
+ * @param nSize Size of the block, in bytes.
+ * @return Address of the block, aligned to THREAD_ARENA_ALIGNMENT, or NULL
+ * if there is not enough memory or the handle is invalid.
+ * @remarks Usually just moves a pointer.  Blocks are not freed one by one;
+ * see ResetArena and ResetArenaToMark.
+ */
+void* ArenaAlloc(HARENA hArena, size_t nSize);
+
+/**
+ * @brief Gets the current position in an arena.
+ * @param hArena Handle to the arena.
+ * @return The position.
+ */
+ARENAMARK GetArenaMark(HARENA hArena);
+
+/**
+ * @brief Frees every block allocated from an arena since a mark was taken.
+ * @param hArena Handle to the arena.
+ * @param pMark Address of a mark returned by GetArenaMark for the same
+ * arena.  The arena must not have been reset to an earlier mark since.
+ */
+void ResetArenaToMark(HARENA hArena, const ARENAMARK* pMark);
+
+/**
+ * @brief Frees every block allocated from an arena.
+ * @param hArena Handle to the arena.
+ * @remarks Keeps up to THREAD_ARENA_SPARE_CHUNKS chunks for reuse.
+ */
+void ResetArena(HARENA hArena);
+
+/**
+ * @brief Copies a block, e.g., one allocated from an arena, to the shared
+ * heap, so that it outlives the arena.
+ * @param pvBlock Address of the block.
+ * @param nSize Size of the block, in bytes.
+ * @return Address of the copy, which the caller releases with free(), or
+ * NULL if there is not enough memory.
+ * @remarks Use this for the result a thread procedure returns to
+ * WaitThreadEx, or anything else that is handed to another thread.
+ */
+void* PromoteArenaBlock(const void* pvBlock, size_t nSize);
+
+#endif //__THREAD_ARENA_H__
@@ -0,0 +1,107 @@
+// thread_pool.h - Interface for a pool of persistent worker threads that
+// execute queued work items.
+//
+
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include "threading_core.h"
+
+/**
+ * @brief Number of milliseconds that a worker thread above the minimum
+ * count of a thread pool is allowed to sit idle before it retires.
+ */
+#ifndef THREAD_POOL_IDLE_TIMEOUT_MS
+#define THREAD_POOL_IDLE_TIMEOUT_MS 30000
+#endif //THREAD_POOL_IDLE_TIMEOUT_MS
+
+/**
+ * @brief Opaque structure that holds the state of a thread pool.
+ */
+typedef struct _THREADPOOL THREADPOOL, *LPTHREADPOOL;
+
+/**
+ * @brief Handle to a pool of worker threads.
+ */
+typedef LPTHREADPOOL HTHREADPOOL;
+
+/**
+ * @brief Creates a pool of worker threads that execute work items queued
+ * with QueueWorkItem.
+ * @param nMinThreads Number of worker threads that are started immediately
+ * and kept alive for the lifetime of the pool.  May be zero.
+ * @param nMaxThreads Maximum number of worker threads the pool may grow to.
+ * Pass a value that is less than or equal to nMinThreads for a fixed-size
+ * pool.
+ * @return Handle to the new thread pool, or INVALID_HANDLE_VALUE if an error
+ * occurred.
+ * @remarks Worker threads are created with CreateThreadEx, so the cost of
+ * creating a thread is paid once per worker instead of once per work item.
+ * When a work item is queued and more items are waiting than there are idle
+ * workers, the pool grows by one worker, up to nMaxThreads.  Workers above
+ * nMinThreads retire after they have been idle for
+ * THREAD_POOL_IDLE_TIMEOUT_MS milliseconds.
+ */
+HTHREADPOOL CreateThreadPool(int nMinThreads, int nMaxThreads);
+
+/**
+ * @brief Creates a pool of worker threads, each of which is pinned to a
+ * physical core according to the specified placement policy.
+ * @param nMinThreads See CreateThreadPool.
+ * @param nMaxThreads See CreateThreadPool.  Pass GetPhysicalCoreCount() for
+ * one worker per physical core.
+ * @param nPlacement One of the THREAD_PLACEMENT_* values.
+ * @return Handle to the new thread pool, or INVALID_HANDLE_VALUE if an error
+ * occurred.
+ * @remarks With THREAD_PLACEMENT_NONE, this is the same as CreateThreadPool.
+ * If there are more workers than physical cores, cores are handed out again
+ * from the start of the policy's order.
+ */
+HTHREADPOOL CreateThreadPoolEx(int nMinThreads, int nMaxThreads,
+    int nPlacement);
+
+/**
+ * @brief Waits for all outstanding work items to finish, stops the worker
+ * threads of the pool, and releases the pool's resources.
+ * @param hThreadPool Handle to the thread pool to destroy.
+ * @return System error code.  Zero if successful.
+ * @remarks Work items that are already queued are run before the workers
+ * stop.  The handle is invalid once this function returns.
+ */
+int DestroyThreadPool(HTHREADPOOL hThreadPool);
+
+/**
+ * @brief Gets the number of worker threads currently alive in a pool.
+ * @param hThreadPool Handle to the thread pool.
+ * @return Number of worker threads, or ERROR if the handle is invalid.
+ */
+int GetThreadPoolThreadCount(HTHREADPOOL hThreadPool);
+
+/**
+ * @brief Queues a work item for execution by one of the worker threads of
+ * a pool.
+ * @param hThreadPool Handle to the thread pool that should run the item.
+ * @param lpfnWorkItem Address of the function to run.  It has the same
+ * signature as a thread procedure passed to CreateThreadEx.
+ * @param pUserState Address of user state that is passed to lpfnWorkItem.
+ * May be NULL.
+ * @return TRUE if the work item was queued; FALSE otherwise.
+ * @remarks The value returned by lpfnWorkItem is discarded.  Data that lives
+ * on the stack of the caller must be marshalled with MarshalBlockToThread,
+ * just as it would be for a thread created with CreateThreadEx.
+ */
+BOOL QueueWorkItem(HTHREADPOOL hThreadPool,
+    LPTHREAD_START_ROUTINE lpfnWorkItem, void* pUserState);
+
+/**
+ * @brief Blocks the calling thread until every work item queued on a pool
+ * has finished running.
+ * @param hThreadPool Handle to the thread pool to wait for.
+ * @return System error code.  Zero if successful.
+ * @remarks The pool remains usable after this function returns.  Do not call
+ * this function from inside a work item of the same pool; it would wait for
+ * itself.
+ */
+int WaitThreadPool(HTHREADPOOL hThreadPool);
+
+#endif //__THREAD_POOL_H__
@@ -0,0 +1,78 @@
+// thread_trace.h - Interface for the opt-in trace recorder, which keeps a
+// timeline of what the threading_core library did and writes it out in the
+// Chrome trace-event format.
+//
+
+#ifndef __THREAD_TRACE_H__
+#define __THREAD_TRACE_H__
+
+#include "threading_core.h"
+
+/**
+ * @brief Number of events each thread keeps.  Must be a power of two.  Once
+ * a thread has recorded this many, each new event overwrites its oldest.
+ */
+#ifndef THREAD_TRACE_BUFFER_EVENTS
+#define THREAD_TRACE_BUFFER_EVENTS 8192
+#endif //THREAD_TRACE_BUFFER_EVENTS
+
+/**
+ * @brief Number of threads that have exited whose events are kept until the
+ * trace is written or cleared.  Beyond that, the events of the thread that
+ * exited first are dropped.
+ */
+#ifndef THREAD_TRACE_MAX_EXITED
+#define THREAD_TRACE_MAX_EXITED 256
+#endif //THREAD_TRACE_MAX_EXITED
+
+/**
+ * @brief Turns the trace recorder on or off.
+ * @param bEnable TRUE to record events; FALSE to stop.
+ * @remarks Tracing is off by default, and costs one relaxed load and a
+ * predictable branch per instrumented call while it is.  While it is on,
+ * threads record thread creation, start and exit, waits in WaitThreadEx,
+ * CancelThread, stop requests sent by KillThread and its relatives, signal
+ * handlers, and marshalling copies.  Each thread writes its events, stamped
+ * with the CPU's time stamp counter, to a ring buffer of its own, without
+ * locks or atomic read-modify-write instructions; only its first event
+ * allocates the buffer.  Events recorded so far are kept when tracing is
+ * turned off.
+ */
+void EnableThreadTrace(BOOL bEnable);
+
+/**
+ * @brief Determines whether the trace recorder is on.
+ * @return TRUE if events are being recorded; FALSE otherwise.
+ */
+BOOL IsThreadTraceEnabled(void);
+
+/**
+ * @brief Writes the events recorded so far to a file, as Chrome trace-event
+ * JSON.
+ * @param pszPath Path of the file to create or overwrite.
+ * @return Zero if successful, or a system error code; EINVAL if pszPath is
+ * NULL.
+ * @remarks Open the file with chrome://tracing or ui.perfetto.dev.  Every
+ * thread gets a track, named after the thread, on which its lifetime, its
+ * waits for other threads, its signal handlers and its marshalling copies
+ * show up as spans.  Threads keep recording while the trace is written; an
+ * event that is overwritten while it is being read is left out.  The events
+ * are not cleared, so a trace that is written again later includes them
+ * too; call ClearThreadTrace in between to avoid that.
+ */
+int WriteThreadTrace(const char* pszPath);
+
+/**
+ * @brief Writes the trace to a file when the process exits normally, i.e.,
+ * returns from main() or calls exit().
+ * @param pszPath Path of the file, or NULL to write nothing at exit.
+ * @return TRUE if successful; FALSE if there was not enough memory.
+ */
+BOOL SetThreadTraceExitPath(const char* pszPath);
+
+/**
+ * @brief Drops every event recorded so far.
+ */
+void ClearThreadTrace(void);
+
+#endif //__THREAD_TRACE_H__
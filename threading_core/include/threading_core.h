@@ -1,7 +1,14 @@
 #ifndef __THREADING_CORE_H__
 #define __THREADING_CORE_H__
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE   // cpu_set_t and the CPU_* macros
+#endif //_GNU_SOURCE
+
 #include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <time.h>
 
 #include "marshalling_functions.h"
 
@@ -15,10 +22,133 @@
 #define INVALID_HANDLE_VALUE NULL
 #endif //INVALID_HANDLE_VALUE
 
+/**
+ * @brief Timeout value, in milliseconds, that tells a wait function to
+ * wait for as long as it takes.
+ */
+#ifndef INFINITE
+#define INFINITE -1
+#endif //INFINITE
+
+/**
+ * @brief Value added to the index of the thread that satisfied a call to
+ * WaitForMultipleThreads to form its return value.
+ */
+#ifndef WAIT_OBJECT_0
+#define WAIT_OBJECT_0 0
+#endif //WAIT_OBJECT_0
+
+/**
+ * @brief Value returned by WaitForMultipleThreads if the timeout elapsed
+ * before the wait was satisfied.
+ */
+#ifndef WAIT_TIMEOUT
+#define WAIT_TIMEOUT -2
+#endif //WAIT_TIMEOUT
+
+/**
+ * @brief Value returned by WaitForMultipleThreads if the wait could not be
+ * performed, e.g., because an invalid handle was passed.
+ */
+#ifndef WAIT_FAILED
+#define WAIT_FAILED -1
+#endif //WAIT_FAILED
+
+/**
+ * @brief Number of milliseconds KillThread and KillThreadEx wait, by
+ * default, for a thread to acknowledge a stop request before canceling it.
+ * See SetThreadKillTimeout.
+ */
+#ifndef THREAD_KILL_TIMEOUT_MS
+#define THREAD_KILL_TIMEOUT_MS 250
+#endif //THREAD_KILL_TIMEOUT_MS
+
+/**
+ * @brief Maximum length, including the terminating null, of a thread name
+ * set with SetThreadName.
+ */
+#ifndef THREAD_NAME_MAX_LENGTH
+#define THREAD_NAME_MAX_LENGTH 32
+#endif //THREAD_NAME_MAX_LENGTH
+
+/**
+ * @brief Value of THREAD_ATTRIBUTES::nNumaNode that places a thread on no
+ * NUMA node in particular.
+ */
+#ifndef THREAD_NUMA_NODE_ANY
+#define THREAD_NUMA_NODE_ANY -1
+#endif //THREAD_NUMA_NODE_ANY
+
+/**
+ * @brief Value of THREAD_ATTRIBUTES::nSchedPolicy that makes a thread
+ * inherit the scheduling policy and priority of the thread creating it.
+ */
+#ifndef THREAD_SCHED_INHERIT
+#define THREAD_SCHED_INHERIT -1
+#endif //THREAD_SCHED_INHERIT
+
+/**
+ * @brief Value of THREAD_ATTRIBUTES::nGuardSize that keeps the system's
+ * default guard size.
+ */
+#ifndef THREAD_GUARD_SIZE_DEFAULT
+#define THREAD_GUARD_SIZE_DEFAULT ((size_t) -1)
+#endif //THREAD_GUARD_SIZE_DEFAULT
+
+/**
+ * @name THREAD_PLACEMENT_*
+ * @brief Policies for spreading the workers of a thread pool or task
+ * scheduler over the machine.  NONE leaves placement to the system.  The
+ * other two pin each worker to one physical core (all of its hardware
+ * threads): COMPACT fills up one socket before moving on to the next, so
+ * workers share caches; SCATTER deals cores out round-robin across
+ * sockets, so workers get as much cache and memory bandwidth as possible.
+ */
+#ifndef THREAD_PLACEMENT_NONE
+#define THREAD_PLACEMENT_NONE     0
+#endif //THREAD_PLACEMENT_NONE
+
+#ifndef THREAD_PLACEMENT_COMPACT
+#define THREAD_PLACEMENT_COMPACT  1
+#endif //THREAD_PLACEMENT_COMPACT
+
+#ifndef THREAD_PLACEMENT_SCATTER
+#define THREAD_PLACEMENT_SCATTER  2
+#endif //THREAD_PLACEMENT_SCATTER
+
+/**
+ * @brief Options for creating a thread with CreateThreadEx2.  Call
+ * InitThreadAttributes to fill in the defaults, then change the fields you
+ * care about.
+ */
+typedef struct _THREAD_ATTRIBUTES {
+  cpu_set_t cpuSet;       // CPUs the thread may run on; empty for any
+  int nNumaNode;          // NUMA node to run on, or THREAD_NUMA_NODE_ANY
+  size_t nStackSize;      // size of the stack, in bytes; zero for default
+  size_t nGuardSize;      // size of the guard area; see above for default
+  int nSchedPolicy;       // SCHED_OTHER, SCHED_FIFO, ... or inherit
+  int nPriority;          // static priority, for SCHED_FIFO and SCHED_RR
+  BOOL bFiber;            // run on the carrier threads; see fiber.h
+} THREAD_ATTRIBUTES, *LPTHREAD_ATTRIBUTES;
+
+/**
+ * @brief Opaque type that thread handles point to.  It is never defined;
+ * see HTHREAD.
+ */
+typedef struct _THREADHANDLE* LPTHREADHANDLE;
+
 /**
  * @brief Handle to a process thread.
+ * @remarks A handle identifies a slot in the library's table of thread
+ * control blocks, along with the generation of that slot.  Once a handle
+ * has been released (by WaitThread, WaitThreadEx or DestroyThread), the
+ * generation of the slot moves on and every copy of the handle becomes
+ * stale: functions that are passed a stale handle fail as if they had been
+ * passed INVALID_HANDLE_VALUE, rather than touching a thread that happens
+ * to reuse the slot.  Handles must not be dereferenced; use GetThreadId to
+ * get at the underlying pthread_t.
  */
-typedef pthread_t* HTHREAD;
+typedef LPTHREADHANDLE HTHREAD;
 
 /**
  * @brief Signature of a function that handles a signal.
@@ -72,6 +202,134 @@ HTHREAD CreateThread(LPTHREAD_START_ROUTINE lpfnThreadProc);
 HTHREAD CreateThreadEx(LPTHREAD_START_ROUTINE lpfnThreadProc,
         void* __restrict pUserState);
 
+/**
+ * @brief Fills in a THREAD_ATTRIBUTES structure with default values, which
+ * make CreateThreadEx2 behave just like CreateThreadEx.
+ * @param pAttributes Address of the structure to initialize.
+ */
+void InitThreadAttributes(LPTHREAD_ATTRIBUTES pAttributes);
+
+/**
+ * @brief Creates a new thread with the specified placement, stack and
+ * scheduling options.
+ * @param lpfnThreadProc Address of a function that will serve as the thread
+ * procedure.
+ * @param pUserState Address of a block of memory that contains user state
+ * that is to be passed as an argument to the thread procedure.
+ * @param pAttributes Address of the options for the new thread, as set up
+ * by InitThreadAttributes.  May be NULL, in which case this is the same as
+ * CreateThreadEx.
+ * @return Handle to the created thread, or INVALID_HANDLE_VALUE if an error
+ * occurred.
+ * @remarks If both a CPU set and a NUMA node are given, the thread runs on
+ * the CPUs of the set that belong to the node.  A thread placed on a NUMA
+ * node also prefers that node's memory for its allocations.  Real-time
+ * scheduling policies typically require privileges; creation fails if the
+ * process does not have them.  A fiber (bFiber) takes its stack size from
+ * the attributes and ignores the other fields.
+ */
+HTHREAD CreateThreadEx2(LPTHREAD_START_ROUTINE lpfnThreadProc,
+    void* pUserState, const THREAD_ATTRIBUTES* pAttributes);
+
+/**
+ * @brief Creates several threads that run the same thread procedure.
+ * @param nCount Number of threads to create.
+ * @param lpfnThreadProc Address of a function that will serve as the thread
+ * procedure of each thread.
+ * @param ppvUserStates Address of an array of nCount user states; thread i
+ * gets ppvUserStates[i].  May be NULL, in which case every thread gets NULL.
+ * @param phThreads Address of an array of nCount elements that receives the
+ * handles of the threads.
+ * @return Number of threads created.  If it is less than nCount, the
+ * elements of phThreads from that index on are INVALID_HANDLE_VALUE.
+ * @remarks Faster than calling CreateThreadEx nCount times: the control
+ * blocks of all the threads are taken from the handle table at once.
+ */
+int CreateThreads(int nCount, LPTHREAD_START_ROUTINE lpfnThreadProc,
+    void** ppvUserStates, HTHREAD* phThreads);
+
+/**
+ * @brief Creates several threads with the same placement, stack and
+ * scheduling options.
+ * @param nCount Number of threads to create.
+ * @param lpfnThreadProc Address of the thread procedure.
+ * @param ppvUserStates Address of an array of nCount user states, or NULL.
+ * @param pAttributes Address of the options for the new threads, or NULL
+ * for the defaults.
+ * @param phThreads Address of an array of nCount elements that receives the
+ * handles of the threads.
+ * @return Number of threads created, as for CreateThreads.
+ * @remarks The options are turned into a single pthread attributes object,
+ * which every thread of the batch is created from, so a CPU set or NUMA
+ * node is only looked up once.
+ */
+int CreateThreadsEx(int nCount, LPTHREAD_START_ROUTINE lpfnThreadProc,
+    void** ppvUserStates, const THREAD_ATTRIBUTES* pAttributes,
+    HTHREAD* phThreads);
+
+/**
+ * @brief Gets the number of physical cores the calling process may run on.
+ * @return Number of cores.  Hardware threads of the same core count once.
+ */
+int GetPhysicalCoreCount(void);
+
+/**
+ * @brief Gets the CPUs that a placement policy assigns to a worker.
+ * @param nPlacement THREAD_PLACEMENT_COMPACT or THREAD_PLACEMENT_SCATTER.
+ * @param nWorkerIndex Zero-based index of the worker.  Indices beyond the
+ * number of physical cores wrap around.
+ * @param pCpuSet Address of storage that receives the CPUs of the physical
+ * core assigned to the worker.
+ * @return TRUE if successful; FALSE if the arguments are invalid.
+ * @remarks Useful for placing threads of your own the same way the thread
+ * pool and task scheduler place their workers.
+ */
+BOOL GetPlacementCpuSet(int nPlacement, int nWorkerIndex,
+    cpu_set_t* pCpuSet);
+
+/**
+ * @brief Sets the stack size of threads that are created without asking for
+ * a particular one.
+ * @param nStackSize Size of the stack, in bytes, or zero for the system's
+ * default (usually 8 MB, from RLIMIT_STACK).
+ * @remarks Applies to CreateThread, CreateThreadEx, and CreateThreadEx2
+ * with a THREAD_ATTRIBUTES::nStackSize of zero, including the workers of
+ * thread pools and task schedulers.  Threads that mostly sleep rarely need
+ * more than a few hundred kilobytes.
+ */
+void SetDefaultThreadStackSize(size_t nStackSize);
+
+/**
+ * @brief Gets the stack size set with SetDefaultThreadStackSize.
+ * @return Size of the stack, in bytes, or zero for the system's default.
+ */
+size_t GetDefaultThreadStackSize(void);
+
+/**
+ * @brief Turns on (or off) the recycling of thread stacks.
+ * @param nMaxCachedStacks Maximum number of stacks of exited threads that
+ * are kept for new threads.  Zero turns the cache off, and releases the
+ * stacks it holds.
+ * @param nPrefaultSize Number of bytes at the top of each stack that are
+ * touched when the stack is first mapped, and that stay resident while it
+ * sits in the cache.  Zero lets every page fault in on first use.
+ * @remarks While the cache is on, threads run on stacks that this library
+ * maps itself.  A stack goes back into the cache when its thread is waited
+ * on; threads whose handles are destroyed without waiting are reaped
+ * (with pthread_tryjoin_np) by later calls to the thread creation
+ * functions.  A new thread whose stack comes from the cache starts without
+ * a single page fault on its stack, and the memory below the resident window
+ * of a cached stack is given back to the system.
+ */
+void SetThreadStackCacheOptions(int nMaxCachedStacks, size_t nPrefaultSize);
+
+/**
+ * @brief Unmaps every stack in the stack cache, and reaps the stacks of
+ * threads that have terminated without being waited on.
+ * @remarks The cache stays on; it fills up again as threads exit.
+ */
+void TrimThreadStackCache(void);
+
 /**
  * @brief Destroys (deallocates) a thread handle and releases its resources to
  * the operating system.
@@ -81,9 +339,74 @@ HTHREAD CreateThreadEx(LPTHREAD_START_ROUTINE lpfnThreadProc,
  * be destroyed.
  * Nominally, WaitThreadEx also releases threads once it has finished waiting
  * for them to terminate.
+ * If the thread has not been waited on, it is detached, so that the system
+ * reclaims it when it terminates; it can no longer be waited on afterwards.
  */
 int DestroyThread(HTHREAD hThread);
 
+/**
+ * @brief Gets whether a thread handle refers to a thread whose handle has
+ * not yet been released.
+ * @param hThread Handle to check.
+ * @return TRUE if the handle is valid; FALSE if it is INVALID_HANDLE_VALUE
+ * or stale.
+ */
+BOOL IsThreadHandleValid(HTHREAD hThread);
+
+/**
+ * @brief Gets the POSIX thread identifier of a thread.
+ * @param hThread Handle to the thread.
+ * @param pThreadID Address of storage that receives the pthread_t of the
+ * thread.  Left untouched if the function fails.
+ * @return Zero if successful; EINVAL if the arguments are invalid, e.g., if
+ * the handle is stale.
+ */
+int GetThreadId(HTHREAD hThread, pthread_t* pThreadID);
+
+/**
+ * @brief Gives a thread a name, for diagnostics.
+ * @param hThread Handle to the thread to name.
+ * @param pszName Name to give the thread.  Names longer than
+ * THREAD_NAME_MAX_LENGTH - 1 characters are truncated.
+ * @return TRUE if the name was set; FALSE if the arguments are invalid.
+ * @remarks The name is also passed on to the operating system (which
+ * truncates it further, to 15 characters), so it shows up in debuggers and
+ * in tools such as top.
+ */
+BOOL SetThreadName(HTHREAD hThread, const char* pszName);
+
+/**
+ * @brief Gets the name of a thread.
+ * @param hThread Handle to the thread.
+ * @param pszName Address of a buffer that receives the name.  It is empty
+ * if the thread has never been named.
+ * @param nSize Size of the buffer, in characters.
+ * @return TRUE if the name was retrieved; FALSE if the arguments are
+ * invalid.
+ */
+BOOL GetThreadName(HTHREAD hThread, char* pszName, int nSize);
+
+/**
+ * @brief Gets the time at which a thread started running.
+ * @param hThread Handle to the thread.
+ * @param pStartTime Address of storage that receives the time, measured
+ * against CLOCK_MONOTONIC.
+ * @return Zero if successful; EINVAL if the arguments are invalid.
+ */
+int GetThreadStartTime(HTHREAD hThread, struct timespec* pStartTime);
+
+/**
+ * @brief Gets the exit status of a thread that has terminated, without
+ * releasing its handle.
+ * @param hThread Handle to the thread.
+ * @param ppvExitStatus Address of storage that receives the value returned
+ * by the thread procedure, or PTHREAD_CANCELED if the thread was canceled
+ * or called pthread_exit.
+ * @return Zero if successful; EBUSY if the thread is still running; EINVAL
+ * if the arguments are invalid.
+ */
+int GetThreadExitStatus(HTHREAD hThread, void** ppvExitStatus);
+
 /**
  * @brief Registers a function to be called when a signal is sent to a thread.
  * @param lpfnEventHandler Address of a function of type LPSIGNALHANDLER that
@@ -107,6 +430,9 @@ BOOL RegisterEvent(LPSIGNALHANDLER lpfnEventHandler);
  * thread.
  * The handler should register itself over again during the call, as the last
  * statement.
+ * If the signal is routed through the event dispatcher, no signal handler is
+ * installed; the dispatcher calls lpfnEventHandler on its own thread
+ * instead.
  */
 BOOL RegisterEventEx(int signum, LPSIGNALHANDLER lpfnEventHandler);
 
@@ -132,10 +458,79 @@ int SetThreadCancelType(int nType);
  * @param hThread Thread handle of the thread you wish to kill.
  * @param signum Code identifying the signal that should be sent to the thread.
  * @remarks Causes a thread to terminate and signals the thread beforehand so
- * that it has the opportunity to perform cleanup.
+ * that it has the opportunity to perform cleanup.  Equivalent to calling
+ * KillThreadExTimeout with the timeout set by SetThreadKillTimeout.
  */
 void KillThreadEx(HTHREAD hThread, int signum);
 
+/**
+ * @brief Asks a thread to stop, raises a signal to it, and waits for it to
+ * acknowledge; cancels the thread if it does not do so in time.
+ * @param hThread Thread handle of the thread you wish to kill.
+ * @param signum Code identifying the signal that should be sent to the
+ * thread, or zero to only set its stop token.
+ * @param nTimeoutMs Maximum number of milliseconds to wait for the thread to
+ * acknowledge, or INFINITE.
+ * @return Zero if the thread acknowledged (or had already terminated);
+ * ETIMEDOUT if it did not, and a cancellation request was sent to it
+ * instead; EINVAL if the arguments are invalid, e.g., a negative timeout
+ * other than INFINITE; ENOMEM if there was not enough memory.
+ * @remarks The stop token of the thread is set before the signal is sent,
+ * so the thread can also notice the request by polling
+ * IsThreadStopRequested.  A thread acknowledges when a handler registered
+ * with RegisterEvent or RegisterEventEx returns on that thread, when it
+ * calls AcknowledgeThreadStop, or when it terminates.  A signal that goes
+ * through the event dispatcher is not raised to the thread at all; the
+ * dispatcher acknowledges once the handler has returned on its own thread
+ * (see StartEventDispatcher).
+ */
+int KillThreadExTimeout(HTHREAD hThread, int signum, int nTimeoutMs);
+
+/**
+ * @brief Asks several threads to stop at once, and waits for all of them
+ * to acknowledge; cancels the ones that do not do so in time.
+ * @param phThreads Address of an array of handles to the threads to kill.
+ * @param nCount Number of elements in phThreads.
+ * @param signum Code identifying the signal that should be sent to the
+ * threads, or zero to only set their stop tokens.
+ * @param nTimeoutMs Maximum number of milliseconds to wait, in total, for
+ * the threads to acknowledge, or INFINITE.
+ * @return Zero if every thread acknowledged; ETIMEDOUT if at least one did
+ * not and was sent a cancellation request; EINVAL if the arguments are
+ * invalid, e.g., a negative timeout other than INFINITE; ENOMEM if there
+ * was not enough memory.
+ * @remarks Every thread is signalled before any acknowledgement is waited
+ * for, so tearing down N threads takes about as long as the slowest one,
+ * not the sum of all of them.
+ */
+int KillMultipleThreads(HTHREAD* phThreads, int nCount, int signum,
+    int nTimeoutMs);
+
+/**
+ * @brief Sets how long KillThread and KillThreadEx wait for a thread to
+ * acknowledge a stop request before canceling it.
+ * @param nTimeoutMs Number of milliseconds, or INFINITE.  The default is
+ * THREAD_KILL_TIMEOUT_MS.
+ */
+void SetThreadKillTimeout(int nTimeoutMs);
+
+/**
+ * @brief Gets whether the calling thread has been asked to stop by
+ * KillThread, KillThreadEx, KillThreadExTimeout or KillMultipleThreads.
+ * @return TRUE if a stop has been requested; FALSE otherwise, or if the
+ * calling thread was not created by this library.
+ */
+BOOL IsThreadStopRequested(void);
+
+/**
+ * @brief Tells the thread that asked the calling thread to stop that the
+ * request has been seen, so it does not have to cancel the calling thread.
+ * @remarks Threads that are signalled by KillThread and friends acknowledge
+ * automatically when their registered handler returns; this is for threads
+ * that poll IsThreadStopRequested instead.
+ */
+void AcknowledgeThreadStop(void);
+
 /**
  * @brief Forcibly terminates a thread and raises a signal to it.
  * @param hThread Thread handle of the thread you wish to kill.
@@ -144,6 +539,43 @@ void KillThreadEx(HTHREAD hThread, int signum);
  */
 void KillThread(HTHREAD hThread);
 
+/**
+ * @brief Waits until any one, or all, of several threads have terminated.
+ * @param phThreads Address of an array of thread handles.
+ * @param nCount Number of elements in phThreads.
+ * @param bWaitAll TRUE to wait for every thread to terminate; FALSE to wait
+ * for whichever one terminates first.
+ * @param nTimeoutMs Maximum number of milliseconds to wait, or INFINITE.
+ * @return If bWaitAll is FALSE, WAIT_OBJECT_0 plus the index of a thread
+ * that has terminated; if bWaitAll is TRUE, WAIT_OBJECT_0.  WAIT_TIMEOUT if
+ * the timeout elapsed first, or WAIT_FAILED if the arguments are invalid.
+ * @remarks The calling thread sleeps until a thread it waits on terminates;
+ * it is woken exactly once, when the wait is satisfied.  The handles remain
+ * valid after this function returns; call WaitThreadEx to collect the
+ * return value of a terminated thread (which then returns immediately) and
+ * release its handle.
+ */
+int WaitForMultipleThreads(HTHREAD* phThreads, int nCount, BOOL bWaitAll,
+    int nTimeoutMs);
+
+/**
+ * @brief Waits for several threads to terminate, and releases their handles.
+ * @param phThreads Address of an array of thread handles, e.g., as filled in
+ * by CreateThreads.
+ * @param nCount Number of elements in phThreads.
+ * @param ppvResults Address of an array of nCount elements that receives
+ * the value each thread returned, at the same index as its handle.  May be
+ * NULL.
+ * @return Zero if every thread was joined; ERROR if the arguments are
+ * invalid, in which case none of them is; otherwise the first error
+ * WaitThreadEx ran into.
+ * @remarks Threads are joined in the order they terminate, not the order of
+ * phThreads, so a slow first thread does not hold up the collection of the
+ * others.  The calling thread sleeps in between.  Like WaitThreadEx, but for
+ * a whole batch; the handles are no longer valid afterwards.
+ */
+int WaitThreads(HTHREAD* phThreads, int nCount, void** ppvResults);
+
 /**
  * @brief Waits for the thread specified by hThread to terminate.
  * @param hThread Handle to the thread you want to wait for.
@@ -168,4 +600,33 @@ int WaitThread(HTHREAD hThread);
  */
 int WaitThreadEx(HTHREAD hThread, void** ppvRetVal);
 
+/**
+ * @brief Waits, for at most the specified number of milliseconds, for the
+ * thread specified by hThread to terminate.
+ * @param hThread Handle to the thread you want to wait for.
+ * @param ppvRetVal Address of memory that is to be filled with the user state
+ * returned by the thread procedure.  May be NULL.
+ * @param nTimeoutMs Maximum number of milliseconds to wait, or INFINITE.
+ * @return Zero if the thread terminated and its handle has been released;
+ * ETIMEDOUT if the timeout elapsed first, in which case the handle remains
+ * valid; otherwise, an error code.
+ */
+int WaitThreadExTimeout(HTHREAD hThread, void** ppvRetVal, int nTimeoutMs);
+
+#include "thread_pool.h"
+#include "task_scheduler.h"
+#include "future.h"
+#include "channel.h"
+#include "ring_buffer.h"
+#include "threading_stats.h"
+#include "event_dispatcher.h"
+#include "sync_objects.h"
+#include "timer_wheel.h"
+#include "fiber.h"
+#include "parallel_for.h"
+#include "thread_arena.h"
+#include "io_completion.h"
+#include "epoch_reclaim.h"
+#include "thread_trace.h"
+
 #endif //__THREADING_CORE_H__
@@ -0,0 +1,503 @@
+// threading_core_internal.h - Declarations of functions that are shared
+// between the modules of the threading_core library but that are not part
+// of its public interface.
+//
+
+#ifndef __THREADING_CORE_INTERNAL_H__
+#define __THREADING_CORE_INTERNAL_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "marshal_pool.h"
+#include "threading_core.h"
+#include "threading_core_symbols.h"
+
+/**
+ * @brief Value mixed into the cookie that marks the header of a marshalled
+ * block.
+ */
+#define MARSHAL_BLOCK_MAGIC       ((uintptr_t) 0x9E3779B97F4A7C15ULL)
+
+/**
+ * @brief Bits of the cookie of a marshalled block that hold its kind.
+ */
+#define MARSHAL_BLOCK_KIND_MASK   7
+
+/**
+ * @brief Kind of a marshalled block that lives in a slot of a marshalling
+ * pool.
+ */
+#define MARSHAL_BLOCK_POOLED      1
+
+/**
+ * @brief Kind of a pooled block that holds a MARSHALENVELOPE transferring
+ * ownership of a buffer to exactly one receiver.
+ */
+#define MARSHAL_BLOCK_TRANSFER    2
+
+/**
+ * @brief Kind of a pooled block that holds a MARSHALENVELOPE sharing a
+ * read-only buffer between any number of receivers.
+ */
+#define MARSHAL_BLOCK_SHARED      3
+
+/**
+ * @brief Kind of a marshalled block of at least MARSHAL_LARGE_BLOCK_SIZE
+ * bytes, which has a mapping of its own rather than a slot.
+ */
+#define MARSHAL_BLOCK_LARGE       4
+
+/**
+ * @brief Header that precedes the data of every block that lives in a slot
+ * of a marshalling pool, or in a mapping of its own.  Blocks that are too
+ * big for the pool, but not big enough for a mapping, are ordinary heap
+ * blocks and have no header.
+ */
+typedef struct _MARSHALBLOCKHEADER {
+  uintptr_t nCookie;                // see _GetBlockHeader
+  struct _MARSHALCLASS* pClass;     // size class the slot belongs to
+} MARSHALBLOCKHEADER, *LPMARSHALBLOCKHEADER;
+
+/**
+ * @brief Data of a marshalled block that refers to a buffer instead of
+ * holding a copy of it.
+ */
+typedef struct _MARSHALENVELOPE {
+  void* pvBuffer;
+  size_t nBlockSize;
+  void (*lpfnRelease)(void* pvBuffer);   // never NULL
+  atomic_int nRefCount;                  // MARSHAL_BLOCK_SHARED only
+} MARSHALENVELOPE, *LPMARSHALENVELOPE;
+
+/**
+ * @brief Per-thread statistics kept in the control block of every thread
+ * created by this library.  The thread itself is the main writer, so the
+ * area starts on a cache line of its own, away from the fields that other
+ * threads take locks on.
+ */
+typedef struct _THREADSTATS {
+  CACHE_ALIGNED struct timespec startTime;  // CLOCK_MONOTONIC
+  struct timespec exitTime;                 // CLOCK_MONOTONIC; zero if running
+  void* pvExitStatus;
+} THREADSTATS, *LPTHREADSTATS;
+
+/**
+ * @brief Initializes a condition variable whose timed waits are measured
+ * against CLOCK_MONOTONIC, so that they are not disturbed when the wall
+ * clock is changed.
+ * @param pCond Address of the condition variable to initialize.
+ * @return System error code.  Zero if successful.
+ */
+int _InitCondition(pthread_cond_t* pCond);
+
+/**
+ * @brief Computes the CLOCK_MONOTONIC time that lies nTimeoutMs milliseconds
+ * from now, for use with condition variables set up by _InitCondition.
+ * @param nTimeoutMs Number of milliseconds from now; negative values are
+ * treated as zero.
+ * @param pDeadline Address of storage that receives the deadline.
+ */
+void _GetAbsoluteDeadline(int nTimeoutMs, struct timespec* pDeadline);
+
+/**
+ * @brief Blocks the calling thread while the value at pnValue equals
+ * nExpected.
+ * @param pnValue Address of the value to wait on.
+ * @param nExpected Value that the caller last saw at pnValue.
+ * @param pDeadline Absolute CLOCK_MONOTONIC deadline, as computed by
+ * _GetAbsoluteDeadline, or NULL to wait indefinitely.
+ * @return Zero if woken, or if the value had already changed; ETIMEDOUT if
+ * the deadline passed; EINVAL if the deadline is malformed.
+ * @remarks Wake-ups may be spurious, so callers must re-check whatever
+ * they are waiting for whenever this returns zero, and give up otherwise.
+ */
+int _FutexWait(atomic_int* pnValue, int nExpected,
+    const struct timespec* pDeadline);
+
+/**
+ * @brief Wakes threads blocked in _FutexWait on the specified value.
+ * @param pnValue Address of the value the threads are waiting on.
+ * @param nCount Maximum number of threads to wake; INT_MAX wakes them all.
+ */
+void _FutexWake(atomic_int* pnValue, int nCount);
+
+/**
+ * @brief Allocates storage for a marshalled block from a marshalling pool.
+ * @param pPool Address of the pool to allocate from, or NULL for the
+ * default pool.
+ * @param nBlockSize Number of bytes of data the block must hold.
+ * @return Address of the data of the block, or NULL if there was not
+ * enough memory.
+ * @remarks Blocks that do not fit the largest size class are allocated
+ * with malloc(), and blocks of at least MARSHAL_LARGE_BLOCK_SIZE bytes are
+ * mapped from the system, in huge pages if it has them to spare.
+ */
+void* _AllocMarshalBlock(LPMARSHALPOOL pPool, size_t nBlockSize);
+
+/**
+ * @brief Copies the data of a marshalled block, in either direction.
+ * @param pvDest Address to copy to.
+ * @param pvSource Address to copy from.
+ * @param nSize Number of bytes to copy.
+ * @return pvDest.
+ * @remarks Copies of at least MARSHAL_LARGE_BLOCK_SIZE bytes bypass the
+ * cache where the CPU supports it.  Overlapping blocks are handled as by
+ * memmove().
+ */
+void* _CopyMarshalledData(void* pvDest, const void* pvSource, size_t nSize);
+
+/**
+ * @brief Releases the storage of a marshalled block.
+ * @param pvData Address of the data of the block.  Addresses that were not
+ * returned by _AllocMarshalBlock are passed to free().
+ * @remarks Only the slot itself is released; the buffer an envelope refers
+ * to is the caller's business.
+ */
+void _FreeMarshalBlock(void* pvData);
+
+/**
+ * @brief Gets the header of a marshalled block.
+ * @param pvData Address of the data of the block.
+ * @return Address of the header, or NULL if pvData does not lie in a slot
+ * of a marshalling pool.
+ */
+LPMARSHALBLOCKHEADER _GetBlockHeader(void* pvData);
+
+/**
+ * @brief Gets the kind (MARSHAL_BLOCK_*) of a marshalled block.
+ */
+int _GetBlockKind(LPMARSHALBLOCKHEADER pHeader);
+
+/**
+ * @brief Stamps the header of a marshalled block with its kind.
+ */
+void _SetBlockKind(LPMARSHALBLOCKHEADER pHeader, int nKind);
+
+/**
+ * @brief Tells the CPU that the caller is spinning on a memory location, so
+ * that it can save power and give the other hyperthread of the core more of
+ * its resources.
+ */
+static inline void _CpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield" ::: "memory");
+#else
+  atomic_signal_fence(memory_order_seq_cst);
+#endif
+}
+
+/**
+ * @brief Gets the statistics area of a thread.
+ * @param hThread Handle to the thread.
+ * @return Address of the area, or NULL if the handle is invalid or stale.
+ */
+LPTHREADSTATS _GetThreadStats(HTHREAD hThread);
+
+/**
+ * @brief Gets the CPUs that belong to a NUMA node.
+ * @param nNode Zero-based number of the node.
+ * @param pCpuSet Address of storage that receives the CPUs.
+ * @return TRUE if successful; FALSE if there is no such node, or the system
+ * does not say which CPUs it has.
+ */
+BOOL _GetNumaNodeCpuSet(int nNode, cpu_set_t* pCpuSet);
+
+/**
+ * @brief A thread stack mapped by this library, as opposed to one that the
+ * system allocates on its own.
+ */
+typedef struct _THREADSTACK {
+  void* pvBase;           // start of the mapping, i.e., of the guard area
+  size_t nMapSize;        // size of the whole mapping
+  size_t nGuardSize;      // size of the inaccessible area at the bottom
+} THREADSTACK, *LPTHREADSTACK;
+
+/**
+ * @brief Picks the stack for a new thread and sets it up in a pthread
+ * attributes object.
+ * @param pAttr Attributes object the thread is going to be created with.
+ * @param nStackSize Size of the stack the caller asked for, or zero.
+ * @param nGuardSize Size of the guard area the caller asked for, or
+ * THREAD_GUARD_SIZE_DEFAULT.
+ * @param pStack Address of storage that receives the stack, if it is mapped
+ * by this library.  Receives a NULL pvBase if the system allocates it.
+ * @return Zero if successful, or a system error code.
+ * @remarks Also reaps the stacks of threads that have terminated without
+ * being waited on.
+ */
+int _PrepareThreadStack(pthread_attr_t* pAttr, size_t nStackSize,
+    size_t nGuardSize, LPTHREADSTACK pStack);
+
+/**
+ * @brief Hands the stack of a thread that has been joined (or never
+ * started) back to the stack cache, or unmaps it.
+ */
+void _ReleaseThreadStack(LPTHREADSTACK pStack);
+
+/**
+ * @brief Hands over the stack of a thread that nobody is going to join, so
+ * that it can be reaped once the thread has terminated.
+ */
+void _ReleaseThreadStackLater(pthread_t nThreadID, LPTHREADSTACK pStack);
+
+/**
+ * @brief Rounds a size up to a whole number of pages.
+ */
+size_t _RoundUpToPage(size_t nSize);
+
+/**
+ * @brief Maps a stack outside of the stack cache.
+ * @param nStackSize Usable size of the stack, a whole number of pages.
+ * @param nGuardSize Size of the inaccessible area below it.
+ * @param nPrefaultSize Number of bytes at the top of the stack to fault in
+ * now.
+ * @param pStack Address of storage that receives the stack.
+ * @return TRUE if successful; FALSE if the system is out of memory.
+ */
+BOOL _MapThreadStack(size_t nStackSize, size_t nGuardSize,
+    size_t nPrefaultSize, LPTHREADSTACK pStack);
+
+/**
+ * @brief Unmaps a stack mapped by _MapThreadStack.
+ */
+void _UnmapThreadStack(LPTHREADSTACK pStack);
+
+/**
+ * @name THREADING_STAT_*
+ * @brief Indices of the counters in a per-thread statistics slot.  See
+ * THREADING_STATS for what they count.
+ */
+#define THREADING_STAT_THREADS_CREATED      0
+#define THREADING_STAT_THREADS_JOINED       1
+#define THREADING_STAT_THREADS_CANCELED     2
+#define THREADING_STAT_THREADS_KILLED       3
+#define THREADING_STAT_START_LATENCY_TOTAL  4
+#define THREADING_STAT_START_LATENCY_MAX    5
+#define THREADING_STAT_WAIT_TOTAL           6
+#define THREADING_STAT_WAIT_MAX             7
+#define THREADING_STAT_MARSHAL_CALLS        8
+#define THREADING_STAT_MARSHAL_BYTES        9
+#define THREADING_STAT_COUNT                10
+
+/**
+ * @brief TRUE while statistics are being collected.  Read through
+ * _IsThreadingStatsEnabled.
+ */
+extern atomic_bool g_bThreadingStatsEnabled;
+
+/**
+ * @brief Determines, as cheaply as possible, whether the caller should
+ * record statistics.
+ */
+static inline BOOL _IsThreadingStatsEnabled(void) {
+  return __builtin_expect(atomic_load_explicit(&g_bThreadingStatsEnabled,
+      memory_order_relaxed), 0);
+}
+
+/**
+ * @brief Adds to a counter (THREADING_STAT_*) of the calling thread.  For
+ * the *_MAX counters, raises the counter to nValue instead.
+ * @remarks Callers check _IsThreadingStatsEnabled first.
+ */
+void _AddThreadingStat(int nCounter, uint64_t nValue);
+
+/**
+ * @name TRACE_EVENT_*
+ * @brief Kinds of events in a trace buffer.  The comment says what the
+ * argument of each is.
+ */
+#define TRACE_EVENT_THREAD_CREATE   0   // handle of the new thread
+#define TRACE_EVENT_THREAD_BEGIN    1   // handle of the thread
+#define TRACE_EVENT_THREAD_END      2
+#define TRACE_EVENT_FIBER_BEGIN     3   // handle of the fiber
+#define TRACE_EVENT_FIBER_END       4   // handle of the fiber
+#define TRACE_EVENT_WAIT_BEGIN      5   // handle waited on
+#define TRACE_EVENT_WAIT_END        6
+#define TRACE_EVENT_CANCEL          7   // handle of the thread
+#define TRACE_EVENT_KILL            8   // handle of the thread, and signal
+#define TRACE_EVENT_SIGNAL          9   // span; signal number
+#define TRACE_EVENT_MARSHAL         10  // span; bytes copied
+#define TRACE_EVENT_DEMARSHAL       11  // span; bytes copied
+#define TRACE_EVENT_COUNT           12
+
+/**
+ * @brief TRUE while the trace recorder is on.  Read through
+ * _IsThreadTraceEnabled.
+ */
+extern atomic_bool g_bThreadTraceEnabled;
+
+/**
+ * @brief Determines, as cheaply as possible, whether the caller should
+ * record trace events.
+ */
+static inline BOOL _IsThreadTraceEnabled(void) {
+  return __builtin_expect(atomic_load_explicit(&g_bThreadTraceEnabled,
+      memory_order_relaxed), 0);
+}
+
+/**
+ * @brief Gets the time stamp of a trace event: the CPU's time stamp counter
+ * where there is one, or else CLOCK_MONOTONIC nanoseconds.
+ */
+static inline uint64_t _GetTraceTicks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Records a trace event (TRACE_EVENT_*) of the calling thread.
+ * @remarks Callers check _IsThreadTraceEnabled first.
+ */
+void _RecordTraceEvent(int nType, uint64_t nArg, uint32_t nArg2);
+
+/**
+ * @brief Records a span (TRACE_EVENT_SIGNAL, _MARSHAL or _DEMARSHAL) of the
+ * calling thread that began at nStartTicks, as returned by _GetTraceTicks,
+ * and ends now.
+ */
+void _RecordTraceSpan(int nType, uint64_t nStartTicks, uint64_t nArg);
+
+/**
+ * @brief Records the run of a signal handler.  Safe to call from the
+ * handler itself.
+ */
+void _RecordSignalTraceSpan(int nSignal, uint64_t nStartTicks);
+
+/**
+ * @brief Gets the number of nanoseconds from one CLOCK_MONOTONIC time to
+ * another.
+ */
+static inline uint64_t _GetElapsedNs(const struct timespec* pStart,
+    const struct timespec* pEnd) {
+  return (uint64_t) ((pEnd->tv_sec - pStart->tv_sec) * 1000000000LL
+      + (pEnd->tv_nsec - pStart->tv_nsec));
+}
+
+/**
+ * @brief Gets the handler registered with RegisterEventEx for a signal.
+ * @return Address of the handler, or NULL if there is none.
+ */
+LPSIGNALHANDLER _GetEventHandler(int nSignal);
+
+/**
+ * @brief Acknowledges the pending stop request of a thread on its behalf.
+ * Does nothing if the handle is stale.
+ */
+void _AcknowledgeThreadStop(HTHREAD hThread);
+
+/**
+ * @brief Determines whether a signal is routed through the event
+ * dispatcher, so that KillThreadEx should hand it to _PostThreadEvent
+ * instead of raising it to the thread.
+ */
+BOOL _IsSignalDispatched(int nSignal);
+
+/**
+ * @brief Queues a signal raised to a thread for the event dispatcher, which
+ * handles it and then calls _AcknowledgeThreadStop.
+ * @return TRUE if the event was queued; FALSE if the dispatcher is not
+ * running or there is not enough memory.
+ */
+BOOL _PostThreadEvent(int nSignal, HTHREAD hThread);
+
+/**
+ * @brief Blocks the signals of the event dispatcher, if it is running, in
+ * the calling thread.
+ */
+void _BlockDispatchedSignals(void);
+
+/**
+ * @brief Gets the index of the calling thread among the workers of a task
+ * scheduler.
+ * @return Index of the worker, or ERROR if the calling thread is not a
+ * worker of that scheduler (it may be a worker of another one).
+ */
+int _GetSchedulerWorkerIndex(HTASKSCHEDULER hScheduler);
+
+/**
+ * @brief Gets where the arena of the calling thread, or of the fiber it is
+ * running, is kept.
+ * @return Address of the slot, or NULL if the calling thread was not created
+ * by this library.
+ */
+void** _GetCurrentThreadArenaSlot(void);
+
+/**
+ * @brief Releases an arena and all of its memory.  Does nothing if pvArena
+ * is NULL.
+ */
+void _DestroyThreadArena(void* pvArena);
+
+/**
+ * @brief Gets the current position in the arena of the calling thread,
+ * without setting up an arena if it has none yet.
+ */
+void _SaveThreadArena(LPARENAMARK pMark);
+
+/**
+ * @brief Frees everything the calling thread has allocated from its arena
+ * since _SaveThreadArena.  Used around work items and tasks.
+ */
+void _RestoreThreadArena(const ARENAMARK* pMark);
+
+/**
+ * @brief State of a fiber.  Defined in fiber.c.
+ */
+typedef struct _FIBER FIBER, *LPFIBER;
+
+/**
+ * @brief Sets up a fiber for a thread whose attributes ask for one.
+ * @param pvControl Address of the control block of the thread, which the
+ * fiber passes to _RunFiberProc and, once it has finished, to
+ * _CompleteThread.
+ * @param nStackSize Size of the stack, or zero for FIBER_STACK_SIZE.
+ * @return Address of the fiber, or NULL if the carrier threads could not be
+ * started or there is not enough memory.
+ * @remarks The fiber does not run until it is passed to _StartFiber.
+ */
+LPFIBER _CreateFiber(void* pvControl, size_t nStackSize);
+
+/**
+ * @brief Queues a fiber set up by _CreateFiber to run on a carrier thread.
+ */
+void _StartFiber(LPFIBER pFiber);
+
+/**
+ * @brief Determines whether any fiber is waiting for a carrier thread.
+ */
+BOOL _AreFibersReady(void);
+
+/**
+ * @brief Runs the thread procedure of a fiber, and keeps its return value
+ * for WaitThreadEx.  Called on the fiber.
+ */
+void _RunFiberProc(void* pvControl);
+
+/**
+ * @brief Makes the control block of a fiber the calling carrier thread's
+ * current thread, for as long as the fiber runs on it.
+ * @param pvControl Address of the control block, or the value this
+ * function returned before to switch back.
+ * @return Address of the control block that was current before.
+ */
+void* _SwapCurrentThread(void* pvControl);
+
+/**
+ * @brief Marks a thread as completed, wakes its waiters, and releases the
+ * reference to its control block that the running thread holds.
+ */
+void _CompleteThread(void* pvControl);
+
+#endif //__THREADING_CORE_INTERNAL_H__
@@ -40,4 +40,33 @@
   "\t(did you pass a NULL pointer to MarshalBlock?).\n"
 #endif //ERROR_FAILED_TO_MARSHAL_BLOCK
 
+/**
+ * @name ERROR_INVALID_MARSHALLED_BLOCK
+ * @brief Error message displayed when a block is handed back to a
+ * marshalling pool that is not a live block of the pool (typically because
+ * it was released twice).
+ */
+#ifndef ERROR_INVALID_MARSHALLED_BLOCK
+#define ERROR_INVALID_MARSHALLED_BLOCK \
+  "Attempted to release a marshalled block that is not live\n" \
+  "\t(was it released twice?).\n"
+#endif //ERROR_INVALID_MARSHALLED_BLOCK
+
+/**
+ * @name CACHE_LINE_SIZE
+ * @brief Size, in bytes, of a cache line.  Data that is written by different
+ * threads is padded to this size to avoid false sharing.
+ */
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif //CACHE_LINE_SIZE
+
+/**
+ * @name CACHE_ALIGNED
+ * @brief Aligns a structure member (or variable) on a cache line boundary.
+ */
+#ifndef CACHE_ALIGNED
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+#endif //CACHE_ALIGNED
+
 #endif //__THREADING_CORE_SYMBOLS_H__
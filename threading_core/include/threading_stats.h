@@ -0,0 +1,62 @@
+// threading_stats.h - Interface for the opt-in statistics that the
+// threading_core library keeps about thread lifecycles and marshalling.
+//
+
+#ifndef __THREADING_STATS_H__
+#define __THREADING_STATS_H__
+
+#include <stdint.h>
+
+#include "threading_core.h"
+
+/**
+ * @brief Snapshot of the statistics of the threading_core library, as
+ * filled in by GetThreadingStats.  Every count covers the time during which
+ * statistics were enabled; times are in nanoseconds.
+ */
+typedef struct _THREADING_STATS {
+  uint64_t nThreadsCreated;       // threads started by CreateThread*
+  uint64_t nThreadsJoined;        // threads waited on with WaitThread*
+  uint64_t nThreadsCanceled;      // calls to CancelThread
+  uint64_t nThreadsKilled;        // stop requests sent by KillThread*
+
+  uint64_t nStartLatencyTotalNs;  // creation to first run, summed
+  uint64_t nStartLatencyMaxNs;    // creation to first run, worst case
+
+  uint64_t nWaitTotalNs;          // time spent blocked in WaitThreadEx
+  uint64_t nWaitMaxNs;            // longest single WaitThreadEx
+
+  uint64_t nMarshalCalls;         // calls to MarshalBlockToThread*
+  uint64_t nMarshalBytes;         // bytes copied by MarshalBlockToThread*
+} THREADING_STATS, *LPTHREADING_STATS;
+
+/**
+ * @brief Turns the collection of statistics on or off.
+ * @param bEnable TRUE to collect statistics; FALSE to stop.
+ * @remarks Statistics are off by default.  While they are off, every
+ * instrumented call pays for one relaxed load and a predictable branch.
+ * While they are on, each thread adds to counters in a cache-line-padded
+ * slot of its own, without atomic read-modify-write instructions, so
+ * threads never contend with each other or with GetThreadingStats.
+ */
+void EnableThreadingStats(BOOL bEnable);
+
+/**
+ * @brief Determines whether statistics are being collected.
+ * @return TRUE if statistics are on; FALSE otherwise.
+ */
+BOOL IsThreadingStatsEnabled(void);
+
+/**
+ * @brief Adds up the counters of every thread into a snapshot.
+ * @param pStats Address of storage that receives the snapshot.
+ * @return TRUE if successful; FALSE if pStats is NULL.
+ * @remarks Counters of threads that have exited are kept.  Each counter is
+ * read atomically, but the snapshot as a whole is not: counters that
+ * change while it is taken may be a few events apart.  Counters only ever
+ * go up, so a metrics scraper should report the difference between two
+ * snapshots.
+ */
+BOOL GetThreadingStats(LPTHREADING_STATS pStats);
+
+#endif //__THREADING_STATS_H__
@@ -0,0 +1,84 @@
+// timer_wheel.h - Interface for delayed and periodic callbacks, which the
+// threading_core library runs off a hierarchical timer wheel instead of a
+// sleeping thread per timer.
+//
+
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include "threading_core.h"
+
+/**
+ * @brief Resolution of the timer wheel, in milliseconds.  Timers that are
+ * due within the same tick fire together, with a single wakeup.
+ */
+#ifndef TIMER_WHEEL_TICK_MS
+#define TIMER_WHEEL_TICK_MS 1
+#endif //TIMER_WHEEL_TICK_MS
+
+/**
+ * @brief Maximum number of threads that run timer callbacks at the same
+ * time.
+ */
+#ifndef TIMER_CALLBACK_THREADS
+#define TIMER_CALLBACK_THREADS 4
+#endif //TIMER_CALLBACK_THREADS
+
+/**
+ * @brief Opaque type that timer handles point to.  It is never defined;
+ * see HTIMER.
+ */
+typedef struct _TIMERHANDLE* LPTIMERHANDLE;
+
+/**
+ * @brief Handle to a timer scheduled with ScheduleAfter or ScheduleEvery.
+ * @remarks Like a thread handle, it carries a generation: once a one-shot
+ * timer has fired, or any timer has been canceled, the handle is stale and
+ * CancelTimer fails with EINVAL instead of touching a newer timer.
+ */
+typedef LPTIMERHANDLE HTIMER;
+
+/**
+ * @brief Runs a callback once, after a delay.
+ * @param nDelayMs Number of milliseconds to wait.  May be zero.
+ * @param lpfnCallback Address of the function to run.  It has the same
+ * signature as a thread procedure; its return value is discarded.
+ * @param pUserState Address of user state that is passed to lpfnCallback.
+ * May be NULL.
+ * @return Handle to the timer, or INVALID_HANDLE_VALUE if the arguments are
+ * invalid or an error occurred.
+ * @remarks The callback never runs early, and runs late by at most about
+ * TIMER_WHEEL_TICK_MS, unless all of the callback threads are busy.
+ * Scheduling and canceling take constant time.  The timer thread and the
+ * callback threads are started the first time a timer is scheduled.
+ */
+HTIMER ScheduleAfter(int nDelayMs, LPTHREAD_START_ROUTINE lpfnCallback,
+    void* pUserState);
+
+/**
+ * @brief Runs a callback at a fixed interval until the timer is canceled.
+ * @param nIntervalMs Number of milliseconds from one run to the next, and
+ * to the first one.  Must be positive.
+ * @param lpfnCallback See ScheduleAfter.
+ * @param pUserState See ScheduleAfter.
+ * @return Handle to the timer, or INVALID_HANDLE_VALUE if the arguments are
+ * invalid or an error occurred.
+ * @remarks Runs of the same timer never overlap.  The schedule is kept at a
+ * fixed rate; if a run takes longer than the interval, the runs that were
+ * missed are skipped rather than made up in a burst.
+ */
+HTIMER ScheduleEvery(int nIntervalMs, LPTHREAD_START_ROUTINE lpfnCallback,
+    void* pUserState);
+
+/**
+ * @brief Cancels a timer.
+ * @param hTimer Handle to the timer.
+ * @return Zero if the timer will not run again; EINVAL if the handle is
+ * invalid or stale, e.g., because a one-shot timer has already fired.
+ * @remarks If the callback is running, waits for it to return, so that its
+ * user state can be released as soon as this function returns.  A callback
+ * may cancel its own timer; it does not wait for itself.
+ */
+int CancelTimer(HTIMER hTimer);
+
+#endif //__TIMER_WHEEL_H__
@@ -0,0 +1,401 @@
+// channel.c - Implementations of the functions defined in channel.h
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+#include "channel.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @brief Bit of the send position that is set once the channel is closed.
+ * Setting it makes every later attempt to claim a cell fail.
+ */
+#define CHANNEL_CLOSED_BIT      (SIZE_MAX ^ (SIZE_MAX >> 1))
+
+/**
+ * @brief Smallest capacity a channel is created with.
+ */
+#define CHANNEL_MIN_CAPACITY    2
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief One slot of the ring.  nSequence says whose turn it is: it equals
+ * the position of the cell when the cell is free for the sender that claims
+ * that position, and the position plus one once it holds a message.
+ */
+typedef struct _CHANNELCELL {
+  atomic_size_t nSequence;
+  void* pvMessage;
+} CHANNELCELL, *LPCHANNELCELL;
+
+/* The counters that senders and receivers hammer on each get a cache line
+ * of their own, so that the two sides do not slow each other down. */
+struct _CHANNEL {
+  CACHE_ALIGNED atomic_size_t nSendPos;      // next position to send to
+  CACHE_ALIGNED atomic_size_t nReceivePos;   // next position to receive from
+
+  CACHE_ALIGNED atomic_int nSendEvent;       // bumped when room is made
+  atomic_int nWaitingSenders;
+
+  CACHE_ALIGNED atomic_int nReceiveEvent;    // bumped when messages arrive
+  atomic_int nWaitingReceivers;
+
+  CACHE_ALIGNED size_t nMask;                // capacity - 1
+  LPCHANNELCELL pCells;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _NotifyWaiters: Wakes up to nCount threads blocked on one side of a
+// channel, if there are any.  Called after the other side made progress.
+
+void _NotifyWaiters(atomic_int* pnEvent, atomic_int* pnWaiters, int nCount) {
+  /* Pairs with the fence in _WaitChannel: either the waiter sees our
+   * progress when it looks again, or we see the waiter here. */
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if (0 == atomic_load_explicit(pnWaiters, memory_order_relaxed)) {
+    return;
+  }
+
+  atomic_fetch_add_explicit(pnEvent, 1, memory_order_release);
+  _FutexWake(pnEvent, nCount);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _TrySend: Sends as many of nCount messages as fit without blocking.
+// Returns zero if at least one message was sent, EAGAIN if the channel is
+// full, or EPIPE if it is closed.
+
+int _TrySend(LPCHANNEL pChannel, void** ppvMessages, int nCount,
+    int* pnSent) {
+  size_t nPos = atomic_load_explicit(&pChannel->nSendPos,
+      memory_order_relaxed);
+  int nClaimed = 0;
+
+  while (TRUE) {
+    if (nPos & CHANNEL_CLOSED_BIT) {
+      return EPIPE;
+    }
+
+    /* Count the free cells from nPos on; then claim them all at once. */
+    size_t nSequence = 0;
+    for (nClaimed = 0; nClaimed < nCount; nClaimed++) {
+      LPCHANNELCELL pCell = &pChannel->pCells[(nPos + nClaimed)
+          & pChannel->nMask];
+      nSequence = atomic_load_explicit(&pCell->nSequence,
+          memory_order_acquire);
+      if (nSequence != nPos + nClaimed) {
+        break;
+      }
+    }
+
+    if (0 == nClaimed) {
+      if ((intptr_t) (nSequence - nPos) < 0) {
+        return EAGAIN;  // the cell still holds a message from a lap ago
+      }
+
+      /* Another sender got here first */
+      nPos = atomic_load_explicit(&pChannel->nSendPos, memory_order_relaxed);
+      continue;
+    }
+
+    if (atomic_compare_exchange_weak_explicit(&pChannel->nSendPos, &nPos,
+        nPos + nClaimed, memory_order_relaxed, memory_order_relaxed)) {
+      break;
+    }
+  }
+
+  for (int i = 0; i < nClaimed; i++) {
+    LPCHANNELCELL pCell = &pChannel->pCells[(nPos + i) & pChannel->nMask];
+    pCell->pvMessage = ppvMessages[i];
+    atomic_store_explicit(&pCell->nSequence, nPos + i + 1,
+        memory_order_release);
+  }
+
+  *pnSent = nClaimed;
+
+  _NotifyWaiters(&pChannel->nReceiveEvent, &pChannel->nWaitingReceivers,
+      nClaimed);
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _TryReceive: Receives up to nMaxCount messages without blocking.  Returns
+// zero if at least one message was received, EAGAIN if the channel is empty,
+// or EPIPE if it is empty and closed.
+
+int _TryReceive(LPCHANNEL pChannel, void** ppvMessages, int nMaxCount,
+    int* pnReceived) {
+  size_t nPos = atomic_load_explicit(&pChannel->nReceivePos,
+      memory_order_relaxed);
+  int nClaimed = 0;
+
+  while (TRUE) {
+    size_t nSequence = 0;
+    for (nClaimed = 0; nClaimed < nMaxCount; nClaimed++) {
+      LPCHANNELCELL pCell = &pChannel->pCells[(nPos + nClaimed)
+          & pChannel->nMask];
+      nSequence = atomic_load_explicit(&pCell->nSequence,
+          memory_order_acquire);
+      if (nSequence != nPos + nClaimed + 1) {
+        break;
+      }
+    }
+
+    if (0 == nClaimed) {
+      if ((intptr_t) (nSequence - (nPos + 1)) < 0) {
+        /* Empty.  It is only over if the channel is closed and every
+         * position a sender claimed has been received; a sender that has
+         * claimed a cell but not yet filled it will wake us. */
+        size_t nSendPos = atomic_load_explicit(&pChannel->nSendPos,
+            memory_order_acquire);
+        if ((nSendPos & CHANNEL_CLOSED_BIT)
+            && (nSendPos & ~CHANNEL_CLOSED_BIT) == nPos) {
+          return EPIPE;
+        }
+        return EAGAIN;
+      }
+
+      /* Another receiver got here first */
+      nPos = atomic_load_explicit(&pChannel->nReceivePos,
+          memory_order_relaxed);
+      continue;
+    }
+
+    if (atomic_compare_exchange_weak_explicit(&pChannel->nReceivePos, &nPos,
+        nPos + nClaimed, memory_order_relaxed, memory_order_relaxed)) {
+      break;
+    }
+  }
+
+  for (int i = 0; i < nClaimed; i++) {
+    LPCHANNELCELL pCell = &pChannel->pCells[(nPos + i) & pChannel->nMask];
+    ppvMessages[i] = pCell->pvMessage;
+    atomic_store_explicit(&pCell->nSequence, nPos + i + pChannel->nMask + 1,
+        memory_order_release);
+  }
+
+  *pnReceived = nClaimed;
+
+  _NotifyWaiters(&pChannel->nSendEvent, &pChannel->nWaitingSenders,
+      nClaimed);
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _TransferBatch: Sends or receives messages, blocking as needed.  Senders
+// keep going until all nCount messages are sent; receivers stop as soon as
+// they have something.
+
+int _TransferBatch(LPCHANNEL pChannel, BOOL bSend, void** ppvMessages,
+    int nCount, int* pnDone, int nTimeoutMs) {
+  atomic_int* pnEvent = bSend ? &pChannel->nSendEvent
+      : &pChannel->nReceiveEvent;
+  atomic_int* pnWaiters = bSend ? &pChannel->nWaitingSenders
+      : &pChannel->nWaitingReceivers;
+
+  struct timespec deadline;
+  struct timespec* pDeadline = NULL;
+  if (nTimeoutMs > 0) {
+    _GetAbsoluteDeadline(nTimeoutMs, &deadline);
+    pDeadline = &deadline;
+  }
+
+  int nDone = 0;
+  int nResult = OK;
+
+  while (nDone < nCount && (bSend || 0 == nDone)) {
+    int nMoved = 0;
+    nResult = bSend
+        ? _TrySend(pChannel, ppvMessages + nDone, nCount - nDone, &nMoved)
+        : _TryReceive(pChannel, ppvMessages, nCount, &nMoved);
+    if (OK == nResult) {
+      nDone += nMoved;
+      continue;
+    }
+
+    if (EAGAIN != nResult || 0 == nTimeoutMs) {
+      break;
+    }
+
+    /* Register as a waiter, then look once more before going to sleep, so
+     * that progress made in between is not missed. */
+    int nEvent = atomic_load_explicit(pnEvent, memory_order_acquire);
+    atomic_fetch_add_explicit(pnWaiters, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    nResult = bSend
+        ? _TrySend(pChannel, ppvMessages + nDone, nCount - nDone, &nMoved)
+        : _TryReceive(pChannel, ppvMessages, nCount, &nMoved);
+    if (EAGAIN == nResult) {
+      nResult = _FutexWait(pnEvent, nEvent, pDeadline);
+    } else if (OK == nResult) {
+      nDone += nMoved;
+    }
+
+    atomic_fetch_sub_explicit(pnWaiters, 1, memory_order_relaxed);
+
+    if (OK != nResult) {
+      break;    // timed out, closed, or the futex refused the deadline
+    }
+  }
+
+  if (NULL != pnDone) {
+    *pnDone = nDone;
+  }
+
+  if (bSend) {
+    return (nDone == nCount) ? OK : nResult;
+  }
+  return (nDone > 0) ? OK : nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateChannel function
+
+HCHANNEL CreateChannel(int nCapacity) {
+  if (nCapacity <= 0 || nCapacity > (INT_MAX / 2) + 1) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  size_t nCells = CHANNEL_MIN_CAPACITY;
+  while (nCells < (size_t) nCapacity) {
+    nCells <<= 1;
+  }
+
+  LPCHANNEL pChannel = NULL;
+  if (OK != posix_memalign((void**) &pChannel, CACHE_LINE_SIZE,
+      sizeof(CHANNEL))) {
+    return INVALID_HANDLE_VALUE;
+  }
+  memset(pChannel, 0, sizeof(CHANNEL));
+
+  if (OK != posix_memalign((void**) &pChannel->pCells, CACHE_LINE_SIZE,
+      nCells * sizeof(CHANNELCELL))) {
+    free(pChannel);
+    return INVALID_HANDLE_VALUE;
+  }
+
+  for (size_t i = 0; i < nCells; i++) {
+    atomic_init(&pChannel->pCells[i].nSequence, i);
+    pChannel->pCells[i].pvMessage = NULL;
+  }
+
+  pChannel->nMask = nCells - 1;
+  atomic_init(&pChannel->nSendPos, 0);
+  atomic_init(&pChannel->nReceivePos, 0);
+  atomic_init(&pChannel->nSendEvent, 0);
+  atomic_init(&pChannel->nWaitingSenders, 0);
+  atomic_init(&pChannel->nReceiveEvent, 0);
+  atomic_init(&pChannel->nWaitingReceivers, 0);
+
+  return (HCHANNEL) pChannel;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyChannel function
+
+int DestroyChannel(HCHANNEL hChannel) {
+  if (INVALID_HANDLE_VALUE == hChannel) {
+    return EINVAL;
+  }
+
+  LPCHANNEL pChannel = (LPCHANNEL) hChannel;
+
+  free(pChannel->pCells);
+  free(pChannel);
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CloseChannel function
+
+int CloseChannel(HCHANNEL hChannel) {
+  if (INVALID_HANDLE_VALUE == hChannel) {
+    return EINVAL;
+  }
+
+  LPCHANNEL pChannel = (LPCHANNEL) hChannel;
+
+  atomic_fetch_or_explicit(&pChannel->nSendPos, CHANNEL_CLOSED_BIT,
+      memory_order_acq_rel);
+
+  /* Everybody who is blocked has to find out */
+  atomic_fetch_add_explicit(&pChannel->nSendEvent, 1, memory_order_release);
+  _FutexWake(&pChannel->nSendEvent, INT_MAX);
+  atomic_fetch_add_explicit(&pChannel->nReceiveEvent, 1,
+      memory_order_release);
+  _FutexWake(&pChannel->nReceiveEvent, INT_MAX);
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendToChannel function
+
+int SendToChannel(HCHANNEL hChannel, void* pvMessage, int nTimeoutMs) {
+  return SendBatchToChannel(hChannel, &pvMessage, 1, NULL, nTimeoutMs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReceiveFromChannel function
+
+int ReceiveFromChannel(HCHANNEL hChannel, void** ppvMessage,
+    int nTimeoutMs) {
+  int nReceived = 0;
+  return ReceiveBatchFromChannel(hChannel, ppvMessage, 1, &nReceived,
+      nTimeoutMs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendBatchToChannel function
+
+int SendBatchToChannel(HCHANNEL hChannel, void** ppvMessages, int nCount,
+    int* pnSent, int nTimeoutMs) {
+  if (NULL != pnSent) {
+    *pnSent = 0;
+  }
+
+  if (INVALID_HANDLE_VALUE == hChannel || NULL == ppvMessages
+      || nCount < 0) {
+    return EINVAL;
+  }
+
+  return _TransferBatch((LPCHANNEL) hChannel, TRUE, ppvMessages, nCount,
+      pnSent, nTimeoutMs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReceiveBatchFromChannel function
+
+int ReceiveBatchFromChannel(HCHANNEL hChannel, void** ppvMessages,
+    int nMaxCount, int* pnReceived, int nTimeoutMs) {
+  if (NULL != pnReceived) {
+    *pnReceived = 0;
+  }
+
+  if (INVALID_HANDLE_VALUE == hChannel || NULL == ppvMessages
+      || nMaxCount <= 0 || NULL == pnReceived) {
+    return EINVAL;
+  }
+
+  return _TransferBatch((LPCHANNEL) hChannel, FALSE, ppvMessages, nMaxCount,
+      pnReceived, nTimeoutMs);
+}
@@ -0,0 +1,260 @@
+// cpu_topology.c - Discovers how the CPUs of the machine are grouped into
+// cores, sockets and NUMA nodes, and implements the placement policies that
+// are built on top of that.
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @brief Maximum length of a path into /sys or of a line read from it.
+ */
+#define CPU_TOPOLOGY_MAX_PATH       256
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief One physical core and the hardware threads (CPUs) it is made of.
+ */
+typedef struct _CPUCORE {
+  int nPackage;       // socket
+  int nCoreID;        // core within the socket
+  cpu_set_t cpuSet;
+} CPUCORE, *LPCPUCORE;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+static pthread_once_t g_topologyOnce = PTHREAD_ONCE_INIT;
+static LPCPUCORE g_pCores = NULL;     // sorted by socket, then core
+static int* g_pnScatterOrder = NULL;  // indices into g_pCores
+static int g_nCores = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _ReadSysfsInt: Reads an integer out of a file in /sys, or returns
+// nDefault if the file cannot be read.
+
+int _ReadSysfsInt(const char* pszPath, int nDefault) {
+  FILE* fp = fopen(pszPath, "r");
+  if (NULL == fp) {
+    return nDefault;
+  }
+
+  int nValue = nDefault;
+  if (1 != fscanf(fp, "%d", &nValue)) {
+    nValue = nDefault;
+  }
+
+  fclose(fp);
+  return nValue;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CompareCores: Orders cores by socket, then by core ID.
+
+int _CompareCores(const void* pvLeft, const void* pvRight) {
+  const CPUCORE* pLeft = (const CPUCORE*) pvLeft;
+  const CPUCORE* pRight = (const CPUCORE*) pvRight;
+
+  if (pLeft->nPackage != pRight->nPackage) {
+    return (pLeft->nPackage < pRight->nPackage) ? -1 : 1;
+  }
+
+  if (pLeft->nCoreID != pRight->nCoreID) {
+    return (pLeft->nCoreID < pRight->nCoreID) ? -1 : 1;
+  }
+
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _LoadCpuTopology: Groups the CPUs the process may run on into physical
+// cores.  Where /sys does not say, every CPU is taken to be a core of its own
+// on socket zero.
+
+void _LoadCpuTopology(void) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (OK != sched_getaffinity(0, sizeof(cpu_set_t), &allowed)) {
+    long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long i = 0; i < nCpus && i < CPU_SETSIZE; i++) {
+      CPU_SET(i, &allowed);
+    }
+  }
+
+  int nMaxCores = CPU_COUNT(&allowed);
+  if (nMaxCores <= 0) {
+    return;
+  }
+
+  g_pCores = (LPCPUCORE) calloc(nMaxCores, sizeof(CPUCORE));
+  g_pnScatterOrder = (int*) calloc(nMaxCores, sizeof(int));
+  if (NULL == g_pCores || NULL == g_pnScatterOrder) {
+    free(g_pCores);
+    free(g_pnScatterOrder);
+    g_pCores = NULL;
+    g_pnScatterOrder = NULL;
+    return;
+  }
+
+  char szPath[CPU_TOPOLOGY_MAX_PATH];
+
+  for (int nCpu = 0; nCpu < CPU_SETSIZE; nCpu++) {
+    if (!CPU_ISSET(nCpu, &allowed)) {
+      continue;
+    }
+
+    snprintf(szPath, sizeof(szPath),
+        "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", nCpu);
+    int nPackage = _ReadSysfsInt(szPath, 0);
+
+    snprintf(szPath, sizeof(szPath),
+        "/sys/devices/system/cpu/cpu%d/topology/core_id", nCpu);
+    int nCoreID = _ReadSysfsInt(szPath, nCpu);
+
+    int i = 0;
+    while (i < g_nCores && (g_pCores[i].nPackage != nPackage
+        || g_pCores[i].nCoreID != nCoreID)) {
+      i++;
+    }
+
+    if (i == g_nCores) {
+      g_pCores[i].nPackage = nPackage;
+      g_pCores[i].nCoreID = nCoreID;
+      CPU_ZERO(&g_pCores[i].cpuSet);
+      g_nCores++;
+    }
+
+    CPU_SET(nCpu, &g_pCores[i].cpuSet);
+  }
+
+  qsort(g_pCores, g_nCores, sizeof(CPUCORE), _CompareCores);
+
+  /* Scatter order: the first core of every socket, then the second core of
+   * every socket, and so on. */
+  int nScattered = 0;
+  for (int nRound = 0; nScattered < g_nCores; nRound++) {
+    int nFirst = 0;
+    while (nFirst < g_nCores) {
+      int nEnd = nFirst;
+      while (nEnd < g_nCores
+          && g_pCores[nEnd].nPackage == g_pCores[nFirst].nPackage) {
+        nEnd++;
+      }
+
+      if (nFirst + nRound < nEnd) {
+        g_pnScatterOrder[nScattered++] = nFirst + nRound;
+      }
+
+      nFirst = nEnd;
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetNumaNodeCpuSet: Gets the CPUs that belong to a NUMA node, from its
+// cpulist in /sys (e.g., "0-3,8-11").  Shared with the other modules of this
+// library.
+
+BOOL _GetNumaNodeCpuSet(int nNode, cpu_set_t* pCpuSet) {
+  if (nNode < 0 || NULL == pCpuSet) {
+    return FALSE;
+  }
+
+  char szPath[CPU_TOPOLOGY_MAX_PATH];
+  snprintf(szPath, sizeof(szPath),
+      "/sys/devices/system/node/node%d/cpulist", nNode);
+
+  FILE* fp = fopen(szPath, "r");
+  if (NULL == fp) {
+    return FALSE;
+  }
+
+  char szLine[CPU_TOPOLOGY_MAX_PATH];
+  BOOL bResult = (NULL != fgets(szLine, sizeof(szLine), fp));
+  fclose(fp);
+
+  if (!bResult) {
+    return FALSE;
+  }
+
+  CPU_ZERO(pCpuSet);
+
+  char* pszCursor = szLine;
+  while ('\0' != *pszCursor && '\n' != *pszCursor) {
+    char* pszEnd = NULL;
+    long nFirst = strtol(pszCursor, &pszEnd, 10);
+    if (pszEnd == pszCursor) {
+      return FALSE;
+    }
+
+    long nLast = nFirst;
+    if ('-' == *pszEnd) {
+      pszCursor = pszEnd + 1;
+      nLast = strtol(pszCursor, &pszEnd, 10);
+      if (pszEnd == pszCursor) {
+        return FALSE;
+      }
+    }
+
+    for (long nCpu = nFirst; nCpu <= nLast && nCpu < CPU_SETSIZE; nCpu++) {
+      CPU_SET(nCpu, pCpuSet);
+    }
+
+    pszCursor = (',' == *pszEnd) ? pszEnd + 1 : pszEnd;
+  }
+
+  return CPU_COUNT(pCpuSet) > 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// GetPhysicalCoreCount function
+
+int GetPhysicalCoreCount(void) {
+  pthread_once(&g_topologyOnce, _LoadCpuTopology);
+
+  return (g_nCores > 0) ? g_nCores : 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetPlacementCpuSet function
+
+BOOL GetPlacementCpuSet(int nPlacement, int nWorkerIndex,
+    cpu_set_t* pCpuSet) {
+  if (NULL == pCpuSet || nWorkerIndex < 0) {
+    return FALSE;
+  }
+
+  if (THREAD_PLACEMENT_COMPACT != nPlacement
+      && THREAD_PLACEMENT_SCATTER != nPlacement) {
+    return FALSE;
+  }
+
+  pthread_once(&g_topologyOnce, _LoadCpuTopology);
+
+  if (0 == g_nCores) {
+    return FALSE;
+  }
+
+  int nCore = nWorkerIndex % g_nCores;
+  if (THREAD_PLACEMENT_SCATTER == nPlacement) {
+    nCore = g_pnScatterOrder[nCore];
+  }
+
+  *pCpuSet = g_pCores[nCore].cpuSet;
+
+  return TRUE;
+}
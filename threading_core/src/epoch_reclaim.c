@@ -0,0 +1,475 @@
+// epoch_reclaim.c - Implementations of the functions defined in
+// epoch_reclaim.h
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+#include "epoch_reclaim.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @brief Bit of EPOCHRECORD::nLocalEpoch that is set while the thread is
+ * inside a critical section.  The epoch it entered in is in the other bits.
+ */
+#define EPOCH_ACTIVE                1UL
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+typedef struct _RETIREDBLOCK {
+  void* pvBlock;
+  LPRELEASE_BLOCK_ROUTINE lpfnRelease;    // NULL for free()
+} RETIREDBLOCK, *LPRETIREDBLOCK;
+
+/**
+ * @brief Blocks retired by one thread.  A batch may be released once the
+ * global epoch is two past the epoch its last block was retired in.
+ */
+typedef struct _RETIREBATCH {
+  unsigned long nEpoch;
+  int nCount;
+  RETIREDBLOCK aBlocks[EPOCH_RETIRE_BATCH_SIZE];
+  struct _RETIREBATCH* pNext;
+} RETIREBATCH, *LPRETIREBATCH;
+
+/**
+ * @brief Registration of a thread.  Records are never freed, only handed
+ * on to the next thread once their owner has exited, so that the threads
+ * that scan them never see one go away.
+ */
+typedef struct _EPOCHRECORD {
+  /* The only field that other threads read, on a cache line of its own */
+  CACHE_ALIGNED atomic_ulong nLocalEpoch;   // see EPOCH_ACTIVE; 0 if outside
+
+  CACHE_ALIGNED atomic_bool bInUse;
+  struct _EPOCHRECORD* pNext;
+
+  /* Only touched by the owner */
+  int nNesting;
+  LPRETIREBATCH pOpenBatch;
+  LPRETIREBATCH pClosedHead;      // oldest first
+  LPRETIREBATCH pClosedTail;
+  LPRETIREBATCH pSpareBatch;
+} EPOCHRECORD, *LPEPOCHRECORD;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+static atomic_ulong g_nGlobalEpoch = 1;
+static _Atomic(LPEPOCHRECORD) g_pEpochRecords = NULL;
+
+static pthread_once_t g_epochOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_epochKey;
+static BOOL g_bMembarrier = FALSE;  // readers may skip their fence
+
+static __thread LPEPOCHRECORD g_pEpochRecord = NULL;
+
+/* Batches of threads that exited before they could release them */
+static pthread_mutex_t g_orphanMutex = PTHREAD_MUTEX_INITIALIZER;
+static LPRETIREBATCH g_pOrphanBatches = NULL;
+static atomic_int g_nOrphanBatches = 0;   // lets reclaimers skip the mutex
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _IssueReaderBarrier: Makes sure that whatever the readers stored to their
+// records before now is visible to the caller.  With membarrier, every
+// thread of the process runs a full barrier, so the readers need none;
+// without it, the readers fence, and so do we.
+
+void _IssueReaderBarrier(void) {
+#if defined(SYS_membarrier)
+  if (g_bMembarrier) {
+    syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+    return;
+  }
+#endif
+
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ReleaseBatch: Releases every block in a batch.
+
+void _ReleaseBatch(LPRETIREBATCH pBatch) {
+  for (int i = 0; i < pBatch->nCount; i++) {
+    LPRETIREDBLOCK pBlock = &pBatch->aBlocks[i];
+    if (NULL != pBlock->lpfnRelease) {
+      pBlock->lpfnRelease(pBlock->pvBlock);
+    } else {
+      free(pBlock->pvBlock);
+    }
+  }
+
+  pBatch->nCount = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CloseOpenBatch: Moves the batch a thread is filling to the end of its
+// list of batches waiting to be released.
+
+void _CloseOpenBatch(LPEPOCHRECORD pRecord) {
+  LPRETIREBATCH pBatch = pRecord->pOpenBatch;
+  if (NULL == pBatch || 0 == pBatch->nCount) {
+    return;
+  }
+
+  pRecord->pOpenBatch = NULL;
+  pBatch->pNext = NULL;
+
+  if (NULL == pRecord->pClosedTail) {
+    pRecord->pClosedHead = pBatch;
+  } else {
+    pRecord->pClosedTail->pNext = pBatch;
+  }
+  pRecord->pClosedTail = pBatch;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _UnregisterEpochThread: Destructor of g_epochKey.  Hands the batches of an
+// exiting thread over to whoever reclaims next, and its record to the next
+// thread that registers.
+
+void _UnregisterEpochThread(void* pvRecord) {
+  LPEPOCHRECORD pRecord = (LPEPOCHRECORD) pvRecord;
+
+  _CloseOpenBatch(pRecord);
+  free(pRecord->pOpenBatch);      // empty, if there is one
+  free(pRecord->pSpareBatch);
+
+  if (NULL != pRecord->pClosedHead) {
+    int nBatches = 0;
+    for (LPRETIREBATCH pBatch = pRecord->pClosedHead; NULL != pBatch;
+        pBatch = pBatch->pNext) {
+      nBatches++;
+    }
+
+    pthread_mutex_lock(&g_orphanMutex);
+    pRecord->pClosedTail->pNext = g_pOrphanBatches;
+    g_pOrphanBatches = pRecord->pClosedHead;
+    atomic_fetch_add_explicit(&g_nOrphanBatches, nBatches,
+        memory_order_relaxed);
+    pthread_mutex_unlock(&g_orphanMutex);
+  }
+
+  pRecord->nNesting = 0;
+  pRecord->pOpenBatch = NULL;
+  pRecord->pClosedHead = NULL;
+  pRecord->pClosedTail = NULL;
+  pRecord->pSpareBatch = NULL;
+  atomic_store_explicit(&pRecord->nLocalEpoch, 0, memory_order_release);
+  atomic_store_explicit(&pRecord->bInUse, false, memory_order_release);
+
+  g_pEpochRecord = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _InitEpochs: Sets up the thread-exit hook and, if the kernel has it,
+// membarrier.  Runs once.
+
+void _InitEpochs(void) {
+  pthread_key_create(&g_epochKey, _UnregisterEpochThread);
+
+#if defined(SYS_membarrier)
+  g_bMembarrier = (OK == syscall(SYS_membarrier,
+      MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0));
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetEpochRecord: Gets the record of the calling thread, registering the
+// thread the first time.  Returns NULL if there is not enough memory.
+
+LPEPOCHRECORD _GetEpochRecord(void) {
+  if (NULL != g_pEpochRecord) {
+    return g_pEpochRecord;
+  }
+
+  pthread_once(&g_epochOnce, _InitEpochs);
+
+  /* Take over the record of a thread that has exited, if there is one */
+  LPEPOCHRECORD pRecord = atomic_load_explicit(&g_pEpochRecords,
+      memory_order_acquire);
+  for (; NULL != pRecord; pRecord = pRecord->pNext) {
+    bool bExpected = false;
+    if (!atomic_load_explicit(&pRecord->bInUse, memory_order_relaxed)
+        && atomic_compare_exchange_strong_explicit(&pRecord->bInUse,
+            &bExpected, true, memory_order_acq_rel, memory_order_relaxed)) {
+      break;
+    }
+  }
+
+  if (NULL == pRecord) {
+    if (OK != posix_memalign((void**) &pRecord, CACHE_LINE_SIZE,
+        sizeof(EPOCHRECORD))) {
+      return NULL;
+    }
+    memset(pRecord, 0, sizeof(EPOCHRECORD));
+    atomic_init(&pRecord->nLocalEpoch, 0);
+    atomic_init(&pRecord->bInUse, true);
+
+    pRecord->pNext = atomic_load_explicit(&g_pEpochRecords,
+        memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&g_pEpochRecords,
+        &pRecord->pNext, pRecord, memory_order_release,
+        memory_order_relaxed)) {
+      // pRecord->pNext has been reloaded; try again
+    }
+  }
+
+  pthread_setspecific(g_epochKey, pRecord);
+  g_pEpochRecord = pRecord;
+
+  return pRecord;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _TryAdvanceEpoch: Moves the global epoch on if every thread inside a
+// critical section entered it in the current epoch.  Returns TRUE if the
+// epoch moved on, by our hand or another's.
+
+BOOL _TryAdvanceEpoch(void) {
+  unsigned long nEpoch = atomic_load_explicit(&g_nGlobalEpoch,
+      memory_order_acquire);
+
+  _IssueReaderBarrier();
+
+  for (LPEPOCHRECORD pRecord = atomic_load_explicit(&g_pEpochRecords,
+      memory_order_acquire); NULL != pRecord; pRecord = pRecord->pNext) {
+    unsigned long nLocal = atomic_load_explicit(&pRecord->nLocalEpoch,
+        memory_order_acquire);
+    if ((nLocal & EPOCH_ACTIVE) && (nLocal >> 1) != nEpoch) {
+      return FALSE;   // still reading what was current an epoch ago
+    }
+  }
+
+  atomic_compare_exchange_strong_explicit(&g_nGlobalEpoch, &nEpoch,
+      nEpoch + 1, memory_order_acq_rel, memory_order_relaxed);
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ReclaimOrphans: Releases the batches of exited threads that are old
+// enough.  The release routines run outside g_orphanMutex, since they may
+// retire blocks themselves.
+
+void _ReclaimOrphans(unsigned long nEpoch) {
+  if (0 == atomic_load_explicit(&g_nOrphanBatches, memory_order_relaxed)) {
+    return;
+  }
+
+  LPRETIREBATCH pRipe = NULL;
+
+  pthread_mutex_lock(&g_orphanMutex);
+
+  LPRETIREBATCH* ppLink = &g_pOrphanBatches;
+  while (NULL != *ppLink) {
+    LPRETIREBATCH pBatch = *ppLink;
+    if (pBatch->nEpoch + 2 > nEpoch) {
+      ppLink = &pBatch->pNext;
+      continue;
+    }
+
+    *ppLink = pBatch->pNext;
+    atomic_fetch_sub_explicit(&g_nOrphanBatches, 1, memory_order_relaxed);
+    pBatch->pNext = pRipe;
+    pRipe = pBatch;
+  }
+
+  pthread_mutex_unlock(&g_orphanMutex);
+
+  while (NULL != pRipe) {
+    LPRETIREBATCH pBatch = pRipe;
+    pRipe = pBatch->pNext;
+    _ReleaseBatch(pBatch);
+    free(pBatch);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ReclaimBatches: Releases the batches of the calling thread that are old
+// enough, oldest first, keeping one around for the next blocks retired.
+
+void _ReclaimBatches(LPEPOCHRECORD pRecord) {
+  unsigned long nEpoch = atomic_load_explicit(&g_nGlobalEpoch,
+      memory_order_acquire);
+
+  while (NULL != pRecord->pClosedHead
+      && pRecord->pClosedHead->nEpoch + 2 <= nEpoch) {
+    LPRETIREBATCH pBatch = pRecord->pClosedHead;
+    pRecord->pClosedHead = pBatch->pNext;
+    if (NULL == pRecord->pClosedHead) {
+      pRecord->pClosedTail = NULL;
+    }
+
+    _ReleaseBatch(pBatch);
+
+    if (NULL == pRecord->pSpareBatch) {
+      pRecord->pSpareBatch = pBatch;
+    } else {
+      free(pBatch);
+    }
+  }
+
+  _ReclaimOrphans(nEpoch);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _WaitForReclaim: Moves the global epoch on until everything the calling
+// thread has retired so far may be released, and releases it.
+
+void _WaitForReclaim(LPEPOCHRECORD pRecord) {
+  _CloseOpenBatch(pRecord);
+
+  atomic_thread_fence(memory_order_seq_cst);
+  unsigned long nTarget = atomic_load_explicit(&g_nGlobalEpoch,
+      memory_order_relaxed) + 2;
+
+  while (atomic_load_explicit(&g_nGlobalEpoch, memory_order_acquire)
+      < nTarget) {
+    if (!_TryAdvanceEpoch()) {
+      sched_yield();
+    }
+  }
+
+  _ReclaimBatches(pRecord);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// EnterEpoch function
+
+int EnterEpoch(void) {
+  LPEPOCHRECORD pRecord = _GetEpochRecord();
+  if (NULL == pRecord) {
+    return ENOMEM;
+  }
+
+  if (0 != pRecord->nNesting++) {
+    return OK;
+  }
+
+  unsigned long nEpoch = atomic_load_explicit(&g_nGlobalEpoch,
+      memory_order_relaxed);
+  atomic_store_explicit(&pRecord->nLocalEpoch,
+      (nEpoch << 1) | EPOCH_ACTIVE, memory_order_relaxed);
+
+  /* Our reads of the structure must not move above the store */
+  if (g_bMembarrier) {
+    atomic_signal_fence(memory_order_seq_cst);
+  } else {
+    atomic_thread_fence(memory_order_seq_cst);
+  }
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ExitEpoch function
+
+void ExitEpoch(void) {
+  LPEPOCHRECORD pRecord = g_pEpochRecord;
+  if (NULL == pRecord || pRecord->nNesting <= 0) {
+    return;   // unbalanced; nothing to leave
+  }
+
+  if (0 == --pRecord->nNesting) {
+    atomic_store_explicit(&pRecord->nLocalEpoch, 0, memory_order_release);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RetireBlock function
+
+int RetireBlock(void* pvBlock, LPRELEASE_BLOCK_ROUTINE lpfnRelease) {
+  if (NULL == pvBlock) {
+    return OK;
+  }
+
+  LPEPOCHRECORD pRecord = _GetEpochRecord();
+  if (NULL == pRecord) {
+    return ENOMEM;
+  }
+
+  LPRETIREBATCH pBatch = pRecord->pOpenBatch;
+  if (NULL == pBatch) {
+    pBatch = pRecord->pSpareBatch;
+    pRecord->pSpareBatch = NULL;
+    if (NULL == pBatch) {
+      pBatch = (LPRETIREBATCH) malloc(sizeof(RETIREBATCH));
+    }
+
+    if (NULL == pBatch) {
+      /* Out of memory: wait out the readers instead of deferring.  Inside
+       * a critical section we cannot, so the block stays with the
+       * caller. */
+      if (pRecord->nNesting > 0) {
+        return ENOMEM;
+      }
+
+      _WaitForReclaim(pRecord);
+      if (NULL != lpfnRelease) {
+        lpfnRelease(pvBlock);
+      } else {
+        free(pvBlock);
+      }
+      return OK;
+    }
+
+    pBatch->nCount = 0;
+    pRecord->pOpenBatch = pBatch;
+  }
+
+  /* The block was unlinked before this call; the epoch must be read after
+   * that, or we might release it an epoch early */
+  atomic_thread_fence(memory_order_seq_cst);
+  pBatch->nEpoch = atomic_load_explicit(&g_nGlobalEpoch,
+      memory_order_relaxed);
+
+  pBatch->aBlocks[pBatch->nCount].pvBlock = pvBlock;
+  pBatch->aBlocks[pBatch->nCount].lpfnRelease = lpfnRelease;
+
+  if (EPOCH_RETIRE_BATCH_SIZE == ++pBatch->nCount) {
+    _CloseOpenBatch(pRecord);
+    _TryAdvanceEpoch();
+    _ReclaimBatches(pRecord);
+  }
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RetireMarshalledBlock function
+
+int RetireMarshalledBlock(void* pvData) {
+  return RetireBlock(pvData, FreeMarshalledBlock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SynchronizeEpoch function
+
+int SynchronizeEpoch(void) {
+  LPEPOCHRECORD pRecord = _GetEpochRecord();
+  if (NULL == pRecord) {
+    return ENOMEM;
+  }
+
+  /* We would be waiting for ourselves */
+  if (pRecord->nNesting > 0) {
+    return EDEADLK;
+  }
+
+  _WaitForReclaim(pRecord);
+
+  return OK;
+}
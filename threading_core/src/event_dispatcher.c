@@ -0,0 +1,514 @@
+// event_dispatcher.c - Implements the event dispatcher: a thread that reads
+// blocked signals from a signalfd, and the events that KillThreadEx queues
+// for it, and runs their handlers in ordinary thread context.
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief Handler that a dispatched signal is routed to, for one thread or,
+ * with INVALID_HANDLE_VALUE, for all of them.
+ */
+typedef struct _EVENTROUTE {
+  HTHREAD hThread;
+  LPEVENT_ROUTINE lpfnEventRoutine;
+  void* pUserState;
+  struct _EVENTROUTE* pNext;
+} EVENTROUTE, *LPEVENTROUTE;
+
+/**
+ * @brief Signal that KillThreadEx has raised to a thread, waiting for the
+ * dispatcher to handle it.
+ */
+typedef struct _THREADEVENT {
+  int nSignal;
+  HTHREAD hThread;
+  struct _THREADEVENT* pNext;
+} THREADEVENT, *LPTHREADEVENT;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+/* Serializes StartEventDispatcher and StopEventDispatcher */
+static pthread_mutex_t g_dispatcherMutex = PTHREAD_MUTEX_INITIALIZER;
+static HTHREAD g_hDispatcherThread = INVALID_HANDLE_VALUE;
+static int g_nSignalFd = -1;
+static int g_nEventFd = -1;       // wakes the dispatcher for queued events
+static atomic_bool g_bDispatcherStopping = false;
+
+/* g_dispatchedSignals is only written while g_bDispatcherRunning is false */
+static atomic_bool g_bDispatcherRunning = false;
+static sigset_t g_dispatchedSignals;
+static atomic_bool g_abDispatched[NSIG];
+
+static pthread_mutex_t g_routeMutex = PTHREAD_MUTEX_INITIALIZER;
+static LPEVENTROUTE g_apRoutes[NSIG];
+
+static pthread_mutex_t g_eventQueueMutex = PTHREAD_MUTEX_INITIALIZER;
+static LPTHREADEVENT g_pEventQueueHead = NULL;
+static LPTHREADEVENT g_pEventQueueTail = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _IsDispatchableSignal: Determines whether a signal can be blocked and read
+// from a signalfd.  Faults have to be handled on the thread that caused
+// them, and SIGKILL and SIGSTOP cannot be caught at all.
+
+BOOL _IsDispatchableSignal(int nSignal) {
+  switch (nSignal) {
+    case SIGKILL:
+    case SIGSTOP:
+    case SIGSEGV:
+    case SIGBUS:
+    case SIGFPE:
+    case SIGILL:
+    case SIGTRAP:
+    case SIGSYS:
+      return FALSE;
+
+    default:
+      return nSignal > 0 && nSignal < NSIG;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _PruneEventRoutes: Discards the routes of threads whose handles have been
+// released.  g_routeMutex must be held by the caller.
+
+void _PruneEventRoutes(int nSignal) {
+  LPEVENTROUTE* ppRoute = &g_apRoutes[nSignal];
+  while (NULL != *ppRoute) {
+    LPEVENTROUTE pRoute = *ppRoute;
+    if (INVALID_HANDLE_VALUE != pRoute->hThread
+        && !IsThreadHandleValid(pRoute->hThread)) {
+      *ppRoute = pRoute->pNext;
+      free(pRoute);
+    } else {
+      ppRoute = &pRoute->pNext;
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _FindEventRoute: Finds the route of a thread for a signal.  g_routeMutex
+// must be held by the caller.
+
+LPEVENTROUTE _FindEventRoute(int nSignal, HTHREAD hThread) {
+  for (LPEVENTROUTE pRoute = g_apRoutes[nSignal]; NULL != pRoute;
+      pRoute = pRoute->pNext) {
+    if (hThread == pRoute->hThread) {
+      return pRoute;
+    }
+  }
+
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _DispatchEvent: Runs the handler that an event is routed to.  The handler
+// is called without any lock held, so that it may change the routes.
+
+void _DispatchEvent(int nSignal, HTHREAD hThread) {
+  LPEVENT_ROUTINE lpfnEventRoutine = NULL;
+  void* pUserState = NULL;
+
+  pthread_mutex_lock(&g_routeMutex);
+
+  LPEVENTROUTE pRoute = NULL;
+  if (INVALID_HANDLE_VALUE != hThread) {
+    pRoute = _FindEventRoute(nSignal, hThread);
+  }
+  if (NULL == pRoute) {
+    pRoute = _FindEventRoute(nSignal, INVALID_HANDLE_VALUE);
+  }
+  if (NULL != pRoute) {
+    lpfnEventRoutine = pRoute->lpfnEventRoutine;
+    pUserState = pRoute->pUserState;
+  }
+
+  pthread_mutex_unlock(&g_routeMutex);
+
+  BOOL bTrace = _IsThreadTraceEnabled();
+  uint64_t nStartTicks = bTrace ? _GetTraceTicks() : 0;
+
+  if (NULL != lpfnEventRoutine) {
+    lpfnEventRoutine(nSignal, hThread, pUserState);
+  } else {
+    LPSIGNALHANDLER lpfnEventHandler = _GetEventHandler(nSignal);
+    if (NULL != lpfnEventHandler) {
+      lpfnEventHandler(nSignal);
+    }
+  }
+
+  if (bTrace) {
+    _RecordTraceSpan(TRACE_EVENT_SIGNAL, nStartTicks, (uint64_t) nSignal);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _TakeQueuedEvents: Empties the queue of events raised to threads and
+// returns what was in it, oldest first.
+
+LPTHREADEVENT _TakeQueuedEvents(void) {
+  pthread_mutex_lock(&g_eventQueueMutex);
+
+  LPTHREADEVENT pEvents = g_pEventQueueHead;
+  g_pEventQueueHead = NULL;
+  g_pEventQueueTail = NULL;
+
+  pthread_mutex_unlock(&g_eventQueueMutex);
+
+  return pEvents;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _HandleQueuedEvents: Handles the events raised to threads, or only
+// acknowledges them if bDispatch is FALSE, and frees them.
+
+void _HandleQueuedEvents(BOOL bDispatch) {
+  LPTHREADEVENT pEvent = _TakeQueuedEvents();
+  while (NULL != pEvent) {
+    LPTHREADEVENT pNext = pEvent->pNext;
+
+    if (bDispatch) {
+      _DispatchEvent(pEvent->nSignal, pEvent->hThread);
+    }
+
+    _AcknowledgeThreadStop(pEvent->hThread);
+    free(pEvent);
+
+    pEvent = pNext;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _HandleProcessSignals: Reads the signals that are pending for the process
+// from the signalfd, and handles each of them.
+
+void _HandleProcessSignals(void) {
+  struct signalfd_siginfo aInfo[16];
+
+  for (;;) {
+    ssize_t nRead = read(g_nSignalFd, aInfo, sizeof(aInfo));
+    if (nRead <= 0) {
+      return;   // EAGAIN: nothing more is pending
+    }
+
+    int nCount = (int) (nRead / (ssize_t) sizeof(aInfo[0]));
+    for (int i = 0; i < nCount; i++) {
+      _DispatchEvent((int) aInfo[i].ssi_signo, INVALID_HANDLE_VALUE);
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _DispatcherProc: Thread procedure of the dispatcher.  Waits for a signal
+// or a queued event, and handles whatever has arrived, until told to stop.
+// Returns zero, or the system error code that made it give up early.
+
+void* _DispatcherProc(void* pvParam) {
+  (void) pvParam;
+
+  struct pollfd aFds[2];
+  aFds[0].fd = g_nSignalFd;
+  aFds[0].events = POLLIN;
+  aFds[1].fd = g_nEventFd;
+  aFds[1].events = POLLIN;
+
+  while (!atomic_load_explicit(&g_bDispatcherStopping,
+      memory_order_acquire)) {
+    if (poll(aFds, 2, -1) < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return (void*) (intptr_t) errno;
+    }
+
+    if (0 != (aFds[1].revents & POLLIN)) {
+      uint64_t nCount = 0;
+      if (read(g_nEventFd, &nCount, sizeof(nCount)) < 0 && EAGAIN != errno) {
+        return (void*) (intptr_t) errno;
+      }
+    }
+
+    if (0 != (aFds[0].revents & POLLIN)) {
+      _HandleProcessSignals();
+    }
+
+    _HandleQueuedEvents(TRUE);
+  }
+
+  return (void*) (intptr_t) OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _WakeDispatcher: Makes the dispatcher thread look at its queue.  Returns
+// zero, or a system error code if the dispatcher could not be woken.  A
+// full eventfd counter (EAGAIN) already wakes it.
+
+int _WakeDispatcher(void) {
+  uint64_t nOne = 1;
+  if (write(g_nEventFd, &nOne, sizeof(nOne)) < 0 && EAGAIN != errno) {
+    return errno;
+  }
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _IsSignalDispatched: Determines whether KillThreadEx should queue a signal
+// for the dispatcher instead of raising it.  Shared with the other modules
+// of this library.
+
+BOOL _IsSignalDispatched(int nSignal) {
+  if (nSignal <= 0 || nSignal >= NSIG) {
+    return FALSE;
+  }
+
+  return atomic_load_explicit(&g_abDispatched[nSignal], memory_order_acquire)
+      ? TRUE : FALSE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _PostThreadEvent: Queues a signal raised to a thread for the dispatcher.
+// Returns FALSE if the dispatcher is not running or we are out of memory,
+// in which case nobody will acknowledge the event.  Shared with the other
+// modules of this library.
+
+BOOL _PostThreadEvent(int nSignal, HTHREAD hThread) {
+  LPTHREADEVENT pEvent = (LPTHREADEVENT) malloc(sizeof(THREADEVENT));
+  if (NULL == pEvent) {
+    return FALSE;
+  }
+
+  pEvent->nSignal = nSignal;
+  pEvent->hThread = hThread;
+  pEvent->pNext = NULL;
+
+  pthread_mutex_lock(&g_eventQueueMutex);
+
+  /* Checked under the queue lock, so that StopEventDispatcher, which
+   * clears it before draining the queue, cannot strand the event */
+  if (!atomic_load_explicit(&g_bDispatcherRunning, memory_order_acquire)) {
+    pthread_mutex_unlock(&g_eventQueueMutex);
+    free(pEvent);
+    return FALSE;
+  }
+
+  if (NULL == g_pEventQueueTail) {
+    g_pEventQueueHead = pEvent;
+  } else {
+    g_pEventQueueTail->pNext = pEvent;
+  }
+  g_pEventQueueTail = pEvent;
+
+  pthread_mutex_unlock(&g_eventQueueMutex);
+
+  /* The event stays queued either way; it is handled the next time the
+   * dispatcher wakes, or acknowledged when it stops.  The caller does not
+   * have to wait that long, though. */
+  return (OK == _WakeDispatcher()) ? TRUE : FALSE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _BlockDispatchedSignals: Blocks the dispatched signals in the calling
+// thread.  Every thread that this library starts calls it first thing.
+
+void _BlockDispatchedSignals(void) {
+  if (atomic_load_explicit(&g_bDispatcherRunning, memory_order_acquire)) {
+    pthread_sigmask(SIG_BLOCK, &g_dispatchedSignals, NULL);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// StartEventDispatcher function
+
+BOOL StartEventDispatcher(const sigset_t* pSignals) {
+  if (NULL == pSignals) {
+    return FALSE;
+  }
+
+  BOOL bAny = FALSE;
+  for (int nSignal = 1; nSignal < NSIG; nSignal++) {
+    if (1 == sigismember(pSignals, nSignal)) {
+      if (!_IsDispatchableSignal(nSignal)) {
+        return FALSE;
+      }
+      bAny = TRUE;
+    }
+  }
+  if (!bAny) {
+    return FALSE;
+  }
+
+  pthread_mutex_lock(&g_dispatcherMutex);
+
+  if (INVALID_HANDLE_VALUE != g_hDispatcherThread) {
+    pthread_mutex_unlock(&g_dispatcherMutex);
+    return FALSE;
+  }
+
+  /* Blocked here first, so that the dispatcher thread and everything else
+   * this thread creates inherits the mask */
+  pthread_sigmask(SIG_BLOCK, pSignals, NULL);
+
+  g_nSignalFd = signalfd(-1, pSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+  g_nEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (g_nSignalFd < 0 || g_nEventFd < 0) {
+    if (g_nSignalFd >= 0) {
+      close(g_nSignalFd);
+    }
+    if (g_nEventFd >= 0) {
+      close(g_nEventFd);
+    }
+    g_nSignalFd = g_nEventFd = -1;
+
+    pthread_mutex_unlock(&g_dispatcherMutex);
+    return FALSE;
+  }
+
+  g_dispatchedSignals = *pSignals;
+  atomic_store_explicit(&g_bDispatcherStopping, false, memory_order_relaxed);
+  atomic_store_explicit(&g_bDispatcherRunning, true, memory_order_release);
+
+  g_hDispatcherThread = CreateThreadEx(_DispatcherProc, NULL);
+  if (INVALID_HANDLE_VALUE == g_hDispatcherThread) {
+    atomic_store_explicit(&g_bDispatcherRunning, false, memory_order_release);
+
+    close(g_nSignalFd);
+    close(g_nEventFd);
+    g_nSignalFd = g_nEventFd = -1;
+
+    pthread_mutex_unlock(&g_dispatcherMutex);
+    return FALSE;
+  }
+
+  SetThreadName(g_hDispatcherThread, "tc-dispatch");
+
+  /* Only now does KillThreadEx start queueing instead of raising */
+  for (int nSignal = 1; nSignal < NSIG; nSignal++) {
+    if (1 == sigismember(pSignals, nSignal)) {
+      atomic_store_explicit(&g_abDispatched[nSignal], true,
+          memory_order_release);
+    }
+  }
+
+  pthread_mutex_unlock(&g_dispatcherMutex);
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StopEventDispatcher function
+
+int StopEventDispatcher(void) {
+  pthread_mutex_lock(&g_dispatcherMutex);
+
+  if (INVALID_HANDLE_VALUE == g_hDispatcherThread) {
+    pthread_mutex_unlock(&g_dispatcherMutex);
+    return OK;
+  }
+
+  for (int nSignal = 1; nSignal < NSIG; nSignal++) {
+    atomic_store_explicit(&g_abDispatched[nSignal], false,
+        memory_order_release);
+  }
+
+  pthread_mutex_lock(&g_eventQueueMutex);
+  atomic_store_explicit(&g_bDispatcherRunning, false, memory_order_release);
+  pthread_mutex_unlock(&g_eventQueueMutex);
+
+  /* poll() is a cancellation point, so a dispatcher that cannot be woken
+   * can still be made to stop */
+  atomic_store_explicit(&g_bDispatcherStopping, true, memory_order_release);
+  if (OK != _WakeDispatcher()) {
+    CancelThread(g_hDispatcherThread);
+  }
+
+  void* pvExitStatus = NULL;
+  WaitThreadEx(g_hDispatcherThread, &pvExitStatus);
+  g_hDispatcherThread = INVALID_HANDLE_VALUE;
+
+  int nResult = (PTHREAD_CANCELED == pvExitStatus)
+      ? OK : (int) (intptr_t) pvExitStatus;
+
+  /* Whoever is waiting on these should not have to time out */
+  _HandleQueuedEvents(FALSE);
+
+  close(g_nSignalFd);
+  close(g_nEventFd);
+  g_nSignalFd = g_nEventFd = -1;
+
+  pthread_mutex_unlock(&g_dispatcherMutex);
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsEventDispatched function
+
+BOOL IsEventDispatched(int nSignal) {
+  return _IsSignalDispatched(nSignal);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RegisterThreadEvent function
+
+BOOL RegisterThreadEvent(HTHREAD hThread, int nSignal,
+    LPEVENT_ROUTINE lpfnEventRoutine, void* pUserState) {
+  if (!_IsDispatchableSignal(nSignal)) {
+    return FALSE;
+  }
+
+  if (INVALID_HANDLE_VALUE != hThread && !IsThreadHandleValid(hThread)) {
+    return FALSE;
+  }
+
+  LPEVENTROUTE pNewRoute = NULL;
+  if (NULL != lpfnEventRoutine) {
+    pNewRoute = (LPEVENTROUTE) malloc(sizeof(EVENTROUTE));
+    if (NULL == pNewRoute) {
+      return FALSE;
+    }
+  }
+
+  pthread_mutex_lock(&g_routeMutex);
+
+  _PruneEventRoutes(nSignal);
+
+  LPEVENTROUTE pRoute = _FindEventRoute(nSignal, hThread);
+  if (NULL != pRoute && NULL != lpfnEventRoutine) {
+    pRoute->lpfnEventRoutine = lpfnEventRoutine;
+    pRoute->pUserState = pUserState;
+    free(pNewRoute);
+  } else if (NULL != lpfnEventRoutine) {
+    pNewRoute->hThread = hThread;
+    pNewRoute->lpfnEventRoutine = lpfnEventRoutine;
+    pNewRoute->pUserState = pUserState;
+    pNewRoute->pNext = g_apRoutes[nSignal];
+    g_apRoutes[nSignal] = pNewRoute;
+  } else if (NULL != pRoute) {
+    LPEVENTROUTE* ppRoute = &g_apRoutes[nSignal];
+    while (pRoute != *ppRoute) {
+      ppRoute = &(*ppRoute)->pNext;
+    }
+    *ppRoute = pRoute->pNext;
+    free(pRoute);
+  }
+
+  pthread_mutex_unlock(&g_routeMutex);
+
+  return TRUE;
+}
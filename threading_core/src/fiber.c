@@ -0,0 +1,462 @@
+// fiber.c - Implements fibers: the context switch, the pool of fiber stacks,
+// and the carrier threads that fibers are multiplexed onto.
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+#include "fiber.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+#if defined(__x86_64__)
+
+/**
+ * @brief Saved registers of a fiber or carrier thread that is switched out.
+ * They are pushed onto its own stack, so all that is kept here is where.
+ */
+typedef struct _FIBERCONTEXT {
+  void* pvStackPointer;
+} FIBERCONTEXT, *LPFIBERCONTEXT;
+
+#else
+
+/**
+ * @brief Saved registers of a fiber or carrier thread that is switched out.
+ * Elsewhere than on x86-64, we make do with ucontext, which costs a system
+ * call per switch to save and restore the signal mask.
+ */
+typedef struct _FIBERCONTEXT {
+  ucontext_t context;
+} FIBERCONTEXT, *LPFIBERCONTEXT;
+
+#endif
+
+/**
+ * @brief State of a fiber.  It lives at the top of the fiber's own stack,
+ * so that a fiber costs exactly one stack.
+ */
+struct _FIBER {
+  FIBERCONTEXT context;
+  LPFIBERCONTEXT pCarrierContext;   // where to switch to, to give up the CPU
+  void* pvControl;                  // control block of the fiber's HTHREAD
+  THREADSTACK stack;
+  BOOL bFinished;
+  struct _FIBER* pNext;             // in the run queue
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+static pthread_once_t g_fiberOnce = PTHREAD_ONCE_INIT;
+static atomic_bool g_bCarriersStarted = false;
+static BOOL g_bCarriersReady = FALSE;
+static int g_nCarrierThreads = 0;       // zero for one per online CPU
+
+/* Fibers that are ready to run, oldest first */
+static pthread_mutex_t g_runQueueMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_runQueueCond = PTHREAD_COND_INITIALIZER;
+static LPFIBER g_pRunQueueHead = NULL;
+static LPFIBER g_pRunQueueTail = NULL;
+static int g_nIdleCarriers = 0;
+static atomic_int g_nReadyFibers = 0;   // lets YieldThread skip the lock
+
+/* Stacks of finished fibers, all FIBER_STACK_SIZE in size */
+static pthread_mutex_t g_fiberStackMutex = PTHREAD_MUTEX_INITIALIZER;
+static THREADSTACK g_aCachedFiberStacks[FIBER_STACK_CACHE_MAX];
+static int g_nCachedFiberStacks = 0;
+
+/* Fiber that the calling carrier thread is running, if any */
+static __thread LPFIBER g_pCurrentFiber = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+#if defined(__x86_64__)
+
+void _SwapFiberContext(LPFIBERCONTEXT pFrom, LPFIBERCONTEXT pTo);
+void _FiberTrampoline(void);
+
+/* _SwapFiberContext: Saves the callee-saved registers, along with the SSE
+ * and x87 control words, on the current stack, and restores those of pTo
+ * from its stack.  Everything else is saved by the caller, as with any
+ * function call.
+ * _FiberTrampoline: Where a new fiber starts; calls the function in r13
+ * with the fiber in r12, as laid out by _InitFiberContext. */
+__asm__(
+    ".text\n"
+    ".globl _SwapFiberContext\n"
+    ".hidden _SwapFiberContext\n"
+    ".type _SwapFiberContext, @function\n"
+    "_SwapFiberContext:\n"
+    "  pushq %rbp\n"
+    "  pushq %rbx\n"
+    "  pushq %r12\n"
+    "  pushq %r13\n"
+    "  pushq %r14\n"
+    "  pushq %r15\n"
+    "  subq $8, %rsp\n"
+    "  stmxcsr (%rsp)\n"
+    "  fnstcw 4(%rsp)\n"
+    "  movq %rsp, (%rdi)\n"
+    "  movq (%rsi), %rsp\n"
+    "  ldmxcsr (%rsp)\n"
+    "  fldcw 4(%rsp)\n"
+    "  addq $8, %rsp\n"
+    "  popq %r15\n"
+    "  popq %r14\n"
+    "  popq %r13\n"
+    "  popq %r12\n"
+    "  popq %rbx\n"
+    "  popq %rbp\n"
+    "  ret\n"
+    ".size _SwapFiberContext, .-_SwapFiberContext\n"
+    ".globl _FiberTrampoline\n"
+    ".hidden _FiberTrampoline\n"
+    ".type _FiberTrampoline, @function\n"
+    "_FiberTrampoline:\n"
+    "  movq %r12, %rdi\n"
+    "  callq *%r13\n"
+    "  ud2\n"
+    ".size _FiberTrampoline, .-_FiberTrampoline\n");
+
+#else
+
+///////////////////////////////////////////////////////////////////////////////
+// _SwapFiberContext: Saves the registers of the caller into pFrom and
+// resumes pTo.
+
+void _SwapFiberContext(LPFIBERCONTEXT pFrom, LPFIBERCONTEXT pTo) {
+  swapcontext(&pFrom->context, &pTo->context);
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// _FiberMain: Runs the thread procedure of a fiber, and gives the carrier
+// thread back for good.
+
+void _FiberMain(LPFIBER pFiber) {
+  _RunFiberProc(pFiber->pvControl);
+
+  /* The fiber may have moved to another carrier since it started */
+  pFiber->bFinished = TRUE;
+  _SwapFiberContext(&pFiber->context, pFiber->pCarrierContext);
+
+  abort();    // a finished fiber is never resumed
+}
+
+#if !defined(__x86_64__)
+
+///////////////////////////////////////////////////////////////////////////////
+// _FiberStart: Entry point that makecontext calls.  makecontext only passes
+// int arguments, so the fiber comes in two halves.
+
+void _FiberStart(unsigned int nHigh, unsigned int nLow) {
+  _FiberMain((LPFIBER) (((uintptr_t) nHigh << 16 << 16) | nLow));
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// _InitFiberContext: Sets up the context of a new fiber, so that switching
+// to it calls _FiberMain.  pvStackTop is the highest address the fiber's
+// stack may use.
+
+void _InitFiberContext(LPFIBER pFiber, void* pvStackTop) {
+#if defined(__x86_64__)
+  /* The frame _SwapFiberContext pops: control words, r15, r14, r13, r12,
+   * rbx, rbp, and the return address, which leaves the stack 16-byte
+   * aligned at the call in _FiberTrampoline, as the ABI wants */
+  uint64_t* pnTop = (uint64_t*) ((uintptr_t) pvStackTop & ~(uintptr_t) 15);
+
+  pnTop[-1] = (uint64_t) (uintptr_t) _FiberTrampoline;
+  pnTop[-2] = 0;                                  // rbp
+  pnTop[-3] = 0;                                  // rbx
+  pnTop[-4] = (uint64_t) (uintptr_t) pFiber;      // r12
+  pnTop[-5] = (uint64_t) (uintptr_t) _FiberMain;  // r13
+  pnTop[-6] = 0;                                  // r14
+  pnTop[-7] = 0;                                  // r15
+
+  /* Start out with the same floating-point modes as the creator */
+  uint32_t* pnControlWords = (uint32_t*) &pnTop[-8];
+  __asm__ __volatile__("stmxcsr %0" : "=m" (pnControlWords[0]));
+  __asm__ __volatile__("fnstcw %0" : "=m" (pnControlWords[1]));
+
+  pFiber->context.pvStackPointer = &pnTop[-8];
+#else
+  char* pStackBottom = (char*) pFiber->stack.pvBase
+      + pFiber->stack.nGuardSize;
+
+  getcontext(&pFiber->context.context);
+  pFiber->context.context.uc_stack.ss_sp = pStackBottom;
+  pFiber->context.context.uc_stack.ss_size =
+      (size_t) ((char*) pvStackTop - pStackBottom);
+  pFiber->context.context.uc_link = NULL;
+
+  uintptr_t nFiber = (uintptr_t) pFiber;
+  makecontext(&pFiber->context.context, (void (*)(void)) _FiberStart, 2,
+      (unsigned int) (nFiber >> 16 >> 16), (unsigned int) nFiber);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetFiberStack: Gets a stack for a new fiber, from the cache if it is the
+// default size.
+
+BOOL _GetFiberStack(size_t nStackSize, LPTHREADSTACK pStack) {
+  size_t nGuardSize = (size_t) sysconf(_SC_PAGESIZE);
+
+  if (FIBER_STACK_SIZE == nStackSize) {
+    pthread_mutex_lock(&g_fiberStackMutex);
+    if (g_nCachedFiberStacks > 0) {
+      *pStack = g_aCachedFiberStacks[--g_nCachedFiberStacks];
+      pthread_mutex_unlock(&g_fiberStackMutex);
+      return TRUE;
+    }
+    pthread_mutex_unlock(&g_fiberStackMutex);
+  }
+
+  return _MapThreadStack(nStackSize, nGuardSize, 0, pStack);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ReleaseFiberStack: Puts the stack of a finished fiber back into the
+// cache, or unmaps it.  The FIBER on it goes with it.
+
+void _ReleaseFiberStack(LPTHREADSTACK pStack) {
+  THREADSTACK stack = *pStack;    // pStack may well be on the stack itself
+
+  if (FIBER_STACK_SIZE == stack.nMapSize - stack.nGuardSize) {
+    pthread_mutex_lock(&g_fiberStackMutex);
+    if (g_nCachedFiberStacks < FIBER_STACK_CACHE_MAX) {
+      g_aCachedFiberStacks[g_nCachedFiberStacks++] = stack;
+      pthread_mutex_unlock(&g_fiberStackMutex);
+      return;
+    }
+    pthread_mutex_unlock(&g_fiberStackMutex);
+  }
+
+  _UnmapThreadStack(&stack);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _PushReadyFiber: Adds a fiber to the end of the run queue, and wakes an
+// idle carrier thread to run it.
+
+void _PushReadyFiber(LPFIBER pFiber) {
+  pFiber->pNext = NULL;
+
+  pthread_mutex_lock(&g_runQueueMutex);
+
+  if (NULL == g_pRunQueueTail) {
+    g_pRunQueueHead = pFiber;
+  } else {
+    g_pRunQueueTail->pNext = pFiber;
+  }
+  g_pRunQueueTail = pFiber;
+  atomic_fetch_add_explicit(&g_nReadyFibers, 1, memory_order_relaxed);
+
+  if (g_nIdleCarriers > 0) {
+    pthread_cond_signal(&g_runQueueCond);
+  }
+
+  pthread_mutex_unlock(&g_runQueueMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _PopReadyFiber: Takes the fiber at the head of the run queue, waiting
+// for one if there is none.
+
+LPFIBER _PopReadyFiber(void) {
+  pthread_mutex_lock(&g_runQueueMutex);
+
+  while (NULL == g_pRunQueueHead) {
+    g_nIdleCarriers++;
+    pthread_cond_wait(&g_runQueueCond, &g_runQueueMutex);
+    g_nIdleCarriers--;
+  }
+
+  LPFIBER pFiber = g_pRunQueueHead;
+  g_pRunQueueHead = pFiber->pNext;
+  if (NULL == g_pRunQueueHead) {
+    g_pRunQueueTail = NULL;
+  }
+  atomic_fetch_sub_explicit(&g_nReadyFibers, 1, memory_order_relaxed);
+
+  pthread_mutex_unlock(&g_runQueueMutex);
+
+  return pFiber;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CarrierThreadProc: Thread procedure of a carrier thread.  Runs ready
+// fibers until they yield or finish, one after another.
+
+void* _CarrierThreadProc(void* pvParam) {
+  (void) pvParam;
+
+  FIBERCONTEXT carrierContext;
+
+  for (;;) {
+    LPFIBER pFiber = _PopReadyFiber();
+
+    /* Library calls the fiber makes see it as the current thread */
+    pFiber->pCarrierContext = &carrierContext;
+    g_pCurrentFiber = pFiber;
+    void* pvCarrierControl = _SwapCurrentThread(pFiber->pvControl);
+
+    _SwapFiberContext(&carrierContext, &pFiber->context);
+
+    _SwapCurrentThread(pvCarrierControl);
+    g_pCurrentFiber = NULL;
+
+    /* Only requeued once it is off its stack, so that no other carrier
+     * can resume it while we are still switching away from it */
+    if (pFiber->bFinished) {
+      void* pvControl = pFiber->pvControl;
+      _ReleaseFiberStack(&pFiber->stack);
+      _CompleteThread(pvControl);
+    } else {
+      _PushReadyFiber(pFiber);
+    }
+  }
+
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _StartCarrierThreads: Starts the carrier threads, once.
+
+void _StartCarrierThreads(void) {
+  atomic_store_explicit(&g_bCarriersStarted, true, memory_order_relaxed);
+
+  int nCarrierThreads = g_nCarrierThreads;
+  if (nCarrierThreads <= 0) {
+    nCarrierThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (nCarrierThreads <= 0) {
+    nCarrierThreads = 1;
+  }
+
+  int nStarted = 0;
+  for (int i = 0; i < nCarrierThreads; i++) {
+    HTHREAD hCarrier = CreateThreadEx(_CarrierThreadProc, NULL);
+    if (INVALID_HANDLE_VALUE != hCarrier) {
+      SetThreadName(hCarrier, "tc-carrier");
+      nStarted++;
+    }
+  }
+
+  g_bCarriersReady = nStarted > 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CreateFiber: Sets up a fiber, with a stack of its own, for the control
+// block of a HTHREAD.  Returns NULL if the carrier threads could not be
+// started or we are out of memory.  Shared with the other modules of this
+// library.
+
+LPFIBER _CreateFiber(void* pvControl, size_t nStackSize) {
+  pthread_once(&g_fiberOnce, _StartCarrierThreads);
+  if (!g_bCarriersReady) {
+    return NULL;
+  }
+
+  if (0 == nStackSize) {
+    nStackSize = FIBER_STACK_SIZE;
+  }
+
+  THREADSTACK stack;
+  if (!_GetFiberStack(nStackSize, &stack)) {
+    return NULL;
+  }
+
+  /* The FIBER goes at the very top of the stack, and the stack proper
+   * starts below it */
+  char* pTop = (char*) stack.pvBase + stack.nMapSize;
+  LPFIBER pFiber = (LPFIBER) (((uintptr_t) pTop - sizeof(FIBER))
+      & ~(uintptr_t) (CACHE_LINE_SIZE - 1));
+
+  memset(pFiber, 0, sizeof(FIBER));
+  pFiber->pvControl = pvControl;
+  pFiber->stack = stack;
+
+  _InitFiberContext(pFiber, pFiber);
+
+  return pFiber;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _StartFiber: Makes a new fiber ready to run.  Shared with the other
+// modules of this library.
+
+void _StartFiber(LPFIBER pFiber) {
+  _PushReadyFiber(pFiber);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AreFibersReady: Determines whether any fiber is waiting for a carrier
+// thread.  Shared with the other modules of this library.
+
+BOOL _AreFibersReady(void) {
+  return 0 != atomic_load_explicit(&g_nReadyFibers, memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateFiber function
+
+HTHREAD CreateFiber(LPTHREAD_START_ROUTINE lpfnThreadProc, void* pUserState) {
+  THREAD_ATTRIBUTES attributes;
+  InitThreadAttributes(&attributes);
+  attributes.bFiber = TRUE;
+
+  return CreateThreadEx2(lpfnThreadProc, pUserState, &attributes);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetFiberCarrierCount function
+
+BOOL SetFiberCarrierCount(int nCarrierThreads) {
+  if (nCarrierThreads < 0
+      || atomic_load_explicit(&g_bCarriersStarted, memory_order_relaxed)) {
+    return FALSE;
+  }
+
+  g_nCarrierThreads = nCarrierThreads;
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// YieldThread function
+
+void YieldThread(void) {
+  LPFIBER pFiber = g_pCurrentFiber;
+  if (NULL == pFiber) {
+    sched_yield();
+    return;
+  }
+
+  if (!_AreFibersReady()) {
+    return;   // we would only be put straight back on
+  }
+
+  /* Nothing thread-local may be touched after this: we may come back on
+   * another carrier thread */
+  _SwapFiberContext(&pFiber->context, pFiber->pCarrierContext);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsRunningOnFiber function
+
+BOOL IsRunningOnFiber(void) {
+  return NULL != g_pCurrentFiber;
+}
@@ -0,0 +1,539 @@
+// future.c - Implementations of the functions defined in future.h
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+#include "future.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @brief Number of futures WaitAnyFuture can wait on without allocating its
+ * wait nodes on the heap.
+ */
+#define FUTURE_WAIT_NODES_ON_STACK  16
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief State shared between a thread in WaitAnyFuture and the futures it
+ * waits on.
+ */
+typedef struct _FUTUREWAITER {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int nIndex;     // index of the first future completed, or ERROR
+} FUTUREWAITER, *LPFUTUREWAITER;
+
+/**
+ * @brief Links a FUTUREWAITER into the list of waiters of one future.
+ */
+typedef struct _FUTUREWAITNODE {
+  LPFUTUREWAITER pWaiter;
+  int nIndex;
+  BOOL bLinked;
+  struct _FUTUREWAITNODE* pPrev;
+  struct _FUTUREWAITNODE* pNext;
+} FUTUREWAITNODE, *LPFUTUREWAITNODE;
+
+typedef struct _CONTINUATION {
+  LPTHREAD_START_ROUTINE lpfnContinuation;
+  HTHREADPOOL hThreadPool;    // INVALID_HANDLE_VALUE to run inline
+  LPFUTURE pResult;           // completed with the continuation's result
+  void* pvArgument;           // result of the antecedent
+  struct _CONTINUATION* pNext;
+} CONTINUATION, *LPCONTINUATION;
+
+struct _FUTURE {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  atomic_int nRefCount;
+  atomic_bool bReady;
+  int nStatus;                // OK, or ECANCELED if it was abandoned
+  void* pvResult;
+  LPCONTINUATION pContinuations;
+  LPFUTUREWAITNODE pWaiters;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _CreateFuture: Allocates a future that starts out with the specified number
+// of references.
+
+LPFUTURE _CreateFuture(int nRefCount) {
+  LPFUTURE pFuture = (LPFUTURE) calloc(1, sizeof(FUTURE));
+  if (NULL == pFuture) {
+    return NULL;
+  }
+
+  pthread_mutex_init(&pFuture->mutex, NULL);
+  _InitCondition(&pFuture->cond);
+  atomic_init(&pFuture->nRefCount, nRefCount);
+  atomic_init(&pFuture->bReady, FALSE);
+
+  return pFuture;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CompleteFuture: Completes a future with a result, or abandons it with an
+// error status, and wakes every thread waiting on it.  Returns the pending
+// continuations, which the caller must dispatch or cancel, through
+// ppContinuations.  Returns FALSE if the future had already been completed.
+
+BOOL _CompleteFuture(LPFUTURE pFuture, void* pvResult, int nStatus,
+    LPCONTINUATION* ppContinuations) {
+  pthread_mutex_lock(&pFuture->mutex);
+
+  if (atomic_load_explicit(&pFuture->bReady, memory_order_relaxed)) {
+    pthread_mutex_unlock(&pFuture->mutex);
+    return FALSE;   // a future is completed exactly once
+  }
+
+  pFuture->pvResult = pvResult;
+  pFuture->nStatus = nStatus;
+  atomic_store_explicit(&pFuture->bReady, TRUE, memory_order_release);
+
+  /* Wake each thread in WaitAnyFuture exactly once; the first future to
+   * complete gets to report its index. */
+  for (LPFUTUREWAITNODE pNode = pFuture->pWaiters; NULL != pNode;
+      pNode = pNode->pNext) {
+    LPFUTUREWAITER pWaiter = pNode->pWaiter;
+
+    pthread_mutex_lock(&pWaiter->mutex);
+    if (ERROR == pWaiter->nIndex) {
+      pWaiter->nIndex = pNode->nIndex;
+      pthread_cond_signal(&pWaiter->cond);
+    }
+    pthread_mutex_unlock(&pWaiter->mutex);
+
+    pNode->bLinked = FALSE;
+  }
+  pFuture->pWaiters = NULL;
+
+  *ppContinuations = pFuture->pContinuations;
+  pFuture->pContinuations = NULL;
+
+  pthread_cond_broadcast(&pFuture->cond);
+  pthread_mutex_unlock(&pFuture->mutex);
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CancelContinuations: Frees continuations whose antecedent will never
+// produce a result, abandoning the futures they would have completed (and,
+// in turn, the continuations of those).
+
+void _CancelContinuations(LPCONTINUATION pContinuations) {
+  while (NULL != pContinuations) {
+    LPCONTINUATION pNext = pContinuations->pNext;
+    LPCONTINUATION pDependents = NULL;
+
+    if (_CompleteFuture(pContinuations->pResult, NULL, ECANCELED,
+        &pDependents)) {
+      _CancelContinuations(pDependents);
+    }
+    DestroyFuture(pContinuations->pResult);
+
+    free(pContinuations);
+    pContinuations = pNext;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ContinuationProc: Runs a continuation and completes its result future.
+// Doubles as the thread pool work item for ContinueFutureWithEx and
+// SubmitWorkItem; for the latter, pvArgument is the user state.
+
+void* _ContinuationProc(void* pUserState) {
+  LPCONTINUATION pContinuation = (LPCONTINUATION) pUserState;
+
+  void* pvResult = pContinuation->lpfnContinuation(pContinuation->pvArgument);
+
+  SetFutureResult(pContinuation->pResult, pvResult);
+  DestroyFuture(pContinuation->pResult);
+
+  free(pContinuation);
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _DispatchContinuation: Runs a continuation, or queues it on its thread pool,
+// once its antecedent has produced pvArgument.
+
+void _DispatchContinuation(LPCONTINUATION pContinuation, void* pvArgument) {
+  pContinuation->pvArgument = pvArgument;
+
+  if (INVALID_HANDLE_VALUE != pContinuation->hThreadPool
+      && QueueWorkItem(pContinuation->hThreadPool, _ContinuationProc,
+          pContinuation)) {
+    return;
+  }
+
+  /* No pool, or the pool refused the item; rather than lose the result,
+   * run the continuation right here. */
+  _ContinuationProc(pContinuation);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// CreatePromise function
+
+HFUTURE CreatePromise(void) {
+  LPFUTURE pFuture = _CreateFuture(1);
+  if (NULL == pFuture) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  return (HFUTURE) pFuture;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AddRefFuture function
+
+void AddRefFuture(HFUTURE hFuture) {
+  if (INVALID_HANDLE_VALUE == hFuture) {
+    return;
+  }
+
+  atomic_fetch_add_explicit(&((LPFUTURE) hFuture)->nRefCount, 1,
+      memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ContinueFutureWith function
+
+HFUTURE ContinueFutureWith(HFUTURE hFuture,
+    LPTHREAD_START_ROUTINE lpfnContinuation) {
+  return ContinueFutureWithEx(hFuture, INVALID_HANDLE_VALUE,
+      lpfnContinuation);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ContinueFutureWithEx function
+
+HFUTURE ContinueFutureWithEx(HFUTURE hFuture, HTHREADPOOL hThreadPool,
+    LPTHREAD_START_ROUTINE lpfnContinuation) {
+  if (INVALID_HANDLE_VALUE == hFuture) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  if (NULL == lpfnContinuation) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  LPFUTURE pFuture = (LPFUTURE) hFuture;
+
+  LPCONTINUATION pContinuation =
+      (LPCONTINUATION) calloc(1, sizeof(CONTINUATION));
+  if (NULL == pContinuation) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  /* One reference for the caller and one for the continuation, which
+   * completes the future and then lets go of it. */
+  LPFUTURE pResult = _CreateFuture(2);
+  if (NULL == pResult) {
+    free(pContinuation);
+    return INVALID_HANDLE_VALUE;
+  }
+
+  pContinuation->lpfnContinuation = lpfnContinuation;
+  pContinuation->hThreadPool = hThreadPool;
+  pContinuation->pResult = pResult;
+
+  pthread_mutex_lock(&pFuture->mutex);
+
+  if (!atomic_load_explicit(&pFuture->bReady, memory_order_relaxed)) {
+    pContinuation->pNext = pFuture->pContinuations;
+    pFuture->pContinuations = pContinuation;
+    pthread_mutex_unlock(&pFuture->mutex);
+    return (HFUTURE) pResult;
+  }
+
+  void* pvArgument = pFuture->pvResult;
+  int nStatus = pFuture->nStatus;
+  pthread_mutex_unlock(&pFuture->mutex);
+
+  if (OK != nStatus) {
+    _CancelContinuations(pContinuation);   // the antecedent was abandoned
+  } else {
+    _DispatchContinuation(pContinuation, pvArgument);
+  }
+
+  return (HFUTURE) pResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyFuture function
+
+void DestroyFuture(HFUTURE hFuture) {
+  if (INVALID_HANDLE_VALUE == hFuture) {
+    return;
+  }
+
+  LPFUTURE pFuture = (LPFUTURE) hFuture;
+
+  if (1 != atomic_fetch_sub_explicit(&pFuture->nRefCount, 1,
+      memory_order_acq_rel)) {
+    return;
+  }
+
+  /* Last reference; the future can no longer be completed, so any
+   * continuations that are still pending will never run.  Abandon the
+   * futures they would have completed, so that nobody waits on those
+   * forever. */
+  _CancelContinuations(pFuture->pContinuations);
+
+  pthread_cond_destroy(&pFuture->cond);
+  pthread_mutex_destroy(&pFuture->mutex);
+  free(pFuture);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsFutureReady function
+
+BOOL IsFutureReady(HFUTURE hFuture) {
+  if (INVALID_HANDLE_VALUE == hFuture) {
+    return FALSE;
+  }
+
+  return atomic_load_explicit(&((LPFUTURE) hFuture)->bReady,
+      memory_order_acquire);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetFutureResult function
+
+BOOL SetFutureResult(HFUTURE hFuture, void* pvResult) {
+  if (INVALID_HANDLE_VALUE == hFuture) {
+    return FALSE;
+  }
+
+  LPCONTINUATION pContinuations = NULL;
+  if (!_CompleteFuture((LPFUTURE) hFuture, pvResult, OK, &pContinuations)) {
+    return FALSE;
+  }
+
+  while (NULL != pContinuations) {
+    LPCONTINUATION pNext = pContinuations->pNext;
+    _DispatchContinuation(pContinuations, pvResult);
+    pContinuations = pNext;
+  }
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SubmitWorkItem function
+
+HFUTURE SubmitWorkItem(HTHREADPOOL hThreadPool,
+    LPTHREAD_START_ROUTINE lpfnWorkItem, void* pUserState) {
+  if (INVALID_HANDLE_VALUE == hThreadPool) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  if (NULL == lpfnWorkItem) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  LPCONTINUATION pWorkItem = (LPCONTINUATION) calloc(1, sizeof(CONTINUATION));
+  if (NULL == pWorkItem) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  LPFUTURE pResult = _CreateFuture(2);
+  if (NULL == pResult) {
+    free(pWorkItem);
+    return INVALID_HANDLE_VALUE;
+  }
+
+  pWorkItem->lpfnContinuation = lpfnWorkItem;
+  pWorkItem->pvArgument = pUserState;
+  pWorkItem->pResult = pResult;
+
+  if (!QueueWorkItem(hThreadPool, _ContinuationProc, pWorkItem)) {
+    free(pWorkItem);
+    DestroyFuture(pResult);
+    DestroyFuture(pResult);
+    return INVALID_HANDLE_VALUE;
+  }
+
+  return (HFUTURE) pResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WaitAnyFuture function
+
+int WaitAnyFuture(HFUTURE* phFutures, int nCount, int nTimeoutMs,
+    int* pnIndex) {
+  if (NULL == phFutures || nCount <= 0 || NULL == pnIndex) {
+    return EINVAL;
+  }
+
+  for (int i = 0; i < nCount; i++) {
+    if (INVALID_HANDLE_VALUE == phFutures[i]) {
+      return EINVAL;
+    }
+  }
+
+  FUTUREWAITNODE aStackNodes[FUTURE_WAIT_NODES_ON_STACK];
+  LPFUTUREWAITNODE pNodes = aStackNodes;
+  if (nCount > FUTURE_WAIT_NODES_ON_STACK) {
+    pNodes = (LPFUTUREWAITNODE) malloc(nCount * sizeof(FUTUREWAITNODE));
+    if (NULL == pNodes) {
+      return ENOMEM;
+    }
+  }
+
+  FUTUREWAITER waiter;
+  pthread_mutex_init(&waiter.mutex, NULL);
+  _InitCondition(&waiter.cond);
+  waiter.nIndex = ERROR;
+
+  /* Hook ourselves onto every future that is still pending.  If one turns
+   * out to be complete already there is no reason to keep going. */
+  int nLinked = 0;
+  int nReadyIndex = ERROR;
+  for (; nLinked < nCount; nLinked++) {
+    LPFUTURE pFuture = (LPFUTURE) phFutures[nLinked];
+    LPFUTUREWAITNODE pNode = &pNodes[nLinked];
+
+    pNode->pWaiter = &waiter;
+    pNode->nIndex = nLinked;
+    pNode->pPrev = NULL;
+
+    pthread_mutex_lock(&pFuture->mutex);
+    if (atomic_load_explicit(&pFuture->bReady, memory_order_relaxed)) {
+      pthread_mutex_unlock(&pFuture->mutex);
+      nReadyIndex = nLinked;
+      break;
+    }
+
+    pNode->bLinked = TRUE;
+    pNode->pNext = pFuture->pWaiters;
+    if (NULL != pFuture->pWaiters) {
+      pFuture->pWaiters->pPrev = pNode;
+    }
+    pFuture->pWaiters = pNode;
+    pthread_mutex_unlock(&pFuture->mutex);
+  }
+
+  int nResult = OK;
+  if (ERROR == nReadyIndex) {
+    struct timespec deadline;
+    if (INFINITE != nTimeoutMs) {
+      _GetAbsoluteDeadline(nTimeoutMs, &deadline);
+    }
+
+    pthread_mutex_lock(&waiter.mutex);
+    while (ERROR == waiter.nIndex && OK == nResult) {
+      if (INFINITE == nTimeoutMs) {
+        pthread_cond_wait(&waiter.cond, &waiter.mutex);
+      } else {
+        nResult = pthread_cond_timedwait(&waiter.cond, &waiter.mutex,
+            &deadline);
+      }
+    }
+    nReadyIndex = waiter.nIndex;
+    pthread_mutex_unlock(&waiter.mutex);
+
+    if (ERROR != nReadyIndex) {
+      nResult = OK;   // completion and timeout raced; completion wins
+    }
+  }
+
+  /* Unhook from every future that has not already dropped us */
+  for (int i = 0; i < nLinked; i++) {
+    LPFUTURE pFuture = (LPFUTURE) phFutures[i];
+    LPFUTUREWAITNODE pNode = &pNodes[i];
+
+    pthread_mutex_lock(&pFuture->mutex);
+    if (pNode->bLinked) {
+      if (NULL != pNode->pPrev) {
+        pNode->pPrev->pNext = pNode->pNext;
+      } else {
+        pFuture->pWaiters = pNode->pNext;
+      }
+      if (NULL != pNode->pNext) {
+        pNode->pNext->pPrev = pNode->pPrev;
+      }
+      pNode->bLinked = FALSE;
+    }
+    pthread_mutex_unlock(&pFuture->mutex);
+  }
+
+  pthread_cond_destroy(&waiter.cond);
+  pthread_mutex_destroy(&waiter.mutex);
+
+  if (pNodes != aStackNodes) {
+    free(pNodes);
+  }
+
+  if (OK == nResult) {
+    *pnIndex = nReadyIndex;
+  }
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WaitFuture function
+
+int WaitFuture(HFUTURE hFuture, void** ppvResult, int nTimeoutMs) {
+  if (INVALID_HANDLE_VALUE == hFuture) {
+    return EINVAL;
+  }
+
+  LPFUTURE pFuture = (LPFUTURE) hFuture;
+
+  /* Fast path: no need for the lock once the result has been published */
+  if (atomic_load_explicit(&pFuture->bReady, memory_order_acquire)) {
+    if (OK == pFuture->nStatus && NULL != ppvResult) {
+      *ppvResult = pFuture->pvResult;
+    }
+    return pFuture->nStatus;
+  }
+
+  struct timespec deadline;
+  if (INFINITE != nTimeoutMs) {
+    _GetAbsoluteDeadline(nTimeoutMs, &deadline);
+  }
+
+  int nResult = OK;
+
+  pthread_mutex_lock(&pFuture->mutex);
+  while (!atomic_load_explicit(&pFuture->bReady, memory_order_relaxed)) {
+    if (INFINITE == nTimeoutMs) {
+      pthread_cond_wait(&pFuture->cond, &pFuture->mutex);
+      continue;
+    }
+
+    if (ETIMEDOUT == pthread_cond_timedwait(&pFuture->cond, &pFuture->mutex,
+        &deadline)
+        && !atomic_load_explicit(&pFuture->bReady, memory_order_relaxed)) {
+      nResult = ETIMEDOUT;
+      break;
+    }
+  }
+
+  if (OK == nResult) {
+    nResult = pFuture->nStatus;
+  }
+  if (OK == nResult && NULL != ppvResult) {
+    *ppvResult = pFuture->pvResult;
+  }
+  pthread_mutex_unlock(&pFuture->mutex);
+
+  return nResult;
+}
@@ -0,0 +1,715 @@
+// io_completion.c - Implementations of the functions defined in
+// io_completion.h
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+#include "io_completion.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @brief Maximum number of packets a port keeps for reuse.
+ */
+#define IOCP_FREE_PACKETS_MAX       1024
+
+/**
+ * @brief Initial number of entries in the descriptor table of a port.
+ */
+#define IOCP_INITIAL_FD_CAPACITY    64
+
+/**
+ * @name IOWAITER_*
+ * @brief Values of IOWAITER::nState: still waiting; handed a packet; woken
+ * because the port is being destroyed.
+ */
+#define IOWAITER_WAITING            0
+#define IOWAITER_DELIVERED          1
+#define IOWAITER_SHUTDOWN           2
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief Completion waiting in the queue of a port.
+ */
+typedef struct _IOPACKET {
+  IOCOMPLETION completion;
+  struct _IOPACKET* pNext;
+} IOPACKET, *LPIOPACKET;
+
+/**
+ * @brief Thread blocked in GetQueuedCompletion.  Lives on its stack; a
+ * packet is handed to it directly rather than through the queue.
+ */
+typedef struct _IOWAITER {
+  atomic_int nState;          // IOWAITER_*; also the futex it sleeps on
+  IOCOMPLETION completion;
+  struct _IOWAITER* pNext;
+} IOWAITER, *LPIOWAITER;
+
+/**
+ * @brief What a port knows about a descriptor, indexed by the descriptor.
+ */
+typedef struct _IOFDENTRY {
+  BOOL bAssociated;
+  uint32_t nEvents;
+  uintptr_t nCompletionKey;
+} IOFDENTRY, *LPIOFDENTRY;
+
+struct _IOCOMPLETIONPORT {
+  int nEpollFd;
+  int nWakeFd;                // tells the poll threads to quit
+  int nConcurrency;
+
+  int nPollThreads;
+  HTHREAD* phPollThreads;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t condDrained;   // signalled when nBlocked drops to zero
+  BOOL bShutdown;
+  BOOL bDestroyed;            // torn down; the last running thread frees it
+  int nRunning;               // threads between two GetQueuedCompletion
+  int nBlocked;               // threads waiting in GetQueuedCompletion
+
+  LPIOPACKET pHead;
+  LPIOPACKET pTail;
+  LPIOPACKET pFreePackets;
+  int nFreePackets;
+  LPIOWAITER pWaiters;        // most recent first
+
+  LPIOFDENTRY pFds;
+  int nFdCapacity;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+/* Port that the calling thread last took a packet from, and so counts as
+ * running for.  g_runningPortKey holds the same port, so that a thread that
+ * exits gives its slot back. */
+static __thread LPIOCOMPLETIONPORT g_pRunningPort = NULL;
+static pthread_once_t g_runningPortOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_runningPortKey;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _QueueCompletion: Hands a completion to the thread that went to sleep on
+// the port most recently, if the port is below its concurrency, or else
+// queues it.  The mutex of the port must be held by the caller.
+
+BOOL _QueueCompletion(LPIOCOMPLETIONPORT pPort,
+    const IOCOMPLETION* pCompletion) {
+  LPIOWAITER pWaiter = pPort->pWaiters;
+  if (NULL != pWaiter && pPort->nRunning < pPort->nConcurrency) {
+    pPort->pWaiters = pWaiter->pNext;
+    pPort->nRunning++;
+
+    /* The waiter takes the mutex before it leaves, so it is still there
+     * to be woken once we have stored the state */
+    pWaiter->completion = *pCompletion;
+    atomic_store_explicit(&pWaiter->nState, IOWAITER_DELIVERED,
+        memory_order_release);
+    _FutexWake(&pWaiter->nState, 1);
+    return TRUE;
+  }
+
+  LPIOPACKET pPacket = pPort->pFreePackets;
+  if (NULL != pPacket) {
+    pPort->pFreePackets = pPacket->pNext;
+    pPort->nFreePackets--;
+  } else {
+    pPacket = (LPIOPACKET) malloc(sizeof(IOPACKET));
+    if (NULL == pPacket) {
+      return FALSE;
+    }
+  }
+
+  pPacket->completion = *pCompletion;
+  pPacket->pNext = NULL;
+  if (NULL == pPort->pTail) {
+    pPort->pHead = pPacket;
+  } else {
+    pPort->pTail->pNext = pPacket;
+  }
+  pPort->pTail = pPacket;
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _DequeueCompletion: Takes the packet at the head of the queue of a port.
+// The queue must not be empty, and the mutex of the port must be held by
+// the caller.
+
+void _DequeueCompletion(LPIOCOMPLETIONPORT pPort, LPIOCOMPLETION pCompletion) {
+  LPIOPACKET pPacket = pPort->pHead;
+
+  pPort->pHead = pPacket->pNext;
+  if (NULL == pPort->pHead) {
+    pPort->pTail = NULL;
+  }
+
+  *pCompletion = pPacket->completion;
+
+  if (pPort->nFreePackets < IOCP_FREE_PACKETS_MAX) {
+    pPacket->pNext = pPort->pFreePackets;
+    pPort->pFreePackets = pPacket;
+    pPort->nFreePackets++;
+  } else {
+    free(pPacket);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RemoveWaiter: Takes a waiter that timed out off the stack of waiters.
+// The mutex of the port must be held by the caller.
+
+void _RemoveWaiter(LPIOCOMPLETIONPORT pPort, LPIOWAITER pWaiter) {
+  for (LPIOWAITER* ppLink = &pPort->pWaiters; NULL != *ppLink;
+      ppLink = &(*ppLink)->pNext) {
+    if (pWaiter == *ppLink) {
+      *ppLink = pWaiter->pNext;
+      return;
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _FreeIoCompletionPort: Releases the memory and descriptors of a port
+// whose poll threads are no longer running.
+
+void _FreeIoCompletionPort(LPIOCOMPLETIONPORT pPort) {
+  if (pPort->nEpollFd >= 0) {
+    close(pPort->nEpollFd);
+  }
+  if (pPort->nWakeFd >= 0) {
+    close(pPort->nWakeFd);
+  }
+
+  LPIOPACKET apLists[2] = { pPort->pHead, pPort->pFreePackets };
+  for (int i = 0; i < 2; i++) {
+    while (NULL != apLists[i]) {
+      LPIOPACKET pNext = apLists[i]->pNext;
+      free(apLists[i]);
+      apLists[i] = pNext;
+    }
+  }
+
+  pthread_mutex_destroy(&pPort->mutex);
+  pthread_cond_destroy(&pPort->condDrained);
+
+  free(pPort->phPollThreads);
+  free(pPort->pFds);
+  free(pPort);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ReleaseRunningSlot: Gives back the slot that a thread took along with
+// its last packet, handing it on to a sleeping thread if packets are
+// queued.  Frees the port if it has been destroyed and this was the last
+// slot taken.  The mutex of the port must be held by the caller; it is
+// released.
+
+void _ReleaseRunningSlot(LPIOCOMPLETIONPORT pPort) {
+  BOOL bFree = (0 == --pPort->nRunning && pPort->bDestroyed);
+
+  /* With a waiter present and a slot free, this cannot fail */
+  if (!pPort->bShutdown && NULL != pPort->pHead
+      && NULL != pPort->pWaiters) {
+    IOCOMPLETION completion;
+    _DequeueCompletion(pPort, &completion);
+    _QueueCompletion(pPort, &completion);
+  }
+
+  pthread_mutex_unlock(&pPort->mutex);
+
+  if (bFree) {
+    _FreeIoCompletionPort(pPort);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ReleaseExitingThreadSlot: Destructor of g_runningPortKey.  Gives back the
+// slot of a thread that exits while it counts as running for a port.
+
+void _ReleaseExitingThreadSlot(void* pvPort) {
+  LPIOCOMPLETIONPORT pPort = (LPIOCOMPLETIONPORT) pvPort;
+
+  g_pRunningPort = NULL;
+
+  pthread_mutex_lock(&pPort->mutex);
+  _ReleaseRunningSlot(pPort);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CreateRunningPortKey: Creates g_runningPortKey, once.
+
+void _CreateRunningPortKey(void) {
+  pthread_key_create(&g_runningPortKey, _ReleaseExitingThreadSlot);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _SetRunningPort: Records the port the calling thread counts as running
+// for, or NULL for none.
+
+void _SetRunningPort(LPIOCOMPLETIONPORT pPort) {
+  g_pRunningPort = pPort;
+  pthread_setspecific(g_runningPortKey, pPort);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetFdEntry: Gets the entry of a descriptor in the table of a port,
+// growing the table if bGrow is set.  Returns NULL if the descriptor is out
+// of range.  The mutex of the port must be held by the caller.
+
+LPIOFDENTRY _GetFdEntry(LPIOCOMPLETIONPORT pPort, int nFd, BOOL bGrow) {
+  if (nFd < 0) {
+    return NULL;
+  }
+
+  if (nFd >= pPort->nFdCapacity) {
+    if (!bGrow) {
+      return NULL;
+    }
+
+    int nCapacity = pPort->nFdCapacity;
+    while (nCapacity <= nFd) {
+      nCapacity *= 2;
+    }
+
+    LPIOFDENTRY pFds = (LPIOFDENTRY) realloc(pPort->pFds,
+        nCapacity * sizeof(IOFDENTRY));
+    if (NULL == pFds) {
+      return NULL;
+    }
+    memset(&pFds[pPort->nFdCapacity], 0,
+        (nCapacity - pPort->nFdCapacity) * sizeof(IOFDENTRY));
+
+    pPort->pFds = pFds;
+    pPort->nFdCapacity = nCapacity;
+  }
+
+  return &pPort->pFds[nFd];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _IocpPollProc: Thread procedure of the poll threads of a port.  Moves
+// events from epoll to the port until the wake descriptor fires.
+
+void* _IocpPollProc(void* pUserState) {
+  LPIOCOMPLETIONPORT pPort = (LPIOCOMPLETIONPORT) pUserState;
+  struct epoll_event aEvents[IOCP_EVENTS_PER_POLL];
+
+  BOOL bStop = FALSE;
+  while (!bStop) {
+    int nEvents = epoll_wait(pPort->nEpollFd, aEvents, IOCP_EVENTS_PER_POLL,
+        -1);
+    if (nEvents < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      break;
+    }
+
+    /* One trip through the mutex for the whole batch */
+    pthread_mutex_lock(&pPort->mutex);
+
+    for (int i = 0; i < nEvents; i++) {
+      int nFd = aEvents[i].data.fd;
+      if (pPort->nWakeFd == nFd) {
+        bStop = TRUE;
+        continue;
+      }
+
+      /* Dissociated while the event was on its way */
+      LPIOFDENTRY pEntry = _GetFdEntry(pPort, nFd, FALSE);
+      if (NULL == pEntry || !pEntry->bAssociated) {
+        continue;
+      }
+
+      IOCOMPLETION completion;
+      completion.nFd = nFd;
+      completion.nEvents = aEvents[i].events;
+      completion.nCompletionKey = pEntry->nCompletionKey;
+      if (_QueueCompletion(pPort, &completion)) {
+        continue;
+      }
+
+      /* Out of memory.  The descriptor is disarmed now, and nobody would
+       * ever rearm it, so arm it again; readiness that is still there
+       * comes back with the next epoll_wait. */
+      struct epoll_event event;
+      memset(&event, 0, sizeof(event));
+      event.events = pEntry->nEvents | EPOLLONESHOT;
+      event.data.fd = nFd;
+      epoll_ctl(pPort->nEpollFd, EPOLL_CTL_MOD, nFd, &event);
+    }
+
+    pthread_mutex_unlock(&pPort->mutex);
+  }
+
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateIoCompletionPort function
+
+HIOCP CreateIoCompletionPort(int nConcurrency, int nPollThreads) {
+  if (nConcurrency <= 0) {
+    nConcurrency = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (nConcurrency <= 0) {
+    nConcurrency = 1;
+  }
+  if (nPollThreads <= 0) {
+    nPollThreads = 1;
+  }
+
+  pthread_once(&g_runningPortOnce, _CreateRunningPortKey);
+
+  LPIOCOMPLETIONPORT pPort = (LPIOCOMPLETIONPORT) calloc(1,
+      sizeof(IOCOMPLETIONPORT));
+  if (NULL == pPort) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  pPort->nConcurrency = nConcurrency;
+  pPort->nEpollFd = epoll_create1(EPOLL_CLOEXEC);
+  pPort->nWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  pthread_mutex_init(&pPort->mutex, NULL);
+  _InitCondition(&pPort->condDrained);
+
+  pPort->nFdCapacity = IOCP_INITIAL_FD_CAPACITY;
+  pPort->pFds = (LPIOFDENTRY) calloc(pPort->nFdCapacity, sizeof(IOFDENTRY));
+  pPort->phPollThreads = (HTHREAD*) calloc(nPollThreads, sizeof(HTHREAD));
+
+  /* The wake descriptor stays readable once written, so that every poll
+   * thread sees it */
+  struct epoll_event wakeEvent;
+  memset(&wakeEvent, 0, sizeof(wakeEvent));
+  wakeEvent.events = EPOLLIN;
+  wakeEvent.data.fd = pPort->nWakeFd;
+
+  if (pPort->nEpollFd < 0 || pPort->nWakeFd < 0 || NULL == pPort->pFds
+      || NULL == pPort->phPollThreads || OK != epoll_ctl(pPort->nEpollFd,
+          EPOLL_CTL_ADD, pPort->nWakeFd, &wakeEvent)) {
+    _FreeIoCompletionPort(pPort);
+    return INVALID_HANDLE_VALUE;
+  }
+
+  for (int i = 0; i < nPollThreads; i++) {
+    HTHREAD hThread = CreateThreadEx(_IocpPollProc, pPort);
+    if (INVALID_HANDLE_VALUE == hThread) {
+      DestroyIoCompletionPort(pPort);
+      return INVALID_HANDLE_VALUE;
+    }
+
+    SetThreadName(hThread, "tc-iocp-poll");
+    pPort->phPollThreads[pPort->nPollThreads++] = hThread;
+  }
+
+  return pPort;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyIoCompletionPort function
+
+int DestroyIoCompletionPort(HIOCP hPort) {
+  if (INVALID_HANDLE_VALUE == hPort) {
+    return EINVAL;
+  }
+
+  LPIOCOMPLETIONPORT pPort = (LPIOCOMPLETIONPORT) hPort;
+
+  pthread_mutex_lock(&pPort->mutex);
+
+  /* A worker may destroy the port it took its last packet from */
+  if (pPort == g_pRunningPort) {
+    pPort->nRunning--;
+    _SetRunningPort(NULL);
+  }
+
+  pPort->bShutdown = TRUE;
+  while (NULL != pPort->pWaiters) {
+    LPIOWAITER pWaiter = pPort->pWaiters;
+    pPort->pWaiters = pWaiter->pNext;
+    atomic_store_explicit(&pWaiter->nState, IOWAITER_SHUTDOWN,
+        memory_order_release);
+    _FutexWake(&pWaiter->nState, 1);
+  }
+
+  pthread_mutex_unlock(&pPort->mutex);
+
+  /* If the poll threads cannot be woken, cancel them instead; they only
+   * ever block in epoll_wait, which is a cancellation point.  Either way
+   * the port is torn down before the error is reported. */
+  int nResult = OK;
+  uint64_t nWake = 1;
+  if (sizeof(nWake) != write(pPort->nWakeFd, &nWake, sizeof(nWake))) {
+    nResult = errno;
+    for (int i = 0; i < pPort->nPollThreads; i++) {
+      CancelThread(pPort->phPollThreads[i]);
+    }
+  }
+
+  for (int i = 0; i < pPort->nPollThreads; i++) {
+    WaitThread(pPort->phPollThreads[i]);
+  }
+
+  /* The waiters we woke still have to get out of GetQueuedCompletion.
+   * Threads still running a packet keep the port alive until they come
+   * back for the next one, or exit. */
+  pthread_mutex_lock(&pPort->mutex);
+  while (pPort->nBlocked > 0) {
+    pthread_cond_wait(&pPort->condDrained, &pPort->mutex);
+  }
+  pPort->bDestroyed = TRUE;
+  BOOL bFree = (0 == pPort->nRunning);
+  pthread_mutex_unlock(&pPort->mutex);
+
+  if (bFree) {
+    _FreeIoCompletionPort(pPort);
+  }
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AssociateFd function
+
+int AssociateFd(HIOCP hPort, int nFd, uint32_t nEvents,
+    uintptr_t nCompletionKey) {
+  if (INVALID_HANDLE_VALUE == hPort || nFd < 0) {
+    return EINVAL;
+  }
+
+  LPIOCOMPLETIONPORT pPort = (LPIOCOMPLETIONPORT) hPort;
+  int nResult = OK;
+
+  pthread_mutex_lock(&pPort->mutex);
+
+  LPIOFDENTRY pEntry = _GetFdEntry(pPort, nFd, TRUE);
+  if (NULL == pEntry) {
+    nResult = ENOMEM;
+  } else if (pEntry->bAssociated) {
+    nResult = EEXIST;
+  } else {
+    pEntry->bAssociated = TRUE;
+    pEntry->nEvents = nEvents;
+    pEntry->nCompletionKey = nCompletionKey;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = nEvents | EPOLLONESHOT;
+    event.data.fd = nFd;
+
+    if (OK != epoll_ctl(pPort->nEpollFd, EPOLL_CTL_ADD, nFd, &event)) {
+      nResult = errno;
+      pEntry->bAssociated = FALSE;
+    }
+  }
+
+  pthread_mutex_unlock(&pPort->mutex);
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RearmFd function
+
+int RearmFd(HIOCP hPort, int nFd) {
+  if (INVALID_HANDLE_VALUE == hPort) {
+    return EINVAL;
+  }
+
+  LPIOCOMPLETIONPORT pPort = (LPIOCOMPLETIONPORT) hPort;
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.data.fd = nFd;
+
+  int nResult = OK;
+
+  pthread_mutex_lock(&pPort->mutex);
+
+  LPIOFDENTRY pEntry = _GetFdEntry(pPort, nFd, FALSE);
+  if (pPort->bShutdown) {
+    nResult = ESHUTDOWN;
+  } else if (NULL == pEntry || !pEntry->bAssociated) {
+    nResult = ENOENT;
+  } else {
+    event.events = pEntry->nEvents | EPOLLONESHOT;
+    if (OK != epoll_ctl(pPort->nEpollFd, EPOLL_CTL_MOD, nFd, &event)) {
+      nResult = errno;
+    }
+  }
+
+  pthread_mutex_unlock(&pPort->mutex);
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DissociateFd function
+
+int DissociateFd(HIOCP hPort, int nFd) {
+  if (INVALID_HANDLE_VALUE == hPort) {
+    return EINVAL;
+  }
+
+  LPIOCOMPLETIONPORT pPort = (LPIOCOMPLETIONPORT) hPort;
+  int nResult = OK;
+
+  pthread_mutex_lock(&pPort->mutex);
+
+  LPIOFDENTRY pEntry = _GetFdEntry(pPort, nFd, FALSE);
+  if (NULL == pEntry || !pEntry->bAssociated) {
+    nResult = ENOENT;
+  } else {
+    pEntry->bAssociated = FALSE;
+    if (OK != epoll_ctl(pPort->nEpollFd, EPOLL_CTL_DEL, nFd, NULL)) {
+      nResult = errno;
+    }
+  }
+
+  pthread_mutex_unlock(&pPort->mutex);
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PostQueuedCompletion function
+
+BOOL PostQueuedCompletion(HIOCP hPort, uintptr_t nCompletionKey,
+    uint32_t nEvents) {
+  if (INVALID_HANDLE_VALUE == hPort) {
+    return FALSE;
+  }
+
+  LPIOCOMPLETIONPORT pPort = (LPIOCOMPLETIONPORT) hPort;
+
+  IOCOMPLETION completion;
+  completion.nFd = -1;
+  completion.nEvents = nEvents;
+  completion.nCompletionKey = nCompletionKey;
+
+  pthread_mutex_lock(&pPort->mutex);
+  BOOL bResult = !pPort->bShutdown && _QueueCompletion(pPort, &completion);
+  pthread_mutex_unlock(&pPort->mutex);
+
+  return bResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetQueuedCompletion function
+
+int GetQueuedCompletion(HIOCP hPort, LPIOCOMPLETION pCompletion,
+    int nTimeoutMs) {
+  if (INVALID_HANDLE_VALUE == hPort || NULL == pCompletion
+      || (nTimeoutMs < 0 && INFINITE != nTimeoutMs)) {
+    return EINVAL;
+  }
+
+  LPIOCOMPLETIONPORT pPort = (LPIOCOMPLETIONPORT) hPort;
+
+  /* A thread counts as running for one port at a time */
+  LPIOCOMPLETIONPORT pOtherPort = g_pRunningPort;
+  if (NULL != pOtherPort && pPort != pOtherPort) {
+    _SetRunningPort(NULL);
+    pthread_mutex_lock(&pOtherPort->mutex);
+    _ReleaseRunningSlot(pOtherPort);
+  }
+
+  pthread_mutex_lock(&pPort->mutex);
+
+  /* Coming back for more means the last packet has been dealt with.  Once
+   * the port has been destroyed, that is all there is left to do. */
+  if (pPort == g_pRunningPort) {
+    _SetRunningPort(NULL);
+    if (pPort->bShutdown) {
+      _ReleaseRunningSlot(pPort);
+      return ESHUTDOWN;
+    }
+    pPort->nRunning--;
+  }
+
+  if (pPort->bShutdown) {
+    pthread_mutex_unlock(&pPort->mutex);
+    return ESHUTDOWN;
+  }
+
+  /* The thread that has just finished a packet is the one whose caches are
+   * warm, so it goes ahead of any thread that is asleep */
+  if (NULL != pPort->pHead && pPort->nRunning < pPort->nConcurrency) {
+    _DequeueCompletion(pPort, pCompletion);
+    pPort->nRunning++;
+    pthread_mutex_unlock(&pPort->mutex);
+
+    _SetRunningPort(pPort);
+    return OK;
+  }
+
+  if (0 == nTimeoutMs) {
+    pthread_mutex_unlock(&pPort->mutex);
+    return ETIMEDOUT;
+  }
+
+  IOWAITER waiter;
+  atomic_init(&waiter.nState, IOWAITER_WAITING);
+  waiter.pNext = pPort->pWaiters;
+  pPort->pWaiters = &waiter;
+  pPort->nBlocked++;
+
+  pthread_mutex_unlock(&pPort->mutex);
+
+  struct timespec deadline;
+  if (INFINITE != nTimeoutMs) {
+    _GetAbsoluteDeadline(nTimeoutMs, &deadline);
+  }
+
+  while (IOWAITER_WAITING == atomic_load_explicit(&waiter.nState,
+      memory_order_acquire)) {
+    if (OK != _FutexWait(&waiter.nState, IOWAITER_WAITING,
+        (INFINITE != nTimeoutMs) ? &deadline : NULL)) {
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&pPort->mutex);
+
+  int nResult = OK;
+  switch (atomic_load_explicit(&waiter.nState, memory_order_acquire)) {
+    case IOWAITER_DELIVERED:
+      *pCompletion = waiter.completion;
+      _SetRunningPort(pPort);
+      break;
+
+    case IOWAITER_WAITING:
+      _RemoveWaiter(pPort, &waiter);
+      nResult = ETIMEDOUT;
+      break;
+
+    default:
+      nResult = ESHUTDOWN;
+      break;
+  }
+
+  if (0 == --pPort->nBlocked && pPort->bShutdown) {
+    pthread_cond_broadcast(&pPort->condDrained);
+  }
+
+  pthread_mutex_unlock(&pPort->mutex);
+
+  return nResult;
+}
@@ -0,0 +1,673 @@
+// marshal_pool.c - Implementations of the functions defined in marshal_pool.h
+// along with the block allocator used by the marshalling functions.
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+#include "marshal_pool.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @brief Number of size classes.  Class k holds slots of
+ * (MARSHAL_MIN_SLOT_SIZE << k) bytes, header included.
+ */
+#define MARSHAL_SIZE_CLASSES        9
+
+/**
+ * @brief Size, in bytes, of a slot in the smallest size class.
+ */
+#define MARSHAL_MIN_SLOT_SIZE       32
+
+/**
+ * @brief Size, in bytes, of the slabs that slots are carved out of.  Slabs
+ * are aligned on their size, so this must be a power of two.
+ */
+#define MARSHAL_SLAB_SHIFT          16
+#define MARSHAL_SLAB_SIZE           (1 << MARSHAL_SLAB_SHIFT)
+
+/**
+ * @brief Number of address bits resolved by each level of the slab map.
+ * Together with MARSHAL_SLAB_SHIFT they cover a 48-bit address space.
+ */
+#define MARSHAL_MAP_BITS            16
+
+/**
+ * @brief Number of blocks moved between a thread cache and its pool at once.
+ */
+#define MARSHAL_BATCH_SIZE          32
+
+/**
+ * @brief Number of pools each thread keeps a cache for.
+ */
+#define MARSHAL_THREAD_CACHES       4
+
+/**
+ * @brief Size, in bytes, of a transparent huge page.  Large blocks at least
+ * this big are mapped on a boundary of it, so the kernel can back them with
+ * huge pages.
+ */
+#define MARSHAL_HUGE_PAGE_SIZE      (2 * 1024 * 1024)
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief Start of the mapping of a large block.  The data of the block
+ * begins on the next cache line, right after the header.
+ */
+typedef struct _MARSHALLARGEBLOCK {
+  size_t nMapSize;
+  char aPad[CACHE_LINE_SIZE - sizeof(size_t) - sizeof(MARSHALBLOCKHEADER)];
+  MARSHALBLOCKHEADER header;
+} MARSHALLARGEBLOCK, *LPMARSHALLARGEBLOCK;
+
+/**
+ * @brief Overlays the header of a slot while it sits on a free list.
+ */
+typedef struct _MARSHALFREEBLOCK {
+  struct _MARSHALFREEBLOCK* pNext;
+} MARSHALFREEBLOCK, *LPMARSHALFREEBLOCK;
+
+typedef struct _MARSHALSLAB {
+  struct _MARSHALSLAB* pNext;
+} MARSHALSLAB, *LPMARSHALSLAB;
+
+/**
+ * @brief Leaf of the slab map; one flag per slab-sized piece of address
+ * space.
+ */
+typedef atomic_uchar MARSHALMAPLEAF[1 << MARSHAL_MAP_BITS];
+typedef MARSHALMAPLEAF* LPMARSHALMAPLEAF;
+
+/**
+ * @brief One size class of a pool.  Every class sits on its own cache line
+ * so that threads refilling different classes do not contend.
+ */
+typedef struct _MARSHALCLASS {
+  CACHE_ALIGNED pthread_mutex_t mutex;
+  LPMARSHALFREEBLOCK pFree;
+  LPMARSHALSLAB pSlabs;
+  LPMARSHALPOOL pPool;
+  int nIndex;
+} MARSHALCLASS, *LPMARSHALCLASS;
+
+struct _MARSHALPOOL {
+  MARSHALCLASS aClasses[MARSHAL_SIZE_CLASSES];
+  unsigned long long nPoolID;
+  struct _MARSHALPOOL* pNextLive;
+};
+
+/**
+ * @brief Blocks of one pool that the calling thread holds on to.
+ */
+typedef struct _MARSHALCACHE {
+  unsigned long long nPoolID;   // zero if the entry is unused
+  LPMARSHALPOOL pPool;
+  LPMARSHALFREEBLOCK apFree[MARSHAL_SIZE_CLASSES];
+  int anFree[MARSHAL_SIZE_CLASSES];
+} MARSHALCACHE, *LPMARSHALCACHE;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+/* Pools that have not been destroyed; thread caches check here before they
+ * hand blocks back to a pool. */
+static pthread_mutex_t g_liveMutex = PTHREAD_MUTEX_INITIALIZER;
+static LPMARSHALPOOL g_pLivePools = NULL;
+static unsigned long long g_nNextPoolID = 1;
+
+static pthread_once_t g_defaultPoolOnce = PTHREAD_ONCE_INIT;
+static LPMARSHALPOOL g_pDefaultPool = NULL;
+
+static pthread_once_t g_cacheKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_cacheKey;
+
+/* Two-level map of the address space that tells whether an address lies in
+ * a slab, so that blocks can be told apart from ordinary heap blocks
+ * without peeking at memory that might not belong to us. */
+static pthread_mutex_t g_slabMapMutex = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(LPMARSHALMAPLEAF) g_apSlabMap[1 << MARSHAL_MAP_BITS];
+
+static __thread MARSHALCACHE g_aCaches[MARSHAL_THREAD_CACHES];
+static __thread int g_nNextEviction = 0;
+static __thread BOOL g_bCacheKeySet = FALSE;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+void _FlushMarshalCache(LPMARSHALCACHE pCache);
+
+///////////////////////////////////////////////////////////////////////////////
+// _MakeBlockCookie: Computes the cookie that marks the header at pHeader as
+// belonging to a marshalled block of the specified kind.
+
+static inline uintptr_t _MakeBlockCookie(LPMARSHALBLOCKHEADER pHeader,
+    int nKind) {
+  return ((MARSHAL_BLOCK_MAGIC ^ (uintptr_t) pHeader)
+      & ~(uintptr_t) MARSHAL_BLOCK_KIND_MASK) | (uintptr_t) nKind;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _IsInSlab: Gets whether an address lies inside of a slab of any pool.
+
+BOOL _IsInSlab(void* pv) {
+  uintptr_t nSlab = (uintptr_t) pv >> MARSHAL_SLAB_SHIFT;
+  uintptr_t nRoot = nSlab >> MARSHAL_MAP_BITS;
+  if (nRoot >= (1 << MARSHAL_MAP_BITS)) {
+    return FALSE;
+  }
+
+  LPMARSHALMAPLEAF pLeaf = atomic_load_explicit(&g_apSlabMap[nRoot],
+      memory_order_acquire);
+  if (NULL == pLeaf) {
+    return FALSE;
+  }
+
+  return 0 != atomic_load_explicit(
+      &(*pLeaf)[nSlab & ((1 << MARSHAL_MAP_BITS) - 1)], memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _SetSlabMapEntry: Marks a slab (or the first slab-sized piece of a large
+// block) as present in, or absent from, the slab map.
+
+BOOL _SetSlabMapEntry(void* pvSlab, BOOL bPresent) {
+  uintptr_t nSlab = (uintptr_t) pvSlab >> MARSHAL_SLAB_SHIFT;
+  uintptr_t nRoot = nSlab >> MARSHAL_MAP_BITS;
+  if (nRoot >= (1 << MARSHAL_MAP_BITS)) {
+    return FALSE;   // beyond 48 bits; the slab cannot be used
+  }
+
+  LPMARSHALMAPLEAF pLeaf = atomic_load_explicit(&g_apSlabMap[nRoot],
+      memory_order_acquire);
+  if (NULL == pLeaf) {
+    if (!bPresent) {
+      return TRUE;
+    }
+
+    pthread_mutex_lock(&g_slabMapMutex);
+    pLeaf = atomic_load_explicit(&g_apSlabMap[nRoot], memory_order_relaxed);
+    if (NULL == pLeaf) {
+      pLeaf = (LPMARSHALMAPLEAF) calloc(1, sizeof(MARSHALMAPLEAF));
+      if (NULL == pLeaf) {
+        pthread_mutex_unlock(&g_slabMapMutex);
+        return FALSE;
+      }
+      atomic_store_explicit(&g_apSlabMap[nRoot], pLeaf,
+          memory_order_release);
+    }
+    pthread_mutex_unlock(&g_slabMapMutex);
+  }
+
+  atomic_store_explicit(&(*pLeaf)[nSlab & ((1 << MARSHAL_MAP_BITS) - 1)],
+      bPresent ? 1 : 0, memory_order_relaxed);
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetBlockHeader: Gets the header of a marshalled block from the address of
+// its data, or NULL if the address does not belong to a marshalled block.
+
+LPMARSHALBLOCKHEADER _GetBlockHeader(void* pvData) {
+  if (NULL == pvData || !_IsInSlab(pvData)) {
+    return NULL;
+  }
+
+  LPMARSHALBLOCKHEADER pHeader = (LPMARSHALBLOCKHEADER) pvData - 1;
+  int nKind = (int) (pHeader->nCookie & MARSHAL_BLOCK_KIND_MASK);
+  if (0 == nKind || pHeader->nCookie != _MakeBlockCookie(pHeader, nKind)) {
+    return NULL;
+  }
+
+  return pHeader;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetBlockKind: Gets how a marshalled block was allocated.
+
+int _GetBlockKind(LPMARSHALBLOCKHEADER pHeader) {
+  return (int) (pHeader->nCookie & MARSHAL_BLOCK_KIND_MASK);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _SetBlockKind: Stamps the header of a block with its cookie.
+
+void _SetBlockKind(LPMARSHALBLOCKHEADER pHeader, int nKind) {
+  pHeader->nCookie = _MakeBlockCookie(pHeader, nKind);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _DestroyCacheKey: Called by the system when a thread that used a pool
+// terminates; hands its cached blocks back.
+
+void _DestroyCacheKey(void* pvValue) {
+  (void) pvValue;
+
+  for (int i = 0; i < MARSHAL_THREAD_CACHES; i++) {
+    _FlushMarshalCache(&g_aCaches[i]);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CreateCacheKey: Creates the key whose destructor flushes thread caches.
+
+void _CreateCacheKey(void) {
+  pthread_key_create(&g_cacheKey, _DestroyCacheKey);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CreateDefaultPool: Creates the pool that MarshalBlockToThread uses.
+
+void _CreateDefaultPool(void) {
+  g_pDefaultPool = CreateMarshalPool();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetSizeClass: Gets the size class that fits a block of nBlockSize bytes,
+// or ERROR if it is too big for any class.
+
+int _GetSizeClass(size_t nBlockSize) {
+  size_t nSlotSize = nBlockSize + sizeof(MARSHALBLOCKHEADER);
+  size_t nClassSize = MARSHAL_MIN_SLOT_SIZE;
+
+  for (int i = 0; i < MARSHAL_SIZE_CLASSES; i++, nClassSize <<= 1) {
+    if (nSlotSize <= nClassSize) {
+      return i;
+    }
+  }
+
+  return ERROR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _PushBlocks: Hands a chain of blocks back to their size class.  The chain
+// runs from pFirst to pLast.
+
+void _PushBlocks(LPMARSHALCLASS pClass, LPMARSHALFREEBLOCK pFirst,
+    LPMARSHALFREEBLOCK pLast) {
+  pthread_mutex_lock(&pClass->mutex);
+  pLast->pNext = pClass->pFree;
+  pClass->pFree = pFirst;
+  pthread_mutex_unlock(&pClass->mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _FlushMarshalCache: Returns every block in a thread cache to its pool, if
+// the pool still exists, and clears the cache.
+
+void _FlushMarshalCache(LPMARSHALCACHE pCache) {
+  if (0 == pCache->nPoolID) {
+    return;
+  }
+
+  pthread_mutex_lock(&g_liveMutex);
+
+  LPMARSHALPOOL pPool = g_pLivePools;
+  while (NULL != pPool && pPool->nPoolID != pCache->nPoolID) {
+    pPool = pPool->pNextLive;
+  }
+
+  for (int i = 0; NULL != pPool && i < MARSHAL_SIZE_CLASSES; i++) {
+    LPMARSHALFREEBLOCK pFirst = pCache->apFree[i];
+    if (NULL == pFirst) {
+      continue;
+    }
+
+    LPMARSHALFREEBLOCK pLast = pFirst;
+    while (NULL != pLast->pNext) {
+      pLast = pLast->pNext;
+    }
+
+    _PushBlocks(&pPool->aClasses[i], pFirst, pLast);
+  }
+
+  pthread_mutex_unlock(&g_liveMutex);
+
+  memset(pCache, 0, sizeof(MARSHALCACHE));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetMarshalCache: Gets the calling thread's cache for a pool, setting one up
+// (and evicting another pool's if need be) the first time around.
+
+LPMARSHALCACHE _GetMarshalCache(LPMARSHALPOOL pPool) {
+  LPMARSHALCACHE pFree = NULL;
+
+  for (int i = 0; i < MARSHAL_THREAD_CACHES; i++) {
+    LPMARSHALCACHE pCache = &g_aCaches[i];
+    if (pCache->pPool == pPool && pCache->nPoolID == pPool->nPoolID) {
+      return pCache;
+    }
+
+    if (NULL == pFree && 0 == pCache->nPoolID) {
+      pFree = pCache;
+    }
+  }
+
+  if (!g_bCacheKeySet) {
+    pthread_once(&g_cacheKeyOnce, _CreateCacheKey);
+    pthread_setspecific(g_cacheKey, g_aCaches);
+    g_bCacheKeySet = TRUE;
+  }
+
+  if (NULL == pFree) {
+    pFree = &g_aCaches[g_nNextEviction];
+    g_nNextEviction = (g_nNextEviction + 1) % MARSHAL_THREAD_CACHES;
+    _FlushMarshalCache(pFree);
+  }
+
+  pFree->pPool = pPool;
+  pFree->nPoolID = pPool->nPoolID;
+
+  return pFree;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AddSlab: Carves a new slab into free blocks of a size class.  The mutex of
+// the class must be held by the caller.
+
+BOOL _AddSlab(LPMARSHALCLASS pClass) {
+  LPMARSHALSLAB pSlab = NULL;
+  if (OK != posix_memalign((void**) &pSlab, MARSHAL_SLAB_SIZE,
+      MARSHAL_SLAB_SIZE)) {
+    return FALSE;
+  }
+
+  if (!_SetSlabMapEntry(pSlab, TRUE)) {
+    free(pSlab);
+    return FALSE;
+  }
+
+  pSlab->pNext = pClass->pSlabs;
+  pClass->pSlabs = pSlab;
+
+  size_t nSlotSize = (size_t) MARSHAL_MIN_SLOT_SIZE << pClass->nIndex;
+  char* pSlot = (char*) pSlab + CACHE_LINE_SIZE;
+  char* pEnd = (char*) pSlab + MARSHAL_SLAB_SIZE;
+
+  for (; pSlot + nSlotSize <= pEnd; pSlot += nSlotSize) {
+    LPMARSHALFREEBLOCK pBlock = (LPMARSHALFREEBLOCK) pSlot;
+    pBlock->pNext = pClass->pFree;
+    pClass->pFree = pBlock;
+  }
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RefillMarshalCache: Moves a batch of blocks from a size class of a pool to
+// the calling thread's cache.
+
+BOOL _RefillMarshalCache(LPMARSHALCACHE pCache, int nClass) {
+  LPMARSHALCLASS pClass = &pCache->pPool->aClasses[nClass];
+
+  pthread_mutex_lock(&pClass->mutex);
+
+  if (NULL == pClass->pFree && !_AddSlab(pClass)) {
+    pthread_mutex_unlock(&pClass->mutex);
+    return FALSE;
+  }
+
+  LPMARSHALFREEBLOCK pFirst = pClass->pFree;
+  LPMARSHALFREEBLOCK pLast = pFirst;
+  int nTaken = 1;
+  while (nTaken < MARSHAL_BATCH_SIZE && NULL != pLast->pNext) {
+    pLast = pLast->pNext;
+    nTaken++;
+  }
+
+  pClass->pFree = pLast->pNext;
+  pthread_mutex_unlock(&pClass->mutex);
+
+  pLast->pNext = pCache->apFree[nClass];
+  pCache->apFree[nClass] = pFirst;
+  pCache->anFree[nClass] += nTaken;
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AllocLargeMarshalBlock: Maps a block of its own for nBlockSize bytes of
+// data.  The mapping starts on a slab boundary, so the slab map can tell it
+// from the heap just like a slab, and on a huge page boundary if it is big
+// enough to use huge pages.  Returns NULL if the system is out of mappings.
+
+void* _AllocLargeMarshalBlock(size_t nBlockSize) {
+  if (nBlockSize > SIZE_MAX - sizeof(MARSHALLARGEBLOCK)
+      - MARSHAL_HUGE_PAGE_SIZE) {
+    return NULL;
+  }
+
+  size_t nPageSize = (size_t) sysconf(_SC_PAGESIZE);
+  size_t nMapSize = (sizeof(MARSHALLARGEBLOCK) + nBlockSize + nPageSize - 1)
+      & ~(nPageSize - 1);
+  size_t nAlignment = (nMapSize >= MARSHAL_HUGE_PAGE_SIZE)
+      ? MARSHAL_HUGE_PAGE_SIZE : MARSHAL_SLAB_SIZE;
+
+  /* Map more than we need and trim both ends down to an aligned range */
+  char* pMap = (char*) mmap(NULL, nMapSize + nAlignment,
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == pMap) {
+    return NULL;
+  }
+
+  char* pBase = (char*) (((uintptr_t) pMap + nAlignment - 1)
+      & ~((uintptr_t) nAlignment - 1));
+  if (pBase > pMap) {
+    munmap(pMap, pBase - pMap);
+  }
+  if (pBase + nMapSize < pMap + nMapSize + nAlignment) {
+    munmap(pBase + nMapSize, pMap + nMapSize + nAlignment
+        - (pBase + nMapSize));
+  }
+
+#ifdef MADV_HUGEPAGE
+  if (MARSHAL_HUGE_PAGE_SIZE == nAlignment) {
+    madvise(pBase, nMapSize, MADV_HUGEPAGE);  // only a hint
+  }
+#endif //MADV_HUGEPAGE
+
+  if (!_SetSlabMapEntry(pBase, TRUE)) {
+    munmap(pBase, nMapSize);
+    return NULL;
+  }
+
+  LPMARSHALLARGEBLOCK pLarge = (LPMARSHALLARGEBLOCK) pBase;
+  pLarge->nMapSize = nMapSize;
+  pLarge->header.pClass = NULL;
+  _SetBlockKind(&pLarge->header, MARSHAL_BLOCK_LARGE);
+
+  return &pLarge->header + 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _FreeLargeMarshalBlock: Gives the mapping of a large block back to the
+// system.
+
+void _FreeLargeMarshalBlock(LPMARSHALBLOCKHEADER pHeader) {
+  LPMARSHALLARGEBLOCK pLarge = (LPMARSHALLARGEBLOCK) ((char*) pHeader
+      - offsetof(MARSHALLARGEBLOCK, header));
+
+  /* Out of the map first, so nobody takes the range for a block once it
+   * has been reused */
+  _SetSlabMapEntry(pLarge, FALSE);
+  munmap(pLarge, pLarge->nMapSize);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AllocMarshalBlock: Allocates storage for a marshalled block of nBlockSize
+// bytes from a pool (or from the default pool, if pPool is NULL).  Shared
+// with the other modules of this library.
+
+void* _AllocMarshalBlock(LPMARSHALPOOL pPool, size_t nBlockSize) {
+  if (NULL == pPool) {
+    pthread_once(&g_defaultPoolOnce, _CreateDefaultPool);
+    pPool = g_pDefaultPool;
+  }
+
+  if (nBlockSize >= MARSHAL_LARGE_BLOCK_SIZE) {
+    void* pvData = _AllocLargeMarshalBlock(nBlockSize);
+    if (NULL != pvData) {
+      return pvData;
+    }
+    /* Out of mappings; the heap may still have room */
+  }
+
+  int nClass = _GetSizeClass(nBlockSize);
+  if (ERROR == nClass || NULL == pPool) {
+    /* Too big for the slabs; an ordinary heap block it is.  Releasing it
+     * goes down the same path as any other heap block. */
+    return malloc(nBlockSize);
+  }
+
+  LPMARSHALCACHE pCache = _GetMarshalCache(pPool);
+  if (NULL == pCache->apFree[nClass]
+      && !_RefillMarshalCache(pCache, nClass)) {
+    return malloc(nBlockSize);
+  }
+
+  LPMARSHALFREEBLOCK pBlock = pCache->apFree[nClass];
+  pCache->apFree[nClass] = pBlock->pNext;
+  pCache->anFree[nClass]--;
+
+  LPMARSHALBLOCKHEADER pHeader = (LPMARSHALBLOCKHEADER) pBlock;
+  pHeader->pClass = &pPool->aClasses[nClass];
+  _SetBlockKind(pHeader, MARSHAL_BLOCK_POOLED);
+
+  return pHeader + 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _FreeMarshalBlock: Releases the storage of a marshalled block, whatever its
+// kind.  Addresses that did not come from _AllocMarshalBlock are assumed to
+// be ordinary heap blocks and are passed to free(), as they always have been.
+// Shared with the other modules of this library.
+
+void _FreeMarshalBlock(void* pvData) {
+  if (!_IsInSlab(pvData)) {
+    free(pvData);
+    return;
+  }
+
+  LPMARSHALBLOCKHEADER pHeader = _GetBlockHeader(pvData);
+  if (NULL == pHeader) {
+    /* Inside of a slab but not a live block: released twice */
+    ThrowMarshalingException(ERROR_INVALID_MARSHALLED_BLOCK);
+    return;
+  }
+
+  if (MARSHAL_BLOCK_LARGE == _GetBlockKind(pHeader)) {
+    _FreeLargeMarshalBlock(pHeader);
+    return;
+  }
+
+  LPMARSHALCLASS pClass = pHeader->pClass;
+  LPMARSHALCACHE pCache = _GetMarshalCache(pClass->pPool);
+  int nClass = pClass->nIndex;
+
+  /* Overwriting the header also wipes the cookie, so a second release of
+   * the same block is caught above. */
+  LPMARSHALFREEBLOCK pBlock = (LPMARSHALFREEBLOCK) pHeader;
+  pBlock->pNext = pCache->apFree[nClass];
+  pCache->apFree[nClass] = pBlock;
+
+  if (++pCache->anFree[nClass] < 2 * MARSHAL_BATCH_SIZE) {
+    return;
+  }
+
+  /* This thread is mostly releasing blocks that other threads allocated;
+   * hand a batch back so the pool does not run dry elsewhere. */
+  LPMARSHALFREEBLOCK pLast = pBlock;
+  for (int i = 1; i < MARSHAL_BATCH_SIZE; i++) {
+    pLast = pLast->pNext;
+  }
+
+  pCache->apFree[nClass] = pLast->pNext;
+  pCache->anFree[nClass] -= MARSHAL_BATCH_SIZE;
+  _PushBlocks(pClass, pBlock, pLast);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateMarshalPool function
+
+HMARSHALPOOL CreateMarshalPool(void) {
+  LPMARSHALPOOL pPool = NULL;
+  if (OK != posix_memalign((void**) &pPool, CACHE_LINE_SIZE,
+      sizeof(MARSHALPOOL))) {
+    return NULL;
+  }
+  memset(pPool, 0, sizeof(MARSHALPOOL));
+
+  for (int i = 0; i < MARSHAL_SIZE_CLASSES; i++) {
+    pthread_mutex_init(&pPool->aClasses[i].mutex, NULL);
+    pPool->aClasses[i].pPool = pPool;
+    pPool->aClasses[i].nIndex = i;
+  }
+
+  pthread_mutex_lock(&g_liveMutex);
+  pPool->nPoolID = g_nNextPoolID++;
+  pPool->pNextLive = g_pLivePools;
+  g_pLivePools = pPool;
+  pthread_mutex_unlock(&g_liveMutex);
+
+  return (HMARSHALPOOL) pPool;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyMarshalPool function
+
+void DestroyMarshalPool(HMARSHALPOOL hPool) {
+  if (NULL == hPool) {
+    return;
+  }
+
+  LPMARSHALPOOL pPool = (LPMARSHALPOOL) hPool;
+  if (pPool == g_pDefaultPool) {
+    return;
+  }
+
+  /* Once the pool is off of the live list, no thread cache will hand
+   * blocks back to it any more. */
+  pthread_mutex_lock(&g_liveMutex);
+  LPMARSHALPOOL* ppLink = &g_pLivePools;
+  while (NULL != *ppLink && *ppLink != pPool) {
+    ppLink = &(*ppLink)->pNextLive;
+  }
+  if (NULL != *ppLink) {
+    *ppLink = pPool->pNextLive;
+  }
+  pthread_mutex_unlock(&g_liveMutex);
+
+  /* Our own cache for the pool is stale now; forget it without touching
+   * the blocks in it. */
+  for (int i = 0; i < MARSHAL_THREAD_CACHES; i++) {
+    if (g_aCaches[i].nPoolID == pPool->nPoolID) {
+      memset(&g_aCaches[i], 0, sizeof(MARSHALCACHE));
+    }
+  }
+
+  for (int i = 0; i < MARSHAL_SIZE_CLASSES; i++) {
+    LPMARSHALCLASS pClass = &pPool->aClasses[i];
+
+    while (NULL != pClass->pSlabs) {
+      LPMARSHALSLAB pNext = pClass->pSlabs->pNext;
+      _SetSlabMapEntry(pClass->pSlabs, FALSE);
+      free(pClass->pSlabs);
+      pClass->pSlabs = pNext;
+    }
+
+    pthread_mutex_destroy(&pClass->mutex);
+  }
+
+  free(pPool);
+}
@@ -6,11 +6,153 @@
 
 #include "marshalling_functions.h"
 #include "threading_core.h"
+#include "threading_core_internal.h"
 #include "threading_core_symbols.h"
 
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @brief Largest size, in bytes, of a marshalled block.  Anything bigger is
+ * far more likely to be a negative int that was converted to a size_t than
+ * a real request.
+ */
+#define MARSHAL_MAX_BLOCK_SIZE    ((size_t) PTRDIFF_MAX)
+
 ///////////////////////////////////////////////////////////////////////////////
 // Internal-use-only functions
 
+///////////////////////////////////////////////////////////////////////////////
+// _CopyMarshalledData: Copies the data of a marshalled block.  A large copy
+// is streamed to its destination with non-temporal stores, so that it
+// neither evicts the working set of the calling thread nor has to read in
+// the destination lines first.  Shared with the other modules of this
+// library.
+
+void* _CopyMarshalledData(void* pvDest, const void* pvSource, size_t nSize) {
+  uintptr_t nDest = (uintptr_t) pvDest;
+  uintptr_t nSource = (uintptr_t) pvSource;
+
+  if (nSize < MARSHAL_LARGE_BLOCK_SIZE
+      || (nDest < nSource + nSize && nSource < nDest + nSize)) {
+    return memmove(pvDest, pvSource, nSize);
+  }
+
+#ifdef __SSE2__
+  char* pDest = (char*) pvDest;
+  const char* pSource = (const char*) pvSource;
+
+  /* Streaming stores must be aligned; line up the destination first */
+  size_t nHead = (16 - (nDest & 15)) & 15;
+  memcpy(pDest, pSource, nHead);
+  pDest += nHead;
+  pSource += nHead;
+  nSize -= nHead;
+
+  for (; nSize >= 64; nSize -= 64, pDest += 64, pSource += 64) {
+    __m128i v0 = _mm_loadu_si128((const __m128i*) pSource);
+    __m128i v1 = _mm_loadu_si128((const __m128i*) (pSource + 16));
+    __m128i v2 = _mm_loadu_si128((const __m128i*) (pSource + 32));
+    __m128i v3 = _mm_loadu_si128((const __m128i*) (pSource + 48));
+    _mm_stream_si128((__m128i*) pDest, v0);
+    _mm_stream_si128((__m128i*) (pDest + 16), v1);
+    _mm_stream_si128((__m128i*) (pDest + 32), v2);
+    _mm_stream_si128((__m128i*) (pDest + 48), v3);
+  }
+
+  /* Streaming stores are not ordered with the ones that hand the block to
+   * another thread, so make sure they are visible before we return */
+  _mm_sfence();
+
+  memcpy(pDest, pSource, nSize);
+
+  return pvDest;
+#else
+  return memcpy(pvDest, pvSource, nSize);
+#endif //__SSE2__
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CreateEnvelope: Wraps a buffer in an envelope of the specified kind
+// (MARSHAL_BLOCK_TRANSFER or MARSHAL_BLOCK_SHARED).
+
+LPMARSHALENVELOPE _CreateEnvelope(void* pvBuffer, size_t nBlockSize,
+    LPRELEASE_BLOCK_ROUTINE lpfnRelease, int nKind, int nRefCount) {
+  if (pvBuffer == NULL) {
+    ThrowArgumentException("pvBuffer");
+  }
+
+  if (nBlockSize == 0 || nBlockSize > MARSHAL_MAX_BLOCK_SIZE) {
+    ThrowArgumentOutOfRangeException("nBlockSize");
+  }
+
+  LPMARSHALENVELOPE pEnvelope = (LPMARSHALENVELOPE) _AllocMarshalBlock(
+      NULL /* default pool */, sizeof(MARSHALENVELOPE));
+  if (pEnvelope == NULL) {
+    ThrowMarshalingException(ERROR_FAILED_TO_MARSHAL_BLOCK);
+  }
+
+  /* The kind of the block is what tells an envelope from copied data, so it
+   * must have come from a slot; a heap block is no use. */
+  LPMARSHALBLOCKHEADER pHeader = _GetBlockHeader(pEnvelope);
+  if (pHeader == NULL) {
+    free(pEnvelope);
+    ThrowMarshalingException(ERROR_FAILED_TO_MARSHAL_BLOCK);
+  }
+
+  pEnvelope->pvBuffer = pvBuffer;
+  pEnvelope->nBlockSize = nBlockSize;
+  pEnvelope->lpfnRelease = (lpfnRelease != NULL) ? lpfnRelease : free;
+  atomic_init(&pEnvelope->nRefCount, nRefCount);
+
+  _SetBlockKind(pHeader, nKind);
+
+  return pEnvelope;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetEnvelope: Gets the envelope at pvData, or NULL if pvData is not a live
+// envelope of the specified kind.
+
+LPMARSHALENVELOPE _GetEnvelope(void* pvData, int nKind) {
+  LPMARSHALBLOCKHEADER pHeader = _GetBlockHeader(pvData);
+  if (pHeader == NULL || _GetBlockKind(pHeader) != nKind) {
+    return NULL;
+  }
+
+  return (LPMARSHALENVELOPE) pvData;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ReleaseMarshalledBlock: Releases a marshalled block of any kind, along
+// with whatever it refers to.
+
+void _ReleaseMarshalledBlock(void* pvData) {
+  LPMARSHALBLOCKHEADER pHeader = _GetBlockHeader(pvData);
+  int nKind = (pHeader != NULL) ? _GetBlockKind(pHeader) : MARSHAL_BLOCK_POOLED;
+
+  LPMARSHALENVELOPE pEnvelope = (LPMARSHALENVELOPE) pvData;
+
+  switch (nKind) {
+    case MARSHAL_BLOCK_TRANSFER:
+      pEnvelope->lpfnRelease(pEnvelope->pvBuffer);
+      break;
+
+    case MARSHAL_BLOCK_SHARED:
+      if (atomic_fetch_sub_explicit(&pEnvelope->nRefCount, 1,
+          memory_order_acq_rel) > 1) {
+        return;   // other consumers still hold references
+      }
+      pEnvelope->lpfnRelease(pEnvelope->pvBuffer);
+      break;
+
+    default:
+      break;
+  }
+
+  _FreeMarshalBlock(pvData);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Publicly-exposed functions
 
@@ -22,12 +164,20 @@
 // heap block provided will simply be duplicated, which might not be what you
 // want.
 
-void* MarshalBlockToThread(void* pvData, int nBlockSize) {
+void* MarshalBlockToThread(void* pvData, size_t nBlockSize) {
+  return MarshalBlockToThreadEx(NULL /* hPool */, pvData, nBlockSize);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MarshalBlockToThreadEx function
+
+void* MarshalBlockToThreadEx(HMARSHALPOOL hPool, void* pvData,
+    size_t nBlockSize) {
   // OKAY, so we have the address of some data, and the data block is
   // supposedly on the stack frame of the caller (which obviously, the address
   // of has been placed on OUR stack frame just now by the compiler).
   //
-  // So we allocate nBlockSize bytes of memory on the heap, and then
+  // So we allocate nBlockSize bytes of memory from the pool, and then
   // we copy the contents of the block pointed to by pvData into that memory
   // and then return the address of the newly-allocated and initialized memory
   // block. I had thought about doing a realloc here instead of malloc;
@@ -39,29 +189,108 @@ void* MarshalBlockToThread(void* pvData, int nBlockSize) {
     ThrowArgumentException("pvData");
   }
 
-  if (nBlockSize <= 0) {
+  if (nBlockSize == 0 || nBlockSize > MARSHAL_MAX_BLOCK_SIZE) {
     ThrowArgumentOutOfRangeException("nBlockSize");
   }
 
-  void* pvResult = malloc(nBlockSize);
+  BOOL bTrace = _IsThreadTraceEnabled();
+  uint64_t nStartTicks = bTrace ? _GetTraceTicks() : 0;
+
+  void* pvResult = _AllocMarshalBlock((LPMARSHALPOOL) hPool, nBlockSize);
   if (pvResult == NULL) {
     ThrowMarshalingException(ERROR_FAILED_TO_MARSHAL_BLOCK);
   }
 
+  if (_IsThreadingStatsEnabled()) {
+    _AddThreadingStat(THREADING_STAT_MARSHAL_CALLS, 1);
+    _AddThreadingStat(THREADING_STAT_MARSHAL_BYTES, (uint64_t) nBlockSize);
+  }
+
   /* Transfer the data values from the source block to the
-   * newly-allocated block.  Use memmove just in case. */
-  if (memmove(pvResult, pvData, nBlockSize) == NULL) {
+   * newly-allocated block.  Overlaps are handled just in case. */
+  if (_CopyMarshalledData(pvResult, pvData, nBlockSize) == NULL) {
     ThrowMarshalingException(ERROR_FAILED_TO_MARSHAL_BLOCK);
   }
 
+  if (bTrace) {
+    _RecordTraceSpan(TRACE_EVENT_MARSHAL, nStartTicks, nBlockSize);
+  }
+
   return pvResult;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// MarshalBlocksToThread function
+
+void* MarshalBlocksToThread(const struct iovec* pBlocks, int nBlockCount) {
+  return MarshalBlocksToThreadEx(NULL /* hPool */, pBlocks, nBlockCount);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MarshalBlocksToThreadEx function
+
+void* MarshalBlocksToThreadEx(HMARSHALPOOL hPool,
+    const struct iovec* pBlocks, int nBlockCount) {
+  if (pBlocks == NULL) {
+    ThrowArgumentException("pBlocks");
+  }
+
+  if (nBlockCount <= 0) {
+    ThrowArgumentOutOfRangeException("nBlockCount");
+  }
+
+  size_t nTotalSize = 0;
+  for (int i = 0; i < nBlockCount; i++) {
+    if (pBlocks[i].iov_len > 0 && pBlocks[i].iov_base == NULL) {
+      ThrowArgumentException("pBlocks");
+    }
+    if (pBlocks[i].iov_len > MARSHAL_MAX_BLOCK_SIZE - nTotalSize) {
+      ThrowArgumentOutOfRangeException("pBlocks");
+    }
+    nTotalSize += pBlocks[i].iov_len;
+  }
+
+  if (nTotalSize == 0) {
+    ThrowArgumentOutOfRangeException("pBlocks");
+  }
+
+  BOOL bTrace = _IsThreadTraceEnabled();
+  uint64_t nStartTicks = bTrace ? _GetTraceTicks() : 0;
+
+  char* pResult = (char*) _AllocMarshalBlock((LPMARSHALPOOL) hPool,
+      nTotalSize);
+  if (pResult == NULL) {
+    ThrowMarshalingException(ERROR_FAILED_TO_MARSHAL_BLOCK);
+  }
+
+  if (_IsThreadingStatsEnabled()) {
+    _AddThreadingStat(THREADING_STAT_MARSHAL_CALLS, 1);
+    _AddThreadingStat(THREADING_STAT_MARSHAL_BYTES, (uint64_t) nTotalSize);
+  }
+
+  /* Each fragment is copied on its own merits: the big ones are streamed,
+   * the small ones go through the cache */
+  size_t nOffset = 0;
+  for (int i = 0; i < nBlockCount; i++) {
+    if (pBlocks[i].iov_len > 0) {
+      _CopyMarshalledData(pResult + nOffset, pBlocks[i].iov_base,
+          pBlocks[i].iov_len);
+      nOffset += pBlocks[i].iov_len;
+    }
+  }
+
+  if (bTrace) {
+    _RecordTraceSpan(TRACE_EVENT_MARSHAL, nStartTicks, nTotalSize);
+  }
+
+  return pResult;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // DeMarshalBlockFromThread function
 
 void DeMarshalBlockFromThread(void* pvDest, void* pvData,
-    int nDataSize) {
+    size_t nDataSize) {
   if (pvDest == NULL) {
     ThrowArgumentException("pvDest");
   }
@@ -70,24 +299,146 @@ void DeMarshalBlockFromThread(void* pvDest, void* pvData,
     ThrowArgumentException("pvData");
   }
 
-  if (nDataSize <= 0) {
+  if (nDataSize == 0 || nDataSize > MARSHAL_MAX_BLOCK_SIZE) {
     ThrowArgumentOutOfRangeException("nDataSize");
   }
 
+  BOOL bTrace = _IsThreadTraceEnabled();
+  uint64_t nStartTicks = bTrace ? _GetTraceTicks() : 0;
+
+  /* If pvData is an envelope, the data lives in the buffer it refers to,
+   * rather than in the block itself. */
+  void* pvSource = pvData;
+  LPMARSHALBLOCKHEADER pHeader = _GetBlockHeader(pvData);
+  if (pHeader != NULL && (_GetBlockKind(pHeader) == MARSHAL_BLOCK_TRANSFER
+      || _GetBlockKind(pHeader) == MARSHAL_BLOCK_SHARED)) {
+    LPMARSHALENVELOPE pEnvelope = (LPMARSHALENVELOPE) pvData;
+    if (nDataSize > pEnvelope->nBlockSize) {
+      ThrowArgumentOutOfRangeException("nDataSize");
+    }
+    pvSource = pEnvelope->pvBuffer;
+  }
+
   /* Copy the data from the heap location (which we assume is referenced
    * by pvData) to the location referenced by pvDest (which we assume is
-   * on the local stack frame of the calling function.)  We use memmove
-   * to try and account for overlaps. */
-  if (memmove(pvDest, pvData, nDataSize) == NULL) {
+   * on the local stack frame of the calling function.)  Overlaps are
+   * accounted for, as memmove would. */
+  if (_CopyMarshalledData(pvDest, pvSource, nDataSize) == NULL) {
     ThrowMarshalingException(ERROR_FAILED_TO_DEMARSHAL_BLOCK);
   }
 
-  /* Call free on the pvData pointer since we assume it's on the heap...
-   * but now, we no longer need access to that memory. NOTE: Since
+  /* Release the pvData pointer since we assume it's on the heap (or in a
+   * marshalling pool)... but now, we no longer need access to that memory.
+   * Blocks that did not come from MarshalBlockToThread are simply passed to
+   * free(), as they always have been.  NOTE: Since
    * pvData was an address that was passed by value to this function,
    * any points that the caller has to the data will be useless after
    * this function is done executing. Callers should take care to set
    * any externally passed value for pvData to NULL in their code after
    * this function returns. */
-  free(pvData);
+  _ReleaseMarshalledBlock(pvData);
+
+  if (bTrace) {
+    _RecordTraceSpan(TRACE_EVENT_DEMARSHAL, nStartTicks, nDataSize);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeMarshalledBlock function
+
+void FreeMarshalledBlock(void* pvData) {
+  if (NULL == pvData) {
+    return;
+  }
+
+  _ReleaseMarshalledBlock(pvData);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TransferBlockToThread function
+
+void* TransferBlockToThread(void* pvBuffer, size_t nBlockSize,
+    LPRELEASE_BLOCK_ROUTINE lpfnRelease) {
+  return _CreateEnvelope(pvBuffer, nBlockSize, lpfnRelease,
+      MARSHAL_BLOCK_TRANSFER, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AcceptTransferredBlock function
+
+void* AcceptTransferredBlock(void* pvEnvelope, size_t* pnBlockSize,
+    LPRELEASE_BLOCK_ROUTINE* plpfnRelease) {
+  LPMARSHALENVELOPE pEnvelope = _GetEnvelope(pvEnvelope,
+      MARSHAL_BLOCK_TRANSFER);
+  if (pEnvelope == NULL) {
+    ThrowMarshalingException(ERROR_INVALID_MARSHALLED_BLOCK);
+  }
+
+  void* pvBuffer = pEnvelope->pvBuffer;
+
+  if (pnBlockSize != NULL) {
+    *pnBlockSize = pEnvelope->nBlockSize;
+  }
+
+  if (plpfnRelease != NULL) {
+    *plpfnRelease = pEnvelope->lpfnRelease;
+  }
+
+  /* Only the envelope goes back to the pool; the buffer is the caller's
+   * now. */
+  _FreeMarshalBlock(pEnvelope);
+
+  return pvBuffer;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ShareBlockWithThreads function
+
+void* ShareBlockWithThreads(void* pvBuffer, size_t nBlockSize,
+    LPRELEASE_BLOCK_ROUTINE lpfnRelease, int nRefCount) {
+  if (nRefCount <= 0) {
+    ThrowArgumentOutOfRangeException("nRefCount");
+  }
+
+  return _CreateEnvelope(pvBuffer, nBlockSize, lpfnRelease,
+      MARSHAL_BLOCK_SHARED, nRefCount);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetSharedBlockData function
+
+const void* GetSharedBlockData(void* pvShared, size_t* pnBlockSize) {
+  LPMARSHALENVELOPE pEnvelope = _GetEnvelope(pvShared, MARSHAL_BLOCK_SHARED);
+  if (pEnvelope == NULL) {
+    ThrowMarshalingException(ERROR_INVALID_MARSHALLED_BLOCK);
+  }
+
+  if (pnBlockSize != NULL) {
+    *pnBlockSize = pEnvelope->nBlockSize;
+  }
+
+  return pEnvelope->pvBuffer;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AddRefSharedBlock function
+
+void AddRefSharedBlock(void* pvShared) {
+  LPMARSHALENVELOPE pEnvelope = _GetEnvelope(pvShared, MARSHAL_BLOCK_SHARED);
+  if (pEnvelope == NULL) {
+    ThrowMarshalingException(ERROR_INVALID_MARSHALLED_BLOCK);
+  }
+
+  atomic_fetch_add_explicit(&pEnvelope->nRefCount, 1, memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReleaseSharedBlock function
+
+void ReleaseSharedBlock(void* pvShared) {
+  if (_GetEnvelope(pvShared, MARSHAL_BLOCK_SHARED) == NULL) {
+    ThrowMarshalingException(ERROR_INVALID_MARSHALLED_BLOCK);
+  }
+
+  _ReleaseMarshalledBlock(pvShared);
 }
@@ -0,0 +1,279 @@
+// parallel_for.c - Implementations of the functions defined in
+// parallel_for.h
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+#include "parallel_for.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @brief Maximum number of times one task halves its range.  Halving a
+ * range of longs more often than this leaves nothing to split.
+ */
+#define PARALLEL_MAX_SPLITS         64
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief State of one call to ParallelForEx or ParallelReduceEx, shared by
+ * all of its chunks.
+ */
+typedef struct _PARALLELLOOP {
+  HTASKSCHEDULER hScheduler;
+  long nGrain;
+  LPPARALLEL_FOR_ROUTINE lpfnFor;         // NULL for a reduction
+  LPPARALLEL_REDUCE_ROUTINE lpfnReduce;
+  void* pContext;
+
+  /* Partial results of a reduction: one per worker, then one for the
+   * caller, each on cache lines of its own */
+  char* pPartials;
+  size_t nPartialStride;
+} PARALLELLOOP, *LPPARALLELLOOP;
+
+/**
+ * @brief Part of the range of a loop that has been split off as a task.
+ * Lives on the stack of the task that split it off, which syncs with it
+ * before returning.
+ */
+typedef struct _PARALLELCHUNK {
+  LPPARALLELLOOP pLoop;
+  long nBegin;
+  long nEnd;
+} PARALLELCHUNK, *LPPARALLELCHUNK;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+static pthread_once_t g_sharedSchedulerOnce = PTHREAD_ONCE_INIT;
+static HTASKSCHEDULER g_hSharedScheduler = INVALID_HANDLE_VALUE;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _CreateSharedScheduler: Starts the task scheduler that ParallelFor and
+// ParallelReduce run on.  It lives as long as the process.
+
+void _CreateSharedScheduler(void) {
+  g_hSharedScheduler = CreateTaskScheduler(0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetSharedScheduler: Gets the shared task scheduler, starting it the first
+// time.  Returns INVALID_HANDLE_VALUE if it could not be started.
+
+HTASKSCHEDULER _GetSharedScheduler(void) {
+  pthread_once(&g_sharedSchedulerOnce, _CreateSharedScheduler);
+  return g_hSharedScheduler;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RunChunk: Runs the body of a loop over one chunk that is not going to be
+// split any further.
+
+void _RunChunk(LPPARALLELLOOP pLoop, long nBegin, long nEnd) {
+  if (NULL != pLoop->lpfnFor) {
+    pLoop->lpfnFor(nBegin, nEnd, pLoop->pContext);
+    return;
+  }
+
+  /* Workers of the scheduler fold into their own partial result; anybody
+   * else can only be the caller, which has the last one */
+  int nSlot = _GetSchedulerWorkerIndex(pLoop->hScheduler);
+  if (ERROR == nSlot) {
+    nSlot = GetTaskSchedulerWorkerCount(pLoop->hScheduler);
+  }
+
+  pLoop->lpfnReduce(nBegin, nEnd,
+      pLoop->pPartials + (size_t) nSlot * pLoop->nPartialStride,
+      pLoop->pContext);
+}
+
+void _RunRange(LPPARALLELLOOP pLoop, long nBegin, long nEnd);
+
+///////////////////////////////////////////////////////////////////////////////
+// _ParallelChunkTask: Task procedure of a chunk that has been split off.
+
+void* _ParallelChunkTask(void* pUserState) {
+  LPPARALLELCHUNK pChunk = (LPPARALLELCHUNK) pUserState;
+  _RunRange(pChunk->pLoop, pChunk->nBegin, pChunk->nEnd);
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RunRange: Splits the upper half off a range as a task, again and again,
+// until what is left is no bigger than the grain; runs that part here, and
+// waits for the rest.  Widths are unsigned, since a range may span more
+// than LONG_MAX values.
+
+void _RunRange(LPPARALLELLOOP pLoop, long nBegin, long nEnd) {
+  PARALLELCHUNK aChunks[PARALLEL_MAX_SPLITS];
+  int nChunks = 0;
+
+  while ((unsigned long) nEnd - (unsigned long) nBegin
+      > (unsigned long) pLoop->nGrain && nChunks < PARALLEL_MAX_SPLITS) {
+    long nMiddle = nBegin
+        + (long) (((unsigned long) nEnd - (unsigned long) nBegin) / 2);
+
+    LPPARALLELCHUNK pChunk = &aChunks[nChunks];
+    pChunk->pLoop = pLoop;
+    pChunk->nBegin = nMiddle;
+    pChunk->nEnd = nEnd;
+
+    if (!SpawnTask(pLoop->hScheduler, _ParallelChunkTask, pChunk)) {
+      break;    // out of memory; do the rest of the range ourselves
+    }
+
+    nChunks++;
+    nEnd = nMiddle;
+  }
+
+  _RunChunk(pLoop, nBegin, nEnd);
+
+  if (nChunks > 0) {
+    SyncTasks(pLoop->hScheduler);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RunLoop: Runs a loop whose state has been filled in, apart from the
+// grain, on the scheduler it names.
+
+void _RunLoop(LPPARALLELLOOP pLoop, long nBegin, long nEnd, long nGrain) {
+  int nWorkers = GetTaskSchedulerWorkerCount(pLoop->hScheduler);
+
+  if (0 == nGrain) {
+    unsigned long nGrainWidth = ((unsigned long) nEnd - (unsigned long) nBegin)
+        / ((unsigned long) nWorkers * PARALLEL_CHUNKS_PER_WORKER);
+    nGrain = (nGrainWidth > LONG_MAX) ? LONG_MAX : (long) nGrainWidth;
+  }
+  pLoop->nGrain = (nGrain > 0) ? nGrain : 1;
+
+  /* A task of another scheduler could not sync on this one */
+  if (ERROR != GetCurrentWorkerIndex()
+      && ERROR == _GetSchedulerWorkerIndex(pLoop->hScheduler)) {
+    _RunChunk(pLoop, nBegin, nEnd);
+    return;
+  }
+
+  _RunRange(pLoop, nBegin, nEnd);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// ParallelFor function
+
+int ParallelFor(long nBegin, long nEnd, long nGrain,
+    LPPARALLEL_FOR_ROUTINE lpfnBody, void* pContext) {
+  HTASKSCHEDULER hScheduler = _GetSharedScheduler();
+  if (INVALID_HANDLE_VALUE == hScheduler) {
+    return ENOMEM;
+  }
+
+  return ParallelForEx(hScheduler, nBegin, nEnd, nGrain, lpfnBody,
+      pContext);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ParallelForEx function
+
+int ParallelForEx(HTASKSCHEDULER hScheduler, long nBegin, long nEnd,
+    long nGrain, LPPARALLEL_FOR_ROUTINE lpfnBody, void* pContext) {
+  if (INVALID_HANDLE_VALUE == hScheduler || NULL == lpfnBody
+      || nGrain < 0) {
+    return EINVAL;
+  }
+
+  if (nEnd <= nBegin) {
+    return OK;    // nothing to do
+  }
+
+  PARALLELLOOP loop;
+  memset(&loop, 0, sizeof(PARALLELLOOP));
+  loop.hScheduler = hScheduler;
+  loop.lpfnFor = lpfnBody;
+  loop.pContext = pContext;
+
+  _RunLoop(&loop, nBegin, nEnd, nGrain);
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ParallelReduce function
+
+int ParallelReduce(long nBegin, long nEnd, long nGrain,
+    const void* pvIdentity, void* pvResult, size_t nResultSize,
+    LPPARALLEL_REDUCE_ROUTINE lpfnBody, LPPARALLEL_COMBINE_ROUTINE lpfnCombine,
+    void* pContext) {
+  HTASKSCHEDULER hScheduler = _GetSharedScheduler();
+  if (INVALID_HANDLE_VALUE == hScheduler) {
+    return ENOMEM;
+  }
+
+  return ParallelReduceEx(hScheduler, nBegin, nEnd, nGrain, pvIdentity,
+      pvResult, nResultSize, lpfnBody, lpfnCombine, pContext);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ParallelReduceEx function
+
+int ParallelReduceEx(HTASKSCHEDULER hScheduler, long nBegin, long nEnd,
+    long nGrain, const void* pvIdentity, void* pvResult, size_t nResultSize,
+    LPPARALLEL_REDUCE_ROUTINE lpfnBody, LPPARALLEL_COMBINE_ROUTINE lpfnCombine,
+    void* pContext) {
+  if (INVALID_HANDLE_VALUE == hScheduler || NULL == pvIdentity
+      || NULL == pvResult || 0 == nResultSize || NULL == lpfnBody
+      || NULL == lpfnCombine || nGrain < 0) {
+    return EINVAL;
+  }
+
+  memcpy(pvResult, pvIdentity, nResultSize);
+
+  if (nEnd <= nBegin) {
+    return OK;    // the identity is all there is
+  }
+
+  PARALLELLOOP loop;
+  memset(&loop, 0, sizeof(PARALLELLOOP));
+  loop.hScheduler = hScheduler;
+  loop.lpfnReduce = lpfnBody;
+  loop.pContext = pContext;
+
+  int nSlots = GetTaskSchedulerWorkerCount(hScheduler) + 1;
+  loop.nPartialStride = (nResultSize + CACHE_LINE_SIZE - 1)
+      & ~((size_t) CACHE_LINE_SIZE - 1);
+  if (OK != posix_memalign((void**) &loop.pPartials, CACHE_LINE_SIZE,
+      (size_t) nSlots * loop.nPartialStride)) {
+    return ENOMEM;
+  }
+
+  for (int i = 0; i < nSlots; i++) {
+    memcpy(loop.pPartials + (size_t) i * loop.nPartialStride, pvIdentity,
+        nResultSize);
+  }
+
+  _RunLoop(&loop, nBegin, nEnd, nGrain);
+
+  /* Slots of workers that got no chunks still hold the identity, which
+   * combines to no effect */
+  for (int i = 0; i < nSlots; i++) {
+    lpfnCombine(pvResult, loop.pPartials + (size_t) i * loop.nPartialStride,
+        pContext);
+  }
+
+  free(loop.pPartials);
+
+  return OK;
+}
@@ -0,0 +1,390 @@
+// ring_buffer.c - Implementations of the functions defined in ring_buffer.h
+//
+
+#include "stdafx.h"
+
+#include "marshalling_functions.h"
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+#include "ring_buffer.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @brief Smallest capacity a ring buffer is created with.
+ */
+#define RING_BUFFER_MIN_CAPACITY    2
+
+/**
+ * @brief Number of times a side polls the other side's position before it
+ * goes to sleep.  At high message rates, the other side nearly always
+ * comes through within that time, and a futex round trip is saved.  On a
+ * single CPU, spinning only delays the other side, so nobody spins there.
+ */
+#define RING_BUFFER_SPIN_COUNT      1000
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief Header of one slot of a ring buffer.  The data of the block (or,
+ * if bIndirect is set, the address returned by MarshalBlockToThread)
+ * follows it.
+ */
+typedef struct _RINGSLOT {
+  int nBlockSize;
+  BOOL bIndirect;
+} RINGSLOT, *LPRINGSLOT;
+
+/**
+ * @brief One side's way of going to sleep.  The other side only reads
+ * bWaiting, so this gets a cache line of its own, which stays put in the
+ * reader's cache until somebody actually goes to sleep.
+ */
+typedef struct _RINGWAITER {
+  CACHE_ALIGNED atomic_int bWaiting;
+  atomic_int nEvent;
+} RINGWAITER, *LPRINGWAITER;
+
+struct _RINGBUFFER {
+  /* Written by the consumer only */
+  CACHE_ALIGNED atomic_size_t nHead;
+  size_t nCachedTail;            // last value of nTail the consumer saw
+
+  /* Written by the producer only */
+  CACHE_ALIGNED atomic_size_t nTail;
+  size_t nCachedHead;            // last value of nHead the producer saw
+  atomic_int bClosed;
+
+  RINGWAITER consumer;
+  RINGWAITER producer;
+
+  CACHE_ALIGNED size_t nMask;    // capacity - 1
+  size_t nSlotSize;
+  int nMaxInlineSize;
+  int nSpinCount;
+  char* pSlots;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetRingSlot: Gets the slot that a position maps to.
+
+static inline LPRINGSLOT _GetRingSlot(LPRINGBUFFER pRing, size_t nPos) {
+  return (LPRINGSLOT) (pRing->pSlots + (nPos & pRing->nMask)
+      * pRing->nSlotSize);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _WakeRingWaiter: Wakes the other side of a ring buffer if it is asleep.
+
+static inline void _WakeRingWaiter(LPRINGWAITER pWaiter) {
+  /* Pairs with the fence in _WaitRing: either the sleeper sees what we just
+   * published when it looks again, or we see bWaiting here.  A fence is
+   * cheaper than a locked instruction and keeps the fast path free of
+   * read-modify-writes. */
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if (!atomic_load_explicit(&pWaiter->bWaiting, memory_order_relaxed)) {
+    return;
+  }
+
+  atomic_fetch_add_explicit(&pWaiter->nEvent, 1, memory_order_release);
+  _FutexWake(&pWaiter->nEvent, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _TryWriteRing: Copies a block into the ring buffer if there is room.
+// Returns zero, EAGAIN if the ring buffer is full, or EPIPE if it is closed.
+
+int _TryWriteRing(LPRINGBUFFER pRing, void* pvData, int nBlockSize) {
+  if (atomic_load_explicit(&pRing->bClosed, memory_order_relaxed)) {
+    return EPIPE;
+  }
+
+  size_t nTail = atomic_load_explicit(&pRing->nTail, memory_order_relaxed);
+  if (nTail - pRing->nCachedHead > pRing->nMask) {
+    pRing->nCachedHead = atomic_load_explicit(&pRing->nHead,
+        memory_order_acquire);
+    if (nTail - pRing->nCachedHead > pRing->nMask) {
+      return EAGAIN;
+    }
+  }
+
+  LPRINGSLOT pSlot = _GetRingSlot(pRing, nTail);
+  pSlot->nBlockSize = nBlockSize;
+  pSlot->bIndirect = (nBlockSize > pRing->nMaxInlineSize);
+
+  if (pSlot->bIndirect) {
+    void* pvBlock = MarshalBlockToThread(pvData, nBlockSize);
+    memcpy(pSlot + 1, &pvBlock, sizeof(void*));
+  } else {
+    memcpy(pSlot + 1, pvData, nBlockSize);
+  }
+
+  atomic_store_explicit(&pRing->nTail, nTail + 1, memory_order_release);
+  _WakeRingWaiter(&pRing->consumer);
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _TryReadRing: Copies the next block out of the ring buffer if there is
+// one.  Returns zero, EAGAIN if the ring buffer is empty, EPIPE if it is empty
+// and closed, or EMSGSIZE if the block does not fit.
+
+int _TryReadRing(LPRINGBUFFER pRing, void* pvDest, int nDestSize,
+    int* pnBlockSize) {
+  size_t nHead = atomic_load_explicit(&pRing->nHead, memory_order_relaxed);
+  if (nHead == pRing->nCachedTail) {
+    pRing->nCachedTail = atomic_load_explicit(&pRing->nTail,
+        memory_order_acquire);
+    if (nHead == pRing->nCachedTail) {
+      if (!atomic_load_explicit(&pRing->bClosed, memory_order_acquire)) {
+        return EAGAIN;
+      }
+
+      /* Everything written before the ring buffer was closed is visible
+       * now, so look one last time. */
+      pRing->nCachedTail = atomic_load_explicit(&pRing->nTail,
+          memory_order_acquire);
+      if (nHead == pRing->nCachedTail) {
+        return EPIPE;
+      }
+    }
+  }
+
+  LPRINGSLOT pSlot = _GetRingSlot(pRing, nHead);
+  if (NULL != pnBlockSize) {
+    *pnBlockSize = pSlot->nBlockSize;
+  }
+
+  if (pSlot->nBlockSize > nDestSize) {
+    return EMSGSIZE;
+  }
+
+  if (pSlot->bIndirect) {
+    void* pvBlock = NULL;
+    memcpy(&pvBlock, pSlot + 1, sizeof(void*));
+    DeMarshalBlockFromThread(pvDest, pvBlock, pSlot->nBlockSize);
+  } else {
+    memcpy(pvDest, pSlot + 1, pSlot->nBlockSize);
+  }
+
+  atomic_store_explicit(&pRing->nHead, nHead + 1, memory_order_release);
+  _WakeRingWaiter(&pRing->producer);
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _IsRingReady: Gets whether one side of a ring buffer can make progress.
+
+static inline BOOL _IsRingReady(LPRINGBUFFER pRing, BOOL bProducer) {
+  if (bProducer) {
+    return atomic_load_explicit(&pRing->nTail, memory_order_relaxed)
+        - atomic_load_explicit(&pRing->nHead, memory_order_acquire)
+        <= pRing->nMask;
+  }
+
+  return atomic_load_explicit(&pRing->nHead, memory_order_relaxed)
+      != atomic_load_explicit(&pRing->nTail, memory_order_acquire)
+      || atomic_load_explicit(&pRing->bClosed, memory_order_acquire);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _WaitRing: Puts one side of a ring buffer to sleep until the other side
+// makes progress, the deadline passes, or the ring buffer is closed.  The
+// caller retries its operation whenever this returns zero.
+
+int _WaitRing(LPRINGBUFFER pRing, BOOL bProducer,
+    const struct timespec* pDeadline) {
+  LPRINGWAITER pWaiter = bProducer ? &pRing->producer : &pRing->consumer;
+
+  for (int i = 0; i < pRing->nSpinCount; i++) {
+    if (_IsRingReady(pRing, bProducer)) {
+      return OK;
+    }
+    _CpuRelax();
+  }
+
+  int nEvent = atomic_load_explicit(&pWaiter->nEvent, memory_order_acquire);
+  atomic_store_explicit(&pWaiter->bWaiting, TRUE, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  /* Look again now that the other side is bound to see bWaiting */
+  int nResult = OK;
+  if (!_IsRingReady(pRing, bProducer)) {
+    nResult = _FutexWait(&pWaiter->nEvent, nEvent, pDeadline);
+  }
+
+  atomic_store_explicit(&pWaiter->bWaiting, FALSE, memory_order_relaxed);
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateRingBuffer function
+
+HRINGBUFFER CreateRingBuffer(int nCapacity, int nMaxInlineSize) {
+  if (nCapacity <= 0 || nCapacity > (INT_MAX / 2) + 1
+      || nMaxInlineSize < 0) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  /* An indirect slot holds an address, so every slot has room for one */
+  if (nMaxInlineSize < (int) sizeof(void*)) {
+    nMaxInlineSize = sizeof(void*);
+  }
+
+  size_t nSlots = RING_BUFFER_MIN_CAPACITY;
+  while (nSlots < (size_t) nCapacity) {
+    nSlots <<= 1;
+  }
+
+  /* Keep every slot 8-byte aligned */
+  size_t nSlotSize = (sizeof(RINGSLOT) + nMaxInlineSize + 7) & ~(size_t) 7;
+
+  LPRINGBUFFER pRing = NULL;
+  if (OK != posix_memalign((void**) &pRing, CACHE_LINE_SIZE,
+      sizeof(RINGBUFFER))) {
+    return INVALID_HANDLE_VALUE;
+  }
+  memset(pRing, 0, sizeof(RINGBUFFER));
+
+  if (OK != posix_memalign((void**) &pRing->pSlots, CACHE_LINE_SIZE,
+      nSlots * nSlotSize)) {
+    free(pRing);
+    return INVALID_HANDLE_VALUE;
+  }
+
+  pRing->nMask = nSlots - 1;
+  pRing->nSlotSize = nSlotSize;
+  pRing->nMaxInlineSize = nMaxInlineSize;
+  pRing->nSpinCount = (sysconf(_SC_NPROCESSORS_ONLN) > 1)
+      ? RING_BUFFER_SPIN_COUNT : 0;
+
+  atomic_init(&pRing->nHead, 0);
+  atomic_init(&pRing->nTail, 0);
+  atomic_init(&pRing->bClosed, FALSE);
+  atomic_init(&pRing->consumer.bWaiting, FALSE);
+  atomic_init(&pRing->consumer.nEvent, 0);
+  atomic_init(&pRing->producer.bWaiting, FALSE);
+  atomic_init(&pRing->producer.nEvent, 0);
+
+  return (HRINGBUFFER) pRing;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyRingBuffer function
+
+int DestroyRingBuffer(HRINGBUFFER hRingBuffer) {
+  if (INVALID_HANDLE_VALUE == hRingBuffer) {
+    return EINVAL;
+  }
+
+  LPRINGBUFFER pRing = (LPRINGBUFFER) hRingBuffer;
+
+  /* Blocks that were marshalled on the way in would leak otherwise */
+  size_t nTail = atomic_load_explicit(&pRing->nTail, memory_order_acquire);
+  for (size_t nPos = atomic_load_explicit(&pRing->nHead,
+      memory_order_relaxed); nPos != nTail; nPos++) {
+    LPRINGSLOT pSlot = _GetRingSlot(pRing, nPos);
+    if (pSlot->bIndirect) {
+      void* pvBlock = NULL;
+      memcpy(&pvBlock, pSlot + 1, sizeof(void*));
+      FreeMarshalledBlock(pvBlock);
+    }
+  }
+
+  free(pRing->pSlots);
+  free(pRing);
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CloseRingBuffer function
+
+int CloseRingBuffer(HRINGBUFFER hRingBuffer) {
+  if (INVALID_HANDLE_VALUE == hRingBuffer) {
+    return EINVAL;
+  }
+
+  LPRINGBUFFER pRing = (LPRINGBUFFER) hRingBuffer;
+
+  atomic_store_explicit(&pRing->bClosed, TRUE, memory_order_release);
+  _WakeRingWaiter(&pRing->consumer);
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WriteToRingBuffer function
+
+int WriteToRingBuffer(HRINGBUFFER hRingBuffer, void* pvData, int nBlockSize,
+    int nTimeoutMs) {
+  if (INVALID_HANDLE_VALUE == hRingBuffer || NULL == pvData
+      || nBlockSize <= 0) {
+    return EINVAL;
+  }
+
+  LPRINGBUFFER pRing = (LPRINGBUFFER) hRingBuffer;
+
+  struct timespec deadline;
+  struct timespec* pDeadline = NULL;
+  if (nTimeoutMs > 0) {
+    _GetAbsoluteDeadline(nTimeoutMs, &deadline);
+    pDeadline = &deadline;
+  }
+
+  int nResult = OK;
+  while (EAGAIN == (nResult = _TryWriteRing(pRing, pvData, nBlockSize))
+      && 0 != nTimeoutMs) {
+    int nWaitResult = _WaitRing(pRing, TRUE, pDeadline);
+    if (OK != nWaitResult) {
+      return nWaitResult;
+    }
+  }
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReadFromRingBuffer function
+
+int ReadFromRingBuffer(HRINGBUFFER hRingBuffer, void* pvDest, int nDestSize,
+    int* pnBlockSize, int nTimeoutMs) {
+  if (INVALID_HANDLE_VALUE == hRingBuffer || NULL == pvDest
+      || nDestSize <= 0) {
+    return EINVAL;
+  }
+
+  LPRINGBUFFER pRing = (LPRINGBUFFER) hRingBuffer;
+
+  struct timespec deadline;
+  struct timespec* pDeadline = NULL;
+  if (nTimeoutMs > 0) {
+    _GetAbsoluteDeadline(nTimeoutMs, &deadline);
+    pDeadline = &deadline;
+  }
+
+  int nResult = OK;
+  while (EAGAIN == (nResult = _TryReadRing(pRing, pvDest, nDestSize,
+      pnBlockSize)) && 0 != nTimeoutMs) {
+    int nWaitResult = _WaitRing(pRing, FALSE, pDeadline);
+    if (OK != nWaitResult) {
+      return nWaitResult;
+    }
+  }
+
+  return nResult;
+}
@@ -0,0 +1,557 @@
+// sync_objects.c - Implementations of the functions defined in
+// sync_objects.h
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+#include "sync_objects.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @name MUTEX_*
+ * @brief Values of MUTEX::nState.  Nobody holds the mutex; somebody does and
+ * nobody is asleep waiting for it; somebody does and others may be asleep.
+ */
+#define MUTEX_UNLOCKED      0
+#define MUTEX_LOCKED        1
+#define MUTEX_CONTENDED     2
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+struct _MUTEX {
+  CACHE_ALIGNED atomic_int nState;        // MUTEX_*
+  atomic_int nSpinEstimate;               // spins a lock typically takes
+};
+
+struct _CONDITION {
+  CACHE_ALIGNED atomic_int nSequence;     // bumped whenever it is signalled
+  atomic_int nWaiters;
+};
+
+/**
+ * @brief Number of readers that hold a reader-writer lock, as counted on
+ * one CPU.  A reader may unlock on a different CPU than it locked on, so a
+ * single counter can go negative; only the sum over all of them means
+ * anything.
+ */
+typedef struct _READERSLOT {
+  CACHE_ALIGNED atomic_long nReaders;
+} CACHE_ALIGNED READERSLOT, *LPREADERSLOT;
+
+struct _RWLOCK {
+  CACHE_ALIGNED atomic_int nWriterActive; // set while a writer holds or wants
+  atomic_int nWaitingReaders;             // asleep until the writer is done
+
+  CACHE_ALIGNED atomic_int nDrainEvent;   // bumped by readers a writer awaits
+
+  MUTEX writerMutex;                      // one writer at a time
+
+  int nSlots;
+  LPREADERSLOT pSlots;                    // one per CPU
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+static pthread_once_t g_syncOnce = PTHREAD_ONCE_INIT;
+static int g_nSpinLimit = 0;            // zero on a uniprocessor
+static int g_nCpuCount = 1;             // number of reader slots
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _InitSyncObjects: Finds out how many CPUs there are, which decides whether
+// spinning makes sense and how many counters a reader-writer lock has.
+
+void _InitSyncObjects(void) {
+  long nOnline = sysconf(_SC_NPROCESSORS_ONLN);
+  long nConfigured = sysconf(_SC_NPROCESSORS_CONF);
+
+  g_nSpinLimit = (nOnline > 1) ? SYNC_SPIN_LIMIT : 0;
+
+  /* CPUs may come online later; sched_getcpu can return any of them */
+  g_nCpuCount = (int) ((nConfigured > nOnline) ? nConfigured : nOnline);
+  if (g_nCpuCount < 1) {
+    g_nCpuCount = 1;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetSpinLimit: Gets how many times a thread may poll a lock before it
+// sleeps, given the number of polls that the lock typically takes.
+
+static inline int _GetSpinLimit(int nSpinEstimate) {
+  pthread_once(&g_syncOnce, _InitSyncObjects);
+
+  int nLimit = 2 * nSpinEstimate + 10;
+  return (nLimit < g_nSpinLimit) ? nLimit : g_nSpinLimit;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _InitMutex: Puts a mutex into the unlocked state.
+
+void _InitMutex(LPMUTEX pMutex) {
+  atomic_init(&pMutex->nState, MUTEX_UNLOCKED);
+  atomic_init(&pMutex->nSpinEstimate, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _TryLockMutex: Locks a mutex if nobody holds it.
+
+static inline BOOL _TryLockMutex(LPMUTEX pMutex) {
+  int nExpected = MUTEX_UNLOCKED;
+  return atomic_compare_exchange_strong_explicit(&pMutex->nState,
+      &nExpected, MUTEX_LOCKED, memory_order_acquire, memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _LockMutexContended: Locks a mutex, marking it contended, and sleeps until
+// it is free or the deadline (NULL for none) passes.  Returns zero or
+// ETIMEDOUT.
+
+int _LockMutexContended(LPMUTEX pMutex, const struct timespec* pDeadline) {
+  /* Whoever unlocks after this will wake somebody, since we cannot know
+   * whether we are the only one asleep */
+  while (MUTEX_UNLOCKED != atomic_exchange_explicit(&pMutex->nState,
+      MUTEX_CONTENDED, memory_order_acquire)) {
+    int nResult = _FutexWait(&pMutex->nState, MUTEX_CONTENDED, pDeadline);
+    if (OK != nResult) {
+      return nResult;
+    }
+  }
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _LockMutex: Locks a mutex, first spinning for about as long as it usually
+// takes to become free, and then sleeping until the deadline (NULL for
+// none).  Returns zero or ETIMEDOUT.
+
+int _LockMutex(LPMUTEX pMutex, const struct timespec* pDeadline) {
+  if (_TryLockMutex(pMutex)) {
+    return OK;
+  }
+
+  int nSpinEstimate = atomic_load_explicit(&pMutex->nSpinEstimate,
+      memory_order_relaxed);
+  int nMaxSpins = _GetSpinLimit(nSpinEstimate);
+
+  int nSpins = 0;
+  BOOL bLocked = FALSE;
+  while (nSpins < nMaxSpins && !bLocked) {
+    nSpins++;
+    _CpuRelax();
+
+    /* Read before trying, so that spinners do not steal the cache line
+     * from the holder */
+    bLocked = MUTEX_UNLOCKED == atomic_load_explicit(&pMutex->nState,
+        memory_order_relaxed) && _TryLockMutex(pMutex);
+  }
+
+  /* Moves the estimate an eighth of the way towards what this lock took,
+   * like glibc's adaptive mutexes do */
+  atomic_store_explicit(&pMutex->nSpinEstimate,
+      nSpinEstimate + (nSpins - nSpinEstimate) / 8, memory_order_relaxed);
+
+  return bLocked ? OK : _LockMutexContended(pMutex, pDeadline);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _UnlockMutex: Unlocks a mutex, waking one sleeper if there may be any.
+
+void _UnlockMutex(LPMUTEX pMutex) {
+  if (MUTEX_CONTENDED == atomic_exchange_explicit(&pMutex->nState,
+      MUTEX_UNLOCKED, memory_order_release)) {
+    _FutexWake(&pMutex->nState, 1);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _WakeConditionWaiters: Wakes up to nCount threads waiting on a condition
+// variable, if there are any.
+
+int _WakeConditionWaiters(HCONDITION hCondition, int nCount) {
+  if (INVALID_HANDLE_VALUE == hCondition) {
+    return EINVAL;
+  }
+
+  LPCONDITION pCondition = (LPCONDITION) hCondition;
+
+  /* Pairs with the increment of nWaiters in WaitCondition, which happens
+   * before the waiter reads the sequence */
+  atomic_fetch_add_explicit(&pCondition->nSequence, 1, memory_order_seq_cst);
+  if (0 != atomic_load_explicit(&pCondition->nWaiters,
+      memory_order_seq_cst)) {
+    _FutexWake(&pCondition->nSequence, nCount);
+  }
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetReaderSlot: Gets the reader counter of the CPU the caller is running
+// on.
+
+static inline LPREADERSLOT _GetReaderSlot(LPRWLOCK pRWLock) {
+  int nCpu = sched_getcpu();
+  if (nCpu < 0) {
+    nCpu = 0;
+  }
+
+  return &pRWLock->pSlots[nCpu % pRWLock->nSlots];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CountReaders: Adds up the reader counters of a reader-writer lock.  Once
+// nWriterActive is set, no reader can enter without backing out again, so
+// a sum of zero means that there are no readers left.
+
+long _CountReaders(LPRWLOCK pRWLock) {
+  long nReaders = 0;
+  for (int i = 0; i < pRWLock->nSlots; i++) {
+    nReaders += atomic_load_explicit(&pRWLock->pSlots[i].nReaders,
+        memory_order_seq_cst);
+  }
+
+  return nReaders;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _LeaveReaderSlot: Counts a reader out, and lets a waiting writer know.
+
+void _LeaveReaderSlot(LPRWLOCK pRWLock, LPREADERSLOT pSlot) {
+  atomic_fetch_sub_explicit(&pSlot->nReaders, 1, memory_order_seq_cst);
+
+  if (0 != atomic_load_explicit(&pRWLock->nWriterActive,
+      memory_order_seq_cst)) {
+    atomic_fetch_add_explicit(&pRWLock->nDrainEvent, 1, memory_order_release);
+    _FutexWake(&pRWLock->nDrainEvent, 1);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateMutex function
+
+HMUTEX CreateMutex(void) {
+  LPMUTEX pMutex = NULL;
+  if (OK != posix_memalign((void**) &pMutex, CACHE_LINE_SIZE,
+      sizeof(MUTEX))) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  _InitMutex(pMutex);
+
+  return (HMUTEX) pMutex;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyMutex function
+
+int DestroyMutex(HMUTEX hMutex) {
+  if (INVALID_HANDLE_VALUE == hMutex) {
+    return EINVAL;
+  }
+
+  free(hMutex);
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LockMutex function
+
+int LockMutex(HMUTEX hMutex) {
+  if (INVALID_HANDLE_VALUE == hMutex) {
+    return EINVAL;
+  }
+
+  return _LockMutex((LPMUTEX) hMutex, NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LockMutexTimeout function
+
+int LockMutexTimeout(HMUTEX hMutex, int nTimeoutMs) {
+  if (INVALID_HANDLE_VALUE == hMutex
+      || (nTimeoutMs < 0 && INFINITE != nTimeoutMs)) {
+    return EINVAL;
+  }
+
+  LPMUTEX pMutex = (LPMUTEX) hMutex;
+
+  if (0 == nTimeoutMs) {
+    return _TryLockMutex(pMutex) ? OK : EAGAIN;
+  }
+
+  if (INFINITE == nTimeoutMs) {
+    return _LockMutex(pMutex, NULL);
+  }
+
+  struct timespec deadline;
+  _GetAbsoluteDeadline(nTimeoutMs, &deadline);
+
+  return _LockMutex(pMutex, &deadline);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UnlockMutex function
+
+int UnlockMutex(HMUTEX hMutex) {
+  if (INVALID_HANDLE_VALUE == hMutex) {
+    return EINVAL;
+  }
+
+  _UnlockMutex((LPMUTEX) hMutex);
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateCondition function
+
+HCONDITION CreateCondition(void) {
+  LPCONDITION pCondition = NULL;
+  if (OK != posix_memalign((void**) &pCondition, CACHE_LINE_SIZE,
+      sizeof(CONDITION))) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  atomic_init(&pCondition->nSequence, 0);
+  atomic_init(&pCondition->nWaiters, 0);
+
+  return (HCONDITION) pCondition;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyCondition function
+
+int DestroyCondition(HCONDITION hCondition) {
+  if (INVALID_HANDLE_VALUE == hCondition) {
+    return EINVAL;
+  }
+
+  free(hCondition);
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WaitCondition function
+
+int WaitCondition(HCONDITION hCondition, HMUTEX hMutex, int nTimeoutMs) {
+  if (INVALID_HANDLE_VALUE == hCondition || INVALID_HANDLE_VALUE == hMutex
+      || (nTimeoutMs < 0 && INFINITE != nTimeoutMs)) {
+    return EINVAL;
+  }
+
+  LPCONDITION pCondition = (LPCONDITION) hCondition;
+  LPMUTEX pMutex = (LPMUTEX) hMutex;
+
+  struct timespec deadline;
+  struct timespec* pDeadline = NULL;
+  if (INFINITE != nTimeoutMs) {
+    _GetAbsoluteDeadline(nTimeoutMs, &deadline);
+    pDeadline = &deadline;
+  }
+
+  /* The sequence is read while the mutex is still held, so a signal sent
+   * after we let go of it changes the value the futex checks */
+  atomic_fetch_add_explicit(&pCondition->nWaiters, 1, memory_order_seq_cst);
+  int nSequence = atomic_load_explicit(&pCondition->nSequence,
+      memory_order_seq_cst);
+
+  _UnlockMutex(pMutex);
+
+  int nResult = _FutexWait(&pCondition->nSequence, nSequence, pDeadline);
+
+  atomic_fetch_sub_explicit(&pCondition->nWaiters, 1, memory_order_relaxed);
+
+  /* Other waiters may have been woken along with us, and be asleep on the
+   * mutex by now */
+  _LockMutexContended(pMutex, NULL);
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SignalCondition function
+
+int SignalCondition(HCONDITION hCondition) {
+  return _WakeConditionWaiters(hCondition, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BroadcastCondition function
+
+int BroadcastCondition(HCONDITION hCondition) {
+  return _WakeConditionWaiters(hCondition, INT_MAX);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateRWLock function
+
+HRWLOCK CreateRWLock(void) {
+  pthread_once(&g_syncOnce, _InitSyncObjects);
+
+  LPRWLOCK pRWLock = NULL;
+  if (OK != posix_memalign((void**) &pRWLock, CACHE_LINE_SIZE,
+      sizeof(RWLOCK))) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  if (OK != posix_memalign((void**) &pRWLock->pSlots, CACHE_LINE_SIZE,
+      g_nCpuCount * sizeof(READERSLOT))) {
+    free(pRWLock);
+    return INVALID_HANDLE_VALUE;
+  }
+
+  pRWLock->nSlots = g_nCpuCount;
+  for (int i = 0; i < pRWLock->nSlots; i++) {
+    atomic_init(&pRWLock->pSlots[i].nReaders, 0);
+  }
+
+  atomic_init(&pRWLock->nWriterActive, 0);
+  atomic_init(&pRWLock->nWaitingReaders, 0);
+  atomic_init(&pRWLock->nDrainEvent, 0);
+  _InitMutex(&pRWLock->writerMutex);
+
+  return (HRWLOCK) pRWLock;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyRWLock function
+
+int DestroyRWLock(HRWLOCK hRWLock) {
+  if (INVALID_HANDLE_VALUE == hRWLock) {
+    return EINVAL;
+  }
+
+  LPRWLOCK pRWLock = (LPRWLOCK) hRWLock;
+
+  free(pRWLock->pSlots);
+  free(pRWLock);
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LockRWLockShared function
+
+int LockRWLockShared(HRWLOCK hRWLock) {
+  if (INVALID_HANDLE_VALUE == hRWLock) {
+    return EINVAL;
+  }
+
+  LPRWLOCK pRWLock = (LPRWLOCK) hRWLock;
+
+  for (;;) {
+    /* Count ourselves in first and look for a writer second; the writer
+     * does the opposite, so one of us always sees the other */
+    LPREADERSLOT pSlot = _GetReaderSlot(pRWLock);
+    atomic_fetch_add_explicit(&pSlot->nReaders, 1, memory_order_seq_cst);
+
+    if (0 == atomic_load_explicit(&pRWLock->nWriterActive,
+        memory_order_seq_cst)) {
+      return OK;
+    }
+
+    _LeaveReaderSlot(pRWLock, pSlot);
+
+    int nSpins = _GetSpinLimit(SYNC_SPIN_LIMIT);
+    while (nSpins-- > 0 && 0 != atomic_load_explicit(
+        &pRWLock->nWriterActive, memory_order_relaxed)) {
+      _CpuRelax();
+    }
+
+    atomic_fetch_add_explicit(&pRWLock->nWaitingReaders, 1,
+        memory_order_seq_cst);
+    while (0 != atomic_load_explicit(&pRWLock->nWriterActive,
+        memory_order_seq_cst)) {
+      _FutexWait(&pRWLock->nWriterActive, 1, NULL);
+    }
+    atomic_fetch_sub_explicit(&pRWLock->nWaitingReaders, 1,
+        memory_order_relaxed);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UnlockRWLockShared function
+
+int UnlockRWLockShared(HRWLOCK hRWLock) {
+  if (INVALID_HANDLE_VALUE == hRWLock) {
+    return EINVAL;
+  }
+
+  LPRWLOCK pRWLock = (LPRWLOCK) hRWLock;
+
+  _LeaveReaderSlot(pRWLock, _GetReaderSlot(pRWLock));
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LockRWLockExclusive function
+
+int LockRWLockExclusive(HRWLOCK hRWLock) {
+  if (INVALID_HANDLE_VALUE == hRWLock) {
+    return EINVAL;
+  }
+
+  LPRWLOCK pRWLock = (LPRWLOCK) hRWLock;
+
+  _LockMutex(&pRWLock->writerMutex, NULL);
+
+  atomic_store_explicit(&pRWLock->nWriterActive, 1, memory_order_seq_cst);
+
+  /* Readers that are already in have to finish; the event is read before
+   * the counters, so that one who leaves in between wakes us */
+  int nSpins = _GetSpinLimit(SYNC_SPIN_LIMIT);
+  for (;;) {
+    int nDrainEvent = atomic_load_explicit(&pRWLock->nDrainEvent,
+        memory_order_seq_cst);
+    if (0 == _CountReaders(pRWLock)) {
+      break;
+    }
+
+    if (nSpins-- > 0) {
+      _CpuRelax();
+    } else {
+      _FutexWait(&pRWLock->nDrainEvent, nDrainEvent, NULL);
+    }
+  }
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UnlockRWLockExclusive function
+
+int UnlockRWLockExclusive(HRWLOCK hRWLock) {
+  if (INVALID_HANDLE_VALUE == hRWLock) {
+    return EINVAL;
+  }
+
+  LPRWLOCK pRWLock = (LPRWLOCK) hRWLock;
+
+  atomic_store_explicit(&pRWLock->nWriterActive, 0, memory_order_seq_cst);
+  if (0 != atomic_load_explicit(&pRWLock->nWaitingReaders,
+      memory_order_seq_cst)) {
+    _FutexWake(&pRWLock->nWriterActive, INT_MAX);
+  }
+
+  _UnlockMutex(&pRWLock->writerMutex);
+
+  return OK;
+}
@@ -0,0 +1,746 @@
+// task_scheduler.c - Implementations of the functions defined in
+// task_scheduler.h
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+#include "task_scheduler.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @brief Initial number of slots in the deque of each worker.  Must be a
+ * power of two.
+ */
+#define TASK_DEQUE_INITIAL_SIZE     256
+
+/**
+ * @brief Maximum number of task blocks each worker keeps for reuse.
+ */
+#define TASK_FREE_LIST_MAX          1024
+
+/**
+ * @brief Number of unsuccessful rounds of stealing an idle worker makes
+ * before it goes to sleep.
+ */
+#define TASK_STEAL_ROUNDS           64
+
+/**
+ * @brief Number of milliseconds an idle worker sleeps before it looks for
+ * work again even if nobody woke it up.
+ */
+#define TASK_IDLE_SLEEP_MS          10
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief Tracks the children of a task (or of a thread that is not a worker)
+ * that have not yet finished.
+ */
+typedef struct _TASKFRAME {
+  atomic_int nPending;
+  BOOL bExternal;     // owned by a thread that is not a worker
+} TASKFRAME, *LPTASKFRAME;
+
+typedef struct _TASK {
+  LPTHREAD_START_ROUTINE lpfnTask;
+  void* pUserState;
+  LPTASKFRAME pParent;
+  TASKFRAME frame;    // frame for the children of this task
+  struct _TASK* pNext;
+} TASK, *LPTASK;
+
+/**
+ * @brief Circular array that backs a Chase-Lev deque.
+ */
+typedef struct _TASKARRAY {
+  long nSize;
+  struct _TASKARRAY* pRetired;  // previous, smaller array
+  _Atomic(LPTASK) aTasks[];
+} TASKARRAY, *LPTASKARRAY;
+
+typedef struct _TASKWORKER {
+  /* The owner and the thieves hammer on bottom and top respectively; keep
+   * them on separate cache lines. */
+  CACHE_ALIGNED atomic_long nTop;
+  CACHE_ALIGNED atomic_long nBottom;
+  _Atomic(LPTASKARRAY) pArray;
+
+  CACHE_ALIGNED LPTASKSCHEDULER pScheduler;
+  int nIndex;
+  unsigned int nRandomSeed;
+  LPTASK pFreeTasks;
+  int nFreeTasks;
+  HTHREAD hThread;
+} TASKWORKER, *LPTASKWORKER;
+
+struct _TASKSCHEDULER {
+  int nWorkerCount;
+  LPTASKWORKER pWorkers;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t condWork;
+  atomic_int nSleepers;
+  atomic_bool bShutdown;
+
+  LPTASK pInjectHead;     // tasks spawned by threads that are not workers
+  LPTASK pInjectTail;
+  atomic_int nInjected;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+static __thread LPTASKWORKER g_pCurrentWorker = NULL;
+static __thread LPTASKFRAME g_pCurrentFrame = NULL;
+static __thread TASKFRAME g_externalFrame = { 0, TRUE };
+
+/* Threads that are not workers sleep on this in SyncTasks. */
+static pthread_mutex_t g_externalSyncMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_externalSyncCond = PTHREAD_COND_INITIALIZER;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _CreateTaskArray: Allocates the circular array of a deque.
+
+LPTASKARRAY _CreateTaskArray(long nSize) {
+  LPTASKARRAY pArray = (LPTASKARRAY) calloc(1,
+      sizeof(TASKARRAY) + nSize * sizeof(_Atomic(LPTASK)));
+  if (NULL == pArray) {
+    return NULL;
+  }
+
+  pArray->nSize = nSize;
+  return pArray;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _PushTask: Pushes a task onto the bottom of the deque of the calling worker.
+// Only the owner of the deque may call this.
+
+BOOL _PushTask(LPTASKWORKER pWorker, LPTASK pTask) {
+  long nBottom = atomic_load_explicit(&pWorker->nBottom,
+      memory_order_relaxed);
+  long nTop = atomic_load_explicit(&pWorker->nTop, memory_order_acquire);
+  LPTASKARRAY pArray = atomic_load_explicit(&pWorker->pArray,
+      memory_order_relaxed);
+
+  if (nBottom - nTop > pArray->nSize - 1) {
+    /* Full; double the array.  Thieves may still be reading the old one,
+     * so it is retired rather than freed. */
+    LPTASKARRAY pNewArray = _CreateTaskArray(pArray->nSize * 2);
+    if (NULL == pNewArray) {
+      return FALSE;
+    }
+
+    for (long i = nTop; i < nBottom; i++) {
+      atomic_store_explicit(&pNewArray->aTasks[i & (pNewArray->nSize - 1)],
+          atomic_load_explicit(&pArray->aTasks[i & (pArray->nSize - 1)],
+              memory_order_relaxed), memory_order_relaxed);
+    }
+
+    pNewArray->pRetired = pArray;
+    atomic_store_explicit(&pWorker->pArray, pNewArray, memory_order_release);
+    pArray = pNewArray;
+  }
+
+  atomic_store_explicit(&pArray->aTasks[nBottom & (pArray->nSize - 1)],
+      pTask, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&pWorker->nBottom, nBottom + 1,
+      memory_order_relaxed);
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _TakeTask: Pops the most recently pushed task off of the bottom of the deque
+// of the calling worker.  Only the owner of the deque may call this.
+
+LPTASK _TakeTask(LPTASKWORKER pWorker) {
+  long nBottom = atomic_load_explicit(&pWorker->nBottom,
+      memory_order_relaxed) - 1;
+  LPTASKARRAY pArray = atomic_load_explicit(&pWorker->pArray,
+      memory_order_relaxed);
+  atomic_store_explicit(&pWorker->nBottom, nBottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long nTop = atomic_load_explicit(&pWorker->nTop, memory_order_relaxed);
+
+  if (nTop > nBottom) {
+    // Deque was empty
+    atomic_store_explicit(&pWorker->nBottom, nBottom + 1,
+        memory_order_relaxed);
+    return NULL;
+  }
+
+  LPTASK pTask = atomic_load_explicit(
+      &pArray->aTasks[nBottom & (pArray->nSize - 1)], memory_order_relaxed);
+
+  if (nTop == nBottom) {
+    // Last task; race the thieves for it
+    if (!atomic_compare_exchange_strong_explicit(&pWorker->nTop, &nTop,
+        nTop + 1, memory_order_seq_cst, memory_order_relaxed)) {
+      pTask = NULL;
+    }
+    atomic_store_explicit(&pWorker->nBottom, nBottom + 1,
+        memory_order_relaxed);
+  }
+
+  return pTask;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _StealTask: Takes the oldest task off of the top of the deque of another
+// worker.  Returns NULL if the deque is empty or another thief won the race.
+
+LPTASK _StealTask(LPTASKWORKER pVictim) {
+  long nTop = atomic_load_explicit(&pVictim->nTop, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long nBottom = atomic_load_explicit(&pVictim->nBottom,
+      memory_order_acquire);
+
+  if (nTop >= nBottom) {
+    return NULL;
+  }
+
+  LPTASKARRAY pArray = atomic_load_explicit(&pVictim->pArray,
+      memory_order_acquire);
+  LPTASK pTask = atomic_load_explicit(
+      &pArray->aTasks[nTop & (pArray->nSize - 1)], memory_order_relaxed);
+
+  if (!atomic_compare_exchange_strong_explicit(&pVictim->nTop, &nTop,
+      nTop + 1, memory_order_seq_cst, memory_order_relaxed)) {
+    return NULL;
+  }
+
+  return pTask;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _DequeIsEmpty: Gets whether the deque of a worker appears to be empty.
+
+BOOL _DequeIsEmpty(LPTASKWORKER pWorker) {
+  return atomic_load_explicit(&pWorker->nTop, memory_order_seq_cst)
+      >= atomic_load_explicit(&pWorker->nBottom, memory_order_seq_cst);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _PopInjectedTask: Takes the oldest task off of the injection queue.
+
+LPTASK _PopInjectedTask(LPTASKSCHEDULER pScheduler) {
+  if (0 == atomic_load_explicit(&pScheduler->nInjected,
+      memory_order_acquire)) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&pScheduler->mutex);
+
+  LPTASK pTask = pScheduler->pInjectHead;
+  if (NULL != pTask) {
+    pScheduler->pInjectHead = pTask->pNext;
+    if (NULL == pScheduler->pInjectHead) {
+      pScheduler->pInjectTail = NULL;
+    }
+    atomic_fetch_sub(&pScheduler->nInjected, 1);
+  }
+
+  pthread_mutex_unlock(&pScheduler->mutex);
+
+  return pTask;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _FindTask: Looks for a task for the calling worker to run: first in its own
+// deque, then in the injection queue, then in the deques of the others.
+
+LPTASK _FindTask(LPTASKWORKER pWorker) {
+  LPTASK pTask = _TakeTask(pWorker);
+  if (NULL != pTask) {
+    return pTask;
+  }
+
+  LPTASKSCHEDULER pScheduler = pWorker->pScheduler;
+
+  pTask = _PopInjectedTask(pScheduler);
+  if (NULL != pTask) {
+    return pTask;
+  }
+
+  int nWorkerCount = pScheduler->nWorkerCount;
+  if (nWorkerCount < 2) {
+    return NULL;
+  }
+
+  /* Start at a random victim so that thieves spread out */
+  pWorker->nRandomSeed ^= pWorker->nRandomSeed << 13;
+  pWorker->nRandomSeed ^= pWorker->nRandomSeed >> 17;
+  pWorker->nRandomSeed ^= pWorker->nRandomSeed << 5;
+  int nStart = (int) (pWorker->nRandomSeed % (unsigned int) nWorkerCount);
+
+  for (int i = 0; i < nWorkerCount; i++) {
+    LPTASKWORKER pVictim = &pScheduler->pWorkers[(nStart + i) % nWorkerCount];
+    if (pVictim == pWorker) {
+      continue;
+    }
+
+    pTask = _StealTask(pVictim);
+    if (NULL != pTask) {
+      return pTask;
+    }
+  }
+
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AllocTask: Gets a task block, from the calling worker's free list if it
+// has one.
+
+LPTASK _AllocTask(void) {
+  LPTASKWORKER pWorker = g_pCurrentWorker;
+  if (NULL != pWorker && NULL != pWorker->pFreeTasks) {
+    LPTASK pTask = pWorker->pFreeTasks;
+    pWorker->pFreeTasks = pTask->pNext;
+    pWorker->nFreeTasks--;
+    return pTask;
+  }
+
+  return (LPTASK) malloc(sizeof(TASK));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _FreeTask: Returns a task block to the calling worker's free list, or to
+// the heap if the list is full.
+
+void _FreeTask(LPTASK pTask) {
+  LPTASKWORKER pWorker = g_pCurrentWorker;
+  if (NULL != pWorker && pWorker->nFreeTasks < TASK_FREE_LIST_MAX) {
+    pTask->pNext = pWorker->pFreeTasks;
+    pWorker->pFreeTasks = pTask;
+    pWorker->nFreeTasks++;
+    return;
+  }
+
+  free(pTask);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _WakeWorker: Wakes a sleeping worker, if there is one, after new work was
+// published.
+
+void _WakeWorker(LPTASKSCHEDULER pScheduler) {
+  /* Pairs with the increment of nSleepers in _WorkerSleep so that either we
+   * see the sleeper or it sees the new task. */
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if (0 == atomic_load_explicit(&pScheduler->nSleepers,
+      memory_order_relaxed)) {
+    return;
+  }
+
+  pthread_mutex_lock(&pScheduler->mutex);
+  pthread_cond_signal(&pScheduler->condWork);
+  pthread_mutex_unlock(&pScheduler->mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _WorkerSleep: Puts an idle worker to sleep until work shows up.
+
+void _WorkerSleep(LPTASKWORKER pWorker) {
+  LPTASKSCHEDULER pScheduler = pWorker->pScheduler;
+
+  pthread_mutex_lock(&pScheduler->mutex);
+  atomic_fetch_add(&pScheduler->nSleepers, 1);
+
+  BOOL bWorkAvailable = NULL != pScheduler->pInjectHead
+      || atomic_load(&pScheduler->bShutdown);
+  for (int i = 0; !bWorkAvailable && i < pScheduler->nWorkerCount; i++) {
+    bWorkAvailable = !_DequeIsEmpty(&pScheduler->pWorkers[i]);
+  }
+
+  if (!bWorkAvailable) {
+    struct timespec deadline;
+    _GetAbsoluteDeadline(TASK_IDLE_SLEEP_MS, &deadline);
+    pthread_cond_timedwait(&pScheduler->condWork, &pScheduler->mutex,
+        &deadline);
+  }
+
+  atomic_fetch_sub(&pScheduler->nSleepers, 1);
+  pthread_mutex_unlock(&pScheduler->mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CompleteFrame: Records that one child of a frame has finished, waking the
+// owner of the frame if it is a thread sleeping in SyncTasks.
+
+void _CompleteFrame(LPTASKFRAME pFrame) {
+  /* Once the count drops to zero, the owner may leave SyncTasks and free
+   * the frame, so it must not be touched after the decrement */
+  BOOL bExternal = pFrame->bExternal;
+
+  if (1 != atomic_fetch_sub_explicit(&pFrame->nPending, 1,
+      memory_order_acq_rel)) {
+    return;
+  }
+
+  if (bExternal) {
+    pthread_mutex_lock(&g_externalSyncMutex);
+    pthread_cond_broadcast(&g_externalSyncCond);
+    pthread_mutex_unlock(&g_externalSyncMutex);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RunTask: Runs a task on the calling worker, joins its children, and
+// reports its completion to its parent.
+
+void _RunTask(LPTASKWORKER pWorker, LPTASK pTask) {
+  LPTASKFRAME pSavedFrame = g_pCurrentFrame;
+
+  /* A task nested inside another (see SyncTasks) only frees its own arena
+   * allocations, not those of the task it interrupted */
+  ARENAMARK arenaMark;
+  _SaveThreadArena(&arenaMark);
+
+  atomic_init(&pTask->frame.nPending, 0);
+  pTask->frame.bExternal = FALSE;
+  g_pCurrentFrame = &pTask->frame;
+
+  pTask->lpfnTask(pTask->pUserState);
+
+  /* Strict fork/join: a task is not done until its children are */
+  SyncTasks(pWorker->pScheduler);
+
+  g_pCurrentFrame = pSavedFrame;
+
+  _RestoreThreadArena(&arenaMark);
+
+  LPTASKFRAME pParent = pTask->pParent;
+  _FreeTask(pTask);
+  _CompleteFrame(pParent);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _TaskWorkerProc: Thread procedure of every worker of a task scheduler.
+
+void* _TaskWorkerProc(void* pUserState) {
+  LPTASKWORKER pWorker = (LPTASKWORKER) pUserState;
+  LPTASKSCHEDULER pScheduler = pWorker->pScheduler;
+
+  g_pCurrentWorker = pWorker;
+
+  int nFailedRounds = 0;
+  while (!atomic_load_explicit(&pScheduler->bShutdown,
+      memory_order_acquire)) {
+    LPTASK pTask = _FindTask(pWorker);
+    if (NULL != pTask) {
+      nFailedRounds = 0;
+      _RunTask(pWorker, pTask);
+      continue;
+    }
+
+    if (++nFailedRounds < TASK_STEAL_ROUNDS) {
+      sched_yield();
+      continue;
+    }
+
+    nFailedRounds = 0;
+    _WorkerSleep(pWorker);
+  }
+
+  while (NULL != pWorker->pFreeTasks) {
+    LPTASK pNext = pWorker->pFreeTasks->pNext;
+    free(pWorker->pFreeTasks);
+    pWorker->pFreeTasks = pNext;
+  }
+  pWorker->nFreeTasks = 0;
+
+  g_pCurrentWorker = NULL;
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _FreeTaskScheduler: Releases the memory consumed by a scheduler whose
+// workers are no longer running.
+
+void _FreeTaskScheduler(LPTASKSCHEDULER pScheduler) {
+  for (int i = 0; i < pScheduler->nWorkerCount; i++) {
+    LPTASKWORKER pWorker = &pScheduler->pWorkers[i];
+    LPTASKARRAY pArray = atomic_load(&pWorker->pArray);
+
+    /* Discard tasks that never got to run */
+    for (long j = atomic_load(&pWorker->nTop);
+        j < atomic_load(&pWorker->nBottom); j++) {
+      free(atomic_load(&pArray->aTasks[j & (pArray->nSize - 1)]));
+    }
+
+    while (NULL != pArray) {
+      LPTASKARRAY pRetired = pArray->pRetired;
+      free(pArray);
+      pArray = pRetired;
+    }
+  }
+
+  while (NULL != pScheduler->pInjectHead) {
+    LPTASK pNext = pScheduler->pInjectHead->pNext;
+    free(pScheduler->pInjectHead);
+    pScheduler->pInjectHead = pNext;
+  }
+
+  pthread_cond_destroy(&pScheduler->condWork);
+  pthread_mutex_destroy(&pScheduler->mutex);
+
+  free(pScheduler->pWorkers);
+  free(pScheduler);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateTaskScheduler function
+
+HTASKSCHEDULER CreateTaskScheduler(int nWorkerThreads) {
+  return CreateTaskSchedulerEx(nWorkerThreads, THREAD_PLACEMENT_NONE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateTaskSchedulerEx function
+
+HTASKSCHEDULER CreateTaskSchedulerEx(int nWorkerThreads, int nPlacement) {
+  if (nWorkerThreads <= 0 && THREAD_PLACEMENT_NONE != nPlacement) {
+    nWorkerThreads = GetPhysicalCoreCount();
+  }
+
+  if (nWorkerThreads <= 0) {
+    nWorkerThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nWorkerThreads <= 0) {
+      nWorkerThreads = 1;
+    }
+  }
+
+  LPTASKSCHEDULER pScheduler =
+      (LPTASKSCHEDULER) calloc(1, sizeof(TASKSCHEDULER));
+  if (NULL == pScheduler) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  LPTASKWORKER pWorkers = NULL;
+  if (OK != posix_memalign((void**) &pWorkers, CACHE_LINE_SIZE,
+      nWorkerThreads * sizeof(TASKWORKER))) {
+    free(pScheduler);
+    return INVALID_HANDLE_VALUE;
+  }
+  memset(pWorkers, 0, nWorkerThreads * sizeof(TASKWORKER));
+
+  pScheduler->pWorkers = pWorkers;
+  pthread_mutex_init(&pScheduler->mutex, NULL);
+  _InitCondition(&pScheduler->condWork);
+
+  for (int i = 0; i < nWorkerThreads; i++) {
+    LPTASKARRAY pArray = _CreateTaskArray(TASK_DEQUE_INITIAL_SIZE);
+    if (NULL == pArray) {
+      _FreeTaskScheduler(pScheduler);
+      return INVALID_HANDLE_VALUE;
+    }
+
+    atomic_init(&pWorkers[i].pArray, pArray);
+    pWorkers[i].pScheduler = pScheduler;
+    pWorkers[i].nIndex = i;
+    pWorkers[i].nRandomSeed = 2654435761U * (unsigned int) (i + 1);
+
+    /* Count the worker only once its deque exists so that a partially
+     * built scheduler can be freed */
+    pScheduler->nWorkerCount = i + 1;
+  }
+
+  THREAD_ATTRIBUTES attributes;
+  InitThreadAttributes(&attributes);
+
+  for (int i = 0; i < nWorkerThreads; i++) {
+    GetPlacementCpuSet(nPlacement, i, &attributes.cpuSet);
+
+    pWorkers[i].hThread = CreateThreadEx2(_TaskWorkerProc, &pWorkers[i],
+        &attributes);
+    if (INVALID_HANDLE_VALUE == pWorkers[i].hThread) {
+      DestroyTaskScheduler(pScheduler);
+      return INVALID_HANDLE_VALUE;
+    }
+  }
+
+  return (HTASKSCHEDULER) pScheduler;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyTaskScheduler function
+
+int DestroyTaskScheduler(HTASKSCHEDULER hScheduler) {
+  if (INVALID_HANDLE_VALUE == hScheduler) {
+    return EINVAL;
+  }
+
+  LPTASKSCHEDULER pScheduler = (LPTASKSCHEDULER) hScheduler;
+
+  pthread_mutex_lock(&pScheduler->mutex);
+  atomic_store(&pScheduler->bShutdown, TRUE);
+  pthread_cond_broadcast(&pScheduler->condWork);
+  pthread_mutex_unlock(&pScheduler->mutex);
+
+  int nResult = OK;
+  for (int i = 0; i < pScheduler->nWorkerCount; i++) {
+    if (INVALID_HANDLE_VALUE == pScheduler->pWorkers[i].hThread) {
+      continue;   // CreateTaskScheduler failed before starting this one
+    }
+
+    int nJoinResult = WaitThread(pScheduler->pWorkers[i].hThread);
+    if (OK != nJoinResult) {
+      nResult = nJoinResult;
+    }
+  }
+
+  _FreeTaskScheduler(pScheduler);
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetTaskSchedulerWorkerCount function
+
+int GetTaskSchedulerWorkerCount(HTASKSCHEDULER hScheduler) {
+  if (INVALID_HANDLE_VALUE == hScheduler) {
+    return ERROR;
+  }
+
+  return ((LPTASKSCHEDULER) hScheduler)->nWorkerCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetCurrentWorkerIndex function
+
+int GetCurrentWorkerIndex(void) {
+  if (NULL == g_pCurrentWorker) {
+    return ERROR;
+  }
+
+  return g_pCurrentWorker->nIndex;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetSchedulerWorkerIndex: Gets the index of the calling thread among the
+// workers of a particular scheduler.  Shared with the other modules of this
+// library.
+
+int _GetSchedulerWorkerIndex(HTASKSCHEDULER hScheduler) {
+  if (NULL == g_pCurrentWorker
+      || g_pCurrentWorker->pScheduler != (LPTASKSCHEDULER) hScheduler) {
+    return ERROR;
+  }
+
+  return g_pCurrentWorker->nIndex;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SpawnTask function
+
+BOOL SpawnTask(HTASKSCHEDULER hScheduler, LPTHREAD_START_ROUTINE lpfnTask,
+    void* pUserState) {
+  if (INVALID_HANDLE_VALUE == hScheduler) {
+    return FALSE;
+  }
+
+  if (NULL == lpfnTask) {
+    return FALSE;
+  }
+
+  LPTASKSCHEDULER pScheduler = (LPTASKSCHEDULER) hScheduler;
+
+  LPTASK pTask = _AllocTask();
+  if (NULL == pTask) {
+    return FALSE;
+  }
+
+  LPTASKFRAME pParent = g_pCurrentFrame;
+  if (NULL == pParent) {
+    pParent = &g_externalFrame;
+  }
+
+  pTask->lpfnTask = lpfnTask;
+  pTask->pUserState = pUserState;
+  pTask->pParent = pParent;
+  pTask->pNext = NULL;
+
+  atomic_fetch_add_explicit(&pParent->nPending, 1, memory_order_relaxed);
+
+  LPTASKWORKER pWorker = g_pCurrentWorker;
+  if (NULL != pWorker && pWorker->pScheduler == pScheduler
+      && _PushTask(pWorker, pTask)) {
+    _WakeWorker(pScheduler);
+    return TRUE;
+  }
+
+  pthread_mutex_lock(&pScheduler->mutex);
+  if (NULL == pScheduler->pInjectTail) {
+    pScheduler->pInjectHead = pTask;
+  } else {
+    pScheduler->pInjectTail->pNext = pTask;
+  }
+  pScheduler->pInjectTail = pTask;
+  atomic_fetch_add(&pScheduler->nInjected, 1);
+  pthread_cond_signal(&pScheduler->condWork);
+  pthread_mutex_unlock(&pScheduler->mutex);
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SyncTasks function
+
+int SyncTasks(HTASKSCHEDULER hScheduler) {
+  if (INVALID_HANDLE_VALUE == hScheduler) {
+    return EINVAL;
+  }
+
+  LPTASKSCHEDULER pScheduler = (LPTASKSCHEDULER) hScheduler;
+  LPTASKWORKER pWorker = g_pCurrentWorker;
+  LPTASKFRAME pFrame = g_pCurrentFrame;
+
+  if (NULL == pFrame) {
+    /* Not inside a task; sleep until the thread's children have finished */
+    pFrame = &g_externalFrame;
+
+    pthread_mutex_lock(&g_externalSyncMutex);
+    while (atomic_load_explicit(&pFrame->nPending,
+        memory_order_acquire) > 0) {
+      pthread_cond_wait(&g_externalSyncCond, &g_externalSyncMutex);
+    }
+    pthread_mutex_unlock(&g_externalSyncMutex);
+
+    return OK;
+  }
+
+  if (NULL == pWorker || pWorker->pScheduler != pScheduler) {
+    return EINVAL;  // tasks of one scheduler cannot sync on another
+  }
+
+  /* Inside a task; help out until our children are done.  Any task we run
+   * here is either one of our own children or some unrelated task that we
+   * stole, which is fine either way. */
+  while (atomic_load_explicit(&pFrame->nPending, memory_order_acquire) > 0) {
+    LPTASK pTask = _FindTask(pWorker);
+    if (NULL != pTask) {
+      _RunTask(pWorker, pTask);
+    } else {
+      sched_yield();
+    }
+  }
+
+  return OK;
+}
@@ -0,0 +1,288 @@
+// thread_arena.c - Implementations of the functions defined in
+// thread_arena.h
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+#include "thread_arena.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief Block of memory that an arena hands out allocations from.
+ */
+typedef struct _ARENACHUNK {
+  struct _ARENACHUNK* pNext;
+  size_t nSize;                     // bytes of aData
+  _Alignas(THREAD_ARENA_ALIGNMENT) char aData[];
+} ARENACHUNK, *LPARENACHUNK;
+
+/**
+ * @brief State of an arena.  Chunks are kept in the order they are used;
+ * the ones after pCurrent are spares.
+ */
+struct _THREADARENA {
+  LPARENACHUNK pFirst;
+  LPARENACHUNK pCurrent;            // NULL until the first allocation
+  size_t nUsed;                     // bytes of pCurrent handed out
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+/* Arenas of threads that this library did not create, which have no control
+ * block to keep them in; g_arenaKey destroys them when the thread exits */
+static __thread LPTHREADARENA g_pForeignArena = NULL;
+static pthread_once_t g_arenaKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_arenaKey;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _DestroyThreadArena: Gives all the chunks of an arena, and the arena
+// itself, back to the heap.  Shared with the other modules of this library.
+
+void _DestroyThreadArena(void* pvArena) {
+  LPTHREADARENA pArena = (LPTHREADARENA) pvArena;
+  if (NULL == pArena) {
+    return;
+  }
+
+  while (NULL != pArena->pFirst) {
+    LPARENACHUNK pNext = pArena->pFirst->pNext;
+    free(pArena->pFirst);
+    pArena->pFirst = pNext;
+  }
+
+  free(pArena);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ClearForeignArena: Destructor of g_arenaKey.
+
+void _ClearForeignArena(void* pvArena) {
+  g_pForeignArena = NULL;
+  _DestroyThreadArena(pvArena);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CreateArenaKey: Creates g_arenaKey, once.
+
+void _CreateArenaKey(void) {
+  pthread_key_create(&g_arenaKey, _ClearForeignArena);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetArenaSlot: Gets where the arena of the calling thread is kept.
+
+LPTHREADARENA* _GetArenaSlot(BOOL* pbForeign) {
+  LPTHREADARENA* ppArena = (LPTHREADARENA*) _GetCurrentThreadArenaSlot();
+
+  *pbForeign = (NULL == ppArena);
+
+  return *pbForeign ? &g_pForeignArena : ppArena;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AllocFromNextChunk: Slow path of ArenaAlloc, for when the current chunk
+// is full.  Moves on to the next spare chunk if the block fits, or else
+// puts a new chunk in front of it.
+
+void* _AllocFromNextChunk(LPTHREADARENA pArena, size_t nSize) {
+  LPARENACHUNK pNext = (NULL != pArena->pCurrent)
+      ? pArena->pCurrent->pNext : pArena->pFirst;
+
+  if (NULL == pNext || pNext->nSize < nSize) {
+    size_t nChunkSize = (nSize > THREAD_ARENA_CHUNK_SIZE)
+        ? nSize : THREAD_ARENA_CHUNK_SIZE;
+    if (nChunkSize > SIZE_MAX - sizeof(ARENACHUNK)) {
+      return NULL;
+    }
+
+    LPARENACHUNK pChunk = (LPARENACHUNK) malloc(sizeof(ARENACHUNK)
+        + nChunkSize);
+    if (NULL == pChunk) {
+      return NULL;
+    }
+
+    pChunk->nSize = nChunkSize;
+    pChunk->pNext = pNext;
+    if (NULL != pArena->pCurrent) {
+      pArena->pCurrent->pNext = pChunk;
+    } else {
+      pArena->pFirst = pChunk;
+    }
+    pNext = pChunk;
+  }
+
+  pArena->pCurrent = pNext;
+  pArena->nUsed = nSize;
+
+  return pNext->aData;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _TrimSpareChunks: Frees the spare chunks of an arena beyond the number it
+// is allowed to keep, and any that are bigger than usual.
+
+void _TrimSpareChunks(LPTHREADARENA pArena) {
+  LPARENACHUNK* ppLink = (NULL != pArena->pCurrent)
+      ? &pArena->pCurrent->pNext : &pArena->pFirst;
+  int nKept = 0;
+
+  while (NULL != *ppLink) {
+    LPARENACHUNK pChunk = *ppLink;
+    if (nKept < THREAD_ARENA_SPARE_CHUNKS
+        && THREAD_ARENA_CHUNK_SIZE == pChunk->nSize) {
+      nKept++;
+      ppLink = &pChunk->pNext;
+      continue;
+    }
+
+    *ppLink = pChunk->pNext;
+    free(pChunk);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _SaveThreadArena: Gets the current position in the arena of the calling
+// thread, without setting the arena up if it has none.  Shared with the
+// other modules of this library.
+
+void _SaveThreadArena(LPARENAMARK pMark) {
+  BOOL bForeign = FALSE;
+  LPTHREADARENA pArena = *_GetArenaSlot(&bForeign);
+
+  pMark->pvChunk = (NULL != pArena) ? pArena->pCurrent : NULL;
+  pMark->nUsed = (NULL != pArena) ? pArena->nUsed : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RestoreThreadArena: Frees what the calling thread has allocated from its
+// arena since _SaveThreadArena.  Shared with the other modules of this
+// library.
+
+void _RestoreThreadArena(const ARENAMARK* pMark) {
+  BOOL bForeign = FALSE;
+  LPTHREADARENA pArena = *_GetArenaSlot(&bForeign);
+
+  /* Cheap unless something was allocated in between */
+  if (NULL != pArena && (pArena->pCurrent != pMark->pvChunk
+      || pArena->nUsed != pMark->nUsed)) {
+    ResetArenaToMark(pArena, pMark);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// GetThreadArena function
+
+HARENA GetThreadArena(void) {
+  BOOL bForeign = FALSE;
+  LPTHREADARENA* ppArena = _GetArenaSlot(&bForeign);
+
+  if (NULL != *ppArena) {
+    return *ppArena;
+  }
+
+  LPTHREADARENA pArena = (LPTHREADARENA) calloc(1, sizeof(THREADARENA));
+  if (NULL == pArena) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  if (bForeign) {
+    pthread_once(&g_arenaKeyOnce, _CreateArenaKey);
+    if (OK != pthread_setspecific(g_arenaKey, pArena)) {
+      free(pArena);
+      return INVALID_HANDLE_VALUE;
+    }
+  }
+
+  *ppArena = pArena;
+
+  return pArena;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ArenaAlloc function
+
+void* ArenaAlloc(HARENA hArena, size_t nSize) {
+  if (INVALID_HANDLE_VALUE == hArena) {
+    return NULL;
+  }
+
+  LPTHREADARENA pArena = (LPTHREADARENA) hArena;
+  LPARENACHUNK pChunk = pArena->pCurrent;
+
+  if (NULL != pChunk) {
+    size_t nOffset = (pArena->nUsed + THREAD_ARENA_ALIGNMENT - 1)
+        & ~((size_t) THREAD_ARENA_ALIGNMENT - 1);
+    if (nOffset <= pChunk->nSize && nSize <= pChunk->nSize - nOffset) {
+      pArena->nUsed = nOffset + nSize;
+      return pChunk->aData + nOffset;
+    }
+  }
+
+  return _AllocFromNextChunk(pArena, nSize);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetArenaMark function
+
+ARENAMARK GetArenaMark(HARENA hArena) {
+  ARENAMARK mark = { NULL, 0 };
+
+  if (INVALID_HANDLE_VALUE != hArena) {
+    mark.pvChunk = ((LPTHREADARENA) hArena)->pCurrent;
+    mark.nUsed = ((LPTHREADARENA) hArena)->nUsed;
+  }
+
+  return mark;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ResetArenaToMark function
+
+void ResetArenaToMark(HARENA hArena, const ARENAMARK* pMark) {
+  if (INVALID_HANDLE_VALUE == hArena || NULL == pMark) {
+    return;
+  }
+
+  LPTHREADARENA pArena = (LPTHREADARENA) hArena;
+  pArena->pCurrent = (LPARENACHUNK) pMark->pvChunk;
+  pArena->nUsed = pMark->nUsed;
+
+  _TrimSpareChunks(pArena);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ResetArena function
+
+void ResetArena(HARENA hArena) {
+  ARENAMARK mark = { NULL, 0 };
+  ResetArenaToMark(hArena, &mark);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PromoteArenaBlock function
+
+void* PromoteArenaBlock(const void* pvBlock, size_t nSize) {
+  if (NULL == pvBlock) {
+    return NULL;
+  }
+
+  void* pvCopy = malloc((nSize > 0) ? nSize : 1);
+  if (NULL != pvCopy) {
+    memcpy(pvCopy, pvBlock, nSize);
+  }
+
+  return pvCopy;
+}
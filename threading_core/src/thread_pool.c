@@ -0,0 +1,385 @@
+// thread_pool.c - Implementations of the functions defined in thread_pool.h
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+#include "thread_pool.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief Node of the queue of work items that are waiting for a worker.
+ */
+typedef struct _WORKITEM {
+  LPTHREAD_START_ROUTINE lpfnWorkItem;
+  void* pUserState;
+  struct _WORKITEM* pNext;
+} WORKITEM, *LPWORKITEM;
+
+struct _THREADPOOL {
+  pthread_mutex_t mutex;
+  pthread_cond_t condWork;       // signalled when a work item is queued
+  pthread_cond_t condIdle;       // signalled when nOutstanding drops to zero
+
+  LPWORKITEM pHead;              // next work item to run
+  LPWORKITEM pTail;              // last work item queued
+  LPWORKITEM pFreeItems;         // recycled queue nodes
+
+  int nOutstanding;              // work items queued or running
+  int nQueued;                   // work items not yet picked up by a worker
+  int nIdleThreads;              // workers waiting for work
+  int nMinThreads;
+  int nMaxThreads;
+  int nThreadCount;              // number of entries used in phThreads
+  HTHREAD* phThreads;            // handles of the live workers
+  int nPlacement;                // THREAD_PLACEMENT_* for new workers
+
+  BOOL bShutdown;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+void* _ThreadPoolWorkerProc(void* pUserState);
+
+///////////////////////////////////////////////////////////////////////////////
+// _AddWorkerThread: Starts a new worker for the pool.  The pool's mutex must be
+// held by the caller.
+
+BOOL _AddWorkerThread(LPTHREADPOOL pPool) {
+  if (pPool->nThreadCount >= pPool->nMaxThreads) {
+    return FALSE;
+  }
+
+  /* Workers take the placement of the slot they fill, so a worker that
+   * replaces a retired one ends up on the core its predecessor left. */
+  THREAD_ATTRIBUTES attributes;
+  InitThreadAttributes(&attributes);
+  GetPlacementCpuSet(pPool->nPlacement, pPool->nThreadCount,
+      &attributes.cpuSet);
+
+  HTHREAD hThread = CreateThreadEx2(_ThreadPoolWorkerProc, pPool,
+      &attributes);
+  if (INVALID_HANDLE_VALUE == hThread) {
+    return FALSE;
+  }
+
+  pPool->phThreads[pPool->nThreadCount++] = hThread;
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RetireWorkerThread: Removes the calling worker from the pool's list of live
+// workers and releases its handle.  The pool's mutex must be held by the
+// caller.  Since nobody will ever join a retired worker, releasing its handle
+// also detaches it.
+
+void _RetireWorkerThread(LPTHREADPOOL pPool) {
+  pthread_t nSelf = pthread_self();
+
+  for (int i = 0; i < pPool->nThreadCount; i++) {
+    pthread_t nThreadID;
+    if (OK != GetThreadId(pPool->phThreads[i], &nThreadID)
+        || !pthread_equal(nThreadID, nSelf)) {
+      continue;
+    }
+
+    HTHREAD hThread = pPool->phThreads[i];
+    pPool->phThreads[i] = pPool->phThreads[--pPool->nThreadCount];
+
+    DestroyThread(hThread);
+    return;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ThreadPoolWorkerProc: Thread procedure run by every worker of a pool.
+// Pulls work items off of the queue until the pool shuts down, or, for
+// workers above the minimum count, until it has been idle for too long.
+
+void* _ThreadPoolWorkerProc(void* pUserState) {
+  LPTHREADPOOL pPool = (LPTHREADPOOL) pUserState;
+
+  pthread_mutex_lock(&pPool->mutex);
+
+  while (TRUE) {
+    while (NULL == pPool->pHead && !pPool->bShutdown) {
+      pPool->nIdleThreads++;
+
+      int nResult = OK;
+      if (pPool->nThreadCount > pPool->nMinThreads) {
+        struct timespec deadline;
+        _GetAbsoluteDeadline(THREAD_POOL_IDLE_TIMEOUT_MS, &deadline);
+        nResult = pthread_cond_timedwait(&pPool->condWork, &pPool->mutex,
+            &deadline);
+      } else {
+        pthread_cond_wait(&pPool->condWork, &pPool->mutex);
+      }
+
+      pPool->nIdleThreads--;
+
+      if (ETIMEDOUT == nResult && NULL == pPool->pHead && !pPool->bShutdown
+          && pPool->nThreadCount > pPool->nMinThreads) {
+        _RetireWorkerThread(pPool);
+        pthread_mutex_unlock(&pPool->mutex);
+        return NULL;
+      }
+    }
+
+    if (NULL == pPool->pHead) {
+      break;  // shutting down and the queue has been drained
+    }
+
+    LPWORKITEM pItem = pPool->pHead;
+    pPool->pHead = pItem->pNext;
+    if (NULL == pPool->pHead) {
+      pPool->pTail = NULL;
+    }
+    pPool->nQueued--;
+
+    LPTHREAD_START_ROUTINE lpfnWorkItem = pItem->lpfnWorkItem;
+    void* pItemState = pItem->pUserState;
+
+    /* Recycle the queue node now so that QueueWorkItem does not have to go
+     * to the heap for the next item. */
+    pItem->pNext = pPool->pFreeItems;
+    pPool->pFreeItems = pItem;
+
+    pthread_mutex_unlock(&pPool->mutex);
+
+    /* The work item's arena allocations go when it returns */
+    ARENAMARK arenaMark;
+    _SaveThreadArena(&arenaMark);
+    lpfnWorkItem(pItemState);
+    _RestoreThreadArena(&arenaMark);
+
+    pthread_mutex_lock(&pPool->mutex);
+
+    if (0 == --pPool->nOutstanding) {
+      pthread_cond_broadcast(&pPool->condIdle);
+    }
+  }
+
+  pthread_mutex_unlock(&pPool->mutex);
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _FreeThreadPool: Releases the memory consumed by a pool whose workers have
+// all been joined.
+
+void _FreeThreadPool(LPTHREADPOOL pPool) {
+  LPWORKITEM pItem = pPool->pFreeItems;
+  while (NULL != pItem) {
+    LPWORKITEM pNext = pItem->pNext;
+    free(pItem);
+    pItem = pNext;
+  }
+
+  pthread_cond_destroy(&pPool->condIdle);
+  pthread_cond_destroy(&pPool->condWork);
+  pthread_mutex_destroy(&pPool->mutex);
+
+  free(pPool->phThreads);
+  free(pPool);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateThreadPool function
+
+HTHREADPOOL CreateThreadPool(int nMinThreads, int nMaxThreads) {
+  return CreateThreadPoolEx(nMinThreads, nMaxThreads, THREAD_PLACEMENT_NONE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateThreadPoolEx function
+
+HTHREADPOOL CreateThreadPoolEx(int nMinThreads, int nMaxThreads,
+    int nPlacement) {
+  if (nMinThreads < 0) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  if (nMaxThreads < nMinThreads) {
+    nMaxThreads = nMinThreads;
+  }
+
+  if (nMaxThreads <= 0) {
+    return INVALID_HANDLE_VALUE;  // a pool must be able to run something
+  }
+
+  LPTHREADPOOL pPool = (LPTHREADPOOL) calloc(1, sizeof(THREADPOOL));
+  if (NULL == pPool) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  pPool->phThreads = (HTHREAD*) calloc(nMaxThreads, sizeof(HTHREAD));
+  if (NULL == pPool->phThreads) {
+    free(pPool);
+    return INVALID_HANDLE_VALUE;
+  }
+
+  pPool->nMinThreads = nMinThreads;
+  pPool->nMaxThreads = nMaxThreads;
+  pPool->nPlacement = nPlacement;
+
+  pthread_mutex_init(&pPool->mutex, NULL);
+  _InitCondition(&pPool->condWork);
+  _InitCondition(&pPool->condIdle);
+
+  pthread_mutex_lock(&pPool->mutex);
+
+  for (int i = 0; i < nMinThreads; i++) {
+    if (!_AddWorkerThread(pPool)) {
+      pthread_mutex_unlock(&pPool->mutex);
+      DestroyThreadPool(pPool);
+      return INVALID_HANDLE_VALUE;
+    }
+  }
+
+  pthread_mutex_unlock(&pPool->mutex);
+
+  return (HTHREADPOOL) pPool;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyThreadPool function
+
+int DestroyThreadPool(HTHREADPOOL hThreadPool) {
+  if (INVALID_HANDLE_VALUE == hThreadPool) {
+    return EINVAL;
+  }
+
+  LPTHREADPOOL pPool = (LPTHREADPOOL) hThreadPool;
+
+  pthread_mutex_lock(&pPool->mutex);
+  pPool->bShutdown = TRUE;
+  pthread_cond_broadcast(&pPool->condWork);
+  pthread_mutex_unlock(&pPool->mutex);
+
+  /* Once bShutdown is set, workers no longer retire on their own, so the
+   * list of handles is stable and every worker can be joined. */
+  int nResult = OK;
+  for (int i = 0; i < pPool->nThreadCount; i++) {
+    int nJoinResult = WaitThread(pPool->phThreads[i]);
+    if (OK != nJoinResult) {
+      nResult = nJoinResult;
+    }
+  }
+
+  _FreeThreadPool(pPool);
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetThreadPoolThreadCount function
+
+int GetThreadPoolThreadCount(HTHREADPOOL hThreadPool) {
+  if (INVALID_HANDLE_VALUE == hThreadPool) {
+    return ERROR;
+  }
+
+  LPTHREADPOOL pPool = (LPTHREADPOOL) hThreadPool;
+
+  pthread_mutex_lock(&pPool->mutex);
+  int nThreadCount = pPool->nThreadCount;
+  pthread_mutex_unlock(&pPool->mutex);
+
+  return nThreadCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// QueueWorkItem function
+
+BOOL QueueWorkItem(HTHREADPOOL hThreadPool,
+    LPTHREAD_START_ROUTINE lpfnWorkItem, void* pUserState) {
+  if (INVALID_HANDLE_VALUE == hThreadPool) {
+    return FALSE;
+  }
+
+  if (NULL == lpfnWorkItem) {
+    return FALSE;  // nothing to run
+  }
+
+  LPTHREADPOOL pPool = (LPTHREADPOOL) hThreadPool;
+
+  pthread_mutex_lock(&pPool->mutex);
+
+  if (pPool->bShutdown) {
+    pthread_mutex_unlock(&pPool->mutex);
+    return FALSE;
+  }
+
+  LPWORKITEM pItem = pPool->pFreeItems;
+  if (NULL != pItem) {
+    pPool->pFreeItems = pItem->pNext;
+  } else {
+    pItem = (LPWORKITEM) malloc(sizeof(WORKITEM));
+    if (NULL == pItem) {
+      pthread_mutex_unlock(&pPool->mutex);
+      return FALSE;
+    }
+  }
+
+  pItem->lpfnWorkItem = lpfnWorkItem;
+  pItem->pUserState = pUserState;
+  pItem->pNext = NULL;
+
+  if (NULL == pPool->pTail) {
+    pPool->pHead = pItem;
+  } else {
+    pPool->pTail->pNext = pItem;
+  }
+  pPool->pTail = pItem;
+  pPool->nOutstanding++;
+  pPool->nQueued++;
+
+  /* Grow the pool if there are more items waiting than idle workers to pick
+   * them up.  If that fails (e.g., we are already at nMaxThreads) the item
+   * simply waits for the next free worker; however, a pool with no workers
+   * at all would never run it. */
+  if (pPool->nQueued > pPool->nIdleThreads && !_AddWorkerThread(pPool)
+      && 0 == pPool->nThreadCount) {
+    pPool->pHead = pItem->pNext;
+    pPool->pTail = NULL;
+    pPool->nOutstanding--;
+    pPool->nQueued--;
+    pItem->pNext = pPool->pFreeItems;
+    pPool->pFreeItems = pItem;
+    pthread_mutex_unlock(&pPool->mutex);
+    return FALSE;
+  }
+
+  pthread_cond_signal(&pPool->condWork);
+  pthread_mutex_unlock(&pPool->mutex);
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WaitThreadPool function
+
+int WaitThreadPool(HTHREADPOOL hThreadPool) {
+  if (INVALID_HANDLE_VALUE == hThreadPool) {
+    return EINVAL;
+  }
+
+  LPTHREADPOOL pPool = (LPTHREADPOOL) hThreadPool;
+
+  pthread_mutex_lock(&pPool->mutex);
+  while (pPool->nOutstanding > 0) {
+    pthread_cond_wait(&pPool->condIdle, &pPool->mutex);
+  }
+  pthread_mutex_unlock(&pPool->mutex);
+
+  return OK;
+}
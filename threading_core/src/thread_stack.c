@@ -0,0 +1,350 @@
+// thread_stack.c - Implements the stack size controls and the cache of
+// pre-faulted stacks that threads created by this library run on.
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief Stack of a thread that has been released without being joined, and
+ * that has to be reaped before the stack can be used again.
+ */
+typedef struct _ZOMBIESTACK {
+  pthread_t nThreadID;
+  THREADSTACK stack;
+  struct _ZOMBIESTACK* pNext;
+} ZOMBIESTACK, *LPZOMBIESTACK;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+static atomic_size_t g_nDefaultStackSize = 0;
+
+static pthread_mutex_t g_stackCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static int g_nMaxCachedStacks = 0;    // zero while the cache is off
+static size_t g_nPrefaultSize = 0;
+static LPTHREADSTACK g_pCachedStacks = NULL;  // g_nMaxCachedStacks entries
+static int g_nCachedStacks = 0;
+
+static LPZOMBIESTACK g_pZombieStacks = NULL;
+static atomic_int g_nZombieStacks = 0;  // lets creators skip the mutex
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _RoundUpToPage: Rounds a size up to a whole number of pages.  Shared with
+// the other modules of this library.
+
+size_t _RoundUpToPage(size_t nSize) {
+  size_t nPageSize = (size_t) sysconf(_SC_PAGESIZE);
+  return (nSize + nPageSize - 1) & ~(nPageSize - 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _UnmapThreadStack: Gives a stack back to the system.  Shared with the
+// other modules of this library.
+
+void _UnmapThreadStack(LPTHREADSTACK pStack) {
+  if (NULL != pStack->pvBase) {
+    munmap(pStack->pvBase, pStack->nMapSize);
+    pStack->pvBase = NULL;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _MapThreadStack: Maps a new stack, with an inaccessible guard area at the
+// bottom, and touches the top nPrefaultSize bytes of it so that the thread
+// does not fault them in one page at a time.  Shared with the other modules
+// of this library.
+
+BOOL _MapThreadStack(size_t nStackSize, size_t nGuardSize,
+    size_t nPrefaultSize, LPTHREADSTACK pStack) {
+  size_t nMapSize = nStackSize + nGuardSize;
+
+  void* pvBase = mmap(NULL, nMapSize, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == pvBase) {
+    return FALSE;
+  }
+
+  if (nGuardSize > 0 && OK != mprotect(pvBase, nGuardSize, PROT_NONE)) {
+    munmap(pvBase, nMapSize);
+    return FALSE;
+  }
+
+  if (nPrefaultSize > nStackSize) {
+    nPrefaultSize = nStackSize;
+  }
+
+  size_t nPageSize = (size_t) sysconf(_SC_PAGESIZE);
+  volatile char* pTop = (volatile char*) pvBase + nMapSize;
+  for (size_t nOffset = nPageSize; nOffset <= nPrefaultSize;
+      nOffset += nPageSize) {
+    pTop[-(ptrdiff_t) nOffset] = 0;
+  }
+
+  pStack->pvBase = pvBase;
+  pStack->nMapSize = nMapSize;
+  pStack->nGuardSize = nGuardSize;
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ReapThreadStacks: Collects the stacks of released threads that have
+// terminated in the meantime.
+
+void _ReapThreadStacks(void) {
+  if (0 == atomic_load_explicit(&g_nZombieStacks, memory_order_relaxed)) {
+    return;
+  }
+
+  LPZOMBIESTACK pReaped = NULL;
+
+  pthread_mutex_lock(&g_stackCacheMutex);
+
+  LPZOMBIESTACK* ppZombie = &g_pZombieStacks;
+  while (NULL != *ppZombie) {
+    LPZOMBIESTACK pZombie = *ppZombie;
+    if (OK != pthread_tryjoin_np(pZombie->nThreadID, NULL)) {
+      ppZombie = &pZombie->pNext;   // still running (EBUSY)
+      continue;
+    }
+
+    *ppZombie = pZombie->pNext;
+    pZombie->pNext = pReaped;
+    pReaped = pZombie;
+    atomic_fetch_sub_explicit(&g_nZombieStacks, 1, memory_order_relaxed);
+  }
+
+  pthread_mutex_unlock(&g_stackCacheMutex);
+
+  while (NULL != pReaped) {
+    LPZOMBIESTACK pNext = pReaped->pNext;
+    _ReleaseThreadStack(&pReaped->stack);
+    free(pReaped);
+    pReaped = pNext;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _PrepareThreadStack: Picks the stack for a new thread.  Shared with the
+// other modules of this library.
+
+int _PrepareThreadStack(pthread_attr_t* pAttr, size_t nStackSize,
+    size_t nGuardSize, LPTHREADSTACK pStack) {
+  int nResult = OK;
+
+  pStack->pvBase = NULL;
+
+  _ReapThreadStacks();
+
+  if (0 == nStackSize) {
+    nStackSize = atomic_load_explicit(&g_nDefaultStackSize,
+        memory_order_relaxed);
+  }
+
+  pthread_mutex_lock(&g_stackCacheMutex);
+  BOOL bUseCache = (g_nMaxCachedStacks > 0);
+  size_t nPrefaultSize = g_nPrefaultSize;
+  pthread_mutex_unlock(&g_stackCacheMutex);
+
+  if (!bUseCache) {
+    /* Let the system allocate the stack, just the size we want */
+    if (nStackSize > 0) {
+      nResult = pthread_attr_setstacksize(pAttr, nStackSize);
+    }
+    if (OK == nResult && THREAD_GUARD_SIZE_DEFAULT != nGuardSize) {
+      nResult = pthread_attr_setguardsize(pAttr, nGuardSize);
+    }
+    return nResult;
+  }
+
+  if (0 == nStackSize) {
+    pthread_attr_getstacksize(pAttr, &nStackSize);  // the system's default
+  }
+  if (nStackSize < (size_t) PTHREAD_STACK_MIN) {
+    nStackSize = (size_t) PTHREAD_STACK_MIN;
+  }
+  nStackSize = _RoundUpToPage(nStackSize);
+
+  nGuardSize = (THREAD_GUARD_SIZE_DEFAULT == nGuardSize)
+      ? (size_t) sysconf(_SC_PAGESIZE) : _RoundUpToPage(nGuardSize);
+
+  pthread_mutex_lock(&g_stackCacheMutex);
+  for (int i = 0; i < g_nCachedStacks; i++) {
+    if (g_pCachedStacks[i].nMapSize == nStackSize + nGuardSize
+        && g_pCachedStacks[i].nGuardSize == nGuardSize) {
+      *pStack = g_pCachedStacks[i];
+      g_pCachedStacks[i] = g_pCachedStacks[--g_nCachedStacks];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_stackCacheMutex);
+
+  if (NULL == pStack->pvBase && !_MapThreadStack(nStackSize, nGuardSize,
+      nPrefaultSize, pStack)) {
+    return ENOMEM;
+  }
+
+  nResult = pthread_attr_setstack(pAttr,
+      (char*) pStack->pvBase + pStack->nGuardSize, nStackSize);
+  if (OK != nResult) {
+    _UnmapThreadStack(pStack);
+  }
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ReleaseThreadStack: Puts a stack back into the cache, or unmaps it if the
+// cache is full or off.  Shared with the other modules of this library.
+
+void _ReleaseThreadStack(LPTHREADSTACK pStack) {
+  if (NULL == pStack->pvBase) {
+    return;
+  }
+
+  pthread_mutex_lock(&g_stackCacheMutex);
+  size_t nPrefaultSize = g_nPrefaultSize;
+  BOOL bCache = (g_nCachedStacks < g_nMaxCachedStacks);
+  pthread_mutex_unlock(&g_stackCacheMutex);
+
+  if (bCache) {
+    /* Keep the resident window warm for the next thread, but give back
+     * whatever the last one dirtied below it. */
+    size_t nStackSize = pStack->nMapSize - pStack->nGuardSize;
+    if (nPrefaultSize < nStackSize) {
+      madvise((char*) pStack->pvBase + pStack->nGuardSize,
+          _RoundUpToPage(nStackSize - nPrefaultSize), MADV_DONTNEED);
+    }
+
+    pthread_mutex_lock(&g_stackCacheMutex);
+    bCache = (g_nCachedStacks < g_nMaxCachedStacks);
+    if (bCache) {
+      g_pCachedStacks[g_nCachedStacks++] = *pStack;
+    }
+    pthread_mutex_unlock(&g_stackCacheMutex);
+  }
+
+  if (bCache) {
+    pStack->pvBase = NULL;
+  } else {
+    _UnmapThreadStack(pStack);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ReleaseThreadStackLater: Parks the stack of a thread that nobody is going
+// to join until the thread can be reaped.  Shared with the other modules of
+// this library.
+
+void _ReleaseThreadStackLater(pthread_t nThreadID, LPTHREADSTACK pStack) {
+  LPZOMBIESTACK pZombie = (LPZOMBIESTACK) malloc(sizeof(ZOMBIESTACK));
+  if (NULL == pZombie) {
+    /* Better to leak the stack than to pull it out from under a thread
+     * that may still be running on it */
+    pthread_detach(nThreadID);
+    pStack->pvBase = NULL;
+    return;
+  }
+
+  pZombie->nThreadID = nThreadID;
+  pZombie->stack = *pStack;
+  pStack->pvBase = NULL;
+
+  pthread_mutex_lock(&g_stackCacheMutex);
+  pZombie->pNext = g_pZombieStacks;
+  g_pZombieStacks = pZombie;
+  atomic_fetch_add_explicit(&g_nZombieStacks, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&g_stackCacheMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// SetDefaultThreadStackSize function
+
+void SetDefaultThreadStackSize(size_t nStackSize) {
+  atomic_store_explicit(&g_nDefaultStackSize, nStackSize,
+      memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetDefaultThreadStackSize function
+
+size_t GetDefaultThreadStackSize(void) {
+  return atomic_load_explicit(&g_nDefaultStackSize, memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetThreadStackCacheOptions function
+
+void SetThreadStackCacheOptions(int nMaxCachedStacks, size_t nPrefaultSize) {
+  if (nMaxCachedStacks < 0) {
+    nMaxCachedStacks = 0;
+  }
+
+  LPTHREADSTACK pCachedStacks = NULL;
+  if (nMaxCachedStacks > 0) {
+    pCachedStacks = (LPTHREADSTACK) calloc(nMaxCachedStacks,
+        sizeof(THREADSTACK));
+    if (NULL == pCachedStacks) {
+      return;   // keep the current settings
+    }
+  }
+
+  pthread_mutex_lock(&g_stackCacheMutex);
+
+  /* Carry over as many cached stacks as fit into the new cache, and swap
+   * the old array out so that the rest can be unmapped after unlocking */
+  int nKept = (g_nCachedStacks < nMaxCachedStacks)
+      ? g_nCachedStacks : nMaxCachedStacks;
+  for (int i = 0; i < nKept; i++) {
+    pCachedStacks[i] = g_pCachedStacks[g_nCachedStacks - nKept + i];
+  }
+
+  LPTHREADSTACK pOldStacks = g_pCachedStacks;
+  int nOldStacks = g_nCachedStacks - nKept;
+
+  g_pCachedStacks = pCachedStacks;
+  g_nCachedStacks = nKept;
+  g_nMaxCachedStacks = nMaxCachedStacks;
+  g_nPrefaultSize = _RoundUpToPage(nPrefaultSize);
+
+  pthread_mutex_unlock(&g_stackCacheMutex);
+
+  for (int i = 0; i < nOldStacks; i++) {
+    _UnmapThreadStack(&pOldStacks[i]);
+  }
+  free(pOldStacks);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TrimThreadStackCache function
+
+void TrimThreadStackCache(void) {
+  _ReapThreadStacks();
+
+  for (;;) {
+    THREADSTACK stack;
+
+    pthread_mutex_lock(&g_stackCacheMutex);
+    if (0 == g_nCachedStacks) {
+      pthread_mutex_unlock(&g_stackCacheMutex);
+      break;
+    }
+    stack = g_pCachedStacks[--g_nCachedStacks];
+    pthread_mutex_unlock(&g_stackCacheMutex);
+
+    _UnmapThreadStack(&stack);
+  }
+}
@@ -0,0 +1,537 @@
+// thread_trace.c - Implementations of the functions defined in
+// thread_trace.h: per-thread event rings and the Chrome trace-event writer.
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+#include "thread_trace.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @brief Shortest time, in nanoseconds, over which the time stamp counter is
+ * measured against CLOCK_MONOTONIC before a trace is written.
+ */
+#define TRACE_CALIBRATION_NS      10000000
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief One recorded event.  A span records when it began and how long it
+ * took; any other event just when it happened.
+ */
+typedef struct _TRACEEVENT {
+  uint64_t nTicks;
+  uint64_t nDuration;       // ticks; spans only
+  uint64_t nArg;            // handle, byte count or signal number
+  uint32_t nType;           // TRACE_EVENT_*
+  uint32_t nArg2;           // signal number of a stop request
+} TRACEEVENT, *LPTRACEEVENT;
+
+/**
+ * @brief Event ring of one thread.  Only the owning thread writes events and
+ * moves nHead on; the writer of a trace reads them while it holds
+ * g_traceMutex, and throws away the ones that may have been overwritten
+ * while it read them.
+ */
+typedef struct _TRACEBUFFER {
+  CACHE_ALIGNED atomic_uint_least64_t nHead;  // events ever recorded
+  uint64_t nTail;                   // events before it have been cleared
+  pid_t nTid;
+  pthread_t nThreadID;
+  char szName[THREAD_NAME_MAX_LENGTH];    // filled in once the thread exits
+  BOOL bExited;
+  struct _TRACEBUFFER* pNext;       // in the list of live or exited buffers
+  struct _TRACEBUFFER** ppPrev;     // live buffers only
+  CACHE_ALIGNED TRACEEVENT aEvents[THREAD_TRACE_BUFFER_EVENTS];
+} TRACEBUFFER, *LPTRACEBUFFER;
+
+/**
+ * @brief How an event of each kind is written out.
+ */
+typedef struct _TRACEEVENTINFO {
+  const char* pszName;
+  const char* pszCategory;
+  char chPhase;             // Chrome trace-event phase: B, E, X or i
+  const char* pszArgName;   // NULL if nArg is not written
+  BOOL bHandleArg;          // nArg is a thread handle
+} TRACEEVENTINFO;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+atomic_bool g_bThreadTraceEnabled = false;
+
+static const TRACEEVENTINFO g_aTraceEventInfo[TRACE_EVENT_COUNT] = {
+  { "CreateThread", "thread", 'i', "thread", TRUE },
+  { "Thread", "thread", 'B', "thread", TRUE },
+  { "Thread", "thread", 'E', NULL, FALSE },
+  { "Fiber start", "thread", 'i', "thread", TRUE },
+  { "Fiber exit", "thread", 'i', "thread", TRUE },
+  { "WaitThreadEx", "wait", 'B', "thread", TRUE },
+  { "WaitThreadEx", "wait", 'E', NULL, FALSE },
+  { "CancelThread", "thread", 'i', "thread", TRUE },
+  { "KillThread", "thread", 'i', "thread", TRUE },
+  { "Signal handler", "signal", 'X', "signal", FALSE },
+  { "MarshalBlock", "marshal", 'X', "bytes", FALSE },
+  { "DeMarshalBlock", "marshal", 'X', "bytes", FALSE },
+};
+
+static pthread_once_t g_traceOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_traceKey;    // runs _RetireTraceBuffer at thread exit
+
+/* Where the ticks of every event are measured from */
+static uint64_t g_nBaseTicks = 0;
+static struct timespec g_baseTime;
+
+/* Buffers of live threads, and of exited ones (oldest first); both
+ * protected by g_traceMutex */
+static pthread_mutex_t g_traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static LPTRACEBUFFER g_pLiveBuffers = NULL;
+static LPTRACEBUFFER g_pExitedBuffers = NULL;
+static LPTRACEBUFFER* g_ppExitedTail = &g_pExitedBuffers;
+static int g_nExitedBuffers = 0;
+static char* g_pszExitPath = NULL;
+static pthread_once_t g_atExitOnce = PTHREAD_ONCE_INIT;
+
+static __thread LPTRACEBUFFER g_pTraceBuffer = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _RetireTraceBuffer: Moves the buffer of an exiting thread to the list of
+// exited ones, dropping the oldest of those if there are too many.
+
+void _RetireTraceBuffer(void* pvBuffer) {
+  LPTRACEBUFFER pBuffer = (LPTRACEBUFFER) pvBuffer;
+  LPTRACEBUFFER pDropped = NULL;
+
+  g_pTraceBuffer = NULL;
+  pthread_getname_np(pthread_self(), pBuffer->szName,
+      THREAD_NAME_MAX_LENGTH);
+
+  pthread_mutex_lock(&g_traceMutex);
+
+  *pBuffer->ppPrev = pBuffer->pNext;
+  if (NULL != pBuffer->pNext) {
+    pBuffer->pNext->ppPrev = pBuffer->ppPrev;
+  }
+
+  pBuffer->bExited = TRUE;
+  pBuffer->pNext = NULL;
+  pBuffer->ppPrev = NULL;
+  *g_ppExitedTail = pBuffer;
+  g_ppExitedTail = &pBuffer->pNext;
+
+  if (++g_nExitedBuffers > THREAD_TRACE_MAX_EXITED) {
+    pDropped = g_pExitedBuffers;
+    g_pExitedBuffers = pDropped->pNext;
+    g_nExitedBuffers--;
+  }
+
+  pthread_mutex_unlock(&g_traceMutex);
+
+  free(pDropped);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _InitThreadTrace: Creates the key whose destructor retires the buffers of
+// exiting threads, and takes the time that ticks are measured from.
+
+void _InitThreadTrace(void) {
+  pthread_key_create(&g_traceKey, _RetireTraceBuffer);
+
+  g_nBaseTicks = _GetTraceTicks();
+  clock_gettime(CLOCK_MONOTONIC, &g_baseTime);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetTraceBuffer: Gets the buffer of the calling thread, giving it one the
+// first time around.  Returns NULL if we are out of memory.
+
+LPTRACEBUFFER _GetTraceBuffer(void) {
+  if (NULL != g_pTraceBuffer) {
+    return g_pTraceBuffer;
+  }
+
+  LPTRACEBUFFER pBuffer = NULL;
+  if (OK != posix_memalign((void**) &pBuffer, CACHE_LINE_SIZE,
+      sizeof(TRACEBUFFER))) {
+    return NULL;
+  }
+
+  atomic_init(&pBuffer->nHead, 0);
+  pBuffer->nTail = 0;
+  pBuffer->nTid = (pid_t) syscall(SYS_gettid);
+  pBuffer->nThreadID = pthread_self();
+  pBuffer->szName[0] = '\0';
+  pBuffer->bExited = FALSE;
+
+  pthread_mutex_lock(&g_traceMutex);
+  pBuffer->pNext = g_pLiveBuffers;
+  pBuffer->ppPrev = &g_pLiveBuffers;
+  if (NULL != g_pLiveBuffers) {
+    g_pLiveBuffers->ppPrev = &pBuffer->pNext;
+  }
+  g_pLiveBuffers = pBuffer;
+  pthread_mutex_unlock(&g_traceMutex);
+
+  pthread_setspecific(g_traceKey, pBuffer);
+  g_pTraceBuffer = pBuffer;
+
+  return pBuffer;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AppendTraceEvent: Writes an event to a buffer.  A signal handler that
+// records an event in between the two steps costs one of the two events,
+// but the buffer stays consistent.
+
+static inline void _AppendTraceEvent(LPTRACEBUFFER pBuffer, int nType,
+    uint64_t nTicks, uint64_t nDuration, uint64_t nArg, uint32_t nArg2) {
+  uint64_t nHead = atomic_load_explicit(&pBuffer->nHead,
+      memory_order_relaxed);
+
+  /* The slot may hold an event that a reader is copying.  A reader that
+   * sees the slot change must also see the head that tells it to throw the
+   * copy away, so the head goes out before the slot is touched. */
+  atomic_thread_fence(memory_order_release);
+
+  LPTRACEEVENT pEvent = &pBuffer->aEvents[nHead
+      & (THREAD_TRACE_BUFFER_EVENTS - 1)];
+  pEvent->nTicks = nTicks;
+  pEvent->nDuration = nDuration;
+  pEvent->nArg = nArg;
+  pEvent->nType = (uint32_t) nType;
+  pEvent->nArg2 = nArg2;
+
+  atomic_store_explicit(&pBuffer->nHead, nHead + 1, memory_order_release);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RecordTraceEvent: Records an event that happens at one point in time.
+// Shared with the other modules of this library.
+
+void _RecordTraceEvent(int nType, uint64_t nArg, uint32_t nArg2) {
+  LPTRACEBUFFER pBuffer = _GetTraceBuffer();
+  if (NULL == pBuffer || nType < 0 || nType >= TRACE_EVENT_COUNT) {
+    return;
+  }
+
+  _AppendTraceEvent(pBuffer, nType, _GetTraceTicks(), 0, nArg, nArg2);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RecordTraceSpan: Records an event that began at nStartTicks and ends now.
+// Shared with the other modules of this library.
+
+void _RecordTraceSpan(int nType, uint64_t nStartTicks, uint64_t nArg) {
+  LPTRACEBUFFER pBuffer = _GetTraceBuffer();
+  if (NULL == pBuffer || nType < 0 || nType >= TRACE_EVENT_COUNT) {
+    return;
+  }
+
+  _AppendTraceEvent(pBuffer, nType, nStartTicks,
+      _GetTraceTicks() - nStartTicks, nArg, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RecordSignalTraceSpan: Records the run of a signal handler that began at
+// nStartTicks.  Async-signal-safe: a thread that has no buffer yet does not
+// get one here.  Shared with the other modules of this library.
+
+void _RecordSignalTraceSpan(int nSignal, uint64_t nStartTicks) {
+  LPTRACEBUFFER pBuffer = g_pTraceBuffer;
+  if (NULL == pBuffer) {
+    return;
+  }
+
+  _AppendTraceEvent(pBuffer, TRACE_EVENT_SIGNAL, nStartTicks,
+      _GetTraceTicks() - nStartTicks, (uint64_t) nSignal, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetNsPerTick: Measures how many nanoseconds a tick of _GetTraceTicks
+// lasts, against CLOCK_MONOTONIC since tracing was first turned on.
+
+double _GetNsPerTick(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t nTicks = _GetTraceTicks();
+
+  if (_GetElapsedNs(&g_baseTime, &now) < TRACE_CALIBRATION_NS) {
+    struct timespec nap = { 0, TRACE_CALIBRATION_NS };
+    nanosleep(&nap, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    nTicks = _GetTraceTicks();
+  }
+
+  return (double) _GetElapsedNs(&g_baseTime, &now)
+      / (double) (nTicks - g_nBaseTicks);
+#else
+  return 1.0;   // the ticks are CLOCK_MONOTONIC nanoseconds already
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _WriteJsonString: Writes a string as a quoted JSON string.
+
+void _WriteJsonString(FILE* pFile, const char* psz) {
+  fputc('"', pFile);
+  for (; '\0' != *psz; psz++) {
+    unsigned char ch = (unsigned char) *psz;
+    if ('"' == ch || '\\' == ch) {
+      fputc('\\', pFile);
+      fputc(ch, pFile);
+    } else if (ch < 0x20) {
+      fprintf(pFile, "\\u%04x", ch);
+    } else {
+      fputc(ch, pFile);
+    }
+  }
+  fputc('"', pFile);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _WriteTraceEvent: Writes one event as a Chrome trace-event object.
+
+void _WriteTraceEvent(FILE* pFile, const TRACEEVENT* pEvent, pid_t nPid,
+    pid_t nTid, double dNsPerTick) {
+  const TRACEEVENTINFO* pInfo = &g_aTraceEventInfo[pEvent->nType];
+  double dTimestampUs = (double) (pEvent->nTicks - g_nBaseTicks)
+      * dNsPerTick / 1000.0;
+
+  fprintf(pFile, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\","
+      "\"ts\":%.3f,\"pid\":%d,\"tid\":%d", pInfo->pszName,
+      pInfo->pszCategory, pInfo->chPhase, dTimestampUs, (int) nPid,
+      (int) nTid);
+
+  if ('X' == pInfo->chPhase) {
+    fprintf(pFile, ",\"dur\":%.3f",
+        (double) pEvent->nDuration * dNsPerTick / 1000.0);
+  } else if ('i' == pInfo->chPhase) {
+    fputs(",\"s\":\"t\"", pFile);
+  }
+
+  if (NULL != pInfo->pszArgName) {
+    if (pInfo->bHandleArg) {
+      fprintf(pFile, ",\"args\":{\"%s\":\"%#" PRIx64 "\"", pInfo->pszArgName,
+          pEvent->nArg);
+    } else {
+      fprintf(pFile, ",\"args\":{\"%s\":%" PRIu64, pInfo->pszArgName,
+          pEvent->nArg);
+    }
+    if (TRACE_EVENT_KILL == pEvent->nType) {
+      fprintf(pFile, ",\"signal\":%u", pEvent->nArg2);
+    }
+    fputc('}', pFile);
+  }
+
+  fputc('}', pFile);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _WriteTraceBuffer: Writes the name of the thread a buffer belongs to, and
+// the events in it.  The events are copied to pCopy first, and the ones
+// that the thread may have overwritten in the meantime are left out.
+// g_traceMutex must be held by the caller.
+
+void _WriteTraceBuffer(FILE* pFile, LPTRACEBUFFER pBuffer,
+    LPTRACEEVENT pCopy, pid_t nPid, double dNsPerTick) {
+  char szName[THREAD_NAME_MAX_LENGTH];
+  if (pBuffer->bExited) {
+    memcpy(szName, pBuffer->szName, sizeof(szName));
+  } else if (OK != pthread_getname_np(pBuffer->nThreadID, szName,
+      sizeof(szName))) {
+    szName[0] = '\0';
+  }
+
+  if ('\0' != szName[0]) {
+    fprintf(pFile, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+        "\"tid\":%d,\"args\":{\"name\":", (int) nPid, (int) pBuffer->nTid);
+    _WriteJsonString(pFile, szName);
+    fputs("}}", pFile);
+  }
+
+  uint64_t nHead = atomic_load_explicit(&pBuffer->nHead,
+      memory_order_acquire);
+  uint64_t nFirst = (nHead > THREAD_TRACE_BUFFER_EVENTS)
+      ? nHead - THREAD_TRACE_BUFFER_EVENTS : 0;
+  if (nFirst < pBuffer->nTail) {
+    nFirst = pBuffer->nTail;
+  }
+
+  for (uint64_t i = nFirst; i < nHead; i++) {
+    pCopy[i - nFirst] = pBuffer->aEvents[i & (THREAD_TRACE_BUFFER_EVENTS - 1)];
+  }
+
+  /* While the head stood at nNow, the thread may have been writing event
+   * nNow, which goes where event nNow - THREAD_TRACE_BUFFER_EVENTS was */
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t nNow = atomic_load_explicit(&pBuffer->nHead,
+      memory_order_relaxed);
+  uint64_t nValid = (nNow >= THREAD_TRACE_BUFFER_EVENTS)
+      ? nNow - THREAD_TRACE_BUFFER_EVENTS + 1 : 0;
+
+  for (uint64_t i = (nValid > nFirst) ? nValid : nFirst; i < nHead; i++) {
+    _WriteTraceEvent(pFile, &pCopy[i - nFirst], nPid, pBuffer->nTid,
+        dNsPerTick);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _WriteTraceAtExit: Writes the trace to the path given to
+// SetThreadTraceExitPath, if any.  Registered with atexit().
+
+void _WriteTraceAtExit(void) {
+  pthread_mutex_lock(&g_traceMutex);
+  char* pszPath = (NULL != g_pszExitPath) ? strdup(g_pszExitPath) : NULL;
+  pthread_mutex_unlock(&g_traceMutex);
+
+  if (NULL != pszPath) {
+    WriteThreadTrace(pszPath);
+    free(pszPath);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RegisterTraceAtExit: Registers _WriteTraceAtExit with atexit(), once.
+
+void _RegisterTraceAtExit(void) {
+  atexit(_WriteTraceAtExit);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// EnableThreadTrace function
+
+void EnableThreadTrace(BOOL bEnable) {
+  pthread_once(&g_traceOnce, _InitThreadTrace);
+
+  atomic_store_explicit(&g_bThreadTraceEnabled, bEnable ? true : false,
+      memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsThreadTraceEnabled function
+
+BOOL IsThreadTraceEnabled(void) {
+  return atomic_load_explicit(&g_bThreadTraceEnabled,
+      memory_order_relaxed) ? TRUE : FALSE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WriteThreadTrace function
+
+int WriteThreadTrace(const char* pszPath) {
+  if (NULL == pszPath) {
+    return EINVAL;
+  }
+
+  pthread_once(&g_traceOnce, _InitThreadTrace);
+
+  LPTRACEEVENT pCopy = (LPTRACEEVENT) malloc(THREAD_TRACE_BUFFER_EVENTS
+      * sizeof(TRACEEVENT));
+  if (NULL == pCopy) {
+    return ENOMEM;
+  }
+
+  FILE* pFile = fopen(pszPath, "w");
+  if (NULL == pFile) {
+    int nResult = errno;
+    free(pCopy);
+    return nResult;
+  }
+
+  double dNsPerTick = _GetNsPerTick();
+  pid_t nPid = getpid();
+
+  /* The process name heads the file, which also spares every event after
+   * it from worrying about the comma in front of it */
+  fprintf(pFile, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+      "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":"
+      "{\"name\":", (int) nPid);
+  _WriteJsonString(pFile, program_invocation_short_name);
+  fputs("}}", pFile);
+
+  pthread_mutex_lock(&g_traceMutex);
+  for (LPTRACEBUFFER pBuffer = g_pExitedBuffers; NULL != pBuffer;
+      pBuffer = pBuffer->pNext) {
+    _WriteTraceBuffer(pFile, pBuffer, pCopy, nPid, dNsPerTick);
+  }
+  for (LPTRACEBUFFER pBuffer = g_pLiveBuffers; NULL != pBuffer;
+      pBuffer = pBuffer->pNext) {
+    _WriteTraceBuffer(pFile, pBuffer, pCopy, nPid, dNsPerTick);
+  }
+  pthread_mutex_unlock(&g_traceMutex);
+
+  fputs("\n]}\n", pFile);
+
+  free(pCopy);
+
+  int nResult = ferror(pFile) ? EIO : OK;
+  if (0 != fclose(pFile) && OK == nResult) {
+    nResult = errno;
+  }
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetThreadTraceExitPath function
+
+BOOL SetThreadTraceExitPath(const char* pszPath) {
+  char* pszCopy = NULL;
+  if (NULL != pszPath && NULL == (pszCopy = strdup(pszPath))) {
+    return FALSE;
+  }
+
+  if (NULL != pszCopy) {
+    pthread_once(&g_atExitOnce, _RegisterTraceAtExit);
+  }
+
+  pthread_mutex_lock(&g_traceMutex);
+  char* pszOld = g_pszExitPath;
+  g_pszExitPath = pszCopy;
+  pthread_mutex_unlock(&g_traceMutex);
+
+  free(pszOld);
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ClearThreadTrace function
+
+void ClearThreadTrace(void) {
+  pthread_mutex_lock(&g_traceMutex);
+
+  for (LPTRACEBUFFER pBuffer = g_pLiveBuffers; NULL != pBuffer;
+      pBuffer = pBuffer->pNext) {
+    pBuffer->nTail = atomic_load_explicit(&pBuffer->nHead,
+        memory_order_acquire);
+  }
+
+  LPTRACEBUFFER pExited = g_pExitedBuffers;
+  g_pExitedBuffers = NULL;
+  g_ppExitedTail = &g_pExitedBuffers;
+  g_nExitedBuffers = 0;
+
+  pthread_mutex_unlock(&g_traceMutex);
+
+  while (NULL != pExited) {
+    LPTRACEBUFFER pNext = pExited->pNext;
+    free(pExited);
+    pExited = pNext;
+  }
+}
@@ -1,29 +1,1029 @@
 #include "stdafx.h"
 
 #include "threading_core.h"
+#include "threading_core_internal.h"
 #include "threading_core_symbols.h"
 
 typedef struct sigaction SIGACTION, *LPSIGACTION;
 
 ///////////////////////////////////////////////////////////////////////////////
-// _FreeThread: Internal function for freeing malloc'd thread handles.  This
+// _InitCondition: Initializes a condition variable that uses the monotonic
+// clock for timed waits.  Shared with the other modules of this library.
+
+int _InitCondition(pthread_cond_t* pCond) {
+  pthread_condattr_t attr;
+
+  int nResult = pthread_condattr_init(&attr);
+  if (OK != nResult) {
+    return nResult;
+  }
+
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  nResult = pthread_cond_init(pCond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetAbsoluteDeadline: Converts a relative timeout into an absolute
+// CLOCK_MONOTONIC deadline.  Negative timeouts are treated as zero, so the
+// deadline is always a well-formed timespec.  Shared with the other modules
+// of this library.
+
+void _GetAbsoluteDeadline(int nTimeoutMs, struct timespec* pDeadline) {
+  clock_gettime(CLOCK_MONOTONIC, pDeadline);
+
+  if (nTimeoutMs < 0) {
+    return;
+  }
+
+  pDeadline->tv_sec += nTimeoutMs / 1000;
+  pDeadline->tv_nsec += (nTimeoutMs % 1000) * 1000000L;
+  if (pDeadline->tv_nsec >= 1000000000L) {
+    pDeadline->tv_sec++;
+    pDeadline->tv_nsec -= 1000000000L;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _FutexWait: Blocks while *pnValue equals nExpected, until woken by
+// _FutexWake or until an absolute CLOCK_MONOTONIC deadline passes.  Shared
+// with the other modules of this library.
+
+int _FutexWait(atomic_int* pnValue, int nExpected,
+    const struct timespec* pDeadline) {
+  /* FUTEX_WAIT_BITSET takes an absolute timeout measured against
+   * CLOCK_MONOTONIC, the same clock as _GetAbsoluteDeadline. */
+  if (OK == syscall(SYS_futex, pnValue,
+      FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, nExpected, pDeadline, NULL,
+      FUTEX_BITSET_MATCH_ANY)) {
+    return OK;
+  }
+
+  /* EAGAIN means the value had already changed and EINTR means a signal
+   * came in; either way, the caller looks at the state again.  Anything
+   * else (ETIMEDOUT, or EINVAL for a malformed deadline) goes back to the
+   * caller, which must not simply try again. */
+  return (EAGAIN == errno || EINTR == errno) ? OK : errno;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _FutexWake: Wakes up to nCount threads blocked in _FutexWait on pnValue.
+// Shared with the other modules of this library.
+
+void _FutexWake(atomic_int* pnValue, int nCount) {
+  syscall(SYS_futex, pnValue, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, nCount, NULL,
+      NULL, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief State shared between a thread in WaitForMultipleThreads (or
+ * WaitThreads) and the threads it waits on.
+ */
+typedef struct _THREADWAITER {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  BOOL bWaitAll;
+  BOOL bCollect;      // keep the nodes of terminated threads in pCompleted
+  int nRemaining;     // threads that have yet to terminate
+  int nFirstIndex;    // index of the first thread to terminate, or ERROR
+  struct _THREADWAITNODE* pCompleted;   // latest termination first
+} THREADWAITER, *LPTHREADWAITER;
+
+/**
+ * @brief Links a THREADWAITER into the list of waiters of one thread.
+ */
+typedef struct _THREADWAITNODE {
+  LPTHREADWAITER pWaiter;
+  struct _THREADCONTROL* pControl;
+  int nIndex;
+  BOOL bLinked;
+  struct _THREADWAITNODE* pPrev;
+  struct _THREADWAITNODE* pNext;
+  struct _THREADWAITNODE* pNextCompleted;
+} THREADWAITNODE, *LPTHREADWAITNODE;
+
+/**
+ * @brief Control block of a thread created by CreateThreadEx.  Control
+ * blocks live in the pages of the handle table and are recycled rather than
+ * freed, so checking a stale HTHREAD against nGeneration is always safe.
+ */
+typedef struct _THREADCONTROL {
+  pthread_t nThreadID;
+  LPTHREAD_START_ROUTINE lpfnThreadProc;
+  void* pUserState;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t condCompleted;
+  BOOL bCompleted;        // thread procedure returned, exited or was canceled
+  BOOL bJoined;
+  BOOL bFiber;            // runs on the carrier threads; see fiber.c
+  LPTHREADWAITNODE pWaiters;
+  void* pvArena;          // see thread_arena.c; NULL until first used
+  char szName[THREAD_NAME_MAX_LENGTH];
+
+  atomic_int nRefCount;   // one for the handle, one for the running thread
+  atomic_int nStopState;  // THREAD_STOP_*; also the futex KillThread waits on
+
+  int nNumaNode;          // node whose memory the thread prefers, or -1
+  THREADSTACK stack;      // pvBase is NULL if the system owns the stack
+
+  int nIndex;             // slot in the handle table
+  atomic_uint nGeneration;  // moves on whenever a handle is released
+  struct _THREADCONTROL* pNextFree;
+
+  THREADSTATS stats;
+} THREADCONTROL, *LPTHREADCONTROL;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @brief Number of threads WaitForMultipleThreads can wait on without
+ * allocating its wait nodes on the heap.
+ */
+#define THREAD_WAIT_NODES_ON_STACK  16
+
+/**
+ * @brief Number of low-order bits of a HTHREAD that hold the slot index
+ * (plus one, so that no handle is NULL).  The remaining bits hold the
+ * generation of the slot.
+ */
+#define THREAD_HANDLE_INDEX_BITS    20
+#define THREAD_HANDLE_INDEX_MASK    ((1 << THREAD_HANDLE_INDEX_BITS) - 1)
+
+/**
+ * @brief Number of control blocks the handle table allocates at once.
+ */
+#define THREAD_TABLE_PAGE_SIZE      256
+
+/**
+ * @brief Maximum number of pages in the handle table.
+ */
+#define THREAD_TABLE_MAX_PAGES      \
+  (THREAD_HANDLE_INDEX_MASK / THREAD_TABLE_PAGE_SIZE)
+
+/**
+ * @brief Memory policy mode of set_mempolicy(2) that makes a node the
+ * preferred source of a thread's memory.  Comes from numaif.h, which is
+ * part of libnuma rather than the C library.
+ */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED              1
+#endif //MPOL_PREFERRED
+
+/**
+ * @brief Number of words in the node mask passed to set_mempolicy(2).
+ */
+#define NUMA_NODE_MASK_WORDS        16
+
+/**
+ * @name THREAD_STOP_*
+ * @brief Values of THREADCONTROL::nStopState.  Nobody has asked the thread
+ * to stop; somebody has and is waiting; the thread has acknowledged; the
+ * thread has terminated.
+ */
+#define THREAD_STOP_NONE            0
+#define THREAD_STOP_REQUESTED       1
+#define THREAD_STOP_ACKNOWLEDGED    2
+#define THREAD_STOP_TERMINATED      3
+
+/**
+ * @brief Longest time, in milliseconds, that a fiber waiting for a thread
+ * blocks its carrier thread before it looks for other fibers to run.
+ */
+#define FIBER_WAIT_NAP_MS           1
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+/* Bookkeeping of the calling thread, if it was created by this library */
+static __thread LPTHREADCONTROL g_pCurrentThread = NULL;
+
+/* Handlers registered with RegisterEventEx; _EventProc calls them */
+static _Atomic(LPSIGNALHANDLER) g_alpfnEventHandlers[NSIG];
+
+static atomic_int g_nKillTimeoutMs = THREAD_KILL_TIMEOUT_MS;
+
+/* The handle table.  Pages are only ever added, so looking up a handle
+ * takes no lock; the free list is protected by g_threadTableMutex. */
+static pthread_mutex_t g_threadTableMutex = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(LPTHREADCONTROL) g_apThreadPages[THREAD_TABLE_MAX_PAGES];
+static int g_nThreadPages = 0;
+static LPTHREADCONTROL g_pFreeControls = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+// _MakeThreadHandle: Encodes a slot of the handle table and its generation
+// as a HTHREAD.
+
+static inline HTHREAD _MakeThreadHandle(int nIndex, unsigned int nGeneration) {
+  return (HTHREAD) (((uintptr_t) nGeneration << THREAD_HANDLE_INDEX_BITS)
+      | (uintptr_t) (nIndex + 1));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetThreadControl: Looks up the control block that a handle refers to.
+// Returns NULL if the handle is invalid or stale.
+
+LPTHREADCONTROL _GetThreadControl(HTHREAD hThread) {
+  uintptr_t nIndex = ((uintptr_t) hThread & THREAD_HANDLE_INDEX_MASK);
+  if (0 == nIndex--
+      || nIndex / THREAD_TABLE_PAGE_SIZE >= THREAD_TABLE_MAX_PAGES) {
+    return NULL;
+  }
+
+  LPTHREADCONTROL pPage = atomic_load_explicit(
+      &g_apThreadPages[nIndex / THREAD_TABLE_PAGE_SIZE],
+      memory_order_acquire);
+  if (NULL == pPage) {
+    return NULL;
+  }
+
+  LPTHREADCONTROL pControl = &pPage[nIndex % THREAD_TABLE_PAGE_SIZE];
+  if (hThread != _MakeThreadHandle(pControl->nIndex, atomic_load_explicit(
+      &pControl->nGeneration, memory_order_acquire))) {
+    return NULL;
+  }
+
+  return pControl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AddThreadTablePage: Adds a page of control blocks to the handle table and
+// puts them on the free list.  g_threadTableMutex must be held by the caller.
+
+BOOL _AddThreadTablePage(void) {
+  if (g_nThreadPages >= THREAD_TABLE_MAX_PAGES) {
+    return FALSE;
+  }
+
+  LPTHREADCONTROL pPage = NULL;
+  if (OK != posix_memalign((void**) &pPage, CACHE_LINE_SIZE,
+      THREAD_TABLE_PAGE_SIZE * sizeof(THREADCONTROL))) {
+    return FALSE;
+  }
+  memset(pPage, 0, THREAD_TABLE_PAGE_SIZE * sizeof(THREADCONTROL));
+
+  /* The mutex and condition of a control block are set up once and reused
+   * by every thread that gets the slot. */
+  for (int i = THREAD_TABLE_PAGE_SIZE - 1; i >= 0; i--) {
+    LPTHREADCONTROL pControl = &pPage[i];
+    pControl->nIndex = g_nThreadPages * THREAD_TABLE_PAGE_SIZE + i;
+    pthread_mutex_init(&pControl->mutex, NULL);
+    _InitCondition(&pControl->condCompleted);
+    atomic_init(&pControl->nGeneration, 1);
+
+    pControl->pNextFree = g_pFreeControls;
+    g_pFreeControls = pControl;
+  }
+
+  atomic_store_explicit(&g_apThreadPages[g_nThreadPages++], pPage,
+      memory_order_release);
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AllocThreadControls: Takes up to nCount control blocks out of the handle
+// table under a single lock.  They are returned chained through pNextFree,
+// in *ppFirst.  Returns the number taken, which is less than nCount only if
+// the table is full or memory ran out.
+
+int _AllocThreadControls(int nCount, LPTHREADCONTROL* ppFirst) {
+  LPTHREADCONTROL* ppLink = ppFirst;
+  int nTaken = 0;
+
+  pthread_mutex_lock(&g_threadTableMutex);
+
+  while (nTaken < nCount) {
+    if (NULL == g_pFreeControls && !_AddThreadTablePage()) {
+      break;
+    }
+
+    *ppLink = g_pFreeControls;
+    ppLink = &g_pFreeControls->pNextFree;
+    g_pFreeControls = g_pFreeControls->pNextFree;
+    nTaken++;
+  }
+  *ppLink = NULL;
+
+  pthread_mutex_unlock(&g_threadTableMutex);
+
+  return nTaken;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _InitThreadControl: Readies a control block, fresh out of the handle
+// table, for a new thread.
+
+void _InitThreadControl(LPTHREADCONTROL pControl,
+    LPTHREAD_START_ROUTINE lpfnThreadProc, void* pUserState) {
+  pControl->pNextFree = NULL;
+  pControl->lpfnThreadProc = lpfnThreadProc;
+  pControl->pUserState = pUserState;
+  pControl->bCompleted = FALSE;
+  pControl->bJoined = FALSE;
+  pControl->bFiber = FALSE;
+  pControl->pWaiters = NULL;
+  pControl->pvArena = NULL;
+  pControl->szName[0] = '\0';
+  pControl->nNumaNode = THREAD_NUMA_NODE_ANY;
+  pControl->stack.pvBase = NULL;
+  atomic_store_explicit(&pControl->nRefCount, 2, memory_order_relaxed);
+  atomic_store_explicit(&pControl->nStopState, THREAD_STOP_NONE,
+      memory_order_relaxed);
+
+  memset(&pControl->stats, 0, sizeof(THREADSTATS));
+  clock_gettime(CLOCK_MONOTONIC, &pControl->stats.startTime);
+  pControl->stats.pvExitStatus = PTHREAD_CANCELED;  // until it returns
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AllocThreadControl: Takes a control block out of the handle table and
+// readies it for a new thread.
+
+LPTHREADCONTROL _AllocThreadControl(LPTHREAD_START_ROUTINE lpfnThreadProc,
+    void* pUserState) {
+  LPTHREADCONTROL pControl = NULL;
+  if (0 == _AllocThreadControls(1, &pControl)) {
+    return NULL;
+  }
+
+  _InitThreadControl(pControl, lpfnThreadProc, pUserState);
+
+  return pControl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ReleaseThreadControl: Drops one reference to the control block of a
+// thread, handing the slot back to the handle table along with the last
+// reference.
+
+void _ReleaseThreadControl(LPTHREADCONTROL pControl) {
+  if (1 != atomic_fetch_sub_explicit(&pControl->nRefCount, 1,
+      memory_order_acq_rel)) {
+    return;
+  }
+
+  pthread_mutex_lock(&g_threadTableMutex);
+  pControl->pNextFree = g_pFreeControls;
+  g_pFreeControls = pControl;
+  pthread_mutex_unlock(&g_threadTableMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AcquireThreadControl: Looks up the control block that a handle refers to
+// and takes a reference to it, so that it is not recycled while the caller
+// works with it, even if the handle is released concurrently.  Returns NULL
+// if the handle is invalid or stale.  Release the reference with
+// _ReleaseThreadControl.
+
+LPTHREADCONTROL _AcquireThreadControl(HTHREAD hThread) {
+  LPTHREADCONTROL pControl = _GetThreadControl(hThread);
+  if (NULL == pControl) {
+    return NULL;
+  }
+
+  /* A block without references is on the free list; leave it alone. */
+  int nRefCount = atomic_load_explicit(&pControl->nRefCount,
+      memory_order_relaxed);
+  do {
+    if (0 == nRefCount) {
+      return NULL;
+    }
+  } while (!atomic_compare_exchange_weak_explicit(&pControl->nRefCount,
+      &nRefCount, nRefCount + 1, memory_order_acq_rel, memory_order_relaxed));
+
+  /* The handle may have been released, and the slot even handed to another
+   * thread, between the lookup and the reference. */
+  if (hThread != _MakeThreadHandle(pControl->nIndex, atomic_load_explicit(
+      &pControl->nGeneration, memory_order_acquire))) {
+    _ReleaseThreadControl(pControl);
+    return NULL;
+  }
+
+  return pControl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetThreadStats: Gets the statistics area of a thread.  Shared with the
+// other modules of this library.
+
+LPTHREADSTATS _GetThreadStats(HTHREAD hThread) {
+  LPTHREADCONTROL pControl = _GetThreadControl(hThread);
+  return (NULL != pControl) ? &pControl->stats : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetCurrentThreadArenaSlot: Gets where the arena of the calling thread (or
+// fiber) is kept.  Shared with the other modules of this library.
+
+void** _GetCurrentThreadArenaSlot(void) {
+  return (NULL != g_pCurrentThread) ? &g_pCurrentThread->pvArena : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CompleteThread: Records that a thread has terminated and wakes everyone
+// waiting for it.  Runs as a cleanup handler of the thread itself, so it
+// fires whether the thread procedure returns, calls pthread_exit or is
+// canceled.  For a fiber, the carrier thread calls it once the fiber is off
+// its stack.
+
+void _CompleteThread(void* pvControl) {
+  LPTHREADCONTROL pControl = (LPTHREADCONTROL) pvControl;
+
+  /* The handle may be released as soon as we say we are done, so this is
+   * the last chance to tell which one it was */
+  if (_IsThreadTraceEnabled()) {
+    _RecordTraceEvent(pControl->bFiber ? TRACE_EVENT_FIBER_END
+        : TRACE_EVENT_THREAD_END, (uint64_t) (uintptr_t) _MakeThreadHandle(
+        pControl->nIndex, atomic_load_explicit(&pControl->nGeneration,
+        memory_order_relaxed)), 0);
+  }
+
+  /* Whatever the thread allocated from its arena dies with it */
+  _DestroyThreadArena(pControl->pvArena);
+  pControl->pvArena = NULL;
+
+  pthread_mutex_lock(&pControl->mutex);
+
+  pControl->bCompleted = TRUE;
+  clock_gettime(CLOCK_MONOTONIC, &pControl->stats.exitTime);
+
+  /* A waiter that waits for all threads is signalled on the last
+   * termination, and any other on each one.  WaitForMultipleThreads stops
+   * at the first of those; WaitThreads picks them up from pCompleted. */
+  for (LPTHREADWAITNODE pNode = pControl->pWaiters; NULL != pNode;
+      pNode = pNode->pNext) {
+    LPTHREADWAITER pWaiter = pNode->pWaiter;
+
+    pthread_mutex_lock(&pWaiter->mutex);
+    if (ERROR == pWaiter->nFirstIndex) {
+      pWaiter->nFirstIndex = pNode->nIndex;
+    }
+    if (pWaiter->bCollect) {
+      pNode->pNextCompleted = pWaiter->pCompleted;
+      pWaiter->pCompleted = pNode;
+    }
+    if (0 == --pWaiter->nRemaining || !pWaiter->bWaitAll) {
+      pthread_cond_signal(&pWaiter->cond);
+    }
+    pthread_mutex_unlock(&pWaiter->mutex);
+
+    pNode->bLinked = FALSE;
+  }
+  pControl->pWaiters = NULL;
+
+  pthread_cond_broadcast(&pControl->condCompleted);
+  pthread_mutex_unlock(&pControl->mutex);
+
+  /* A thread that has terminated needs no further persuasion */
+  atomic_store_explicit(&pControl->nStopState, THREAD_STOP_TERMINATED,
+      memory_order_release);
+  _FutexWake(&pControl->nStopState, INT_MAX);
+
+  /* From here on the block may be handed to another thread, so nothing
+   * that still runs on this one (TLS destructors, say) may find it */
+  if (!pControl->bFiber) {
+    g_pCurrentThread = NULL;
+  }
+
+  _ReleaseThreadControl(pControl);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _PreferNumaNode: Makes the memory the calling thread allocates come from
+// the specified NUMA node whenever the node has any to spare.  Talks to the
+// kernel directly, so we don't need libnuma.
+
+void _PreferNumaNode(int nNode) {
+  unsigned long anNodeMask[NUMA_NODE_MASK_WORDS];
+  const int nBitsPerWord = (int) (8 * sizeof(unsigned long));
+
+  if (nNode < 0 || nNode >= NUMA_NODE_MASK_WORDS * nBitsPerWord) {
+    return;
+  }
+
+  memset(anNodeMask, 0, sizeof(anNodeMask));
+  anNodeMask[nNode / nBitsPerWord] = 1UL << (nNode % nBitsPerWord);
+
+  /* Best effort: a kernel without NUMA support just says ENOSYS, and the
+   * thread then allocates memory the way it would have anyway. */
+  syscall(SYS_set_mempolicy, MPOL_PREFERRED, anNodeMask,
+      (unsigned long) (NUMA_NODE_MASK_WORDS * nBitsPerWord + 1));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ThreadProc: The procedure that every thread created by this library
+// actually runs.  Calls the user's thread procedure and tracks completion.
+
+void* _ThreadProc(void* pvControl) {
+  LPTHREADCONTROL pControl = (LPTHREADCONTROL) pvControl;
+  void* pvRetVal = NULL;
+
+  g_pCurrentThread = pControl;
+
+  _BlockDispatchedSignals();
+
+  if (_IsThreadTraceEnabled()) {
+    _RecordTraceEvent(TRACE_EVENT_THREAD_BEGIN, (uint64_t) (uintptr_t)
+        _MakeThreadHandle(pControl->nIndex, atomic_load_explicit(
+        &pControl->nGeneration, memory_order_relaxed)), 0);
+  }
+
+  if (_IsThreadingStatsEnabled()) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t nLatencyNs = _GetElapsedNs(&pControl->stats.startTime, &now);
+    _AddThreadingStat(THREADING_STAT_START_LATENCY_TOTAL, nLatencyNs);
+    _AddThreadingStat(THREADING_STAT_START_LATENCY_MAX, nLatencyNs);
+  }
+
+  if (pControl->nNumaNode >= 0) {
+    _PreferNumaNode(pControl->nNumaNode);
+  }
+
+  pthread_cleanup_push(_CompleteThread, pControl);
+  pvRetVal = pControl->lpfnThreadProc(pControl->pUserState);
+  pControl->stats.pvExitStatus = pvRetVal;
+  pthread_cleanup_pop(1);
+
+  return pvRetVal;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RunFiberProc: The fiber counterpart of _ThreadProc, minus the completion,
+// which is up to the carrier thread.  Shared with the other modules of this
+// library.
+
+void _RunFiberProc(void* pvControl) {
+  LPTHREADCONTROL pControl = (LPTHREADCONTROL) pvControl;
+
+  if (_IsThreadTraceEnabled()) {
+    _RecordTraceEvent(TRACE_EVENT_FIBER_BEGIN, (uint64_t) (uintptr_t)
+        _MakeThreadHandle(pControl->nIndex, atomic_load_explicit(
+        &pControl->nGeneration, memory_order_relaxed)), 0);
+  }
+
+  if (_IsThreadingStatsEnabled()) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t nLatencyNs = _GetElapsedNs(&pControl->stats.startTime, &now);
+    _AddThreadingStat(THREADING_STAT_START_LATENCY_TOTAL, nLatencyNs);
+    _AddThreadingStat(THREADING_STAT_START_LATENCY_MAX, nLatencyNs);
+  }
+
+  pControl->stats.pvExitStatus = pControl->lpfnThreadProc(
+      pControl->pUserState);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _SwapCurrentThread: Makes a control block the current thread of the
+// calling carrier thread, and returns the one it replaces.  Shared with the
+// other modules of this library.
+
+void* _SwapCurrentThread(void* pvControl) {
+  LPTHREADCONTROL pControl = (LPTHREADCONTROL) pvControl;
+  LPTHREADCONTROL pPrevious = g_pCurrentThread;
+
+  if (NULL != pControl && pControl->bFiber) {
+    pControl->nThreadID = pthread_self();
+  }
+  g_pCurrentThread = pControl;
+
+  return pPrevious;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _SetThreadAttributes: Translates the placement and scheduling options of
+// a THREAD_ATTRIBUTES structure into the pthread attributes object pAttr,
+// which must already be initialized.  The stack is up to
+// _PrepareThreadStack.  Returns zero if successful, or the error code of the
+// call that failed.
+
+int _SetThreadAttributes(pthread_attr_t* pAttr,
+    const THREAD_ATTRIBUTES* pAttributes) {
+  int nResult = OK;
+
+  cpu_set_t cpuSet = pAttributes->cpuSet;
+  if (pAttributes->nNumaNode >= 0) {
+    cpu_set_t nodeCpuSet;
+    if (!_GetNumaNodeCpuSet(pAttributes->nNumaNode, &nodeCpuSet)) {
+      return EINVAL;
+    }
+
+    if (CPU_COUNT(&cpuSet) > 0) {
+      CPU_AND(&cpuSet, &cpuSet, &nodeCpuSet);
+      if (0 == CPU_COUNT(&cpuSet)) {
+        return EINVAL;    // none of the CPUs is on that node
+      }
+    } else {
+      cpuSet = nodeCpuSet;
+    }
+  }
+
+  if (CPU_COUNT(&cpuSet) > 0) {
+    nResult = pthread_attr_setaffinity_np(pAttr, sizeof(cpu_set_t), &cpuSet);
+    if (OK != nResult) {
+      return nResult;
+    }
+  }
+
+  if (THREAD_SCHED_INHERIT != pAttributes->nSchedPolicy) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = pAttributes->nPriority;
+
+    nResult = pthread_attr_setinheritsched(pAttr, PTHREAD_EXPLICIT_SCHED);
+    if (OK == nResult) {
+      nResult = pthread_attr_setschedpolicy(pAttr,
+          pAttributes->nSchedPolicy);
+    }
+    if (OK == nResult) {
+      nResult = pthread_attr_setschedparam(pAttr, &param);
+    }
+  }
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CreateFiberThread: Starts a fiber and returns a handle to it.  There is
+// no pthread to join or detach, so the fiber counts as joined from the
+// start.
+
+HTHREAD _CreateFiberThread(LPTHREAD_START_ROUTINE lpfnThreadProc,
+    void* pUserState, const THREAD_ATTRIBUTES* pAttributes) {
+  LPTHREADCONTROL pControl = _AllocThreadControl(lpfnThreadProc, pUserState);
+  if (NULL == pControl) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  pControl->bFiber = TRUE;
+  pControl->bJoined = TRUE;
+  memset(&pControl->nThreadID, 0, sizeof(pthread_t));   // until it runs
+
+  LPFIBER pFiber = _CreateFiber(pControl, pAttributes->nStackSize > 0
+      ? _RoundUpToPage(pAttributes->nStackSize) : 0);
+  if (NULL == pFiber) {
+    atomic_store_explicit(&pControl->nRefCount, 1, memory_order_relaxed);
+    _ReleaseThreadControl(pControl);
+    return INVALID_HANDLE_VALUE;
+  }
+
+  /* Make the handle before the fiber can run, finish, and give up the
+   * reference it holds */
+  HTHREAD hThread = _MakeThreadHandle(pControl->nIndex, atomic_load_explicit(
+      &pControl->nGeneration, memory_order_relaxed));
+
+  _StartFiber(pFiber);
+
+  if (_IsThreadingStatsEnabled()) {
+    _AddThreadingStat(THREADING_STAT_THREADS_CREATED, 1);
+  }
+  if (_IsThreadTraceEnabled()) {
+    _RecordTraceEvent(TRACE_EVENT_THREAD_CREATE, (uint64_t) (uintptr_t)
+        hThread, 0);
+  }
+
+  return hThread;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CreateThread: Starts a thread with the specified attributes and returns
+// a handle to it.  CreateThreadEx and CreateThreadEx2 both end up here.
+
+HTHREAD _CreateThread(LPTHREAD_START_ROUTINE lpfnThreadProc,
+    void* pUserState, const THREAD_ATTRIBUTES* pAttributes) {
+  if (pAttributes->bFiber) {
+    return _CreateFiberThread(lpfnThreadProc, pUserState, pAttributes);
+  }
+
+  pthread_attr_t attr;
+  if (OK != pthread_attr_init(&attr)) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  THREADSTACK stack;
+  stack.pvBase = NULL;
+
+  int nResult = _SetThreadAttributes(&attr, pAttributes);
+  if (OK == nResult) {
+    nResult = _PrepareThreadStack(&attr, pAttributes->nStackSize,
+        pAttributes->nGuardSize, &stack);
+  }
+
+  LPTHREADCONTROL pControl = NULL;
+  if (OK == nResult) {
+    pControl = _AllocThreadControl(lpfnThreadProc, pUserState);
+  }
+
+  if (NULL != pControl) {
+    pControl->nNumaNode = pAttributes->nNumaNode;
+    pControl->stack = stack;
+
+    nResult = pthread_create(&pControl->nThreadID, &attr, _ThreadProc,
+        pControl);
+    if (OK != nResult) {
+      atomic_store_explicit(&pControl->nRefCount, 1, memory_order_relaxed);
+      _ReleaseThreadControl(pControl);
+      pControl = NULL;
+    }
+  }
+
+  pthread_attr_destroy(&attr);
+
+  if (NULL == pControl) {
+    // Bad attributes, a full handle table, or out of memory
+    _ReleaseThreadStack(&stack);
+    return INVALID_HANDLE_VALUE;
+  }
+
+  HTHREAD hThread = _MakeThreadHandle(pControl->nIndex, atomic_load_explicit(
+      &pControl->nGeneration, memory_order_relaxed));
+
+  if (_IsThreadingStatsEnabled()) {
+    _AddThreadingStat(THREADING_STAT_THREADS_CREATED, 1);
+  }
+  if (_IsThreadTraceEnabled()) {
+    _RecordTraceEvent(TRACE_EVENT_THREAD_CREATE, (uint64_t) (uintptr_t)
+        hThread, 0);
+  }
+
+  return hThread;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AcknowledgeStop: Tells whoever asked a thread to stop that it has seen the
+// request.  Async-signal-safe, since it runs at the end of _EventProc.
+
+void _AcknowledgeStop(LPTHREADCONTROL pControl) {
+  if (NULL == pControl) {
+    return;
+  }
+
+  int nExpected = THREAD_STOP_REQUESTED;
+  if (atomic_compare_exchange_strong_explicit(&pControl->nStopState,
+      &nExpected, THREAD_STOP_ACKNOWLEDGED, memory_order_acq_rel,
+      memory_order_relaxed)) {
+    _FutexWake(&pControl->nStopState, INT_MAX);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _EventProc: The signal handler that RegisterEventEx actually installs.
+// Calls the user's handler and then acknowledges any pending stop request of
+// the thread it ran on.
+
+void _EventProc(int nSignal) {
+  int nSavedErrno = errno;
+
+  BOOL bTrace = _IsThreadTraceEnabled();
+  uint64_t nStartTicks = bTrace ? _GetTraceTicks() : 0;
+
+  LPSIGNALHANDLER lpfnEventHandler = atomic_load_explicit(
+      &g_alpfnEventHandlers[nSignal], memory_order_acquire);
+  if (NULL != lpfnEventHandler) {
+    lpfnEventHandler(nSignal);
+  }
+
+  if (bTrace) {
+    _RecordSignalTraceSpan(nSignal, nStartTicks);
+  }
+
+  _AcknowledgeStop(g_pCurrentThread);
+
+  errno = nSavedErrno;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AcknowledgeThreadStop: Acknowledges the stop request of a thread on its
+// behalf.  Shared with the other modules of this library.
+
+void _AcknowledgeThreadStop(HTHREAD hThread) {
+  _AcknowledgeStop(_GetThreadControl(hThread));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetEventHandler: Gets the handler registered with RegisterEventEx for a
+// signal.  Shared with the other modules of this library.
+
+LPSIGNALHANDLER _GetEventHandler(int nSignal) {
+  if (nSignal <= 0 || nSignal >= NSIG) {
+    return NULL;
+  }
+
+  return atomic_load_explicit(&g_alpfnEventHandlers[nSignal],
+      memory_order_acquire);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RequestStop: Sets the stop token of a thread and raises a signal to it.
+// Returns FALSE if the thread has already terminated.
+
+BOOL _RequestStop(LPTHREADCONTROL pControl, int nSignal) {
+  int nState = atomic_load_explicit(&pControl->nStopState,
+      memory_order_acquire);
+  do {
+    if (THREAD_STOP_TERMINATED == nState) {
+      return FALSE;
+    }
+  } while (!atomic_compare_exchange_weak_explicit(&pControl->nStopState,
+      &nState, THREAD_STOP_REQUESTED, memory_order_acq_rel,
+      memory_order_acquire));
+
+  if (nSignal <= 0 || pControl->bFiber) {
+    return TRUE;  // the stop token is all the thread gets
+  }
+
+  /* The event dispatcher handles the signal on the thread's behalf, so the
+   * thread is never interrupted.  If it cannot, the stop token is still
+   * set, and there is no point in making the caller time out. */
+  if (_IsSignalDispatched(nSignal)) {
+    if (!_PostThreadEvent(nSignal, _MakeThreadHandle(pControl->nIndex,
+        atomic_load_explicit(&pControl->nGeneration,
+            memory_order_acquire)))) {
+      _AcknowledgeStop(pControl);
+    }
+    return TRUE;
+  }
+
+  int retval = pthread_kill(pControl->nThreadID, nSignal);
+
+  /* ESRCH means the thread is on its way out; it will acknowledge by
+   * terminating. */
+  if (OK != retval && ESRCH != retval) {
+    // Failed to kill and/or signal the thread
+    errno = retval;
+
+    perror("KillThreadEx");
+
+    exit(EXIT_FAILURE);
+  }
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _WaitStopAcknowledged: Waits until a thread that was asked to stop
+// acknowledges or terminates, or until the deadline (NULL for none) passes.
+
+int _WaitStopAcknowledged(LPTHREADCONTROL pControl,
+    const struct timespec* pDeadline) {
+  while (THREAD_STOP_REQUESTED == atomic_load_explicit(&pControl->nStopState,
+      memory_order_acquire)) {
+    int nResult = _FutexWait(&pControl->nStopState, THREAD_STOP_REQUESTED,
+        pDeadline);
+    if (OK != nResult && THREAD_STOP_REQUESTED == atomic_load_explicit(
+        &pControl->nStopState, memory_order_acquire)) {
+      return nResult;
+    }
+  }
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _WaitCompleted: Waits until a thread has completed, or until the deadline
+// (NULL for none) passes.  A fiber that waits lets the other fibers run in
+// the meantime, and only blocks its carrier thread, briefly, when none of
+// them is ready.  Returns zero or ETIMEDOUT.
+
+int _WaitCompleted(LPTHREADCONTROL pControl,
+    const struct timespec* pDeadline) {
+  BOOL bOnFiber = IsRunningOnFiber();
+  int nResult = OK;
+
+  pthread_mutex_lock(&pControl->mutex);
+
+  while (!pControl->bCompleted && OK == nResult) {
+    if (!bOnFiber) {
+      if (NULL == pDeadline) {
+        pthread_cond_wait(&pControl->condCompleted, &pControl->mutex);
+      } else {
+        nResult = pthread_cond_timedwait(&pControl->condCompleted,
+            &pControl->mutex, pDeadline);
+      }
+      continue;
+    }
+
+    pthread_mutex_unlock(&pControl->mutex);
+    YieldThread();
+    pthread_mutex_lock(&pControl->mutex);
+
+    if (!pControl->bCompleted && !_AreFibersReady()) {
+      struct timespec nap;
+      _GetAbsoluteDeadline(FIBER_WAIT_NAP_MS, &nap);
+      pthread_cond_timedwait(&pControl->condCompleted, &pControl->mutex,
+          &nap);
+    }
+
+    if (NULL != pDeadline && !pControl->bCompleted) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (now.tv_sec > pDeadline->tv_sec || (now.tv_sec == pDeadline->tv_sec
+          && now.tv_nsec >= pDeadline->tv_nsec)) {
+        nResult = ETIMEDOUT;
+      }
+    }
+  }
+
+  if (pControl->bCompleted) {
+    nResult = OK;
+  }
+
+  pthread_mutex_unlock(&pControl->mutex);
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _StopThreads: Asks every one of the specified threads to stop, then waits
+// for each to acknowledge and cancels the ones that do not in time.  The
+// caller holds a reference to each control block.  Returns zero or
+// ETIMEDOUT.
+
+int _StopThreads(LPTHREADCONTROL* ppControls, HTHREAD* phThreads,
+    int nCount, int signum, int nTimeoutMs) {
+  /* Signal everybody first, so that they all wind down in parallel */
+  for (int i = 0; i < nCount; i++) {
+    if (!_RequestStop(ppControls[i], signum)) {
+      continue;
+    }
+    if (_IsThreadingStatsEnabled()) {
+      _AddThreadingStat(THREADING_STAT_THREADS_KILLED, 1);
+    }
+    if (_IsThreadTraceEnabled()) {
+      _RecordTraceEvent(TRACE_EVENT_KILL, (uint64_t) (uintptr_t) phThreads[i],
+          (uint32_t) signum);
+    }
+  }
+
+  struct timespec deadline;
+  struct timespec* pDeadline = NULL;
+  if (INFINITE != nTimeoutMs) {
+    _GetAbsoluteDeadline(nTimeoutMs, &deadline);
+    pDeadline = &deadline;
+  }
+
+  /* Once the deadline has passed, each remaining check returns at once */
+  int nResult = OK;
+  for (int i = 0; i < nCount; i++) {
+    if (ETIMEDOUT == _WaitStopAcknowledged(ppControls[i], pDeadline)) {
+      CancelThread(phThreads[i]);
+      nResult = ETIMEDOUT;
+    }
+  }
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _FreeThread: Internal function for releasing thread handles.  This
 // function is not exposed in the header file for this library, as it is
 // meant for internal use only.
 
 void _FreeThread(HTHREAD hThread) {
-  if (INVALID_HANDLE_VALUE == hThread) {
-    // If we have an invalid handle (i.e., NULL pointer),
-    // then there is nothing to do.
+  // The HTHREAD handle type encodes a slot of the handle table; if it is
+  // invalid (i.e., NULL) or stale, then there is nothing to do.
+  LPTHREADCONTROL pControl = _GetThreadControl(hThread);
+  if (NULL == pControl) {
+    return;
+  }
+
+  /* Move the generation on first, so that every copy of the handle goes
+   * stale.  Of two threads that race to release the same handle, only one
+   * gets past this point. */
+  unsigned int nGeneration = atomic_load_explicit(&pControl->nGeneration,
+      memory_order_acquire);
+  if (hThread != _MakeThreadHandle(pControl->nIndex, nGeneration)
+      || !atomic_compare_exchange_strong_explicit(&pControl->nGeneration,
+          &nGeneration, nGeneration + 1, memory_order_acq_rel,
+          memory_order_acquire)) {
     return;
   }
 
-  // The HMUTEX handle type is just a typedef of pthread_mutex_t*
-  // However, to work with the pthread functions, we need to view it
-  // as such.
-  pthread_t* pThread = (pthread_t*) hThread;
+  /* Nobody can join the thread once its handle is gone, so let the system
+   * reclaim it on its own when it terminates -- unless it runs on a stack
+   * of ours, in which case it is reaped later so we get the stack back. */
+  pthread_mutex_lock(&pControl->mutex);
+  if (!pControl->bJoined) {
+    if (NULL != pControl->stack.pvBase) {
+      _ReleaseThreadStackLater(pControl->nThreadID, &pControl->stack);
+    } else {
+      pthread_detach(pControl->nThreadID);
+    }
+    pControl->bJoined = TRUE;
+  }
+  pthread_mutex_unlock(&pControl->mutex);
 
-  free(pThread);
-  pThread = NULL;
+  _ReleaseThreadControl(pControl);
 
   hThread = INVALID_HANDLE_VALUE;
 }
@@ -32,11 +1032,24 @@ void _FreeThread(HTHREAD hThread) {
 // CancelThread function
 
 void CancelThread(HTHREAD hThread) {
-  if (INVALID_HANDLE_VALUE == hThread) {
+  LPTHREADCONTROL pControl = _GetThreadControl(hThread);
+  if (NULL == pControl) {
     return;
   }
 
-  pthread_cancel(*((pthread_t*) hThread));
+  /* A fiber cannot be canceled out from under its carrier thread */
+  if (pControl->bFiber) {
+    _RequestStop(pControl, 0);
+  } else {
+    pthread_cancel(pControl->nThreadID);
+  }
+
+  if (_IsThreadingStatsEnabled()) {
+    _AddThreadingStat(THREADING_STAT_THREADS_CANCELED, 1);
+  }
+  if (_IsThreadTraceEnabled()) {
+    _RecordTraceEvent(TRACE_EVENT_CANCEL, (uint64_t) (uintptr_t) hThread, 0);
+  }
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -63,19 +1076,154 @@ HTHREAD CreateThreadEx(LPTHREAD_START_ROUTINE lpfnThreadProc,
     return INVALID_HANDLE_VALUE;
   }
 
-  pthread_t* pNewThread = (pthread_t*) malloc(sizeof(pthread_t));
-  if (NULL == pNewThread) {
-    // Failed to allocate memory
-    return INVALID_HANDLE_VALUE;
+  THREAD_ATTRIBUTES attributes;
+  InitThreadAttributes(&attributes);
+
+  return _CreateThread(lpfnThreadProc, pUserState, &attributes);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// InitThreadAttributes function
+
+void InitThreadAttributes(LPTHREAD_ATTRIBUTES pAttributes) {
+  if (NULL == pAttributes) {
+    return;
   }
 
-  /* NOTE: A pthread_t* and HTHREAD type are interchangeable */
-  int nResult = pthread_create(pNewThread, NULL, lpfnThreadProc, pUserState);
-  if (OK != nResult) {
+  memset(pAttributes, 0, sizeof(THREAD_ATTRIBUTES));
+  CPU_ZERO(&pAttributes->cpuSet);
+  pAttributes->nNumaNode = THREAD_NUMA_NODE_ANY;
+  pAttributes->nStackSize = 0;
+  pAttributes->nGuardSize = THREAD_GUARD_SIZE_DEFAULT;
+  pAttributes->nSchedPolicy = THREAD_SCHED_INHERIT;
+  pAttributes->nPriority = 0;
+  pAttributes->bFiber = FALSE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateThreadEx2 function
+
+HTHREAD CreateThreadEx2(LPTHREAD_START_ROUTINE lpfnThreadProc,
+    void* pUserState, const THREAD_ATTRIBUTES* pAttributes) {
+  if (NULL == lpfnThreadProc) {
     return INVALID_HANDLE_VALUE;
   }
 
-  return (HTHREAD) pNewThread;
+  if (NULL == pAttributes) {
+    return CreateThreadEx(lpfnThreadProc, pUserState);
+  }
+
+  return _CreateThread(lpfnThreadProc, pUserState, pAttributes);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateThreads function
+
+int CreateThreads(int nCount, LPTHREAD_START_ROUTINE lpfnThreadProc,
+    void** ppvUserStates, HTHREAD* phThreads) {
+  return CreateThreadsEx(nCount, lpfnThreadProc, ppvUserStates, NULL,
+      phThreads);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateThreadsEx function
+
+int CreateThreadsEx(int nCount, LPTHREAD_START_ROUTINE lpfnThreadProc,
+    void** ppvUserStates, const THREAD_ATTRIBUTES* pAttributes,
+    HTHREAD* phThreads) {
+  if (nCount <= 0 || NULL == lpfnThreadProc || NULL == phThreads) {
+    return 0;
+  }
+
+  for (int i = 0; i < nCount; i++) {
+    phThreads[i] = INVALID_HANDLE_VALUE;
+  }
+
+  THREAD_ATTRIBUTES attributes;
+  if (NULL == pAttributes) {
+    InitThreadAttributes(&attributes);
+    pAttributes = &attributes;
+  }
+
+  int nCreated = 0;
+
+  if (pAttributes->bFiber) {
+    while (nCreated < nCount) {
+      HTHREAD hThread = _CreateFiberThread(lpfnThreadProc,
+          (NULL != ppvUserStates) ? ppvUserStates[nCreated] : NULL,
+          pAttributes);
+      if (INVALID_HANDLE_VALUE == hThread) {
+        break;
+      }
+      phThreads[nCreated++] = hThread;
+    }
+    return nCreated;
+  }
+
+  /* Affinity and scheduling are worked out once for the whole batch; only
+   * the stack differs from one thread to the next */
+  pthread_attr_t attr;
+  if (OK != pthread_attr_init(&attr)) {
+    return 0;
+  }
+  if (OK != _SetThreadAttributes(&attr, pAttributes)) {
+    pthread_attr_destroy(&attr);
+    return 0;
+  }
+
+  LPTHREADCONTROL pControl = NULL;
+  _AllocThreadControls(nCount, &pControl);
+
+  while (NULL != pControl) {
+    LPTHREADCONTROL pNext = pControl->pNextFree;
+
+    THREADSTACK stack;
+    stack.pvBase = NULL;
+
+    int nResult = _PrepareThreadStack(&attr, pAttributes->nStackSize,
+        pAttributes->nGuardSize, &stack);
+    if (OK != nResult) {
+      break;
+    }
+
+    _InitThreadControl(pControl, lpfnThreadProc,
+        (NULL != ppvUserStates) ? ppvUserStates[nCreated] : NULL);
+    pControl->nNumaNode = pAttributes->nNumaNode;
+    pControl->stack = stack;
+
+    nResult = pthread_create(&pControl->nThreadID, &attr, _ThreadProc,
+        pControl);
+    if (OK != nResult) {
+      _ReleaseThreadStack(&stack);
+      pControl->pNextFree = pNext;    // so the rest go back with it
+      break;
+    }
+
+    phThreads[nCreated] = _MakeThreadHandle(pControl->nIndex,
+        atomic_load_explicit(&pControl->nGeneration, memory_order_relaxed));
+    if (_IsThreadTraceEnabled()) {
+      _RecordTraceEvent(TRACE_EVENT_THREAD_CREATE, (uint64_t) (uintptr_t)
+          phThreads[nCreated], 0);
+    }
+    nCreated++;
+    pControl = pNext;
+  }
+
+  pthread_attr_destroy(&attr);
+
+  /* Hand back the control blocks of the threads we could not start */
+  while (NULL != pControl) {
+    LPTHREADCONTROL pNext = pControl->pNextFree;
+    atomic_store_explicit(&pControl->nRefCount, 1, memory_order_relaxed);
+    _ReleaseThreadControl(pControl);
+    pControl = pNext;
+  }
+
+  if (nCreated > 0 && _IsThreadingStatsEnabled()) {
+    _AddThreadingStat(THREADING_STAT_THREADS_CREATED, nCreated);
+  }
+
+  return nCreated;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -126,17 +1274,95 @@ void KillThreadEx(HTHREAD hThread, int signum) {
     return;	// Invalid value for signum; nothing to do.
   }
 
-  int retval = pthread_kill((pthread_t) (*hThread), signum);
+  /* Rather than sleeping to let the thread do its thing, wait for it to
+   * say it has done so, and cancel it if it does not. */
+  KillThreadExTimeout(hThread, signum,
+      atomic_load_explicit(&g_nKillTimeoutMs, memory_order_relaxed));
+}
 
-  sleep(1); 	// force a context switch to let the thread do its thing
+///////////////////////////////////////////////////////////////////////////////
+// KillThreadExTimeout function
 
-  if (OK != retval) {
-    // Failed to kill and/or signal the thread
+int KillThreadExTimeout(HTHREAD hThread, int signum, int nTimeoutMs) {
+  return KillMultipleThreads(&hThread, 1, signum, nTimeoutMs);
+}
 
-    perror("KillThreadEx");
+///////////////////////////////////////////////////////////////////////////////
+// KillMultipleThreads function
 
-    exit(EXIT_FAILURE);
+int KillMultipleThreads(HTHREAD* phThreads, int nCount, int signum,
+    int nTimeoutMs) {
+  if (NULL == phThreads || nCount <= 0 || signum < 0
+      || (nTimeoutMs < 0 && INFINITE != nTimeoutMs)) {
+    return EINVAL;
+  }
+
+  LPTHREADCONTROL apStackControls[THREAD_WAIT_NODES_ON_STACK];
+  LPTHREADCONTROL* ppControls = apStackControls;
+  if (nCount > THREAD_WAIT_NODES_ON_STACK) {
+    ppControls = (LPTHREADCONTROL*) malloc(nCount * sizeof(LPTHREADCONTROL));
+    if (NULL == ppControls) {
+      return ENOMEM;
+    }
   }
+
+  /* Hold on to every control block until we are done with it, so that a
+   * handle released in the meantime cannot pull it out from under us */
+  int nAcquired = 0;
+  for (; nAcquired < nCount; nAcquired++) {
+    ppControls[nAcquired] = _AcquireThreadControl(phThreads[nAcquired]);
+    if (NULL == ppControls[nAcquired]) {
+      break;
+    }
+  }
+
+  int nResult = EINVAL;
+  if (nAcquired == nCount) {
+    nResult = _StopThreads(ppControls, phThreads, nCount, signum,
+        nTimeoutMs);
+  }
+
+  for (int i = 0; i < nAcquired; i++) {
+    _ReleaseThreadControl(ppControls[i]);
+  }
+
+  if (ppControls != apStackControls) {
+    free(ppControls);
+  }
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetThreadKillTimeout function
+
+void SetThreadKillTimeout(int nTimeoutMs) {
+  if (nTimeoutMs < 0 && INFINITE != nTimeoutMs) {
+    return;
+  }
+
+  atomic_store_explicit(&g_nKillTimeoutMs, nTimeoutMs, memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsThreadStopRequested function
+
+BOOL IsThreadStopRequested(void) {
+  if (NULL == g_pCurrentThread) {
+    return FALSE;
+  }
+
+  int nState = atomic_load_explicit(&g_pCurrentThread->nStopState,
+      memory_order_acquire);
+  return THREAD_STOP_REQUESTED == nState
+      || THREAD_STOP_ACKNOWLEDGED == nState;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AcknowledgeThreadStop function
+
+void AcknowledgeThreadStop(void) {
+  _AcknowledgeStop(g_pCurrentThread);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -155,7 +1381,8 @@ BOOL RegisterEvent(LPSIGNALHANDLER lpfnEventHandler) {
 
 BOOL RegisterEventEx(int nSignal, LPSIGNALHANDLER lpfnEventHandler) {
   BOOL bResult = FALSE;
-  if (nSignal <= 0) { /* all signal codes are positive integers */
+  /* all signal codes are positive integers, and we keep a table of them */
+  if (nSignal <= 0 || nSignal >= NSIG) {
     return bResult;
   }
 
@@ -167,7 +1394,17 @@ BOOL RegisterEventEx(int nSignal, LPSIGNALHANDLER lpfnEventHandler) {
   SIGACTION sigAction;
   memset(&sigAction, 0, sizeof(SIGACTION));
 
-  sigAction.sa_handler = lpfnEventHandler;
+  /* Install our own handler, which calls lpfnEventHandler and then lets
+   * KillThreadEx know that the thread got the message. */
+  atomic_store_explicit(&g_alpfnEventHandlers[nSignal], lpfnEventHandler,
+      memory_order_release);
+
+  /* The signal is blocked everywhere and read by the dispatcher */
+  if (_IsSignalDispatched(nSignal)) {
+    return TRUE;
+  }
+
+  sigAction.sa_handler = _EventProc;
   sigemptyset(&sigAction.sa_mask);
   sigAction.sa_flags = 0;
 
@@ -233,35 +1470,470 @@ int WaitThread(HTHREAD hThread) {
 int WaitThreadEx(HTHREAD hThread, void **ppvRetVal) {
   int nResult = ERROR;
 
-  if (INVALID_HANDLE_VALUE == hThread) {
+  // Look up the control block referenced by the handle, and hold on to it
+  // for the duration of the wait.  A handle that has already been waited
+  // on or destroyed is stale, and is treated the same as an invalid one,
+  // instead of joining some other thread.
+  LPTHREADCONTROL pControl = _AcquireThreadControl(hThread);
+  if (NULL == pControl) {
     return nResult;	// Invalid thread handle passed; nothing to do.
   }
 
-  pthread_t *pThread = (pthread_t*) hThread;
+  // Claim the join, so that a concurrent DestroyThread does not detach the
+  // thread while we are joining it, nor another waiter join it twice.
+  pthread_mutex_lock(&pControl->mutex);
+  BOOL bClaimed = !pControl->bFiber && !pControl->bJoined;
+  if (bClaimed) {
+    pControl->bJoined = TRUE;
+  }
+  pthread_mutex_unlock(&pControl->mutex);
 
-  // pthread_join wants us to dereference the HTHREAD; we can't do this
-  // if pThread is NULL to begin with
-  if (pThread == NULL) {
-    return nResult;
+  if (!pControl->bFiber && !bClaimed) {
+    _ReleaseThreadControl(pControl);
+    return nResult;	// somebody else is already joining it
   }
 
   // get the pthread_t referenced by the handle
-  pthread_t nThreadID = *pThread;
+  pthread_t nThreadID = pControl->nThreadID;
+
+  // Only look at the clock if somebody is going to read the result
+  BOOL bStats = _IsThreadingStatsEnabled();
+  struct timespec waitStart;
+  if (bStats) {
+    clock_gettime(CLOCK_MONOTONIC, &waitStart);
+  }
+
+  // The wait is recorded as it starts, so that one that never ends still
+  // shows up in the trace
+  BOOL bTrace = _IsThreadTraceEnabled();
+  if (bTrace) {
+    _RecordTraceEvent(TRACE_EVENT_WAIT_BEGIN, (uint64_t) (uintptr_t) hThread,
+        0);
+  }
 
-  nResult = pthread_join(nThreadID, ppvRetVal);
+  // A fiber has no pthread of its own to join; its carrier thread keeps
+  // what it returned.
+  void* pvRetVal = NULL;
+  if (pControl->bFiber) {
+    nResult = _WaitCompleted(pControl, NULL);
+    pvRetVal = pControl->stats.pvExitStatus;
+  } else {
+    nResult = pthread_join(nThreadID, &pvRetVal);
+  }
+  if (bTrace) {
+    _RecordTraceEvent(TRACE_EVENT_WAIT_END, 0, 0);
+  }
   if (OK != nResult) {
-    // Failed to join the specified thread.
+    // Failed to join the specified thread; let somebody else try.
+    if (bClaimed) {
+      pthread_mutex_lock(&pControl->mutex);
+      pControl->bJoined = FALSE;
+      pthread_mutex_unlock(&pControl->mutex);
+    }
+    _ReleaseThreadControl(pControl);
     return nResult;
   }
 
+  if (bStats) {
+    struct timespec waitEnd;
+    clock_gettime(CLOCK_MONOTONIC, &waitEnd);
+
+    uint64_t nWaitNs = _GetElapsedNs(&waitStart, &waitEnd);
+    _AddThreadingStat(THREADING_STAT_THREADS_JOINED, 1);
+    _AddThreadingStat(THREADING_STAT_WAIT_TOTAL, nWaitNs);
+    _AddThreadingStat(THREADING_STAT_WAIT_MAX, nWaitNs);
+  }
+
+  if (NULL != ppvRetVal) {
+    *ppvRetVal = pvRetVal;
+  }
+
+  pthread_mutex_lock(&pControl->mutex);
+  pControl->stats.pvExitStatus = pvRetVal;  // also covers pthread_exit
+  THREADSTACK stack = pControl->stack;
+  pControl->stack.pvBase = NULL;
+  pthread_mutex_unlock(&pControl->mutex);
+
+  // The thread is gone for good, so its stack can go to the next one
+  _ReleaseThreadStack(&stack);
+
   // Once we get here, the thread handle is completely useless, so
-  // free the memory assocaited with it and invalidate the thread
-  // handle.  This is necessary because thread handles are allocated
-  // on the heap.
+  // hand its control block back and invalidate every copy of the
+  // thread handle.
   _FreeThread(hThread);
+  _ReleaseThreadControl(pControl);
 
   // Pass the result of pthread_join to the caller
   return nResult;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
+// WaitThreadExTimeout: Like WaitThreadEx, but gives up if the thread has not
+// terminated within the specified number of milliseconds.
+
+int WaitThreadExTimeout(HTHREAD hThread, void** ppvRetVal, int nTimeoutMs) {
+  if (INFINITE == nTimeoutMs) {
+    return WaitThreadEx(hThread, ppvRetVal);
+  }
+
+  /* Hold a reference, so that a concurrent WaitThreadEx or DestroyThread
+   * cannot recycle the control block while we wait on it */
+  LPTHREADCONTROL pControl = _AcquireThreadControl(hThread);
+  if (NULL == pControl) {
+    return ERROR;	// Invalid thread handle passed; nothing to do.
+  }
+
+  struct timespec deadline;
+  _GetAbsoluteDeadline(nTimeoutMs, &deadline);
+
+  int nResult = _WaitCompleted(pControl, &deadline);
+  _ReleaseThreadControl(pControl);
+
+  if (ETIMEDOUT == nResult) {
+    return ETIMEDOUT;
+  }
+
+  // The thread is on its way out, so joining it will not block for long.
+  return WaitThreadEx(hThread, ppvRetVal);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _LinkThreadWaiter: Hooks a waiter onto every one of the specified threads
+// that is still running, and counts (or collects) the ones that have
+// already terminated.  Each waiter lock is only ever taken while holding a
+// thread lock, never the other way around.  Every node holds a reference to
+// its thread's control block, which the caller drops with
+// _ReleaseThreadControl once done with the node.  Returns FALSE, having
+// linked nothing, if any of the handles is invalid.
+
+BOOL _LinkThreadWaiter(LPTHREADWAITER pWaiter, LPTHREADWAITNODE pNodes,
+    HTHREAD* phThreads, int nCount) {
+  for (int i = 0; i < nCount; i++) {
+    pNodes[i].pControl = _AcquireThreadControl(phThreads[i]);
+    if (NULL != pNodes[i].pControl) {
+      continue;
+    }
+
+    while (--i >= 0) {
+      _ReleaseThreadControl(pNodes[i].pControl);
+    }
+    return FALSE;
+  }
+
+  for (int i = 0; i < nCount; i++) {
+    LPTHREADWAITNODE pNode = &pNodes[i];
+    LPTHREADCONTROL pControl = pNode->pControl;
+
+    pNode->pWaiter = pWaiter;
+    pNode->nIndex = i;
+    pNode->pPrev = NULL;
+    pNode->pNextCompleted = NULL;
+    pNode->bLinked = FALSE;
+
+    pthread_mutex_lock(&pControl->mutex);
+    if (pControl->bCompleted) {
+      pthread_mutex_lock(&pWaiter->mutex);
+      if (ERROR == pWaiter->nFirstIndex) {
+        pWaiter->nFirstIndex = i;
+      }
+      if (pWaiter->bCollect) {
+        pNode->pNextCompleted = pWaiter->pCompleted;
+        pWaiter->pCompleted = pNode;
+      }
+      pWaiter->nRemaining--;
+      pthread_mutex_unlock(&pWaiter->mutex);
+    } else {
+      pNode->bLinked = TRUE;
+      pNode->pNext = pControl->pWaiters;
+      if (NULL != pControl->pWaiters) {
+        pControl->pWaiters->pPrev = pNode;
+      }
+      pControl->pWaiters = pNode;
+    }
+    pthread_mutex_unlock(&pControl->mutex);
+  }
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WaitForMultipleThreads: Waits until any one, or all, of the specified
+// threads have terminated, or until the timeout elapses.
+
+int WaitForMultipleThreads(HTHREAD* phThreads, int nCount, BOOL bWaitAll,
+    int nTimeoutMs) {
+  if (NULL == phThreads || nCount <= 0) {
+    return WAIT_FAILED;
+  }
+
+  THREADWAITNODE aStackNodes[THREAD_WAIT_NODES_ON_STACK];
+  LPTHREADWAITNODE pNodes = aStackNodes;
+  if (nCount > THREAD_WAIT_NODES_ON_STACK) {
+    pNodes = (LPTHREADWAITNODE) malloc(nCount * sizeof(THREADWAITNODE));
+    if (NULL == pNodes) {
+      return WAIT_FAILED;
+    }
+  }
+
+  THREADWAITER waiter;
+  pthread_mutex_init(&waiter.mutex, NULL);
+  _InitCondition(&waiter.cond);
+  waiter.bWaitAll = bWaitAll;
+  waiter.bCollect = FALSE;
+  waiter.nRemaining = nCount;
+  waiter.nFirstIndex = ERROR;
+  waiter.pCompleted = NULL;
+
+  if (!_LinkThreadWaiter(&waiter, pNodes, phThreads, nCount)) {
+    pthread_cond_destroy(&waiter.cond);
+    pthread_mutex_destroy(&waiter.mutex);
+    if (pNodes != aStackNodes) {
+      free(pNodes);
+    }
+    return WAIT_FAILED;
+  }
+
+  struct timespec deadline;
+  if (INFINITE != nTimeoutMs) {
+    _GetAbsoluteDeadline(nTimeoutMs, &deadline);
+  }
+
+  int nResult = WAIT_TIMEOUT;
+
+  pthread_mutex_lock(&waiter.mutex);
+  while (TRUE) {
+    if (bWaitAll ? 0 == waiter.nRemaining : ERROR != waiter.nFirstIndex) {
+      nResult = bWaitAll ? WAIT_OBJECT_0 : WAIT_OBJECT_0 + waiter.nFirstIndex;
+      break;
+    }
+
+    if (INFINITE == nTimeoutMs) {
+      pthread_cond_wait(&waiter.cond, &waiter.mutex);
+    } else if (ETIMEDOUT == pthread_cond_timedwait(&waiter.cond,
+        &waiter.mutex, &deadline)) {
+      if (bWaitAll ? 0 == waiter.nRemaining : ERROR != waiter.nFirstIndex) {
+        continue;   // completion and timeout raced; completion wins
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&waiter.mutex);
+
+  /* Unhook from every thread that has not already dropped us */
+  for (int i = 0; i < nCount; i++) {
+    LPTHREADWAITNODE pNode = &pNodes[i];
+    LPTHREADCONTROL pControl = pNode->pControl;
+
+    pthread_mutex_lock(&pControl->mutex);
+    if (pNode->bLinked) {
+      if (NULL != pNode->pPrev) {
+        pNode->pPrev->pNext = pNode->pNext;
+      } else {
+        pControl->pWaiters = pNode->pNext;
+      }
+      if (NULL != pNode->pNext) {
+        pNode->pNext->pPrev = pNode->pPrev;
+      }
+      pNode->bLinked = FALSE;
+    }
+    pthread_mutex_unlock(&pControl->mutex);
+
+    _ReleaseThreadControl(pControl);
+  }
+
+  pthread_cond_destroy(&waiter.cond);
+  pthread_mutex_destroy(&waiter.mutex);
+
+  if (pNodes != aStackNodes) {
+    free(pNodes);
+  }
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WaitThreads function
+
+int WaitThreads(HTHREAD* phThreads, int nCount, void** ppvResults) {
+  if (NULL == phThreads || nCount <= 0) {
+    return ERROR;
+  }
+
+  THREADWAITNODE aStackNodes[THREAD_WAIT_NODES_ON_STACK];
+  LPTHREADWAITNODE pNodes = aStackNodes;
+  if (nCount > THREAD_WAIT_NODES_ON_STACK) {
+    pNodes = (LPTHREADWAITNODE) malloc(nCount * sizeof(THREADWAITNODE));
+    if (NULL == pNodes) {
+      return ENOMEM;
+    }
+  }
+
+  THREADWAITER waiter;
+  pthread_mutex_init(&waiter.mutex, NULL);
+  _InitCondition(&waiter.cond);
+  waiter.bWaitAll = FALSE;
+  waiter.bCollect = TRUE;
+  waiter.nRemaining = nCount;
+  waiter.nFirstIndex = ERROR;
+  waiter.pCompleted = NULL;
+
+  if (!_LinkThreadWaiter(&waiter, pNodes, phThreads, nCount)) {
+    pthread_cond_destroy(&waiter.cond);
+    pthread_mutex_destroy(&waiter.mutex);
+    if (pNodes != aStackNodes) {
+      free(pNodes);
+    }
+    return ERROR;
+  }
+
+  /* Join the threads in the order they terminate, a batch at a time.  A
+   * node is off its thread's list by the time it gets here, and the thread
+   * is done with it by the time it has been joined. */
+  int nResult = OK;
+  int nJoined = 0;
+
+  pthread_mutex_lock(&waiter.mutex);
+  while (nJoined < nCount) {
+    while (NULL == waiter.pCompleted) {
+      pthread_cond_wait(&waiter.cond, &waiter.mutex);
+    }
+
+    LPTHREADWAITNODE pBatch = NULL;
+    while (NULL != waiter.pCompleted) {     // oldest termination first
+      LPTHREADWAITNODE pNode = waiter.pCompleted;
+      waiter.pCompleted = pNode->pNextCompleted;
+      pNode->pNextCompleted = pBatch;
+      pBatch = pNode;
+    }
+    pthread_mutex_unlock(&waiter.mutex);
+
+    for (; NULL != pBatch; pBatch = pBatch->pNextCompleted) {
+      void* pvRetVal = NULL;
+      int nJoinResult = WaitThreadEx(phThreads[pBatch->nIndex], &pvRetVal);
+      if (OK == nResult) {
+        nResult = nJoinResult;
+      }
+      if (NULL != ppvResults) {
+        ppvResults[pBatch->nIndex] = pvRetVal;
+      }
+      _ReleaseThreadControl(pBatch->pControl);
+      nJoined++;
+    }
+
+    pthread_mutex_lock(&waiter.mutex);
+  }
+  pthread_mutex_unlock(&waiter.mutex);
+
+  pthread_cond_destroy(&waiter.cond);
+  pthread_mutex_destroy(&waiter.mutex);
+
+  if (pNodes != aStackNodes) {
+    free(pNodes);
+  }
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsThreadHandleValid function
+
+BOOL IsThreadHandleValid(HTHREAD hThread) {
+  return NULL != _GetThreadControl(hThread);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetThreadId function
+
+int GetThreadId(HTHREAD hThread, pthread_t* pThreadID) {
+  LPTHREADCONTROL pControl = _GetThreadControl(hThread);
+  if (NULL == pControl || NULL == pThreadID) {
+    return EINVAL;
+  }
+
+  *pThreadID = pControl->nThreadID;
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetThreadName function
+
+BOOL SetThreadName(HTHREAD hThread, const char* pszName) {
+  LPTHREADCONTROL pControl = _GetThreadControl(hThread);
+  if (NULL == pControl || NULL == pszName) {
+    return FALSE;
+  }
+
+  pthread_mutex_lock(&pControl->mutex);
+
+  strncpy(pControl->szName, pszName, THREAD_NAME_MAX_LENGTH - 1);
+  pControl->szName[THREAD_NAME_MAX_LENGTH - 1] = '\0';
+
+  /* The kernel only keeps 15 characters; it is just a diagnostic aid, so
+   * failing to set it (e.g., because the thread has exited) is harmless. */
+  if (!pControl->bCompleted && !pControl->bFiber) {
+    char szShortName[16];
+    strncpy(szShortName, pszName, sizeof(szShortName) - 1);
+    szShortName[sizeof(szShortName) - 1] = '\0';
+    pthread_setname_np(pControl->nThreadID, szShortName);
+  }
+
+  pthread_mutex_unlock(&pControl->mutex);
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetThreadName function
+
+BOOL GetThreadName(HTHREAD hThread, char* pszName, int nSize) {
+  LPTHREADCONTROL pControl = _GetThreadControl(hThread);
+  if (NULL == pControl || NULL == pszName || nSize <= 0) {
+    return FALSE;
+  }
+
+  pthread_mutex_lock(&pControl->mutex);
+  strncpy(pszName, pControl->szName, nSize - 1);
+  pthread_mutex_unlock(&pControl->mutex);
+
+  pszName[nSize - 1] = '\0';
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetThreadStartTime function
+
+int GetThreadStartTime(HTHREAD hThread, struct timespec* pStartTime) {
+  LPTHREADCONTROL pControl = _GetThreadControl(hThread);
+  if (NULL == pControl || NULL == pStartTime) {
+    return EINVAL;
+  }
+
+  *pStartTime = pControl->stats.startTime;
+
+  return OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetThreadExitStatus function
+
+int GetThreadExitStatus(HTHREAD hThread, void** ppvExitStatus) {
+  LPTHREADCONTROL pControl = _GetThreadControl(hThread);
+  if (NULL == pControl || NULL == ppvExitStatus) {
+    return EINVAL;
+  }
+
+  int nResult = EBUSY;
+
+  pthread_mutex_lock(&pControl->mutex);
+  if (pControl->bCompleted) {
+    *ppvExitStatus = pControl->stats.pvExitStatus;
+    nResult = OK;
+  }
+  pthread_mutex_unlock(&pControl->mutex);
+
+  return nResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,217 @@
+// threading_stats.c - Implements the opt-in statistics of the threading_core
+// library: per-thread counter slots and the snapshot that adds them up.
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief Counters of one thread.  Only the owning thread writes them, so a
+ * relaxed load and store is enough to bump one; the slot is padded to whole
+ * cache lines so that no two threads ever write to the same line.
+ */
+typedef struct _STATSSLOT {
+  CACHE_ALIGNED atomic_uint_least64_t anCounters[THREADING_STAT_COUNT];
+  struct _STATSSLOT* pNext;       // in the list of live or of free slots
+  struct _STATSSLOT** ppPrev;
+} CACHE_ALIGNED STATSSLOT, *LPSTATSSLOT;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+atomic_bool g_bThreadingStatsEnabled = false;
+
+static pthread_once_t g_statsOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_statsKey;    // runs _RetireStatsSlot at thread exit
+
+/* Slots of live threads, recycled slots, and the totals of the threads that
+ * have exited; all protected by g_statsMutex */
+static pthread_mutex_t g_statsMutex = PTHREAD_MUTEX_INITIALIZER;
+static LPSTATSSLOT g_pLiveSlots = NULL;
+static LPSTATSSLOT g_pFreeSlots = NULL;
+static uint64_t g_anRetiredCounters[THREADING_STAT_COUNT];
+
+static __thread LPSTATSSLOT g_pStatsSlot = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _IsMaxCounter: Determines whether a counter keeps a maximum rather than a
+// running total.
+
+static inline BOOL _IsMaxCounter(int nCounter) {
+  return THREADING_STAT_START_LATENCY_MAX == nCounter
+      || THREADING_STAT_WAIT_MAX == nCounter;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RetireStatsSlot: Folds the counters of an exiting thread into the totals
+// and recycles its slot.
+
+void _RetireStatsSlot(void* pvSlot) {
+  LPSTATSSLOT pSlot = (LPSTATSSLOT) pvSlot;
+
+  pthread_mutex_lock(&g_statsMutex);
+
+  for (int i = 0; i < THREADING_STAT_COUNT; i++) {
+    uint64_t nValue = atomic_load_explicit(&pSlot->anCounters[i],
+        memory_order_relaxed);
+    if (!_IsMaxCounter(i)) {
+      g_anRetiredCounters[i] += nValue;
+    } else if (nValue > g_anRetiredCounters[i]) {
+      g_anRetiredCounters[i] = nValue;
+    }
+    atomic_store_explicit(&pSlot->anCounters[i], 0, memory_order_relaxed);
+  }
+
+  *pSlot->ppPrev = pSlot->pNext;
+  if (NULL != pSlot->pNext) {
+    pSlot->pNext->ppPrev = pSlot->ppPrev;
+  }
+
+  pSlot->pNext = g_pFreeSlots;
+  g_pFreeSlots = pSlot;
+
+  pthread_mutex_unlock(&g_statsMutex);
+
+  g_pStatsSlot = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _InitThreadingStats: Creates the key whose destructor retires the slots of
+// exiting threads.
+
+void _InitThreadingStats(void) {
+  pthread_key_create(&g_statsKey, _RetireStatsSlot);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetStatsSlot: Gets the slot of the calling thread, giving it one the
+// first time around.  Returns NULL if we are out of memory.
+
+LPSTATSSLOT _GetStatsSlot(void) {
+  if (NULL != g_pStatsSlot) {
+    return g_pStatsSlot;
+  }
+
+  pthread_once(&g_statsOnce, _InitThreadingStats);
+
+  pthread_mutex_lock(&g_statsMutex);
+
+  LPSTATSSLOT pSlot = g_pFreeSlots;
+  if (NULL != pSlot) {
+    g_pFreeSlots = pSlot->pNext;
+  } else if (OK != posix_memalign((void**) &pSlot, CACHE_LINE_SIZE,
+      sizeof(STATSSLOT))) {
+    pthread_mutex_unlock(&g_statsMutex);
+    return NULL;
+  } else {
+    memset(pSlot, 0, sizeof(STATSSLOT));
+  }
+
+  pSlot->pNext = g_pLiveSlots;
+  pSlot->ppPrev = &g_pLiveSlots;
+  if (NULL != g_pLiveSlots) {
+    g_pLiveSlots->ppPrev = &pSlot->pNext;
+  }
+  g_pLiveSlots = pSlot;
+
+  pthread_mutex_unlock(&g_statsMutex);
+
+  pthread_setspecific(g_statsKey, pSlot);
+  g_pStatsSlot = pSlot;
+
+  return pSlot;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AddThreadingStat: Adds to a counter of the calling thread.  Shared with
+// the other modules of this library.
+
+void _AddThreadingStat(int nCounter, uint64_t nValue) {
+  LPSTATSSLOT pSlot = _GetStatsSlot();
+  if (NULL == pSlot || nCounter < 0 || nCounter >= THREADING_STAT_COUNT) {
+    return;
+  }
+
+  atomic_uint_least64_t* pnCounter = &pSlot->anCounters[nCounter];
+  uint64_t nCurrent = atomic_load_explicit(pnCounter, memory_order_relaxed);
+
+  if (_IsMaxCounter(nCounter)) {
+    if (nValue > nCurrent) {
+      atomic_store_explicit(pnCounter, nValue, memory_order_relaxed);
+    }
+  } else {
+    atomic_store_explicit(pnCounter, nCurrent + nValue, memory_order_relaxed);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// EnableThreadingStats function
+
+void EnableThreadingStats(BOOL bEnable) {
+  atomic_store_explicit(&g_bThreadingStatsEnabled, bEnable ? true : false,
+      memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsThreadingStatsEnabled function
+
+BOOL IsThreadingStatsEnabled(void) {
+  return atomic_load_explicit(&g_bThreadingStatsEnabled,
+      memory_order_relaxed) ? TRUE : FALSE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetThreadingStats function
+
+BOOL GetThreadingStats(LPTHREADING_STATS pStats) {
+  if (NULL == pStats) {
+    return FALSE;
+  }
+
+  uint64_t anCounters[THREADING_STAT_COUNT];
+
+  pthread_mutex_lock(&g_statsMutex);
+
+  memcpy(anCounters, g_anRetiredCounters, sizeof(anCounters));
+
+  for (LPSTATSSLOT pSlot = g_pLiveSlots; NULL != pSlot;
+      pSlot = pSlot->pNext) {
+    for (int i = 0; i < THREADING_STAT_COUNT; i++) {
+      uint64_t nValue = atomic_load_explicit(&pSlot->anCounters[i],
+          memory_order_relaxed);
+      if (!_IsMaxCounter(i)) {
+        anCounters[i] += nValue;
+      } else if (nValue > anCounters[i]) {
+        anCounters[i] = nValue;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&g_statsMutex);
+
+  pStats->nThreadsCreated = anCounters[THREADING_STAT_THREADS_CREATED];
+  pStats->nThreadsJoined = anCounters[THREADING_STAT_THREADS_JOINED];
+  pStats->nThreadsCanceled = anCounters[THREADING_STAT_THREADS_CANCELED];
+  pStats->nThreadsKilled = anCounters[THREADING_STAT_THREADS_KILLED];
+  pStats->nStartLatencyTotalNs =
+      anCounters[THREADING_STAT_START_LATENCY_TOTAL];
+  pStats->nStartLatencyMaxNs = anCounters[THREADING_STAT_START_LATENCY_MAX];
+  pStats->nWaitTotalNs = anCounters[THREADING_STAT_WAIT_TOTAL];
+  pStats->nWaitMaxNs = anCounters[THREADING_STAT_WAIT_MAX];
+  pStats->nMarshalCalls = anCounters[THREADING_STAT_MARSHAL_CALLS];
+  pStats->nMarshalBytes = anCounters[THREADING_STAT_MARSHAL_BYTES];
+
+  return TRUE;
+}
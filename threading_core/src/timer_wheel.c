@@ -0,0 +1,641 @@
+// timer_wheel.c - Implementations of the functions defined in timer_wheel.h
+//
+
+#include "stdafx.h"
+
+#include "threading_core.h"
+#include "threading_core_internal.h"
+#include "threading_core_symbols.h"
+
+#include "timer_wheel.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @brief Number of levels of the wheel, and of bits of the expiry tick that
+ * each level covers.  Level 0 holds the timers due within 64 ticks, level 1
+ * those due within 64 * 64 ticks, and so on; timers further out than the
+ * top level reaches are parked at its far end and re-inserted from there.
+ */
+#define TIMER_WHEEL_LEVELS      4
+#define TIMER_WHEEL_BITS        6
+#define TIMER_WHEEL_SLOTS       (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK        (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_MAX_DELTA   \
+  ((1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1)
+
+/**
+ * @brief Number of bits of a HTIMER that hold the index of its entry.  See
+ * THREAD_HANDLE_INDEX_BITS.
+ */
+#define TIMER_HANDLE_INDEX_BITS 20
+#define TIMER_HANDLE_INDEX_MASK ((1 << TIMER_HANDLE_INDEX_BITS) - 1)
+
+/**
+ * @brief Number of timer entries allocated at once.
+ */
+#define TIMER_TABLE_PAGE_SIZE   256
+
+/**
+ * @brief Maximum number of pages of timer entries.
+ */
+#define TIMER_TABLE_MAX_PAGES   \
+  (TIMER_HANDLE_INDEX_MASK / TIMER_TABLE_PAGE_SIZE)
+
+/**
+ * @name TIMER_STATE_*
+ * @brief Values of TIMERENTRY::nState.  The entry is on the free list; it
+ * is in the wheel; its callback has been handed to a callback thread.
+ */
+#define TIMER_STATE_FREE        0
+#define TIMER_STATE_PENDING     1
+#define TIMER_STATE_RUNNING     2
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief A timer.  Entries live in pages that are never freed, so a pointer
+ * to one stays good while its callback runs; everything in it is protected
+ * by g_timerMutex.
+ */
+typedef struct _TIMERENTRY {
+  struct _TIMERENTRY* pNext;        // in a slot of the wheel, or free list
+  struct _TIMERENTRY** ppPrev;      // lets the entry unlink itself in O(1)
+  int nLevel;                       // where it is in the wheel
+  int nSlot;
+
+  uint64_t nExpiryTick;
+  uint64_t nIntervalTicks;          // zero for a one-shot timer
+  LPTHREAD_START_ROUTINE lpfnCallback;
+  void* pUserState;
+
+  int nIndex;
+  unsigned int nGeneration;         // moves on whenever the entry is freed
+  int nState;                       // TIMER_STATE_*
+  BOOL bCanceled;                   // while TIMER_STATE_RUNNING
+} TIMERENTRY, *LPTIMERENTRY;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+/* Set once the timer thread is running; a failed start is retried by the
+ * next timer that is set */
+static pthread_mutex_t g_timerInitMutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool g_bTimersReady = false;
+
+static pthread_mutex_t g_timerMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_timerWakeCond;    // the timer thread sleeps on it
+static pthread_cond_t g_timerIdleCond;    // a callback has returned
+
+static struct timespec g_wheelEpoch;      // time of tick zero
+static uint64_t g_nCurrentTick = 0;       // last tick the wheel processed
+static uint64_t g_nWakeTick = UINT64_MAX; // when the timer thread wakes up
+
+static LPTIMERENTRY g_apWheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+static uint64_t g_anOccupied[TIMER_WHEEL_LEVELS];   // a bit per nonempty slot
+
+static LPTIMERENTRY g_apTimerPages[TIMER_TABLE_MAX_PAGES];
+static int g_nTimerPages = 0;
+static LPTIMERENTRY g_pFreeTimers = NULL;
+
+static HTHREADPOOL g_hCallbackPool = INVALID_HANDLE_VALUE;
+
+/* Timer whose callback the calling thread is running, if any */
+static __thread LPTIMERENTRY g_pRunningTimer = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetCurrentTick: Gets the tick of the wheel that the current time falls
+// into.
+
+uint64_t _GetCurrentTick(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return _GetElapsedNs(&g_wheelEpoch, &now)
+      / (TIMER_WHEEL_TICK_MS * 1000000ULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetExpiryTick: Gets the first tick that starts no earlier than nDelayMs
+// from now, so that a timer never fires early.
+
+uint64_t _GetExpiryTick(int nDelayMs) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  uint64_t nTickNs = TIMER_WHEEL_TICK_MS * 1000000ULL;
+  uint64_t nDueNs = _GetElapsedNs(&g_wheelEpoch, &now)
+      + (uint64_t) nDelayMs * 1000000ULL;
+
+  return (nDueNs + nTickNs - 1) / nTickNs;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetTickTime: Gets the CLOCK_MONOTONIC time at which a tick starts.
+
+void _GetTickTime(uint64_t nTick, struct timespec* pTime) {
+  uint64_t nNs = (uint64_t) g_wheelEpoch.tv_nsec
+      + nTick * TIMER_WHEEL_TICK_MS * 1000000ULL;
+
+  pTime->tv_sec = g_wheelEpoch.tv_sec + (time_t) (nNs / 1000000000ULL);
+  pTime->tv_nsec = (long) (nNs % 1000000000ULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _MakeTimerHandle: Encodes an entry and its generation as a HTIMER.
+
+static inline HTIMER _MakeTimerHandle(LPTIMERENTRY pEntry) {
+  return (HTIMER) (((uintptr_t) pEntry->nGeneration
+      << TIMER_HANDLE_INDEX_BITS) | (uintptr_t) (pEntry->nIndex + 1));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetTimerEntry: Looks up the entry that a handle refers to.  Returns NULL
+// if the handle is invalid or stale.  g_timerMutex must be held by the
+// caller.
+
+LPTIMERENTRY _GetTimerEntry(HTIMER hTimer) {
+  uintptr_t nIndex = ((uintptr_t) hTimer & TIMER_HANDLE_INDEX_MASK);
+  if (0 == nIndex--
+      || (int) (nIndex / TIMER_TABLE_PAGE_SIZE) >= g_nTimerPages) {
+    return NULL;
+  }
+
+  LPTIMERENTRY pEntry = &g_apTimerPages[nIndex / TIMER_TABLE_PAGE_SIZE][
+      nIndex % TIMER_TABLE_PAGE_SIZE];
+  if (TIMER_STATE_FREE == pEntry->nState
+      || hTimer != _MakeTimerHandle(pEntry)) {
+    return NULL;
+  }
+
+  return pEntry;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AllocTimerEntry: Takes an entry off the free list, adding a page of them
+// if it is empty.  g_timerMutex must be held by the caller.
+
+LPTIMERENTRY _AllocTimerEntry(void) {
+  if (NULL == g_pFreeTimers) {
+    if (g_nTimerPages >= TIMER_TABLE_MAX_PAGES) {
+      return NULL;
+    }
+
+    LPTIMERENTRY pPage = (LPTIMERENTRY) calloc(TIMER_TABLE_PAGE_SIZE,
+        sizeof(TIMERENTRY));
+    if (NULL == pPage) {
+      return NULL;
+    }
+
+    for (int i = TIMER_TABLE_PAGE_SIZE - 1; i >= 0; i--) {
+      pPage[i].nIndex = g_nTimerPages * TIMER_TABLE_PAGE_SIZE + i;
+      pPage[i].nGeneration = 1;
+      pPage[i].pNext = g_pFreeTimers;
+      g_pFreeTimers = &pPage[i];
+    }
+
+    g_apTimerPages[g_nTimerPages++] = pPage;
+  }
+
+  LPTIMERENTRY pEntry = g_pFreeTimers;
+  g_pFreeTimers = pEntry->pNext;
+  pEntry->pNext = NULL;
+  pEntry->ppPrev = NULL;
+  pEntry->bCanceled = FALSE;
+
+  return pEntry;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _FreeTimerEntry: Puts an entry back on the free list, making every handle
+// to it stale.  g_timerMutex must be held by the caller.
+
+void _FreeTimerEntry(LPTIMERENTRY pEntry) {
+  pEntry->nState = TIMER_STATE_FREE;
+  pEntry->nGeneration = (pEntry->nGeneration + 1)
+      & (UINT_MAX >> TIMER_HANDLE_INDEX_BITS);
+  if (0 == pEntry->nGeneration) {
+    pEntry->nGeneration = 1;
+  }
+
+  pEntry->lpfnCallback = NULL;
+  pEntry->pUserState = NULL;
+  pEntry->pNext = g_pFreeTimers;
+  g_pFreeTimers = pEntry;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _InsertTimer: Links an entry into the slot of the wheel that its expiry
+// tick falls into.  g_timerMutex must be held by the caller.
+
+void _InsertTimer(LPTIMERENTRY pEntry) {
+  uint64_t nExpiry = pEntry->nExpiryTick;
+  if (nExpiry <= g_nCurrentTick) {
+    nExpiry = g_nCurrentTick + 1;   // overdue: fire on the next tick
+  }
+
+  uint64_t nDelta = nExpiry - g_nCurrentTick;
+  if (nDelta > TIMER_WHEEL_MAX_DELTA) {
+    nExpiry = g_nCurrentTick + TIMER_WHEEL_MAX_DELTA;
+    nDelta = TIMER_WHEEL_MAX_DELTA;
+  }
+
+  int nLevel = 0;
+  while (nLevel < TIMER_WHEEL_LEVELS - 1
+      && nDelta >= (1ULL << ((nLevel + 1) * TIMER_WHEEL_BITS))) {
+    nLevel++;
+  }
+
+  int nSlot = (int) ((nExpiry >> (nLevel * TIMER_WHEEL_BITS))
+      & TIMER_WHEEL_MASK);
+
+  LPTIMERENTRY* ppHead = &g_apWheel[nLevel][nSlot];
+  pEntry->pNext = *ppHead;
+  pEntry->ppPrev = ppHead;
+  if (NULL != *ppHead) {
+    (*ppHead)->ppPrev = &pEntry->pNext;
+  }
+  *ppHead = pEntry;
+
+  pEntry->nLevel = nLevel;
+  pEntry->nSlot = nSlot;
+  pEntry->nState = TIMER_STATE_PENDING;
+  g_anOccupied[nLevel] |= 1ULL << nSlot;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RemoveTimer: Unlinks an entry from the wheel.  g_timerMutex must be held
+// by the caller.
+
+void _RemoveTimer(LPTIMERENTRY pEntry) {
+  *pEntry->ppPrev = pEntry->pNext;
+  if (NULL != pEntry->pNext) {
+    pEntry->pNext->ppPrev = pEntry->ppPrev;
+  }
+
+  if (NULL == g_apWheel[pEntry->nLevel][pEntry->nSlot]) {
+    g_anOccupied[pEntry->nLevel] &= ~(1ULL << pEntry->nSlot);
+  }
+
+  pEntry->pNext = NULL;
+  pEntry->ppPrev = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _TakeSlot: Empties a slot of the wheel and returns what was in it.
+// g_timerMutex must be held by the caller.
+
+LPTIMERENTRY _TakeSlot(int nLevel, int nSlot) {
+  LPTIMERENTRY pEntries = g_apWheel[nLevel][nSlot];
+
+  g_apWheel[nLevel][nSlot] = NULL;
+  g_anOccupied[nLevel] &= ~(1ULL << nSlot);
+
+  return pEntries;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AdvanceWheel: Moves the wheel up to nTargetTick, cascading the upper
+// levels down as their slots come due, and collects the timers that have
+// expired into a list, marked as running.  Runs of ticks with nothing to
+// fire or cascade are skipped.  g_timerMutex must be held by the caller.
+
+LPTIMERENTRY _AdvanceWheel(uint64_t nTargetTick) {
+  LPTIMERENTRY pExpired = NULL;
+
+  while (g_nCurrentTick < nTargetTick) {
+    if (0 == g_anOccupied[0]) {
+      BOOL bEmpty = TRUE;
+      for (int nLevel = 1; nLevel < TIMER_WHEEL_LEVELS; nLevel++) {
+        bEmpty &= (0 == g_anOccupied[nLevel]);
+      }
+
+      uint64_t nBoundary = (g_nCurrentTick | TIMER_WHEEL_MASK) + 1;
+      if (bEmpty || nBoundary > nTargetTick) {
+        g_nCurrentTick = nTargetTick;
+        break;
+      }
+
+      g_nCurrentTick = nBoundary - 1;
+    }
+
+    g_nCurrentTick++;
+
+    for (int nLevel = 1; nLevel < TIMER_WHEEL_LEVELS; nLevel++) {
+      int nShift = nLevel * TIMER_WHEEL_BITS;
+      if (0 != (g_nCurrentTick & ((1ULL << nShift) - 1))) {
+        break;
+      }
+
+      LPTIMERENTRY pEntry = _TakeSlot(nLevel,
+          (int) ((g_nCurrentTick >> nShift) & TIMER_WHEEL_MASK));
+      while (NULL != pEntry) {
+        LPTIMERENTRY pNext = pEntry->pNext;
+        _InsertTimer(pEntry);
+        pEntry = pNext;
+      }
+    }
+
+    LPTIMERENTRY pEntry = _TakeSlot(0,
+        (int) (g_nCurrentTick & TIMER_WHEEL_MASK));
+    while (NULL != pEntry) {
+      LPTIMERENTRY pNext = pEntry->pNext;
+
+      /* Timers parked at the far end of the top level come back around
+       * until they are really due */
+      if (pEntry->nExpiryTick > g_nCurrentTick) {
+        _InsertTimer(pEntry);
+      } else {
+        pEntry->nState = TIMER_STATE_RUNNING;
+        pEntry->ppPrev = NULL;
+        pEntry->pNext = pExpired;
+        pExpired = pEntry;
+      }
+
+      pEntry = pNext;
+    }
+  }
+
+  return pExpired;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetNextEventTick: Gets the next tick at which a slot of the wheel fires
+// or cascades, or UINT64_MAX if the wheel is empty.  g_timerMutex must be
+// held by the caller.
+
+uint64_t _GetNextEventTick(void) {
+  uint64_t nNextTick = UINT64_MAX;
+
+  for (int nLevel = 0; nLevel < TIMER_WHEEL_LEVELS; nLevel++) {
+    if (0 == g_anOccupied[nLevel]) {
+      continue;
+    }
+
+    /* Rotate the bitmap so that bit 0 stands for the next slot of the
+     * level to come around */
+    int nShift = nLevel * TIMER_WHEEL_BITS;
+    uint64_t nUnit = g_nCurrentTick >> nShift;
+    int nStart = (int) ((nUnit + 1) & TIMER_WHEEL_MASK);
+
+    uint64_t nBits = g_anOccupied[nLevel];
+    if (0 != nStart) {
+      nBits = (nBits >> nStart) | (nBits << (TIMER_WHEEL_SLOTS - nStart));
+    }
+
+    uint64_t nTick = (nUnit + 1 + (uint64_t) __builtin_ctzll(nBits))
+        << nShift;
+    if (nTick < nNextTick) {
+      nNextTick = nTick;
+    }
+  }
+
+  return nNextTick;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _RunTimerCallback: Work item that runs the callback of a timer on a
+// callback thread, and then either puts a periodic timer back into the
+// wheel or frees the entry.
+
+void* _RunTimerCallback(void* pvEntry) {
+  LPTIMERENTRY pEntry = (LPTIMERENTRY) pvEntry;
+
+  /* Nobody else writes these while the entry is running */
+  g_pRunningTimer = pEntry;
+  pEntry->lpfnCallback(pEntry->pUserState);
+  g_pRunningTimer = NULL;
+
+  pthread_mutex_lock(&g_timerMutex);
+
+  if (0 != pEntry->nIntervalTicks && !pEntry->bCanceled) {
+    /* Keep to the original schedule, skipping the runs that were missed */
+    uint64_t nNowTick = _GetCurrentTick();
+    pEntry->nExpiryTick += pEntry->nIntervalTicks;
+    if (pEntry->nExpiryTick <= nNowTick) {
+      pEntry->nExpiryTick += ((nNowTick - pEntry->nExpiryTick)
+          / pEntry->nIntervalTicks + 1) * pEntry->nIntervalTicks;
+    }
+
+    _InsertTimer(pEntry);
+
+    if (pEntry->nExpiryTick < g_nWakeTick) {
+      pthread_cond_signal(&g_timerWakeCond);
+    }
+  } else {
+    _FreeTimerEntry(pEntry);
+  }
+
+  pthread_cond_broadcast(&g_timerIdleCond);
+
+  pthread_mutex_unlock(&g_timerMutex);
+
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _TimerThreadProc: Thread procedure of the timer thread.  Sleeps until the
+// next slot of the wheel comes due, and hands the expired timers to the
+// callback threads.
+
+void* _TimerThreadProc(void* pvParam) {
+  (void) pvParam;
+
+  pthread_mutex_lock(&g_timerMutex);
+
+  for (;;) {
+    LPTIMERENTRY pExpired = _AdvanceWheel(_GetCurrentTick());
+
+    if (NULL != pExpired) {
+      pthread_mutex_unlock(&g_timerMutex);
+
+      while (NULL != pExpired) {
+        LPTIMERENTRY pNext = pExpired->pNext;
+        pExpired->pNext = NULL;
+
+        if (!QueueWorkItem(g_hCallbackPool, _RunTimerCallback, pExpired)) {
+          _RunTimerCallback(pExpired);    // out of memory: run it here
+        }
+
+        pExpired = pNext;
+      }
+
+      pthread_mutex_lock(&g_timerMutex);
+      continue;   // time has moved on while the lock was released
+    }
+
+    g_nWakeTick = _GetNextEventTick();
+    if (UINT64_MAX == g_nWakeTick) {
+      pthread_cond_wait(&g_timerWakeCond, &g_timerMutex);
+    } else {
+      struct timespec wakeTime;
+      _GetTickTime(g_nWakeTick, &wakeTime);
+      pthread_cond_timedwait(&g_timerWakeCond, &g_timerMutex, &wakeTime);
+    }
+    g_nWakeTick = UINT64_MAX;
+  }
+
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _InitTimers: Starts the timer thread and the pool of callback threads.
+// Tears down whatever it set up if it fails, so that it can be called
+// again.  g_timerInitMutex must be held by the caller.
+
+BOOL _InitTimers(void) {
+  clock_gettime(CLOCK_MONOTONIC, &g_wheelEpoch);
+
+  if (OK != _InitCondition(&g_timerWakeCond)) {
+    return FALSE;
+  }
+
+  if (OK != _InitCondition(&g_timerIdleCond)) {
+    pthread_cond_destroy(&g_timerWakeCond);
+    return FALSE;
+  }
+
+  g_hCallbackPool = CreateThreadPool(0, TIMER_CALLBACK_THREADS);
+  if (INVALID_HANDLE_VALUE == g_hCallbackPool) {
+    pthread_cond_destroy(&g_timerIdleCond);
+    pthread_cond_destroy(&g_timerWakeCond);
+    return FALSE;
+  }
+
+  HTHREAD hTimerThread = CreateThreadEx(_TimerThreadProc, NULL);
+  if (INVALID_HANDLE_VALUE == hTimerThread) {
+    DestroyThreadPool(g_hCallbackPool);
+    g_hCallbackPool = INVALID_HANDLE_VALUE;
+    pthread_cond_destroy(&g_timerIdleCond);
+    pthread_cond_destroy(&g_timerWakeCond);
+    return FALSE;
+  }
+
+  SetThreadName(hTimerThread, "tc-timer");
+
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _EnsureTimers: Starts the timer thread, unless it is already running.
+// Returns FALSE if it could not be started.
+
+BOOL _EnsureTimers(void) {
+  if (atomic_load_explicit(&g_bTimersReady, memory_order_acquire)) {
+    return TRUE;
+  }
+
+  pthread_mutex_lock(&g_timerInitMutex);
+  if (!atomic_load_explicit(&g_bTimersReady, memory_order_relaxed)
+      && _InitTimers()) {
+    atomic_store_explicit(&g_bTimersReady, true, memory_order_release);
+  }
+  pthread_mutex_unlock(&g_timerInitMutex);
+
+  return atomic_load_explicit(&g_bTimersReady, memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ScheduleTimer: Puts a new timer into the wheel, and wakes the timer
+// thread if it is due before the thread would otherwise wake up.
+
+HTIMER _ScheduleTimer(int nDelayMs, int nIntervalMs,
+    LPTHREAD_START_ROUTINE lpfnCallback, void* pUserState) {
+  if (nDelayMs < 0 || nIntervalMs < 0 || NULL == lpfnCallback) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  if (!_EnsureTimers()) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  pthread_mutex_lock(&g_timerMutex);
+
+  LPTIMERENTRY pEntry = _AllocTimerEntry();
+  if (NULL == pEntry) {
+    pthread_mutex_unlock(&g_timerMutex);
+    return INVALID_HANDLE_VALUE;
+  }
+
+  pEntry->nExpiryTick = _GetExpiryTick(nDelayMs);
+  pEntry->nIntervalTicks = (0 == nIntervalMs) ? 0 : (uint64_t)
+      ((nIntervalMs + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS);
+  pEntry->lpfnCallback = lpfnCallback;
+  pEntry->pUserState = pUserState;
+
+  _InsertTimer(pEntry);
+
+  if (pEntry->nExpiryTick < g_nWakeTick) {
+    pthread_cond_signal(&g_timerWakeCond);
+  }
+
+  HTIMER hTimer = _MakeTimerHandle(pEntry);
+
+  pthread_mutex_unlock(&g_timerMutex);
+
+  return hTimer;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// ScheduleAfter function
+
+HTIMER ScheduleAfter(int nDelayMs, LPTHREAD_START_ROUTINE lpfnCallback,
+    void* pUserState) {
+  return _ScheduleTimer(nDelayMs, 0, lpfnCallback, pUserState);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ScheduleEvery function
+
+HTIMER ScheduleEvery(int nIntervalMs, LPTHREAD_START_ROUTINE lpfnCallback,
+    void* pUserState) {
+  if (nIntervalMs <= 0) {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  return _ScheduleTimer(nIntervalMs, nIntervalMs, lpfnCallback, pUserState);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CancelTimer function
+
+int CancelTimer(HTIMER hTimer) {
+  if (INVALID_HANDLE_VALUE == hTimer) {
+    return EINVAL;
+  }
+
+  pthread_mutex_lock(&g_timerMutex);
+
+  LPTIMERENTRY pEntry = _GetTimerEntry(hTimer);
+  if (NULL == pEntry) {
+    pthread_mutex_unlock(&g_timerMutex);
+    return EINVAL;
+  }
+
+  if (TIMER_STATE_PENDING == pEntry->nState) {
+    _RemoveTimer(pEntry);
+    _FreeTimerEntry(pEntry);
+  } else {
+    /* The callback is running; _RunTimerCallback frees the entry when it
+     * returns, which moves the generation on */
+    pEntry->bCanceled = TRUE;
+
+    if (g_pRunningTimer != pEntry) {
+      while (hTimer == _MakeTimerHandle(pEntry)) {
+        pthread_cond_wait(&g_timerIdleCond, &g_timerMutex);
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&g_timerMutex);
+
+  return OK;
+}
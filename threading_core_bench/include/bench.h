@@ -0,0 +1,135 @@
+// bench.h - Interface shared by the benchmarks of the threading_core
+// library and the harness that runs them.
+//
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "threading_core.h"
+
+/**
+ * @brief Maximum number of thread counts that can be passed with
+ * --threads.
+ */
+#ifndef BENCH_MAX_THREAD_COUNTS
+#define BENCH_MAX_THREAD_COUNTS 16
+#endif //BENCH_MAX_THREAD_COUNTS
+
+/**
+ * @brief Number of operations each thread times, per benchmark, unless
+ * --iterations says otherwise.
+ */
+#ifndef BENCH_DEFAULT_ITERATIONS
+#define BENCH_DEFAULT_ITERATIONS 1000
+#endif //BENCH_DEFAULT_ITERATIONS
+
+/**
+ * @brief Options that apply to every benchmark, as parsed from the command
+ * line.
+ */
+typedef struct _BENCHOPTIONS {
+  int nIterations;
+  int anThreadCounts[BENCH_MAX_THREAD_COUNTS];
+  int nThreadCounts;
+  FILE* fpOutput;         // receives the JSON report
+  int nResults;           // results written so far
+} BENCHOPTIONS, *LPBENCHOPTIONS;
+
+/**
+ * @brief Signature of a function that runs one benchmark at every thread
+ * count in the options, and reports each run with ReportBenchResult.
+ */
+typedef void (*LPBENCH_ROUTINE)(LPBENCHOPTIONS pOptions);
+
+/**
+ * @brief State of one run of a benchmark: nThreads threads, each of which
+ * times nIterations operations into its own part of the samples array.
+ */
+typedef struct _BENCHRUN {
+  int nThreads;
+  int nIterations;
+  uint64_t* pnSamples;    // nThreads * nIterations latencies, in ns
+  pthread_barrier_t startBarrier;   // lines up the threads
+  void* pvContext;        // benchmark-specific state
+} BENCHRUN, *LPBENCHRUN;
+
+/**
+ * @brief Identifies one thread of a run to its timing procedure.
+ */
+typedef struct _BENCHTHREAD {
+  LPBENCHRUN pRun;
+  int nIndex;
+  uint64_t* pnSamples;    // this thread's nIterations samples
+  uint64_t nStartNs;      // see BeginBenchTiming
+  uint64_t nEndNs;        // see EndBenchTiming
+} BENCHTHREAD, *LPBENCHTHREAD;
+
+/**
+ * @brief Reads CLOCK_MONOTONIC.
+ * @return Current time, in nanoseconds.
+ */
+uint64_t GetTimestampNs(void);
+
+/**
+ * @brief Runs a timing procedure on nThreads threads at once.
+ * @param pRun Address of the run.  nThreads, nIterations and pvContext
+ * must be filled in; the samples array is allocated here.
+ * @param lpfnThreadProc Procedure each thread runs.  It receives a
+ * BENCHTHREAD, and must call BeginBenchTiming once it is set up and
+ * EndBenchTiming after its last iteration.
+ * @return Wall-clock time of the run, in nanoseconds, from the moment the
+ * first thread started timing until the last one finished; zero if the
+ * threads could not be started.
+ */
+uint64_t RunBenchThreads(LPBENCHRUN pRun,
+    LPTHREAD_START_ROUTINE lpfnThreadProc);
+
+/**
+ * @brief Waits until every thread of the run is ready, then starts the
+ * clock of the calling thread.
+ * @param pThread Address of the calling thread's BENCHTHREAD.
+ */
+void BeginBenchTiming(LPBENCHTHREAD pThread);
+
+/**
+ * @brief Stops the clock of the calling thread.
+ * @param pThread Address of the calling thread's BENCHTHREAD.
+ */
+void EndBenchTiming(LPBENCHTHREAD pThread);
+
+/**
+ * @brief Sorts the samples of a run, writes its percentiles to the report,
+ * and releases the samples.
+ * @param pOptions Options the run was made with.
+ * @param pszName Name of the benchmark.
+ * @param pRun Address of the run.
+ * @param nElapsedNs Value returned by RunBenchThreads.
+ * @param nBlockSize Size of the block each operation moves, in bytes, or
+ * zero if that does not apply.  Used to report throughput in bytes.
+ */
+void ReportBenchResult(LPBENCHOPTIONS pOptions, const char* pszName,
+    LPBENCHRUN pRun, uint64_t nElapsedNs, long long nBlockSize);
+
+/**
+ * @brief Measures CreateThreadEx followed by WaitThread.
+ */
+void RunCreateJoinBenchmark(LPBENCHOPTIONS pOptions);
+
+/**
+ * @brief Measures MarshalBlockToThread followed by DeMarshalBlockFromThread
+ * for block sizes from 16 B to 16 MB.
+ */
+void RunMarshalBenchmark(LPBENCHOPTIONS pOptions);
+
+/**
+ * @brief Measures the round trip of KillThreadExTimeout: raising a signal
+ * to a thread until the handler registered with RegisterEventEx has run on
+ * it and acknowledged.
+ */
+void RunSignalBenchmark(LPBENCHOPTIONS pOptions);
+
+#endif //__BENCH_H__
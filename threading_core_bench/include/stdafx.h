@@ -0,0 +1,33 @@
+#ifndef __STDAFX_H__
+#define __STDAFX_H__
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE   // pthread_barrier_t and friends
+#endif //_GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#ifndef OK
+#define OK		0		// Code to return to the operating system to indicate successful program termination
+#endif // OK
+
+#ifndef ERROR
+#define ERROR	-1		// Code to return to the operating system to indicate an error condition
+#endif // ERROR
+
+#include <../../api_core/api_core/include/api_core.h>
+#include <../../../debug_core/debug_core/include/debug_core.h>
+#include <../../exceptions_core/exceptions_core/include/exceptions_core.h>
+
+#include "threading_core.h"
+
+#endif //__STDAFX_H__
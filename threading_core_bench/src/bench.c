@@ -0,0 +1,183 @@
+// bench.c - Harness that runs the timing procedures of the benchmarks on
+// several threads at once and reports percentiles of their samples.
+//
+
+#include "stdafx.h"
+
+#include "bench.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _CompareSamples: Orders samples from fastest to slowest, for qsort.
+
+int _CompareSamples(const void* pvLeft, const void* pvRight) {
+  uint64_t nLeft = *(const uint64_t*) pvLeft;
+  uint64_t nRight = *(const uint64_t*) pvRight;
+
+  return (nLeft < nRight) ? -1 : (nLeft > nRight) ? 1 : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _GetPercentile: Gets a percentile of sorted samples, by the nearest-rank
+// method.
+
+uint64_t _GetPercentile(const uint64_t* pnSorted, int nCount,
+    double dPercentile) {
+  if (nCount <= 0) {
+    return 0;
+  }
+
+  int nRank = (int) ((dPercentile / 100.0) * nCount + 0.999999);
+  if (nRank < 1) {
+    nRank = 1;
+  }
+  if (nRank > nCount) {
+    nRank = nCount;
+  }
+
+  return pnSorted[nRank - 1];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// GetTimestampNs function
+
+uint64_t GetTimestampNs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RunBenchThreads function
+
+uint64_t RunBenchThreads(LPBENCHRUN pRun,
+    LPTHREAD_START_ROUTINE lpfnThreadProc) {
+  pRun->pnSamples = (uint64_t*) calloc(
+      (size_t) pRun->nThreads * pRun->nIterations, sizeof(uint64_t));
+  HTHREAD* phThreads = (HTHREAD*) calloc(pRun->nThreads, sizeof(HTHREAD));
+  LPBENCHTHREAD pThreads = (LPBENCHTHREAD) calloc(pRun->nThreads,
+      sizeof(BENCHTHREAD));
+  if (NULL == pRun->pnSamples || NULL == phThreads || NULL == pThreads) {
+    free(pRun->pnSamples);
+    free(phThreads);
+    free(pThreads);
+    pRun->pnSamples = NULL;
+    return 0;
+  }
+
+  /* Nobody starts timing until the last thread is ready, rather than as
+   * soon as it has been created */
+  pthread_barrier_init(&pRun->startBarrier, NULL, pRun->nThreads);
+
+  for (int i = 0; i < pRun->nThreads; i++) {
+    pThreads[i].pRun = pRun;
+    pThreads[i].nIndex = i;
+    pThreads[i].pnSamples = pRun->pnSamples + (size_t) i * pRun->nIterations;
+
+    phThreads[i] = CreateThreadEx(lpfnThreadProc, &pThreads[i]);
+    if (INVALID_HANDLE_VALUE == phThreads[i]) {
+      fprintf(stderr, "threading_core_bench: CreateThreadEx failed.\n");
+      exit(EXIT_FAILURE);   // the others are stuck at the barrier
+    }
+  }
+
+  for (int i = 0; i < pRun->nThreads; i++) {
+    WaitThread(phThreads[i]);
+  }
+
+  /* The threads may well have started and finished at different times,
+   * especially when there are more of them than CPUs */
+  uint64_t nStart = pThreads[0].nStartNs;
+  uint64_t nEnd = pThreads[0].nEndNs;
+  for (int i = 1; i < pRun->nThreads; i++) {
+    if (pThreads[i].nStartNs < nStart) {
+      nStart = pThreads[i].nStartNs;
+    }
+    if (pThreads[i].nEndNs > nEnd) {
+      nEnd = pThreads[i].nEndNs;
+    }
+  }
+
+  uint64_t nElapsedNs = nEnd - nStart;
+
+  pthread_barrier_destroy(&pRun->startBarrier);
+  free(phThreads);
+  free(pThreads);
+
+  return nElapsedNs;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BeginBenchTiming function
+
+void BeginBenchTiming(LPBENCHTHREAD pThread) {
+  pthread_barrier_wait(&pThread->pRun->startBarrier);
+  pThread->nStartNs = GetTimestampNs();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// EndBenchTiming function
+
+void EndBenchTiming(LPBENCHTHREAD pThread) {
+  pThread->nEndNs = GetTimestampNs();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReportBenchResult function
+
+void ReportBenchResult(LPBENCHOPTIONS pOptions, const char* pszName,
+    LPBENCHRUN pRun, uint64_t nElapsedNs, long long nBlockSize) {
+  if (NULL == pRun->pnSamples) {
+    return;
+  }
+
+  int nCount = pRun->nThreads * pRun->nIterations;
+  qsort(pRun->pnSamples, nCount, sizeof(uint64_t), _CompareSamples);
+
+  long double ldTotalNs = 0;
+  for (int i = 0; i < nCount; i++) {
+    ldTotalNs += pRun->pnSamples[i];
+  }
+
+  double dMeanNs = (nCount > 0) ? (double) (ldTotalNs / nCount) : 0.0;
+  double dSeconds = (nElapsedNs > 0) ? nElapsedNs / 1e9 : 0.0;
+  double dOpsPerSec = (dSeconds > 0) ? nCount / dSeconds : 0.0;
+  double dBytesPerSec = dOpsPerSec * (double) nBlockSize;
+
+  uint64_t nP50 = _GetPercentile(pRun->pnSamples, nCount, 50.0);
+  uint64_t nP99 = _GetPercentile(pRun->pnSamples, nCount, 99.0);
+
+  fprintf(pOptions->fpOutput,
+      "%s    {\"benchmark\": \"%s\", \"threads\": %d, \"block_size\": %lld, "
+      "\"samples\": %d, \"elapsed_ns\": %llu,\n"
+      "     \"ops_per_sec\": %.1f, \"bytes_per_sec\": %.1f, "
+      "\"mean_ns\": %.1f,\n"
+      "     \"min_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+      "\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}",
+      (pOptions->nResults > 0) ? ",\n" : "", pszName, pRun->nThreads,
+      nBlockSize, nCount, (unsigned long long) nElapsedNs, dOpsPerSec,
+      dBytesPerSec, dMeanNs,
+      (unsigned long long) pRun->pnSamples[0],
+      (unsigned long long) nP50,
+      (unsigned long long) _GetPercentile(pRun->pnSamples, nCount, 90.0),
+      (unsigned long long) nP99,
+      (unsigned long long) _GetPercentile(pRun->pnSamples, nCount, 99.9),
+      (unsigned long long) pRun->pnSamples[nCount - 1]);
+  fflush(pOptions->fpOutput);
+
+  pOptions->nResults++;
+
+  /* Progress for whoever is watching; the report itself is JSON only */
+  fprintf(stderr, "%-12s threads=%-3d block=%-9lld p50=%llu ns p99=%llu ns "
+      "%.0f ops/s\n", pszName, pRun->nThreads, nBlockSize,
+      (unsigned long long) nP50, (unsigned long long) nP99, dOpsPerSec);
+
+  free(pRun->pnSamples);
+  pRun->pnSamples = NULL;
+}
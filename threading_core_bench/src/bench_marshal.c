@@ -0,0 +1,103 @@
+// bench_marshal.c - Benchmark of marshalling blocks across the thread
+// boundary.
+//
+
+#include "stdafx.h"
+
+#include "bench.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @brief Smallest and largest block sizes measured.  Every size in between
+ * is four times the one before.
+ */
+#define BENCH_MARSHAL_MIN_BLOCK_SIZE  16
+#define BENCH_MARSHAL_MAX_BLOCK_SIZE  (16 * 1024 * 1024)
+
+/**
+ * @brief Number of bytes each thread copies, at most, per block size.  Large
+ * blocks get fewer iterations so that a run does not take all day.
+ */
+#define BENCH_MARSHAL_BYTES_PER_RUN   (256LL * 1024 * 1024)
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief Benchmark-specific state of a marshalling run.
+ */
+typedef struct _MARSHALRUN {
+  int nBlockSize;
+} MARSHALRUN, *LPMARSHALRUN;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _MarshalThreadProc: Marshals a block and demarshals it again, once per
+// iteration.
+
+void* _MarshalThreadProc(void* pUserState) {
+  LPBENCHTHREAD pThread = (LPBENCHTHREAD) pUserState;
+  LPBENCHRUN pRun = pThread->pRun;
+  int nBlockSize = ((LPMARSHALRUN) pRun->pvContext)->nBlockSize;
+
+  char* pSource = (char*) malloc(nBlockSize);
+  char* pDest = (char*) malloc(nBlockSize);
+  if (NULL == pSource || NULL == pDest) {
+    fprintf(stderr, "threading_core_bench: Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Touch both buffers up front, so that page faults are not measured */
+  memset(pSource, pThread->nIndex, nBlockSize);
+  memset(pDest, 0, nBlockSize);
+
+  BeginBenchTiming(pThread);
+
+  for (int i = 0; i < pRun->nIterations; i++) {
+    uint64_t nStart = GetTimestampNs();
+
+    void* pvBlock = MarshalBlockToThread(pSource, nBlockSize);
+    DeMarshalBlockFromThread(pDest, pvBlock, nBlockSize);
+
+    pThread->pnSamples[i] = GetTimestampNs() - nStart;
+  }
+
+  EndBenchTiming(pThread);
+
+  free(pSource);
+  free(pDest);
+
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// RunMarshalBenchmark function
+
+void RunMarshalBenchmark(LPBENCHOPTIONS pOptions) {
+  for (int nBlockSize = BENCH_MARSHAL_MIN_BLOCK_SIZE;
+      nBlockSize <= BENCH_MARSHAL_MAX_BLOCK_SIZE; nBlockSize *= 4) {
+    long long nMaxIterations = BENCH_MARSHAL_BYTES_PER_RUN / nBlockSize;
+
+    for (int i = 0; i < pOptions->nThreadCounts; i++) {
+      MARSHALRUN marshalRun;
+      marshalRun.nBlockSize = nBlockSize;
+
+      BENCHRUN run;
+      memset(&run, 0, sizeof(run));
+      run.nThreads = pOptions->anThreadCounts[i];
+      run.nIterations = (pOptions->nIterations < nMaxIterations)
+          ? pOptions->nIterations : (int) nMaxIterations;
+      run.pvContext = &marshalRun;
+
+      uint64_t nElapsedNs = RunBenchThreads(&run, _MarshalThreadProc);
+      ReportBenchResult(pOptions, "marshal", &run, nElapsedNs, nBlockSize);
+    }
+  }
+}
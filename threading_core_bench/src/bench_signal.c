@@ -0,0 +1,125 @@
+// bench_signal.c - Benchmark of signal delivery to threads with
+// KillThreadExTimeout and RegisterEventEx.
+//
+
+#include "stdafx.h"
+
+#include "bench.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only constants
+
+/**
+ * @brief Signal raised to the target threads.
+ */
+#define BENCH_SIGNAL                  SIGUSR1
+
+/**
+ * @brief Number of microseconds a target thread sleeps between signals.  A
+ * signal cuts the sleep short, so this only bounds how long a target takes
+ * to notice that the run is over.
+ */
+#define BENCH_SIGNAL_TARGET_SLEEP_US  100000
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief State shared between a sending thread and its target thread.
+ */
+typedef struct _SIGNALTARGET {
+  atomic_int bReady;      // target is running and can be signalled
+  atomic_int bDone;       // sender has finished; target should return
+} SIGNALTARGET, *LPSIGNALTARGET;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _SignalHandler: Does nothing, so that only delivery gets measured.  The
+// library acknowledges the stop request once it returns.
+
+void _SignalHandler(int nSignal) {
+  (void) nSignal;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _SignalTargetProc: Sleeps until its sender is done with it.
+
+void* _SignalTargetProc(void* pUserState) {
+  LPSIGNALTARGET pTarget = (LPSIGNALTARGET) pUserState;
+
+  atomic_store(&pTarget->bReady, TRUE);
+
+  while (!atomic_load(&pTarget->bDone)) {
+    usleep(BENCH_SIGNAL_TARGET_SLEEP_US);
+  }
+
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _SignalThreadProc: Starts a target thread, then signals it and waits for
+// the acknowledgement once per iteration.
+
+void* _SignalThreadProc(void* pUserState) {
+  LPBENCHTHREAD pThread = (LPBENCHTHREAD) pUserState;
+  LPBENCHRUN pRun = pThread->pRun;
+
+  SIGNALTARGET target;
+  atomic_init(&target.bReady, FALSE);
+  atomic_init(&target.bDone, FALSE);
+
+  HTHREAD hTarget = CreateThreadEx(_SignalTargetProc, &target);
+  if (INVALID_HANDLE_VALUE == hTarget) {
+    fprintf(stderr, "threading_core_bench: CreateThreadEx failed.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* A signal that arrives before the target is up and running has nobody
+   * to acknowledge it */
+  while (!atomic_load(&target.bReady)) {
+    sched_yield();
+  }
+
+  BeginBenchTiming(pThread);
+
+  for (int i = 0; i < pRun->nIterations; i++) {
+    uint64_t nStart = GetTimestampNs();
+
+    KillThreadExTimeout(hTarget, BENCH_SIGNAL, INFINITE);
+
+    pThread->pnSamples[i] = GetTimestampNs() - nStart;
+  }
+
+  EndBenchTiming(pThread);
+
+  atomic_store(&target.bDone, TRUE);
+  KillThreadExTimeout(hTarget, BENCH_SIGNAL, INFINITE);   // cut sleep short
+  WaitThread(hTarget);
+
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// RunSignalBenchmark function
+
+void RunSignalBenchmark(LPBENCHOPTIONS pOptions) {
+  if (!RegisterEventEx(BENCH_SIGNAL, _SignalHandler)) {
+    fprintf(stderr, "threading_core_bench: RegisterEventEx failed.\n");
+    return;
+  }
+
+  for (int i = 0; i < pOptions->nThreadCounts; i++) {
+    BENCHRUN run;
+    memset(&run, 0, sizeof(run));
+    run.nThreads = pOptions->anThreadCounts[i];
+    run.nIterations = pOptions->nIterations;
+
+    uint64_t nElapsedNs = RunBenchThreads(&run, _SignalThreadProc);
+    ReportBenchResult(pOptions, "signal", &run, nElapsedNs, 0);
+  }
+}
@@ -0,0 +1,62 @@
+// bench_threads.c - Benchmark of thread creation and joining.
+//
+
+#include "stdafx.h"
+
+#include "bench.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _EmptyThreadProc: Thread procedure that returns at once, so that all that
+// gets measured is the cost of the thread itself.
+
+void* _EmptyThreadProc(void* pUserState) {
+  return pUserState;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _CreateJoinThreadProc: Creates and joins one thread per iteration.
+
+void* _CreateJoinThreadProc(void* pUserState) {
+  LPBENCHTHREAD pThread = (LPBENCHTHREAD) pUserState;
+  LPBENCHRUN pRun = pThread->pRun;
+
+  BeginBenchTiming(pThread);
+
+  for (int i = 0; i < pRun->nIterations; i++) {
+    uint64_t nStart = GetTimestampNs();
+
+    HTHREAD hThread = CreateThreadEx(_EmptyThreadProc, NULL);
+    if (INVALID_HANDLE_VALUE == hThread) {
+      fprintf(stderr, "threading_core_bench: CreateThreadEx failed.\n");
+      exit(EXIT_FAILURE);
+    }
+    WaitThread(hThread);
+
+    pThread->pnSamples[i] = GetTimestampNs() - nStart;
+  }
+
+  EndBenchTiming(pThread);
+
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// RunCreateJoinBenchmark function
+
+void RunCreateJoinBenchmark(LPBENCHOPTIONS pOptions) {
+  for (int i = 0; i < pOptions->nThreadCounts; i++) {
+    BENCHRUN run;
+    memset(&run, 0, sizeof(run));
+    run.nThreads = pOptions->anThreadCounts[i];
+    run.nIterations = pOptions->nIterations;
+
+    uint64_t nElapsedNs = RunBenchThreads(&run, _CreateJoinThreadProc);
+    ReportBenchResult(pOptions, "create_join", &run, nElapsedNs, 0);
+  }
+}
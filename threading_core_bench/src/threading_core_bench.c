@@ -0,0 +1,174 @@
+// threading_core_bench.c - Entry point of the threading_core benchmark
+// suite.  Runs the selected benchmarks at several thread counts and writes
+// their latency percentiles as JSON, so that they can be compared from one
+// release to the next.
+//
+// Usage: threading_core_bench [--benchmark create_join|marshal|signal|all]
+//            [--threads 1,2,4,8] [--iterations N] [--output FILE]
+//
+
+#include "stdafx.h"
+
+#include "bench.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only types
+
+/**
+ * @brief Associates a benchmark with the name it is selected by.
+ */
+typedef struct _BENCHENTRY {
+  const char* pszName;
+  LPBENCH_ROUTINE lpfnRun;
+} BENCHENTRY, *LPBENCHENTRY;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only variables
+
+static const BENCHENTRY g_aBenchmarks[] = {
+  { "create_join", RunCreateJoinBenchmark },
+  { "marshal", RunMarshalBenchmark },
+  { "signal", RunSignalBenchmark },
+};
+
+#define BENCH_COUNT ((int) (sizeof(g_aBenchmarks) / sizeof(g_aBenchmarks[0])))
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// _PrintUsage: Explains the command line and exits.
+
+void _PrintUsage(const char* pszProgram) {
+  fprintf(stderr,
+      "Usage: %s [--benchmark create_join|marshal|signal|all]\n"
+      "           [--threads 1,2,4,8] [--iterations N] [--output FILE]\n",
+      pszProgram);
+  exit(EXIT_FAILURE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _AddThreadCount: Adds a thread count to the options, unless it is already
+// there.
+
+void _AddThreadCount(LPBENCHOPTIONS pOptions, int nThreads) {
+  if (nThreads <= 0 || pOptions->nThreadCounts >= BENCH_MAX_THREAD_COUNTS) {
+    return;
+  }
+
+  for (int i = 0; i < pOptions->nThreadCounts; i++) {
+    if (pOptions->anThreadCounts[i] == nThreads) {
+      return;
+    }
+  }
+
+  pOptions->anThreadCounts[pOptions->nThreadCounts++] = nThreads;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// _ParseThreadCounts: Parses a comma-separated list of thread counts.
+// Returns FALSE if the list is malformed.
+
+BOOL _ParseThreadCounts(LPBENCHOPTIONS pOptions, const char* pszList) {
+  pOptions->nThreadCounts = 0;
+
+  while ('\0' != *pszList) {
+    char* pszEnd = NULL;
+    long nThreads = strtol(pszList, &pszEnd, 10);
+    if (pszEnd == pszList || nThreads <= 0) {
+      return FALSE;
+    }
+
+    _AddThreadCount(pOptions, (int) nThreads);
+
+    pszList = (',' == *pszEnd) ? pszEnd + 1 : pszEnd;
+    if (pszEnd == pszList && '\0' != *pszList) {
+      return FALSE;
+    }
+  }
+
+  return pOptions->nThreadCounts > 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// main: Parses the command line, runs the benchmarks, and writes the report.
+
+int main(int argc, char* argv[]) {
+  BENCHOPTIONS options;
+  memset(&options, 0, sizeof(options));
+  options.nIterations = BENCH_DEFAULT_ITERATIONS;
+  options.fpOutput = stdout;
+
+  const char* pszBenchmark = "all";
+  const char* pszOutput = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      _PrintUsage(argv[0]);
+    }
+
+    if (0 == strcmp(argv[i], "--benchmark")) {
+      pszBenchmark = argv[++i];
+    } else if (0 == strcmp(argv[i], "--threads")) {
+      if (!_ParseThreadCounts(&options, argv[++i])) {
+        _PrintUsage(argv[0]);
+      }
+    } else if (0 == strcmp(argv[i], "--iterations")) {
+      options.nIterations = atoi(argv[++i]);
+      if (options.nIterations <= 0) {
+        _PrintUsage(argv[0]);
+      }
+    } else if (0 == strcmp(argv[i], "--output")) {
+      pszOutput = argv[++i];
+    } else {
+      _PrintUsage(argv[0]);
+    }
+  }
+
+  long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  /* By default: one thread, a few, and one per CPU */
+  if (0 == options.nThreadCounts) {
+    _AddThreadCount(&options, 1);
+    _AddThreadCount(&options, 2);
+    _AddThreadCount(&options, 4);
+    _AddThreadCount(&options, (int) nCpus);
+  }
+
+  BOOL bFound = FALSE;
+  for (int i = 0; i < BENCH_COUNT; i++) {
+    bFound |= (0 == strcmp(pszBenchmark, "all")
+        || 0 == strcmp(pszBenchmark, g_aBenchmarks[i].pszName));
+  }
+  if (!bFound) {
+    _PrintUsage(argv[0]);
+  }
+
+  if (NULL != pszOutput) {
+    options.fpOutput = fopen(pszOutput, "w");
+    if (NULL == options.fpOutput) {
+      perror(pszOutput);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  fprintf(options.fpOutput,
+      "{\n  \"library\": \"threading_core\",\n  \"timestamp\": %lld,\n"
+      "  \"online_cpus\": %ld,\n  \"iterations\": %d,\n  \"results\": [\n",
+      (long long) time(NULL), nCpus, options.nIterations);
+
+  for (int i = 0; i < BENCH_COUNT; i++) {
+    if (0 == strcmp(pszBenchmark, "all")
+        || 0 == strcmp(pszBenchmark, g_aBenchmarks[i].pszName)) {
+      g_aBenchmarks[i].lpfnRun(&options);
+    }
+  }
+
+  fprintf(options.fpOutput, "\n  ]\n}\n");
+
+  if (stdout != options.fpOutput) {
+    fclose(options.fpOutput);
+  }
+
+  return OK;
+}